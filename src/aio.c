@@ -0,0 +1,709 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#include "aio.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include <tllist.h>
+
+#include "limit.h"
+#include "log.h"
+
+/* Large enough for sequential throughput, small enough to keep several
+ * in flight (and so the device queue busy) */
+#define CHUNK_SIZE (2u << 20)
+#define QUEUE_DEPTH 16
+
+/* Times a submission short of kernel resources is tried again */
+#define SUBMIT_RETRIES 8
+
+/* O_DIRECT wants buffer, offsets and lengths aligned to logical blocks */
+#define ALIGNMENT 4096
+
+struct request {
+    struct aio *aio;
+    char *path;
+    int fd;
+
+    uint8_t *data;
+    size_t size;
+
+    size_t next;     /* offset of the first chunk not yet submitted */
+    size_t done;     /* bytes read */
+    unsigned inflight;
+    int error;
+
+    aio_done_fn callback;
+    void *user;
+};
+
+/* One read in flight; a short read is resubmitted for the rest */
+struct chunk {
+    struct request *req;
+    size_t offset;
+    size_t length;
+};
+
+struct uring {
+    int fd;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    unsigned inflight;
+};
+
+struct aio {
+    int event_fd;
+
+    struct uring *uring; /* NULL if falling back to the worker */
+
+    /* Requests waiting for (room in) the ring, or for the worker */
+    tll(struct request *) queue;
+
+    /* Worker fallback */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    tll(struct request *) finished;
+    bool quit;
+};
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_destroy(struct uring *ring)
+{
+    if (ring == NULL) {
+        return;
+    }
+
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != NULL) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    close(ring->fd);
+    free(ring);
+}
+
+/* Whether kernel knows IORING_OP_READ (5.6) */
+static bool uring_can_read(int fd)
+{
+    const size_t size = sizeof (struct io_uring_probe) +
+                        IORING_OP_LAST * sizeof (struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+
+    bool ok = uring_register(fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0 &&
+              probe->last_op >= IORING_OP_READ &&
+              (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+
+    free(probe);
+    return ok;
+}
+
+static struct uring *uring_create(int event_fd)
+{
+    struct io_uring_params p = { 0 };
+    int fd = uring_setup(QUEUE_DEPTH, &p);
+    if (fd < 0) {
+        /* ENOSYS, or disabled (e.g. by kernel.io_uring_disabled) */
+        LOG_DEBUG("io_uring not available: %s", strerror(errno));
+        return NULL;
+    }
+
+    struct uring *ring = calloc(1, sizeof (*ring));
+    ring->fd = fd;
+
+    if (!uring_can_read(fd)) {
+        LOG_DEBUG("io_uring cannot read files");
+        goto err;
+    }
+
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        goto err;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            goto err;
+        }
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto err;
+    }
+
+    uint8_t *sq = ring->sq_ring;
+    uint8_t *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    if (uring_register(fd, IORING_REGISTER_EVENTFD, &event_fd, 1) < 0) {
+        LOG_ERRNO("io_uring: failed to register eventfd");
+        goto err;
+    }
+
+    return ring;
+
+err:
+    uring_destroy(ring);
+    return NULL;
+}
+
+static void uring_queue_chunk(struct uring *ring, struct chunk *chunk)
+{
+    const unsigned tail = *ring->sq_tail;
+    const unsigned index = tail & *ring->sq_mask;
+
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    *sqe = (struct io_uring_sqe){
+        .opcode = IORING_OP_READ,
+        .fd = chunk->req->fd,
+        .off = chunk->offset,
+        .addr = (uintptr_t)(chunk->req->data + chunk->offset),
+        .len = chunk->length,
+        .user_data = (uintptr_t)chunk,
+    };
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    ring->inflight++;
+    chunk->req->inflight++;
+}
+
+static void request_free(struct request *req)
+{
+    if (req->fd >= 0) {
+        close(req->fd);
+    }
+    free(req->data);
+    free(req->path);
+    free(req);
+}
+
+static void request_finish(struct request *req)
+{
+    const struct aio_result result = {
+        .path = req->path,
+        .data = req->error == 0 ? req->data : NULL,
+        .size = req->error == 0 ? req->size : 0,
+        .error = req->error,
+    };
+
+    if (req->error == 0) {
+        req->data = NULL; /* handed over */
+    }
+
+    req->callback(req->user, &result);
+    request_free(req);
+}
+
+/* Request which failed before all of its chunks were submitted */
+static void queue_remove(struct aio *aio, struct request *req)
+{
+    tll_foreach(aio->queue, it) {
+        if (it->item == req) {
+            tll_remove(aio->queue, it);
+            break;
+        }
+    }
+}
+
+/*
+ * Submits what is in the submission queue. What the kernel would not take
+ * is taken back, and fails its requests with the error: no completion is
+ * coming for it
+ */
+static void uring_flush(struct aio *aio)
+{
+    struct uring *ring = aio->uring;
+    int retries = SUBMIT_RETRIES;
+    int error = 0;
+
+    while (true) {
+        const unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        const unsigned pending = *ring->sq_tail - head;
+        if (pending == 0) {
+            return;
+        }
+
+        const int submitted = uring_enter(ring->fd, pending, 0, 0);
+        if (submitted > 0) {
+            continue;
+        }
+
+        if (submitted < 0 && errno == EINTR) {
+            continue;
+        }
+        if (submitted < 0 && (errno == EAGAIN || errno == EBUSY) && retries-- > 0) {
+            sched_yield();
+            continue;
+        }
+
+        error = (submitted < 0) ? errno : EIO;
+        break;
+    }
+
+    errno = error;
+    LOG_ERRNO("io_uring: failed to submit reads");
+
+    const unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    const unsigned tail = *ring->sq_tail;
+    __atomic_store_n(ring->sq_tail, head, __ATOMIC_RELEASE);
+
+    for (unsigned i = head; i != tail; ++i) {
+        const struct io_uring_sqe *sqe = &ring->sqes[ring->sq_array[i & *ring->sq_mask]];
+        struct chunk *chunk = (struct chunk *)(uintptr_t)sqe->user_data;
+        struct request *req = chunk->req;
+
+        ring->inflight--;
+        req->inflight--;
+        req->error = error;
+        free(chunk);
+
+        /* Else its chunks in flight finish it */
+        if (req->inflight == 0) {
+            queue_remove(aio, req);
+            request_finish(req);
+        }
+    }
+}
+
+/* Fills the ring with chunks of queued requests, in order */
+static void uring_submit(struct aio *aio)
+{
+    struct uring *ring = aio->uring;
+
+    tll_foreach(aio->queue, it) {
+        struct request *req = it->item;
+
+        while (req->error == 0 && req->next < req->size && ring->inflight < QUEUE_DEPTH) {
+            const size_t left = req->size - req->next;
+            struct chunk *chunk = malloc(sizeof (*chunk));
+            *chunk = (struct chunk){
+                .req = req,
+                .offset = req->next,
+                .length = left < CHUNK_SIZE ? left : CHUNK_SIZE,
+            };
+
+            /* O_DIRECT reads whole blocks; buffer is padded for the tail */
+            if (chunk->length < CHUNK_SIZE) {
+                chunk->length = (chunk->length + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+            }
+
+            req->next += chunk->length;
+            uring_queue_chunk(ring, chunk);
+        }
+
+        if (req->error != 0 || req->next >= req->size) {
+            tll_remove(aio->queue, it); /* rest is up to completions */
+        }
+
+        if (ring->inflight >= QUEUE_DEPTH) {
+            break;
+        }
+    }
+
+    uring_flush(aio);
+}
+
+static void uring_reap(struct aio *aio)
+{
+    struct uring *ring = aio->uring;
+
+    unsigned head = *ring->cq_head;
+    const unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; ++head) {
+        const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        struct chunk *chunk = (struct chunk *)(uintptr_t)cqe->user_data;
+        struct request *req = chunk->req;
+        const int res = cqe->res;
+
+        ring->inflight--;
+        req->inflight--;
+
+        if (res == -EINTR || res == -EAGAIN) {
+            uring_queue_chunk(ring, chunk);
+            continue;
+        }
+
+        if (res < 0) {
+            req->error = -res;
+        } else if (res > 0 && (size_t)res < chunk->length && chunk->offset + res < req->size) {
+            /* Short read; the rest of it goes again */
+            req->done += res;
+            chunk->offset += res;
+            chunk->length -= res;
+            uring_queue_chunk(ring, chunk);
+            continue;
+        } else {
+            req->done += res;
+            if (res == 0 && chunk->offset < req->size) {
+                req->error = EIO; /* file shrank under us */
+            }
+        }
+
+        free(chunk);
+
+        if (req->inflight == 0 && (req->error != 0 || req->next >= req->size)) {
+            if (req->error == 0 && req->done < req->size) {
+                req->error = EIO;
+            }
+            if (req->error != 0) {
+                queue_remove(aio, req);
+            }
+            request_finish(req);
+        }
+    }
+
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    /* Resubmissions of the loop above */
+    uring_flush(aio);
+}
+
+/* Plain blocking reads of the worker fallback */
+static void read_all(struct request *req)
+{
+    while (req->done < req->size) {
+        const size_t left = req->size - req->done;
+        size_t length = left < CHUNK_SIZE ? left : CHUNK_SIZE;
+        length = (length + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+
+        const ssize_t n = pread(req->fd, req->data + req->done, length, req->done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            req->error = errno;
+            return;
+        }
+        if (n == 0) {
+            req->error = EIO;
+            return;
+        }
+        req->done += n;
+    }
+}
+
+static void *worker_thread(void *data)
+{
+    struct aio *aio = data;
+
+    pthread_mutex_lock(&aio->lock);
+    while (!aio->quit) {
+        if (tll_length(aio->queue) == 0) {
+            pthread_cond_wait(&aio->cond, &aio->lock);
+            continue;
+        }
+
+        struct request *req = tll_pop_front(aio->queue);
+        pthread_mutex_unlock(&aio->lock);
+
+        read_all(req);
+
+        pthread_mutex_lock(&aio->lock);
+        tll_push_back(aio->finished, req);
+        if (eventfd_write(aio->event_fd, 1) < 0) {
+            LOG_ERRNO("aio: failed to signal completion");
+        }
+    }
+    pthread_mutex_unlock(&aio->lock);
+
+    return NULL;
+}
+
+struct aio *aio_create(void)
+{
+    struct aio *aio = calloc(1, sizeof (*aio));
+
+    aio->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (aio->event_fd < 0) {
+        LOG_ERRNO("aio: failed to create eventfd");
+        free(aio);
+        return NULL;
+    }
+
+    aio->uring = uring_create(aio->event_fd);
+    if (aio->uring != NULL) {
+        return aio;
+    }
+
+    pthread_mutex_init(&aio->lock, NULL);
+    pthread_cond_init(&aio->cond, NULL);
+
+    int err = pthread_create(&aio->thread, NULL, &worker_thread, aio);
+    if (err != 0) {
+        errno = err;
+        LOG_ERRNO("aio: failed to start worker thread");
+        pthread_mutex_destroy(&aio->lock);
+        pthread_cond_destroy(&aio->cond);
+        close(aio->event_fd);
+        free(aio);
+        return NULL;
+    }
+
+    return aio;
+}
+
+void aio_destroy(struct aio *aio)
+{
+    if (aio == NULL) {
+        return;
+    }
+
+    if (aio->uring != NULL) {
+        /* Kernel must be done with the buffers before they are freed */
+        while (aio->uring->inflight > 0) {
+            uring_enter(aio->uring->fd, 0, 1, IORING_ENTER_GETEVENTS);
+            uring_reap(aio);
+        }
+        uring_destroy(aio->uring);
+    } else {
+        pthread_mutex_lock(&aio->lock);
+        aio->quit = true;
+        pthread_cond_signal(&aio->cond);
+        pthread_mutex_unlock(&aio->lock);
+
+        pthread_join(aio->thread, NULL);
+        pthread_mutex_destroy(&aio->lock);
+        pthread_cond_destroy(&aio->cond);
+
+        tll_foreach(aio->finished, it) {
+            request_free(it->item);
+            tll_remove(aio->finished, it);
+        }
+    }
+
+    tll_foreach(aio->queue, it) {
+        request_free(it->item);
+        tll_remove(aio->queue, it);
+    }
+
+    close(aio->event_fd);
+    free(aio);
+}
+
+int aio_fd(const struct aio *aio)
+{
+    return aio->event_fd;
+}
+
+static int open_file(const char *path, unsigned flags)
+{
+    if (flags & AIO_DIRECT) {
+        int fd = open(path, O_RDONLY | O_CLOEXEC | O_DIRECT);
+        if (fd >= 0 || errno != EINVAL) {
+            return fd;
+        }
+        /* Filesystem (e.g. tmpfs) does not support it */
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED); /* start readahead now */
+    }
+    return fd;
+}
+
+bool aio_submit(struct aio *aio, const char *path, unsigned flags,
+                aio_done_fn done, void *user)
+{
+    int fd = open_file(path, flags);
+    if (fd < 0) {
+        LOG_ERRNO("%s: failed to open", path);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        LOG_ERR("%s: failed to stat or empty file", path);
+        close(fd);
+        return false;
+    }
+
+    if ((size_t)st.st_size > LIMIT_FILE_SIZE) {
+        LOG_ERR("%s: file is over the limit of %zu MiB", path, LIMIT_FILE_SIZE >> 20);
+        close(fd);
+        return false;
+    }
+
+    /* Padded to whole blocks, for O_DIRECT reading the tail */
+    const size_t padded = ((size_t)st.st_size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+
+    void *data;
+    if (posix_memalign(&data, ALIGNMENT, padded) != 0) {
+        LOG_ERR("%s: failed to allocate %zu bytes", path, padded);
+        close(fd);
+        return false;
+    }
+
+    struct request *req = malloc(sizeof (*req));
+    *req = (struct request){
+        .aio = aio,
+        .path = strdup(path),
+        .fd = fd,
+        .data = data,
+        .size = st.st_size,
+        .callback = done,
+        .user = user,
+    };
+
+    if (aio->uring != NULL) {
+        tll_push_back(aio->queue, req);
+        uring_submit(aio);
+        return true;
+    }
+
+    pthread_mutex_lock(&aio->lock);
+    tll_push_back(aio->queue, req);
+    pthread_cond_signal(&aio->cond);
+    pthread_mutex_unlock(&aio->lock);
+    return true;
+}
+
+void aio_dispatch(struct aio *aio)
+{
+    eventfd_t count;
+    eventfd_read(aio->event_fd, &count);
+
+    if (aio->uring != NULL) {
+        uring_reap(aio);
+        uring_submit(aio);
+        return;
+    }
+
+    pthread_mutex_lock(&aio->lock);
+    while (tll_length(aio->finished) > 0) {
+        struct request *req = tll_pop_front(aio->finished);
+        pthread_mutex_unlock(&aio->lock);
+
+        request_finish(req);
+
+        pthread_mutex_lock(&aio->lock);
+    }
+    pthread_mutex_unlock(&aio->lock);
+}
+
+struct sync_read {
+    bool done;
+    uint8_t *data;
+    size_t size;
+};
+
+static void sync_done(void *user, const struct aio_result *result)
+{
+    struct sync_read *sync = user;
+    sync->done = true;
+    sync->data = result->data;
+    sync->size = result->size;
+
+    if (result->error != 0) {
+        errno = result->error;
+        LOG_ERRNO("%s: failed to read", result->path);
+    }
+}
+
+uint8_t *aio_read_file(const char *path, unsigned flags, size_t *size)
+{
+    struct aio *aio = aio_create();
+    if (aio == NULL) {
+        return NULL;
+    }
+
+    struct sync_read sync = { 0 };
+    if (!aio_submit(aio, path, flags, &sync_done, &sync)) {
+        aio_destroy(aio);
+        return NULL;
+    }
+
+    while (!sync.done) {
+        struct pollfd pfd = { .fd = aio_fd(aio), .events = POLLIN };
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            LOG_ERRNO("aio: failed to poll");
+            break;
+        }
+        aio_dispatch(aio);
+    }
+
+    aio_destroy(aio);
+
+    *size = sync.size;
+    return sync.data;
+}
@@ -0,0 +1,47 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#ifndef AIO_H_
+#define AIO_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Reads of whole files, in large sequential chunks, done asynchronously:
+ * by io_uring where the kernel offers it, by a worker thread otherwise.
+ * Completions are signalled on an eventfd, to be put in a poll set;
+ * callbacks are then run by aio_dispatch(), on the polling thread.
+ */
+struct aio;
+
+enum aio_flags {
+    AIO_DIRECT = 1 << 0, /* bypass page cache (O_DIRECT), e.g. for cache files */
+};
+
+struct aio_result {
+    const char *path;
+    uint8_t *data; /* owned by callback, free() it; NULL on error */
+    size_t size;
+    int error;     /* errno, 0 on success */
+};
+
+typedef void (*aio_done_fn)(void *user, const struct aio_result *result);
+
+struct aio *aio_create(void);
+void aio_destroy(struct aio *aio);
+
+int aio_fd(const struct aio *aio);
+
+bool aio_submit(struct aio *aio, const char *path, unsigned flags,
+                aio_done_fn done, void *user);
+
+/* Runs callbacks of completed reads; call whenever aio_fd() is readable */
+void aio_dispatch(struct aio *aio);
+
+/* Reads file, waiting for it; returns data to free(), NULL on error */
+uint8_t *aio_read_file(const char *path, unsigned flags, size_t *size);
+
+#endif // AIO_H_
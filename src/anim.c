@@ -0,0 +1,377 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#include "anim.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "gif.h"
+#include "log.h"
+#include "prio.h"
+#include "y4m.h"
+
+enum slot_state {
+    SLOT_FREE,     /* worker may decode into it */
+    SLOT_DECODING,
+    SLOT_READY,    /* decoded, waiting to be taken */
+    SLOT_TAKEN,    /* owned by main thread */
+    SLOT_RETIRED,  /* given back, but compositor may still read it */
+};
+
+struct slot {
+    struct anim_frame frame;
+    enum slot_state state;
+};
+
+/* Source of frames; called on the worker thread only */
+struct decoder {
+    void *data;
+    int width;
+    int height;
+    int ring_size;
+
+    /* Writes next frame into `buf`, along with its delay and damage */
+    bool (*next_frame)(void *data, struct buffer *buf, struct anim_frame *frame);
+    void (*close)(void *data);
+};
+
+struct anim {
+    void *map;
+    size_t map_size;
+
+    struct decoder dec;
+    int width;
+    int height;
+
+    struct slot slots[ANIM_RING_MAX];
+    int ring_size;
+    uint64_t decoded;
+    uint64_t taken;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool quit;
+    bool done;
+
+    int event_fd;
+};
+
+static bool gif_decode(void *data, struct buffer *buf, struct anim_frame *frame)
+{
+    struct gif *gif = data;
+
+    struct gif_frame info;
+    if (!gif_next_frame(gif, &info)) {
+        return false;
+    }
+
+    /* Slot holds a frame from a full ring ago; copy the whole canvas */
+    const uint32_t *src = gif_canvas(gif);
+    uint8_t *dst = buf->mmapped;
+    const size_t len = (size_t)buf->width * sizeof (uint32_t);
+
+    for (int y = 0; y < buf->height; ++y) {
+        memcpy(dst + (size_t)y * buf->stride, src + (size_t)y * buf->width, len);
+    }
+
+    frame->delay = info.delay * 1000;
+    frame->damage = info.damage;
+    return true;
+}
+
+static void gif_decoder_close(void *data)
+{
+    gif_close(data);
+}
+
+static bool y4m_decode(void *data, struct buffer *buf, struct anim_frame *frame)
+{
+    struct y4m *y4m = data;
+
+    /* Converted straight into the SHM buffer; no intermediate copy */
+    if (!y4m_next_frame(y4m, buf->mmapped, buf->stride)) {
+        return false;
+    }
+
+    frame->delay = y4m_frame_duration(y4m);
+    frame->damage = (pixman_box32_t){ 0, 0, buf->width, buf->height };
+    return true;
+}
+
+static void y4m_decoder_close(void *data)
+{
+    y4m_close(data);
+}
+
+static bool open_decoder(struct decoder *dec, const uint8_t *data, size_t size, uint32_t bg)
+{
+    struct gif *gif = gif_open(data, size, bg);
+    if (gif != NULL) {
+        *dec = (struct decoder){
+            .data = gif,
+            .width = gif_width(gif),
+            .height = gif_height(gif),
+            .ring_size = ANIM_RING_MAX,
+            .next_frame = &gif_decode,
+            .close = &gif_decoder_close,
+        };
+        return true;
+    }
+
+    struct y4m *y4m = y4m_open(data, size);
+    if (y4m != NULL) {
+        /* Video frames are large; one shown, one queued, one decoding */
+        *dec = (struct decoder){
+            .data = y4m,
+            .width = y4m_width(y4m),
+            .height = y4m_height(y4m),
+            .ring_size = 3,
+            .next_frame = &y4m_decode,
+            .close = &y4m_decoder_close,
+        };
+        return true;
+    }
+
+    return false;
+}
+
+static void *decode_thread(void *data)
+{
+    struct anim *anim = data;
+
+    prio_background("wbg-decode");
+
+    pthread_mutex_lock(&anim->lock);
+    while (!anim->quit) {
+        struct slot *slot = NULL;
+        for (int i = 0; i < anim->ring_size && slot == NULL; ++i) {
+            if (anim->slots[i].state == SLOT_FREE) {
+                slot = &anim->slots[i];
+            }
+        }
+
+        if (slot == NULL || anim->done) {
+            pthread_cond_wait(&anim->cond, &anim->lock);
+            continue;
+        }
+
+        slot->state = SLOT_DECODING;
+        pthread_mutex_unlock(&anim->lock);
+
+        /* Decoder and the free slot are touched by this thread only */
+        struct anim_frame info = { 0 };
+        const bool ok = anim->dec.next_frame(anim->dec.data, slot->frame.buf, &info);
+
+        pthread_mutex_lock(&anim->lock);
+
+        if (!ok) {
+            slot->state = SLOT_FREE;
+            anim->done = true;
+            LOG_DEBUG("anim: decoded all %llu frames", (unsigned long long)anim->decoded);
+            continue;
+        }
+
+        slot->frame.seq = ++anim->decoded;
+        slot->frame.delay = info.delay;
+        slot->frame.damage = info.damage;
+        slot->state = SLOT_READY;
+
+        if (eventfd_write(anim->event_fd, 1) < 0) {
+            LOG_ERRNO("anim: failed to signal decoded frame");
+        }
+    }
+    pthread_mutex_unlock(&anim->lock);
+
+    return NULL;
+}
+
+struct anim *anim_load(struct wl_shm *shm, const char *path, uint32_t bg)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOG_ERRNO("%s: failed to open", path);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        LOG_ERR("%s: failed to stat or empty file", path);
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        LOG_ERRNO("%s: failed to mmap", path);
+        return NULL;
+    }
+
+    /* Decoders read the file front to back */
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    struct decoder dec;
+    if (!open_decoder(&dec, map, st.st_size, bg)) {
+        LOG_ERR("%s: not a GIF image nor a Y4M video", path);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    struct anim *anim = calloc(1, sizeof (*anim));
+    *anim = (struct anim){
+        .map = map,
+        .map_size = st.st_size,
+        .dec = dec,
+        .width = dec.width,
+        .height = dec.height,
+        .ring_size = dec.ring_size,
+        .event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK),
+    };
+
+    if (anim->event_fd < 0) {
+        LOG_ERRNO("anim: failed to create event FD");
+        goto err;
+    }
+
+    for (int i = 0; i < anim->ring_size; ++i) {
+        struct buffer *buf = shm_get_buffer(
+            shm, anim->width, anim->height, (uintptr_t)(void *)anim);
+        if (buf == NULL) {
+            goto err;
+        }
+        anim->slots[i] = (struct slot){ .frame = { .buf = buf }, .state = SLOT_FREE };
+    }
+
+    pthread_mutex_init(&anim->lock, NULL);
+    pthread_cond_init(&anim->cond, NULL);
+
+    int ret = pthread_create(&anim->thread, NULL, &decode_thread, anim);
+    if (ret != 0) {
+        errno = ret;
+        LOG_ERRNO("anim: failed to start decoder thread");
+        pthread_mutex_destroy(&anim->lock);
+        pthread_cond_destroy(&anim->cond);
+        goto err;
+    }
+
+    LOG_INFO("%s: %dx%d animation", path, anim->width, anim->height);
+    return anim;
+
+err:
+    for (int i = 0; i < anim->ring_size; ++i) {
+        shm_buffer_discard(anim->slots[i].frame.buf);
+    }
+    if (anim->event_fd >= 0) {
+        close(anim->event_fd);
+    }
+    dec.close(dec.data);
+    munmap(map, st.st_size);
+    free(anim);
+    return NULL;
+}
+
+void anim_destroy(struct anim *anim)
+{
+    if (anim == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&anim->lock);
+    anim->quit = true;
+    pthread_cond_signal(&anim->cond);
+    pthread_mutex_unlock(&anim->lock);
+
+    pthread_join(anim->thread, NULL);
+    pthread_mutex_destroy(&anim->lock);
+    pthread_cond_destroy(&anim->cond);
+
+    for (int i = 0; i < anim->ring_size; ++i) {
+        shm_buffer_discard(anim->slots[i].frame.buf);
+    }
+
+    close(anim->event_fd);
+    anim->dec.close(anim->dec.data);
+    munmap(anim->map, anim->map_size);
+    free(anim);
+}
+
+int anim_width(const struct anim *anim)
+{
+    return anim->width;
+}
+
+int anim_height(const struct anim *anim)
+{
+    return anim->height;
+}
+
+int anim_fd(const struct anim *anim)
+{
+    return anim->event_fd;
+}
+
+void anim_drain_fd(struct anim *anim)
+{
+    eventfd_t count;
+    eventfd_read(anim->event_fd, &count);
+}
+
+struct anim_frame *anim_next(struct anim *anim)
+{
+    struct anim_frame *frame = NULL;
+
+    pthread_mutex_lock(&anim->lock);
+    for (int i = 0; i < anim->ring_size; ++i) {
+        struct slot *slot = &anim->slots[i];
+        if (slot->state == SLOT_READY && slot->frame.seq == anim->taken + 1) {
+            slot->state = SLOT_TAKEN;
+            anim->taken++;
+            frame = &slot->frame;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&anim->lock);
+
+    return frame;
+}
+
+void anim_put(struct anim *anim, struct anim_frame *frame)
+{
+    struct slot *slot = (struct slot *)frame;
+
+    pthread_mutex_lock(&anim->lock);
+    slot->state = SLOT_RETIRED;
+    pthread_mutex_unlock(&anim->lock);
+}
+
+void anim_collect(struct anim *anim)
+{
+    bool freed = false;
+
+    pthread_mutex_lock(&anim->lock);
+    for (int i = 0; i < anim->ring_size; ++i) {
+        struct slot *slot = &anim->slots[i];
+
+        /* `busy` is only ever touched from the main thread */
+        if (slot->state == SLOT_RETIRED && !slot->frame.buf->busy) {
+            slot->state = SLOT_FREE;
+            freed = true;
+        }
+    }
+
+    if (freed) {
+        pthread_cond_signal(&anim->cond);
+    }
+    pthread_mutex_unlock(&anim->lock);
+}
@@ -0,0 +1,52 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#ifndef ANIM_H_
+#define ANIM_H_
+
+#include <stdint.h>
+
+#include <pixman.h>
+#include <wayland-client.h>
+
+#include "shm.h"
+
+/* Upper bound of frame buffers per animation; bounds memory use */
+#define ANIM_RING_MAX 4
+
+struct anim;
+
+struct anim_frame {
+    struct buffer *buf;
+    uint64_t seq;          /* frames are numbered from 1, in display order */
+    int delay;             /* microseconds */
+    pixman_box32_t damage; /* area changed since frame seq-1 */
+};
+
+/*
+ * Opens animation (GIF) or video (Y4M) at `path`, allocates the ring of
+ * frame buffers and starts decoding on a worker thread. Transparent pixels
+ * are composited over `bg`. Returns NULL if the file cannot be decoded.
+ */
+struct anim *anim_load(struct wl_shm *shm, const char *path, uint32_t bg);
+void anim_destroy(struct anim *anim);
+
+int anim_width(const struct anim *anim);
+int anim_height(const struct anim *anim);
+
+/* Becomes readable whenever the worker finishes decoding a frame */
+int anim_fd(const struct anim *anim);
+void anim_drain_fd(struct anim *anim);
+
+/*
+ * Takes the next frame in display order, if it has been decoded already.
+ * Frame stays owned by the caller until given back with anim_put().
+ */
+struct anim_frame *anim_next(struct anim *anim);
+void anim_put(struct anim *anim, struct anim_frame *frame);
+
+/* Hands frames given back (and released by the compositor) to the worker */
+void anim_collect(struct anim *anim);
+
+#endif // ANIM_H_
@@ -0,0 +1,180 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#include "budget.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <tllist.h>
+
+#include "log.h"
+#include "stride.h"
+
+struct reclaimer {
+    budget_reclaim_fn reclaim;
+    void *data;
+};
+
+static const char *const kind_names[BUDGET_KINDS] = {
+    [BUDGET_BUFFERS] = "buffers",
+    [BUDGET_IMAGES] = "images",
+    [BUDGET_PYRAMIDS] = "pyramids",
+    [BUDGET_FLATTENED] = "flattened",
+    [BUDGET_PARKED] = "parked",
+};
+
+/* Counters; taken briefly, also from pixman destroy functions */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t limit;
+static size_t total;
+static size_t used[BUDGET_KINDS];
+static size_t peak[BUDGET_KINDS];
+static unsigned denied[BUDGET_KINDS];
+
+/* Held while reclaiming, so that reclaimers are not removed meanwhile */
+static pthread_mutex_t reclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+static tll(struct reclaimer) reclaimers;
+
+void budget_set_limit(size_t bytes)
+{
+    pthread_mutex_lock(&lock);
+    limit = bytes;
+    pthread_mutex_unlock(&lock);
+}
+
+static bool try_reserve(enum budget_kind kind, size_t size)
+{
+    pthread_mutex_lock(&lock);
+
+    const bool fits = limit == 0 || (total <= limit && size <= limit - total);
+    if (fits) {
+        total += size;
+        used[kind] += size;
+        if (used[kind] > peak[kind]) {
+            peak[kind] = used[kind];
+        }
+    }
+
+    pthread_mutex_unlock(&lock);
+    return fits;
+}
+
+bool budget_reserve(enum budget_kind kind, size_t size)
+{
+    if (try_reserve(kind, size)) {
+        return true;
+    }
+
+    /* Caches, in the order they registered, until it fits */
+    bool fits = false;
+    pthread_mutex_lock(&reclaim_lock);
+    tll_foreach(reclaimers, it) {
+        it->item.reclaim(it->item.data, size);
+        if ((fits = try_reserve(kind, size))) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&reclaim_lock);
+
+    if (!fits) {
+        pthread_mutex_lock(&lock);
+        denied[kind]++;
+        const size_t over = total + size - limit;
+        pthread_mutex_unlock(&lock);
+
+        LOG_WARN("budget: %zu KiB of %s do not fit, %zu KiB over",
+                 size / 1024, kind_names[kind], over / 1024);
+    }
+    return fits;
+}
+
+void budget_release(enum budget_kind kind, size_t size)
+{
+    pthread_mutex_lock(&lock);
+    total -= size;
+    used[kind] -= size;
+    pthread_mutex_unlock(&lock);
+}
+
+struct accounted {
+    enum budget_kind kind;
+    size_t size;
+};
+
+static void release_image(pixman_image_t *pix, void *data)
+{
+    struct accounted *acc = data;
+    budget_release(acc->kind, acc->size);
+    free(acc);
+}
+
+pixman_image_t *budget_image_create(enum budget_kind kind, pixman_format_code_t format,
+                                    int width, int height, bool clear)
+{
+    const size_t size = (size_t)stride_for_format_and_width(format, width) * height;
+    if (!budget_reserve(kind, size)) {
+        return NULL;
+    }
+
+    pixman_image_t *pix = clear
+        ? pixman_image_create_bits(format, width, height, NULL, 0)
+        : pixman_image_create_bits_no_clear(format, width, height, NULL, 0);
+    if (pix == NULL) {
+        budget_release(kind, size);
+        return NULL;
+    }
+
+    struct accounted *acc = malloc(sizeof (*acc));
+    *acc = (struct accounted){ .kind = kind, .size = size };
+    pixman_image_set_destroy_function(pix, &release_image, acc);
+    return pix;
+}
+
+void budget_add_reclaimer(budget_reclaim_fn reclaim, void *data)
+{
+    pthread_mutex_lock(&reclaim_lock);
+    tll_push_back(reclaimers, ((struct reclaimer){ .reclaim = reclaim, .data = data }));
+    pthread_mutex_unlock(&reclaim_lock);
+}
+
+void budget_remove_reclaimer(budget_reclaim_fn reclaim, void *data)
+{
+    pthread_mutex_lock(&reclaim_lock);
+    tll_foreach(reclaimers, it) {
+        if (it->item.reclaim == reclaim && it->item.data == data) {
+            tll_remove(reclaimers, it);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&reclaim_lock);
+}
+
+size_t budget_used(enum budget_kind kind)
+{
+    pthread_mutex_lock(&lock);
+    const size_t bytes = used[kind];
+    pthread_mutex_unlock(&lock);
+    return bytes;
+}
+
+void budget_dump_stats(void)
+{
+    pthread_mutex_lock(&lock);
+
+    if (limit > 0) {
+        LOG_INFO("budget: %zu of %zu KiB used", total / 1024, limit / 1024);
+    } else {
+        LOG_INFO("budget: %zu KiB used, no limit", total / 1024);
+    }
+
+    for (int i = 0; i < BUDGET_KINDS; ++i) {
+        LOG_INFO("budget: %-9s %8zu KiB, %8zu KiB at peak, %u denied",
+                 kind_names[i], used[i] / 1024, peak[i] / 1024, denied[i]);
+    }
+
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,60 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#ifndef BUDGET_H_
+#define BUDGET_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <pixman.h>
+
+/*
+ * Accounting of all memory holding pixels, against a single ceiling.
+ * Allocations are reserved before they are made; once the ceiling would
+ * be crossed, caches are asked to give memory back (least recently used
+ * first), and if that is not enough the reservation fails, for the caller
+ * to do with less: not cache, show a smaller or simpler picture.
+ */
+enum budget_kind {
+    BUDGET_BUFFERS,   /* SHM buffers, shared content, span canvas */
+    BUDGET_IMAGES,    /* decoded images */
+    BUDGET_PYRAMIDS,  /* halved copies of images (see mip.h) */
+    BUDGET_FLATTENED, /* static layers flattened, images scaled per size */
+    BUDGET_PARKED,    /* compressed content of powered off outputs */
+    BUDGET_KINDS,
+};
+
+/* Ceiling over all kinds, in bytes; 0 (the default) for none */
+void budget_set_limit(size_t limit);
+
+/* Accounts `size` bytes to `kind`; false, with nothing accounted, if they
+ * do not fit even after reclaiming caches */
+bool budget_reserve(enum budget_kind kind, size_t size);
+void budget_release(enum budget_kind kind, size_t size);
+
+/* Image whose memory is accounted to `kind` for as long as it lives; NULL
+ * if it does not fit */
+pixman_image_t *budget_image_create(enum budget_kind kind, pixman_format_code_t format,
+                                    int width, int height, bool clear);
+
+/*
+ * Frees cached memory, at least `wanted` bytes if it can, least recently
+ * used first. Called from whichever thread is over budget, possibly with
+ * locks of the cache held already: must not block on them (trylock).
+ */
+typedef void (*budget_reclaim_fn)(void *data, size_t wanted);
+
+void budget_add_reclaimer(budget_reclaim_fn reclaim, void *data);
+
+/* Once it returns, reclaimer is not running and not called anymore */
+void budget_remove_reclaimer(budget_reclaim_fn reclaim, void *data);
+
+/* Bytes currently accounted to `kind` */
+size_t budget_used(enum budget_kind kind);
+
+/* Logs use of each kind, its peak, and reservations denied */
+void budget_dump_stats(void);
+
+#endif // BUDGET_H_
@@ -0,0 +1,238 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#include "check.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include "color.h"
+#include "export.h"
+#include "gif.h"
+#include "image.h"
+#include "log.h"
+#include "scene.h"
+#include "timeline.h"
+#include "y4m.h"
+
+/* Animations loop, possibly forever; this many frames are decoded */
+#define CHECK_FRAMES 64
+
+/* Time allowed, per pixel put out and per byte of input */
+#define BUDGET_NS_BASE      (100 * 1000 * 1000)
+#define BUDGET_NS_PER_PIXEL 200
+#define BUDGET_NS_PER_BYTE  1000
+
+/* Peak memory allowed, per pixel of the largest image and per byte of input */
+#define BUDGET_BYTES_BASE      (16 << 20)
+#define BUDGET_BYTES_PER_PIXEL 16
+#define BUDGET_BYTES_PER_BYTE  4
+
+/* Pixels per byte of input; beyond it the file is a decompression bomb */
+#define BUDGET_PIXELS_PER_BYTE 4096
+
+struct usage {
+    size_t pixels; /* put out, over all frames */
+    size_t area;   /* of the largest image */
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t peak_rss(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return (size_t)ru.ru_maxrss * 1024;
+}
+
+static void add_image(struct usage *usage, size_t width, size_t height)
+{
+    usage->pixels += width * height;
+    if (width * height > usage->area) {
+        usage->area = width * height;
+    }
+}
+
+static bool check_gif(const uint8_t *data, size_t size, struct usage *usage)
+{
+    struct gif *gif = gif_open(data, size, 0xff000000u);
+    if (gif == NULL) {
+        return false;
+    }
+
+    struct gif_frame frame;
+    int frames = 0;
+    while (frames < CHECK_FRAMES && gif_next_frame(gif, &frame)) {
+        add_image(usage, gif_width(gif), gif_height(gif));
+        frames++;
+    }
+
+    gif_close(gif);
+    return frames > 0;
+}
+
+static bool check_y4m(const uint8_t *data, size_t size, struct usage *usage)
+{
+    struct y4m *y4m = y4m_open(data, size);
+    if (y4m == NULL) {
+        return false;
+    }
+
+    const int width = y4m_width(y4m);
+    const int height = y4m_height(y4m);
+    uint8_t *frame = malloc((size_t)width * height * sizeof (uint32_t));
+
+    int frames = 0;
+    while (frame != NULL && frames < CHECK_FRAMES &&
+           y4m_next_frame(y4m, frame, width * sizeof (uint32_t))) {
+        add_image(usage, width, height);
+        frames++;
+    }
+
+    free(frame);
+    y4m_close(y4m);
+    return frames > 0;
+}
+
+static bool check_image(const char *path, struct usage *usage)
+{
+    pixman_image_t *pix = image_load(path);
+    if (pix == NULL) {
+        return false;
+    }
+
+    add_image(usage, pixman_image_get_width(pix), pixman_image_get_height(pix));
+    pixman_image_unref(pix);
+    return true;
+}
+
+/* Parsers only; images named are peeked at, not decoded */
+static bool check_text(const char *path, const uint8_t *data, size_t size)
+{
+    bool ok = false;
+
+    /* Every line on its own, as a color */
+    for (size_t pos = 0; pos < size;) {
+        const uint8_t *nl = memchr(data + pos, '\n', size - pos);
+        const size_t len = (nl != NULL) ? (size_t)(nl - data) - pos : size - pos;
+
+        char *line = strndup((const char *)data + pos, len);
+        pixman_color_t color;
+        ok |= color_parse(line, &color);
+        free(line);
+
+        pos += len + 1;
+    }
+
+    struct scene *scene = scene_create(true);
+    ok |= scene_load(scene, path);
+    scene_destroy(scene);
+
+    const struct sun_location loc = { 51.5, 0.0 };
+    struct timeline *tl = timeline_load(path, &loc, true);
+    ok |= tl != NULL;
+    if (tl != NULL) {
+        timeline_destroy(tl);
+    }
+
+    return ok;
+}
+
+static void over_budget(const char *path, const char *what, double value, double budget)
+{
+    LOG_ERR("%s: over budget of %s: %.0f, allowed %.0f", path, what, value, budget);
+    abort();
+}
+
+bool check_file(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOG_ERRNO("%s: failed to open", path);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        LOG_ERR("%s: failed to stat or empty file", path);
+        close(fd);
+        return false;
+    }
+
+    /* Mapped, as the Y4M reader (like the animation player) expects */
+    const size_t size = st.st_size;
+    void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        LOG_ERRNO("%s: failed to mmap", path);
+        return false;
+    }
+    const uint8_t *data = mapping;
+
+    struct usage usage = { 0 };
+    const char *kind;
+    bool ok;
+
+    const size_t rss_before = peak_rss();
+    const uint64_t start = now_ns();
+
+    if (size >= 6 && memcmp(data, "GIF8", 4) == 0) {
+        kind = "gif";
+        ok = check_gif(data, size, &usage);
+    } else if (size >= 10 && memcmp(data, "YUV4MPEG2 ", 10) == 0) {
+        kind = "y4m";
+        ok = check_y4m(data, size, &usage);
+    } else if (size >= 8 && memcmp(data, WBGRAW_MAGIC, 8) == 0) {
+        kind = "wbgraw";
+        ok = check_image(path, &usage);
+    } else {
+        kind = "text";
+        ok = check_text(path, data, size);
+    }
+
+    const uint64_t elapsed = now_ns() - start;
+    const size_t rss = peak_rss() - rss_before;
+
+    munmap(mapping, size);
+
+    LOG_INFO("%s: %s %s, %zu bytes to %zu pixels, %.1f ns/pixel, %zu KiB peak",
+             path, kind, ok ? "accepted" : "rejected", size, usage.pixels,
+             usage.pixels > 0 ? (double)elapsed / usage.pixels : 0.0, rss / 1024);
+
+    const double time_budget = BUDGET_NS_BASE +
+                               (double)BUDGET_NS_PER_PIXEL * usage.pixels +
+                               (double)BUDGET_NS_PER_BYTE * size;
+    if (elapsed > time_budget) {
+        over_budget(path, "time (ns)", elapsed, time_budget);
+    }
+
+    const double memory_budget = BUDGET_BYTES_BASE +
+                                 (double)BUDGET_BYTES_PER_PIXEL * usage.area +
+                                 (double)BUDGET_BYTES_PER_BYTE * size;
+    if (rss > memory_budget) {
+        over_budget(path, "peak memory (bytes)", rss, memory_budget);
+    }
+
+    const double ratio_budget = (double)BUDGET_PIXELS_PER_BYTE * size;
+    if (usage.area > ratio_budget) {
+        over_budget(path, "pixels per input size", usage.area, ratio_budget);
+    }
+
+    return ok;
+}
@@ -0,0 +1,20 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#ifndef CHECK_H_
+#define CHECK_H_
+
+#include <stdbool.h>
+
+/*
+ * Runs `path` through whatever reads it: GIF, Y4M and wbgraw decoders by
+ * magic, otherwise the color, scene and timeline parsers. Rejecting the
+ * input is fine; overrunning budgets of time per pixel, peak memory or
+ * pixels per input byte aborts, as crashes do, so that a fuzzer driving
+ * it (e.g. `afl-fuzz -i seeds -o out -- wbg-color --check @@`) reports
+ * the input. Returns false if the input was rejected.
+ */
+bool check_file(const char *path);
+
+#endif // CHECK_H_
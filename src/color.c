@@ -0,0 +1,570 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#include "color.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "colorhash.h"
+#include "named-colors.h"
+
+/* Hex digit values plus one; zero for anything else */
+static const uint8_t hex_digits[256] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+    ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+static pixman_color_t from_argb(uint32_t argb)
+{
+    return (pixman_color_t){
+        .red   = (uint16_t)((argb >> 16 & 0xff) * 0x0101),
+        .green = (uint16_t)((argb >> 8 & 0xff) * 0x0101),
+        .blue  = (uint16_t)((argb & 0xff) * 0x0101),
+        .alpha = (uint16_t)((argb >> 24) * 0x0101),
+    };
+}
+
+/* `#RGB`, `#RGBA`, `#RRGGBB` or `#RRGGBBAA` */
+static const char *parse_hex(const char *hex, pixman_color_t *color)
+{
+    const size_t len = strnlen(hex, 9);
+    if (len != 3 && len != 4 && len != 6 && len != 8) {
+        return "expected 3, 4, 6 or 8 hex digits";
+    }
+
+    /* Invalid digits turn into all ones, noticed once at the end */
+    uint32_t v = 0;
+    uint32_t invalid = 0;
+    for (size_t i = 0; i < len; ++i) {
+        const uint32_t d = hex_digits[(uint8_t)hex[i]] - 1u;
+        invalid |= d;
+        v = v << 4 | (d & 0xf);
+    }
+    if (invalid > 0xf) {
+        return "invalid hex digit";
+    }
+
+    if (len <= 4) {
+        /* Single digits stand for both of a pair */
+        const uint32_t a = (len == 4) ? (v & 0xf) * 0x1111 : 0xffff;
+        v >>= (len == 4) ? 4 : 0;
+        *color = (pixman_color_t){
+            .red   = (uint16_t)((v >> 8 & 0xf) * 0x1111),
+            .green = (uint16_t)((v >> 4 & 0xf) * 0x1111),
+            .blue  = (uint16_t)((v & 0xf) * 0x1111),
+            .alpha = (uint16_t)a,
+        };
+        return NULL;
+    }
+
+    *color = from_argb((len == 8) ? (v & 0xff) << 24 | v >> 8 : 0xff000000u | v);
+    return NULL;
+}
+
+static const char *parse_name(const char *name, size_t len, pixman_color_t *color)
+{
+    if (len == 0 || len > NAMED_COLOR_MAX) {
+        return "unknown color name";
+    }
+
+    const uint32_t bucket = colorhash(name, len, 0) % NAMED_COLOR_BUCKETS;
+    const uint32_t slot = colorhash(name, len, named_color_seeds[bucket]) % NAMED_COLOR_SLOTS;
+    const struct named_color *named = &named_colors[slot];
+
+    if (strncasecmp(named->name, name, len) != 0 || named->name[len] != '\0') {
+        return "unknown color name";
+    }
+
+    *color = from_argb(named->argb);
+    return NULL;
+}
+
+enum unit { UNIT_NONE, UNIT_PERCENT, UNIT_DEG, UNIT_RAD, UNIT_GRAD, UNIT_TURN };
+
+struct component {
+    double value;
+    enum unit unit;
+};
+
+/* Plain decimal notation, no exponent; independent of locale */
+static bool parse_number(const char **p, double *value)
+{
+    const char *s = *p;
+    const bool negative = *s == '-';
+    if (*s == '-' || *s == '+') {
+        s++;
+    }
+
+    double v = 0;
+    const char *digits = s;
+    while (*s >= '0' && *s <= '9') {
+        v = v * 10 + (*s++ - '0');
+    }
+
+    if (*s == '.') {
+        double scale = 0.1;
+        for (s++; *s >= '0' && *s <= '9'; s++, scale /= 10) {
+            v += (*s - '0') * scale;
+        }
+    }
+
+    if (s == digits || (s == digits + 1 && *digits == '.')) {
+        return false;
+    }
+
+    *value = negative ? -v : v;
+    *p = s;
+    return true;
+}
+
+static bool parse_unit(const char **p, enum unit *unit)
+{
+    static const struct {
+        const char *name;
+        enum unit unit;
+    } units[] = {
+        { "%", UNIT_PERCENT },
+        { "deg", UNIT_DEG },
+        { "rad", UNIT_RAD },
+        { "grad", UNIT_GRAD },
+        { "turn", UNIT_TURN },
+    };
+
+    size_t len = 0;
+    while (((*p)[len] | 0x20) >= 'a' && ((*p)[len] | 0x20) <= 'z') {
+        len++;
+    }
+    if (len == 0 && **p == '%') {
+        len = 1;
+    }
+
+    if (len == 0) {
+        *unit = UNIT_NONE;
+        return true;
+    }
+
+    for (size_t i = 0; i < sizeof (units) / sizeof (units[0]); ++i) {
+        if (strlen(units[i].name) == len && strncasecmp(*p, units[i].name, len) == 0) {
+            *unit = units[i].unit;
+            *p += len;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void skip_spaces(const char **p)
+{
+    while (**p == ' ' || **p == '\t') {
+        (*p)++;
+    }
+}
+
+/*
+ * Arguments of a color function, from just after `(` to the end of string:
+ * `A B C`, `A B C / ALPHA` or `A, B, C[, ALPHA]`
+ */
+static const char *parse_args(const char *p, struct component args[4], int *count)
+{
+    bool commas = false;
+
+    for (*count = 0;; ++*count) {
+        skip_spaces(&p);
+        if (*p == ')') {
+            break;
+        }
+        if (*p == '\0') {
+            return "expected ')'";
+        }
+
+        if (*count == 4) {
+            return "too many arguments";
+        }
+
+        if (*count > 0) {
+            if (*p == '/') {
+                if (*count != 3 || commas) {
+                    return "'/' is only allowed before alpha";
+                }
+                p++;
+            } else if (*p == ',') {
+                if (*count == 1) {
+                    commas = true;
+                } else if (!commas) {
+                    return "mixed ',' and space separators";
+                }
+                p++;
+            } else if (commas) {
+                return "expected ','";
+            } else if (*count == 3) {
+                return "expected '/' before alpha";
+            }
+            skip_spaces(&p);
+        }
+
+        if (!parse_number(&p, &args[*count].value)) {
+            return "expected a number";
+        }
+        if (!parse_unit(&p, &args[*count].unit)) {
+            return "unknown unit";
+        }
+        if (*p != ' ' && *p != '\t' && *p != ',' && *p != '/' && *p != ')' && *p != '\0') {
+            return "expected a separator";
+        }
+    }
+
+    if (p[1] != '\0') {
+        return "trailing characters after ')'";
+    }
+
+    return NULL;
+}
+
+static double clamp01(double v)
+{
+    return (v < 0) ? 0 : (v > 1) ? 1 : v;
+}
+
+static uint16_t channel(double v)
+{
+    return (uint16_t)(clamp01(v) * 0xffff + 0.5);
+}
+
+/* Fraction of `full`, which percents are of */
+static const char *fraction(const struct component *c, double full, double *v)
+{
+    switch (c->unit) {
+        case UNIT_NONE:
+            *v = c->value / full;
+            return NULL;
+        case UNIT_PERCENT:
+            *v = c->value / 100;
+            return NULL;
+        default:
+            return "unexpected angle unit";
+    }
+}
+
+/* In turns */
+static const char *hue(const struct component *c, double *v)
+{
+    switch (c->unit) {
+        case UNIT_NONE:
+        case UNIT_DEG:
+            *v = c->value / 360;
+            break;
+        case UNIT_RAD:
+            *v = c->value / (2 * M_PI);
+            break;
+        case UNIT_GRAD:
+            *v = c->value / 400;
+            break;
+        case UNIT_TURN:
+            *v = c->value;
+            break;
+        case UNIT_PERCENT:
+            return "hue is an angle, not a percentage";
+    }
+
+    *v -= floor(*v);
+    return NULL;
+}
+
+static double hsl_channel(double n, double h, double s, double l)
+{
+    const double k = fmod(n + h * 12, 12);
+    const double a = s * fmin(l, 1 - l);
+    return l - a * fmax(-1, fmin(fmin(k - 3, 9 - k), 1));
+}
+
+static double srgb_encode(double v)
+{
+    return (v <= 0.0031308) ? 12.92 * v : 1.055 * pow(v, 1 / 2.4) - 0.055;
+}
+
+/* OKLCH to sRGB (Björn Ottosson); out of gamut colors are clipped */
+static void oklch_to_srgb(double l, double c, double h, double rgb[3])
+{
+    const double a = c * cos(h * 2 * M_PI);
+    const double b = c * sin(h * 2 * M_PI);
+
+    const double l_ = l + 0.3963377774 * a + 0.2158037573 * b;
+    const double m_ = l - 0.1055613458 * a - 0.0638541728 * b;
+    const double s_ = l - 0.0894841775 * a - 1.2914855480 * b;
+
+    const double lc = l_ * l_ * l_;
+    const double mc = m_ * m_ * m_;
+    const double sc = s_ * s_ * s_;
+
+    rgb[0] = srgb_encode(clamp01(+4.0767416621 * lc - 3.3077115913 * mc + 0.2309699292 * sc));
+    rgb[1] = srgb_encode(clamp01(-1.2684380046 * lc + 2.6097574011 * mc - 0.3413193965 * sc));
+    rgb[2] = srgb_encode(clamp01(-0.0041960863 * lc - 0.7034186147 * mc + 1.7076147010 * sc));
+}
+
+enum function { FN_RGB, FN_HSL, FN_OKLCH };
+
+static const char *parse_function(const char *str, size_t name_len, pixman_color_t *color)
+{
+    static const struct {
+        const char *name;
+        enum function fn;
+    } functions[] = {
+        { "rgb", FN_RGB },
+        { "rgba", FN_RGB },
+        { "hsl", FN_HSL },
+        { "hsla", FN_HSL },
+        { "oklch", FN_OKLCH },
+    };
+
+    size_t i = 0;
+    while (i < sizeof (functions) / sizeof (functions[0]) &&
+           (strlen(functions[i].name) != name_len ||
+            strncasecmp(str, functions[i].name, name_len) != 0)) {
+        i++;
+    }
+    if (i == sizeof (functions) / sizeof (functions[0])) {
+        return "unknown color function";
+    }
+
+    struct component args[4];
+    int count;
+    const char *err = parse_args(str + name_len + 1, args, &count);
+    if (err != NULL) {
+        return err;
+    }
+    if (count < 3) {
+        return "expected 3 or 4 arguments";
+    }
+
+    double alpha = 1;
+    if (count == 4 && (err = fraction(&args[3], 1, &alpha)) != NULL) {
+        return err;
+    }
+
+    double rgb[3];
+    double h, s, l, c;
+
+    switch (functions[i].fn) {
+        case FN_RGB:
+            for (int k = 0; k < 3; ++k) {
+                if ((err = fraction(&args[k], 255, &rgb[k])) != NULL) {
+                    return err;
+                }
+            }
+            break;
+
+        case FN_HSL:
+            if ((err = hue(&args[0], &h)) != NULL ||
+                (err = fraction(&args[1], 100, &s)) != NULL ||
+                (err = fraction(&args[2], 100, &l)) != NULL) {
+                return err;
+            }
+            s = clamp01(s);
+            l = clamp01(l);
+            rgb[0] = hsl_channel(0, h, s, l);
+            rgb[1] = hsl_channel(8, h, s, l);
+            rgb[2] = hsl_channel(4, h, s, l);
+            break;
+
+        case FN_OKLCH:
+            /* Lightness is 0..1 and chroma 0..0.4 at 100% */
+            if ((err = fraction(&args[0], 1, &l)) != NULL ||
+                (err = fraction(&args[1], 1, &c)) != NULL ||
+                (err = hue(&args[2], &h)) != NULL) {
+                return err;
+            }
+            if (args[1].unit == UNIT_PERCENT) {
+                c *= 0.4;
+            }
+            oklch_to_srgb(clamp01(l), fmax(c, 0), h, rgb);
+            break;
+    }
+
+    *color = (pixman_color_t){
+        .red   = channel(rgb[0]),
+        .green = channel(rgb[1]),
+        .blue  = channel(rgb[2]),
+        .alpha = channel(alpha),
+    };
+    return NULL;
+}
+
+const char *color_parse_error(const char *str, pixman_color_t *color)
+{
+    if (str[0] == '#') {
+        return parse_hex(str + 1, color);
+    }
+
+    /* Names and functions are made of letters only */
+    size_t len = 0;
+    while ((str[len] | 0x20) >= 'a' && (str[len] | 0x20) <= 'z') {
+        len++;
+    }
+
+    if (str[len] == '(') {
+        return parse_function(str, len, color);
+    }
+    if (str[len] != '\0') {
+        return (len == 0) ? "expected '#', a name or a function" : "unknown color name";
+    }
+
+    return parse_name(str, len, color);
+}
+
+bool color_parse(const char *str, pixman_color_t *color)
+{
+    return color_parse_error(str, color) == NULL;
+}
+
+static uint16_t mix_channel(uint16_t a, uint16_t b, double t)
+{
+    return (uint16_t)(a + (b - a) * t + 0.5);
+}
+
+pixman_color_t color_mix(pixman_color_t a, pixman_color_t b, double t)
+{
+    return (pixman_color_t){
+        .red   = mix_channel(a.red,   b.red,   t),
+        .green = mix_channel(a.green, b.green, t),
+        .blue  = mix_channel(a.blue,  b.blue,  t),
+        .alpha = mix_channel(a.alpha, b.alpha, t),
+    };
+}
+
+/* Black body colour, each channel 0..1 (fit by Tanner Helland) */
+static void black_body(double kelvin, double rgb[3])
+{
+    const double t = kelvin / 100;
+
+    rgb[0] = (t <= 66) ? 255 : 329.698727446 * pow(t - 60, -0.1332047592);
+    rgb[1] = (t <= 66)
+        ? 99.4708025861 * log(t) - 161.1195681661
+        : 288.1221695283 * pow(t - 60, -0.0755148492);
+    rgb[2] = (t >= 66) ? 255 : (t <= 19) ? 0 : 138.5177312231 * log(t - 10) - 305.0447927307;
+
+    for (int i = 0; i < 3; ++i) {
+        rgb[i] = (rgb[i] < 0) ? 0 : (rgb[i] > 255) ? 1 : rgb[i] / 255;
+    }
+}
+
+pixman_color_t color_temperature(pixman_color_t color, double kelvin)
+{
+    double white[3];
+    double tint[3];
+    black_body(6500, white);
+    black_body(kelvin, tint);
+
+    for (int i = 0; i < 3; ++i) {
+        tint[i] = (tint[i] / white[i] > 1) ? 1 : tint[i] / white[i];
+    }
+
+    return (pixman_color_t){
+        .red   = (uint16_t)(color.red * tint[0] + 0.5),
+        .green = (uint16_t)(color.green * tint[1] + 0.5),
+        .blue  = (uint16_t)(color.blue * tint[2] + 0.5),
+        .alpha = color.alpha,
+    };
+}
+
+static const struct {
+    const char *str;
+    pixman_color_t want;
+} good[] = {
+    { "#fff",                     { 0xffff, 0xffff, 0xffff, 0xffff } },
+    { "#1234",                    { 0x1111, 0x2222, 0x3333, 0x4444 } },
+    { "#C0ffee",                  { 0xc0c0, 0xffff, 0xeeee, 0xffff } },
+    { "#11223380",                { 0x1111, 0x2222, 0x3333, 0x8080 } },
+    { "RebeccaPurple",            { 0x6666, 0x3333, 0x9999, 0xffff } },
+    { "transparent",              { 0x0000, 0x0000, 0x0000, 0x0000 } },
+    { "rgb(255, 0, 128)",         { 0xffff, 0x0000, 0x8080, 0xffff } },
+    { "rgba(255,0,128,0)",        { 0xffff, 0x0000, 0x8080, 0x0000 } },
+    { "rgb(100% 0% 50% / 50%)",   { 0xffff, 0x0000, 0x8000, 0x8000 } },
+    { "hsl(120, 100%, 50%)",      { 0x0000, 0xffff, 0x0000, 0xffff } },
+    { "hsl(0.5turn 100% 25%)",    { 0x0000, 0x8000, 0x8000, 0xffff } },
+    { "oklch(100% 0 0)",          { 0xffff, 0xffff, 0xffff, 0xffff } },
+    { "oklch(0 0 90deg / 0.5)",   { 0x0000, 0x0000, 0x0000, 0x8000 } },
+};
+
+static const char *const bad[] = {
+    "", "#", "#12345", "#ggg", "#1234567", "notacolor", "red(", "foo(1 2 3)",
+    "rgb(1, 2)", "rgb(1 2, 3)", "rgb(1, 2 3)", "rgb(1 2 3 4)", "rgb(1 2 / 3 4)",
+    "rgb(1, 2, 3))", "rgb(1, 2, 3", "rgb(1 2 3 / )", "rgb(1deg 2 3)", "rgb(1px 2 3)",
+    "hsl(10% 1 1)", "rgb(. 2 3)",
+};
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Millions of parses of `str` per second, over at least a quarter of a second */
+static double parse_rate(const char *str)
+{
+    volatile uint16_t sink;
+    pixman_color_t color = { 0 };
+    const double start = now_s();
+    double elapsed;
+    size_t parses = 0;
+
+    do {
+        for (int i = 0; i < 10000; ++i) {
+            color_parse(str, &color);
+            sink = color.red;
+        }
+        parses += 10000;
+        elapsed = now_s() - start;
+    } while (elapsed < 0.25);
+
+    (void)sink;
+    return parses / elapsed / 1e6;
+}
+
+bool color_bench(void)
+{
+    bool ok = true;
+
+    for (size_t i = 0; i < sizeof (good) / sizeof (good[0]); ++i) {
+        pixman_color_t got = { 0 };
+        const char *err = color_parse_error(good[i].str, &got);
+        if (err != NULL || memcmp(&got, &good[i].want, sizeof (got)) != 0) {
+            fprintf(stderr, "%s: parsed as %04x %04x %04x %04x (%s)\n", good[i].str,
+                    got.red, got.green, got.blue, got.alpha, err != NULL ? err : "ok");
+            ok = false;
+        }
+    }
+
+    for (size_t i = 0; i < sizeof (bad) / sizeof (bad[0]); ++i) {
+        pixman_color_t got;
+        if (color_parse(bad[i], &got)) {
+            fprintf(stderr, "%s: accepted\n", bad[i]);
+            ok = false;
+        }
+    }
+
+    if (!ok) {
+        return false;
+    }
+
+    printf("\nMillions of color parses per second\n\n");
+    static const char *const syntaxes[] = {
+        "#abc", "#aabbcc", "#aabbccdd", "lightgoldenrodyellow", "rebeccapurple",
+        "rgb(12, 34, 56)", "rgb(10% 20% 30% / 0.5)", "hsl(210 50% 40%)",
+        "oklch(62.8% 0.2577 29.23)",
+    };
+    for (size_t i = 0; i < sizeof (syntaxes) / sizeof (syntaxes[0]); ++i) {
+        printf("%-28s %10.1f\n", syntaxes[i], parse_rate(syntaxes[i]));
+    }
+
+    return true;
+}
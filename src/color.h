@@ -0,0 +1,32 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#ifndef COLOR_H_
+#define COLOR_H_
+
+#include <stdbool.h>
+
+#include <pixman.h>
+
+/*
+ * Parses a CSS color: `#RGB`, `#RGBA`, `#RRGGBB`, `#RRGGBBAA`, a named
+ * color, or `rgb()`, `rgba()`, `hsl()`, `hsla()` and `oklch()`, with
+ * arguments separated by spaces (alpha after `/`) or commas. Leaves
+ * `color` untouched on failure.
+ */
+bool color_parse(const char *str, pixman_color_t *color);
+
+/* As color_parse(), returning NULL on success, otherwise what is wrong */
+const char *color_parse_error(const char *str, pixman_color_t *color);
+
+/* Checks parsing against known colors, then prints parses per second */
+bool color_bench(void);
+
+/* Linear interpolation between `a` and `b`, `t` being in 0..1 */
+pixman_color_t color_mix(pixman_color_t a, pixman_color_t b, double t);
+
+/* Tints `color` with white point of black body at `kelvin` (6500 is neutral) */
+pixman_color_t color_temperature(pixman_color_t color, double kelvin);
+
+#endif // COLOR_H_
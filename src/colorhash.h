@@ -0,0 +1,30 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#ifndef COLORHASH_H_
+#define COLORHASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Hash of color names, shared by the parser and tools/gen-colors.c, which
+ * builds a perfect hash table of them: a name is put in a bucket by its
+ * hash with seed 0, then in a slot by its hash with the seed of the bucket.
+ * Letters are hashed regardless of case.
+ */
+static inline uint32_t colorhash(const char *name, size_t len, uint32_t seed)
+{
+    uint32_t h = 0x811c9dc5u ^ seed * 0x9e3779b9u;
+    for (size_t i = 0; i < len; ++i) {
+        h = (h ^ ((uint8_t)name[i] | 0x20)) * 0x01000193u;
+    }
+
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    return h;
+}
+
+#endif // COLORHASH_H_
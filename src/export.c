@@ -0,0 +1,211 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#include "export.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF  0x40
+#define QOI_OP_LUMA  0x80
+#define QOI_OP_RUN   0xc0
+#define QOI_OP_RGB   0xfe
+
+static bool has_suffix(const char *str, const char *suffix)
+{
+    const size_t len = strlen(str);
+    const size_t slen = strlen(suffix);
+    return len >= slen && strcasecmp(str + len - slen, suffix) == 0;
+}
+
+static void put32be(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void put32le(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static bool write_ppm(FILE *f, const uint8_t *data, int width, int height, int stride)
+{
+    fprintf(f, "P6\n%d %d\n255\n", width, height);
+
+    uint8_t *row = malloc((size_t)width * 3);
+    for (int y = 0; y < height; ++y) {
+        const uint32_t *src = (const uint32_t *)(data + (size_t)y * stride);
+        for (int x = 0; x < width; ++x) {
+            row[x * 3 + 0] = src[x] >> 16;
+            row[x * 3 + 1] = src[x] >> 8;
+            row[x * 3 + 2] = src[x];
+        }
+        fwrite(row, 3, width, f);
+    }
+
+    free(row);
+    return true;
+}
+
+/* https://qoiformat.org/qoi-specification.pdf */
+static bool write_qoi(FILE *f, const uint8_t *data, int width, int height, int stride)
+{
+    uint8_t header[14] = { 'q', 'o', 'i', 'f' };
+    put32be(header + 4, width);
+    put32be(header + 8, height);
+    header[12] = 3; /* RGB */
+    header[13] = 0; /* sRGB */
+    fwrite(header, 1, sizeof (header), f);
+
+    /* Worst case is 4 bytes a pixel (QOI_OP_RGB), after a run left open
+     * by the row before */
+    uint8_t *out = malloc((size_t)width * 4 + 1);
+
+    uint32_t index[64] = { 0 };
+    uint32_t prev = 0xff000000u;
+    int run = 0;
+
+    for (int y = 0; y < height; ++y) {
+        const uint32_t *src = (const uint32_t *)(data + (size_t)y * stride);
+        size_t n = 0;
+
+        for (int x = 0; x < width; ++x) {
+            const uint32_t px = src[x] | 0xff000000u;
+            const bool last = y == height - 1 && x == width - 1;
+
+            if (px == prev) {
+                if (++run == 62 || last) {
+                    out[n++] = QOI_OP_RUN | (run - 1);
+                    run = 0;
+                }
+                continue;
+            }
+
+            if (run > 0) {
+                out[n++] = QOI_OP_RUN | (run - 1);
+                run = 0;
+            }
+
+            const uint8_t r = px >> 16;
+            const uint8_t g = px >> 8;
+            const uint8_t b = px;
+            const int hash = (r * 3 + g * 5 + b * 7 + 255 * 11) % 64;
+
+            if (index[hash] == px) {
+                out[n++] = QOI_OP_INDEX | hash;
+            } else {
+                index[hash] = px;
+
+                const int8_t dr = (int8_t)(r - (uint8_t)(prev >> 16));
+                const int8_t dg = (int8_t)(g - (uint8_t)(prev >> 8));
+                const int8_t db = (int8_t)(b - (uint8_t)prev);
+                const int8_t dr_dg = (int8_t)(dr - dg);
+                const int8_t db_dg = (int8_t)(db - dg);
+
+                if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                    out[n++] = QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+                } else if (dg >= -32 && dg <= 31 &&
+                           dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) {
+                    out[n++] = QOI_OP_LUMA | (dg + 32);
+                    out[n++] = (dr_dg + 8) << 4 | (db_dg + 8);
+                } else {
+                    out[n++] = QOI_OP_RGB;
+                    out[n++] = r;
+                    out[n++] = g;
+                    out[n++] = b;
+                }
+            }
+
+            prev = px;
+        }
+
+        fwrite(out, 1, n, f);
+    }
+
+    static const uint8_t end[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+    fwrite(end, 1, sizeof (end), f);
+
+    free(out);
+    return true;
+}
+
+/* Average of all pixels, for a placeholder shown before the image is read */
+static uint32_t average_color(const uint8_t *data, int width, int height, int stride)
+{
+    uint64_t r = 0, g = 0, b = 0;
+
+    for (int y = 0; y < height; ++y) {
+        const uint32_t *row = (const uint32_t *)(data + (size_t)y * stride);
+        for (int x = 0; x < width; ++x) {
+            r += (row[x] >> 16) & 0xff;
+            g += (row[x] >> 8) & 0xff;
+            b += row[x] & 0xff;
+        }
+    }
+
+    const uint64_t n = (uint64_t)width * height;
+    return 0xff000000u | (uint32_t)(r / n) << 16 | (uint32_t)(g / n) << 8 | (uint32_t)(b / n);
+}
+
+static bool write_wbgraw(FILE *f, const uint8_t *data, int width, int height, int stride)
+{
+    uint8_t header[WBGRAW_OFFSET] = { 0 };
+    memcpy(header, WBGRAW_MAGIC, 8);
+    put32le(header + 8, width);
+    put32le(header + 12, height);
+    put32le(header + 16, stride);
+    put32le(header + 20, 1 /* WL_SHM_FORMAT_XRGB8888 */);
+    put32le(header + 24, WBGRAW_OFFSET);
+    put32le(header + 28, average_color(data, width, height, stride));
+    fwrite(header, 1, sizeof (header), f);
+
+    fwrite(data, stride, height, f);
+    return true;
+}
+
+bool export_image(const char *path, pixman_image_t *pix)
+{
+    bool (*write)(FILE *, const uint8_t *, int, int, int);
+
+    if (has_suffix(path, ".ppm")) {
+        write = &write_ppm;
+    } else if (has_suffix(path, ".qoi")) {
+        write = &write_qoi;
+    } else if (has_suffix(path, ".wbgraw")) {
+        write = &write_wbgraw;
+    } else {
+        LOG_ERR("%s: unknown format (expected .ppm, .qoi or .wbgraw)", path);
+        return false;
+    }
+
+    FILE *f = fopen(path, "we");
+    if (f == NULL) {
+        LOG_ERRNO("%s: failed to open", path);
+        return false;
+    }
+
+    const bool ok = write(f, (const uint8_t *)pixman_image_get_data(pix),
+                          pixman_image_get_width(pix), pixman_image_get_height(pix),
+                          pixman_image_get_stride(pix)) && !ferror(f);
+
+    if (fclose(f) != 0 || !ok) {
+        LOG_ERRNO("%s: failed to write", path);
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,30 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#ifndef EXPORT_H_
+#define EXPORT_H_
+
+#include <stdbool.h>
+
+#include <pixman.h>
+
+/*
+ * Raw XRGB8888 pixels, ready to be mmapped (or handed to wl_shm) as they
+ * are. Header is little endian:
+ *
+ *     char magic[8];    "WBGRAW01"
+ *     uint32_t width;
+ *     uint32_t height;
+ *     uint32_t stride;
+ *     uint32_t format;  wl_shm format, i.e. 1 for XRGB8888
+ *     uint32_t offset;  of pixel data, a page boundary
+ *     uint32_t color;   average, as 0xffRRGGBB (0 if unknown)
+ */
+#define WBGRAW_MAGIC "WBGRAW01"
+#define WBGRAW_OFFSET 4096
+
+/* Writes x8r8g8b8 image to file; format (PPM, QOI, wbgraw) by extension */
+bool export_image(const char *path, pixman_image_t *pix);
+
+#endif // EXPORT_H_
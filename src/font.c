@@ -0,0 +1,220 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#include "font.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <tllist.h>
+
+#include "log.h"
+
+#define FIRST_GLYPH ' '
+#define LAST_GLYPH  '~'
+#define GLYPHS      (LAST_GLYPH - FIRST_GLYPH + 1)
+
+/* Column-major; bit 0 is the top row */
+static const uint8_t font[GLYPHS][FONT_WIDTH] = {
+    { 0x00, 0x00, 0x00, 0x00, 0x00 }, /*   */
+    { 0x00, 0x00, 0x5f, 0x00, 0x00 }, /* ! */
+    { 0x00, 0x07, 0x00, 0x07, 0x00 }, /* " */
+    { 0x14, 0x7f, 0x14, 0x7f, 0x14 }, /* # */
+    { 0x24, 0x2a, 0x7f, 0x2a, 0x12 }, /* $ */
+    { 0x23, 0x13, 0x08, 0x64, 0x62 }, /* % */
+    { 0x36, 0x49, 0x55, 0x22, 0x50 }, /* & */
+    { 0x00, 0x05, 0x03, 0x00, 0x00 }, /* ' */
+    { 0x00, 0x1c, 0x22, 0x41, 0x00 }, /* ( */
+    { 0x00, 0x41, 0x22, 0x1c, 0x00 }, /* ) */
+    { 0x14, 0x08, 0x3e, 0x08, 0x14 }, /* * */
+    { 0x08, 0x08, 0x3e, 0x08, 0x08 }, /* + */
+    { 0x00, 0x50, 0x30, 0x00, 0x00 }, /* , */
+    { 0x08, 0x08, 0x08, 0x08, 0x08 }, /* - */
+    { 0x00, 0x60, 0x60, 0x00, 0x00 }, /* . */
+    { 0x20, 0x10, 0x08, 0x04, 0x02 }, /* / */
+    { 0x3e, 0x51, 0x49, 0x45, 0x3e }, /* 0 */
+    { 0x00, 0x42, 0x7f, 0x40, 0x00 }, /* 1 */
+    { 0x42, 0x61, 0x51, 0x49, 0x46 }, /* 2 */
+    { 0x21, 0x41, 0x45, 0x4b, 0x31 }, /* 3 */
+    { 0x18, 0x14, 0x12, 0x7f, 0x10 }, /* 4 */
+    { 0x27, 0x45, 0x45, 0x45, 0x39 }, /* 5 */
+    { 0x3c, 0x4a, 0x49, 0x49, 0x30 }, /* 6 */
+    { 0x01, 0x71, 0x09, 0x05, 0x03 }, /* 7 */
+    { 0x36, 0x49, 0x49, 0x49, 0x36 }, /* 8 */
+    { 0x06, 0x49, 0x49, 0x29, 0x1e }, /* 9 */
+    { 0x00, 0x36, 0x36, 0x00, 0x00 }, /* : */
+    { 0x00, 0x56, 0x36, 0x00, 0x00 }, /* ; */
+    { 0x08, 0x14, 0x22, 0x41, 0x00 }, /* < */
+    { 0x14, 0x14, 0x14, 0x14, 0x14 }, /* = */
+    { 0x00, 0x41, 0x22, 0x14, 0x08 }, /* > */
+    { 0x02, 0x01, 0x51, 0x09, 0x06 }, /* ? */
+    { 0x32, 0x49, 0x79, 0x41, 0x3e }, /* @ */
+    { 0x7e, 0x11, 0x11, 0x11, 0x7e }, /* A */
+    { 0x7f, 0x49, 0x49, 0x49, 0x36 }, /* B */
+    { 0x3e, 0x41, 0x41, 0x41, 0x22 }, /* C */
+    { 0x7f, 0x41, 0x41, 0x22, 0x1c }, /* D */
+    { 0x7f, 0x49, 0x49, 0x49, 0x41 }, /* E */
+    { 0x7f, 0x09, 0x09, 0x09, 0x01 }, /* F */
+    { 0x3e, 0x41, 0x49, 0x49, 0x7a }, /* G */
+    { 0x7f, 0x08, 0x08, 0x08, 0x7f }, /* H */
+    { 0x00, 0x41, 0x7f, 0x41, 0x00 }, /* I */
+    { 0x20, 0x40, 0x41, 0x3f, 0x01 }, /* J */
+    { 0x7f, 0x08, 0x14, 0x22, 0x41 }, /* K */
+    { 0x7f, 0x40, 0x40, 0x40, 0x40 }, /* L */
+    { 0x7f, 0x02, 0x0c, 0x02, 0x7f }, /* M */
+    { 0x7f, 0x04, 0x08, 0x10, 0x7f }, /* N */
+    { 0x3e, 0x41, 0x41, 0x41, 0x3e }, /* O */
+    { 0x7f, 0x09, 0x09, 0x09, 0x06 }, /* P */
+    { 0x3e, 0x41, 0x51, 0x21, 0x5e }, /* Q */
+    { 0x7f, 0x09, 0x19, 0x29, 0x46 }, /* R */
+    { 0x46, 0x49, 0x49, 0x49, 0x31 }, /* S */
+    { 0x01, 0x01, 0x7f, 0x01, 0x01 }, /* T */
+    { 0x3f, 0x40, 0x40, 0x40, 0x3f }, /* U */
+    { 0x1f, 0x20, 0x40, 0x20, 0x1f }, /* V */
+    { 0x3f, 0x40, 0x38, 0x40, 0x3f }, /* W */
+    { 0x63, 0x14, 0x08, 0x14, 0x63 }, /* X */
+    { 0x07, 0x08, 0x70, 0x08, 0x07 }, /* Y */
+    { 0x61, 0x51, 0x49, 0x45, 0x43 }, /* Z */
+    { 0x00, 0x7f, 0x41, 0x41, 0x00 }, /* [ */
+    { 0x02, 0x04, 0x08, 0x10, 0x20 }, /* \ */
+    { 0x00, 0x41, 0x41, 0x7f, 0x00 }, /* ] */
+    { 0x04, 0x02, 0x01, 0x02, 0x04 }, /* ^ */
+    { 0x40, 0x40, 0x40, 0x40, 0x40 }, /* _ */
+    { 0x00, 0x01, 0x02, 0x04, 0x00 }, /* ` */
+    { 0x20, 0x54, 0x54, 0x54, 0x78 }, /* a */
+    { 0x7f, 0x48, 0x44, 0x44, 0x38 }, /* b */
+    { 0x38, 0x44, 0x44, 0x44, 0x20 }, /* c */
+    { 0x38, 0x44, 0x44, 0x48, 0x7f }, /* d */
+    { 0x38, 0x54, 0x54, 0x54, 0x18 }, /* e */
+    { 0x08, 0x7e, 0x09, 0x01, 0x02 }, /* f */
+    { 0x0c, 0x52, 0x52, 0x52, 0x3e }, /* g */
+    { 0x7f, 0x08, 0x04, 0x04, 0x78 }, /* h */
+    { 0x00, 0x44, 0x7d, 0x40, 0x00 }, /* i */
+    { 0x20, 0x40, 0x44, 0x3d, 0x00 }, /* j */
+    { 0x7f, 0x10, 0x28, 0x44, 0x00 }, /* k */
+    { 0x00, 0x41, 0x7f, 0x40, 0x00 }, /* l */
+    { 0x7c, 0x04, 0x18, 0x04, 0x78 }, /* m */
+    { 0x7c, 0x08, 0x04, 0x04, 0x78 }, /* n */
+    { 0x38, 0x44, 0x44, 0x44, 0x38 }, /* o */
+    { 0x7c, 0x14, 0x14, 0x14, 0x08 }, /* p */
+    { 0x08, 0x14, 0x14, 0x18, 0x7c }, /* q */
+    { 0x7c, 0x08, 0x04, 0x04, 0x08 }, /* r */
+    { 0x48, 0x54, 0x54, 0x54, 0x20 }, /* s */
+    { 0x04, 0x3f, 0x44, 0x40, 0x20 }, /* t */
+    { 0x3c, 0x40, 0x40, 0x20, 0x7c }, /* u */
+    { 0x1c, 0x20, 0x40, 0x20, 0x1c }, /* v */
+    { 0x3c, 0x40, 0x30, 0x40, 0x3c }, /* w */
+    { 0x44, 0x28, 0x10, 0x28, 0x44 }, /* x */
+    { 0x0c, 0x50, 0x50, 0x50, 0x3c }, /* y */
+    { 0x44, 0x64, 0x54, 0x4c, 0x44 }, /* z */
+    { 0x00, 0x08, 0x36, 0x41, 0x00 }, /* { */
+    { 0x00, 0x00, 0x7f, 0x00, 0x00 }, /* | */
+    { 0x00, 0x41, 0x36, 0x08, 0x00 }, /* } */
+    { 0x02, 0x01, 0x02, 0x04, 0x02 }, /* ~ */
+};
+
+/* Shared by all renderers, which may run in different threads */
+static tll(struct glyph_atlas *) atlases;
+static pthread_mutex_t atlases_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct glyph_atlas *atlas_create(int unit)
+{
+    const int width = GLYPHS * FONT_WIDTH * unit;
+    const int height = FONT_HEIGHT * unit;
+
+    pixman_image_t *pix = pixman_image_create_bits(PIXMAN_a8, width, height, NULL, 0);
+    if (pix == NULL) {
+        LOG_ERR("font: failed to allocate %dx%d glyph atlas", width, height);
+        return NULL;
+    }
+
+    uint8_t *data = (uint8_t *)pixman_image_get_data(pix);
+    const int stride = pixman_image_get_stride(pix);
+
+    for (int g = 0; g < GLYPHS; ++g) {
+        for (int col = 0; col < FONT_WIDTH; ++col) {
+            for (int row = 0; row < FONT_HEIGHT; ++row) {
+                if (!(font[g][col] & (1 << row))) {
+                    continue;
+                }
+
+                const int x = (g * FONT_WIDTH + col) * unit;
+                for (int y = row * unit; y < (row + 1) * unit; ++y) {
+                    memset(data + (size_t)y * stride + x, 0xff, unit);
+                }
+            }
+        }
+    }
+
+    struct glyph_atlas *atlas = malloc(sizeof (*atlas));
+    *atlas = (struct glyph_atlas){ .unit = unit, .refcount = 1, .pix = pix };
+    return atlas;
+}
+
+struct glyph_atlas *glyph_atlas_get(int unit)
+{
+    pthread_mutex_lock(&atlases_lock);
+
+    tll_foreach(atlases, it) {
+        if (it->item->unit == unit) {
+            it->item->refcount++;
+            pthread_mutex_unlock(&atlases_lock);
+            return it->item;
+        }
+    }
+
+    struct glyph_atlas *atlas = atlas_create(unit);
+    if (atlas != NULL) {
+        tll_push_back(atlases, atlas);
+    }
+
+    pthread_mutex_unlock(&atlases_lock);
+    return atlas;
+}
+
+void glyph_atlas_unref(struct glyph_atlas *atlas)
+{
+    if (atlas == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&atlases_lock);
+
+    if (--atlas->refcount > 0) {
+        pthread_mutex_unlock(&atlases_lock);
+        return;
+    }
+
+    tll_foreach(atlases, it) {
+        if (it->item == atlas) {
+            tll_remove(atlases, it);
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&atlases_lock);
+
+    pixman_image_unref(atlas->pix);
+    free(atlas);
+}
+
+void glyph_atlas_draw(const struct glyph_atlas *atlas, char c,
+                      pixman_image_t *src, pixman_image_t *dst, int x, int y)
+{
+    if (c < FIRST_GLYPH || c > LAST_GLYPH) {
+        c = '?';
+    }
+
+    const int w = FONT_WIDTH * atlas->unit;
+    const int h = FONT_HEIGHT * atlas->unit;
+
+    pixman_image_composite32(
+        PIXMAN_OP_OVER,
+        src, atlas->pix, dst,
+        0, 0, (c - FIRST_GLYPH) * w, 0, x, y,
+        w, h);
+}
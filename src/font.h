@@ -0,0 +1,29 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#ifndef FONT_H_
+#define FONT_H_
+
+#include <pixman.h>
+
+/* Built-in 5x7 bitmap font, printable ASCII only */
+#define FONT_WIDTH  5
+#define FONT_HEIGHT 7
+
+/* All glyphs rasterized once, each font pixel being `unit` pixels wide */
+struct glyph_atlas {
+    int unit;
+    int refcount;
+    pixman_image_t *pix; /* a8, glyphs side by side */
+};
+
+/* Returns atlas for given unit, shared with other users of the same size */
+struct glyph_atlas *glyph_atlas_get(int unit);
+void glyph_atlas_unref(struct glyph_atlas *atlas);
+
+/* Composites `src` (typically solid color) through glyph of `c` at x,y */
+void glyph_atlas_draw(const struct glyph_atlas *atlas, char c,
+                      pixman_image_t *src, pixman_image_t *dst, int x, int y);
+
+#endif // FONT_H_
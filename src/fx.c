@@ -0,0 +1,444 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#include "fx.h"
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "budget.h"
+#include "log.h"
+#include "prio.h"
+
+/* Three boxes are within a few percent of a Gaussian */
+#define FX_BOXES 3
+
+/* Standard deviation at most, in pixels of the image blurred; larger blur
+ * is run on a smaller level instead (see fx_reduction()) */
+#define FX_SIGMA_MAX 48
+
+#define FX_TILE_ROWS 32
+#define FX_THREADS_MAX 8
+
+/* Threads cost more than they save below this */
+#define FX_THREADS_MIN_PIXELS (512 * 512)
+
+/* Vignette starts darkening at this distance from the centre, 1 being
+ * the edge of the visible part */
+#define FX_VIGNETTE_INNER 0.5f
+
+enum pass_kind {
+    PASS_ROWS,    /* box blur along rows */
+    PASS_COLUMNS, /* box blur along columns */
+    PASS_COLOR,   /* dim and vignette */
+};
+
+struct pass {
+    enum pass_kind kind;
+    int radius;
+    uint32_t inv; /* 65536 / (2 * radius + 1) */
+    const uint8_t *src;
+    uint8_t *dst;
+};
+
+struct plan {
+    int width;
+    int height;
+    int stride; /* bytes, same for every image */
+    int tiles;
+    int radius_max;
+
+    struct pass passes[2 * FX_BOXES + 1];
+    int count;
+    atomic_int next[2 * FX_BOXES + 1]; /* next tile of each pass */
+
+    uint16_t dim;
+    uint8_t tint[4]; /* as laid out in memory */
+    uint16_t vignette;
+    float cx, cy;    /* centre of visible part */
+    float rx, ry;    /* 1 over its half width and height */
+    float *dx2;      /* per column, squared distance from centre */
+
+    /* Helpers wait for `ready`, all of them started by then */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool ready;
+    pthread_barrier_t barrier;
+};
+
+bool fx_any(const struct fx *fx)
+{
+    return fx->blur > 0 || fx->dim > 0 || fx->vignette > 0;
+}
+
+int fx_reduction(const struct fx *fx)
+{
+    /* Keeping a few pixels of standard deviation hides the upscaling */
+    int reduction = 1;
+    while (reduction * 2 * 4 <= fx->blur) {
+        reduction *= 2;
+    }
+    return reduction;
+}
+
+/* Box sizes whose succession approximates a Gaussian of `sigma` */
+static void box_radii(double sigma, int radii[FX_BOXES])
+{
+    const double ideal = sqrt(12 * sigma * sigma / FX_BOXES + 1);
+    int lower = (int)ideal;
+    if (lower % 2 == 0) {
+        lower--;
+    }
+
+    /* How many boxes are of the lower size, the rest being 2 larger */
+    const double m = (12 * sigma * sigma - FX_BOXES * lower * lower -
+                      4 * FX_BOXES * lower - 3 * FX_BOXES) / (-4.0 * lower - 4);
+
+    for (int i = 0; i < FX_BOXES; ++i) {
+        const int size = (i < lround(m)) ? lower : lower + 2;
+        radii[i] = (size - 1) / 2;
+    }
+}
+
+static inline int clamp(int v, int lo, int hi)
+{
+    return (v < lo) ? lo : (v > hi) ? hi : v;
+}
+
+/*
+ * Sliding window along a row: one add and one subtract per channel and
+ * pixel, whatever the radius. `ext` is the row with its edge pixels
+ * repeated `radius` + 1 times on either side, so that the window never
+ * needs clamping. All four bytes of a pixel are treated alike, which
+ * keeps it independent of their order.
+ */
+static void blur_row(const uint8_t *restrict ext, uint8_t *restrict dst,
+                     int width, int radius, uint32_t inv)
+{
+    uint32_t sum[4] = { 0 };
+    for (int k = 1; k <= 2 * radius + 1; ++k) {
+        for (int c = 0; c < 4; ++c) {
+            sum[c] += ext[4 * k + c];
+        }
+    }
+
+    const uint8_t *restrict in = ext + 4 * (2 * radius + 2);
+    const uint8_t *restrict out = ext + 4;
+
+    for (int x = 0; x < width; ++x) {
+        for (int c = 0; c < 4; ++c) {
+            dst[4 * x + c] = (sum[c] * inv + 0x8000) >> 16;
+            sum[c] += (uint32_t)in[4 * x + c] - out[4 * x + c];
+        }
+    }
+}
+
+static void extend_row(const uint8_t *src, uint8_t *ext, int width, int radius)
+{
+    for (int k = 0; k <= radius; ++k) {
+        memcpy(ext + 4 * k, src, 4);
+        memcpy(ext + 4 * (radius + 1 + width + k), src + 4 * (width - 1), 4);
+    }
+    memcpy(ext + 4 * (radius + 1), src, (size_t)width * 4);
+}
+
+/*
+ * Column sums are kept for a whole row, and moved down a row at a time.
+ * Loops are split in chunks of a fixed count, which are vectorized even
+ * at -O2 (with SSE2 or NEON, no runtime dispatch needed).
+ */
+#define FX_CHUNK 16
+
+static void column_add(uint32_t *restrict sum, const uint8_t *restrict row, size_t n)
+{
+    size_t i = 0;
+    for (; i + FX_CHUNK <= n; i += FX_CHUNK) {
+        for (size_t k = 0; k < FX_CHUNK; ++k) {
+            sum[i + k] += row[i + k];
+        }
+    }
+    for (; i < n; ++i) {
+        sum[i] += row[i];
+    }
+}
+
+static void column_step(uint8_t *restrict dst, uint32_t *restrict sum,
+                        const uint8_t *restrict in, const uint8_t *restrict out,
+                        size_t n, uint32_t inv)
+{
+    size_t i = 0;
+    for (; i + FX_CHUNK <= n; i += FX_CHUNK) {
+        for (size_t k = 0; k < FX_CHUNK; ++k) {
+            dst[i + k] = (sum[i + k] * inv + 0x8000) >> 16;
+            sum[i + k] += (uint32_t)in[i + k] - out[i + k];
+        }
+    }
+    for (; i < n; ++i) {
+        dst[i] = (sum[i] * inv + 0x8000) >> 16;
+        sum[i] += (uint32_t)in[i] - out[i];
+    }
+}
+
+/* Box blur along columns, for rows y0 to y1 */
+static void blur_columns(const struct plan *plan, const struct pass *pass,
+                         int y0, int y1, uint32_t *sum)
+{
+    const size_t n = (size_t)plan->width * 4;
+    const int last = plan->height - 1;
+    const uint8_t *src = pass->src;
+    const int stride = plan->stride;
+
+    memset(sum, 0, n * sizeof (sum[0]));
+    for (int k = -pass->radius; k <= pass->radius; ++k) {
+        column_add(sum, src + (size_t)clamp(y0 + k, 0, last) * stride, n);
+    }
+
+    for (int y = y0; y < y1; ++y) {
+        column_step(pass->dst + (size_t)y * stride, sum,
+                    src + (size_t)clamp(y + pass->radius + 1, 0, last) * stride,
+                    src + (size_t)clamp(y - pass->radius, 0, last) * stride,
+                    n, pass->inv);
+    }
+}
+
+static void color_row(const struct plan *plan, const uint8_t *src, uint8_t *dst, int y)
+{
+    const uint32_t keep = 256 - plan->dim;
+    uint32_t tint[4];
+    for (int c = 0; c < 4; ++c) {
+        tint[c] = plan->tint[c] * plan->dim + 128;
+    }
+
+    const float dy = (y + 0.5f - plan->cy) * plan->ry;
+    const float dy2 = dy * dy;
+
+    for (int x = 0; x < plan->width; ++x) {
+        uint32_t factor = 256;
+        if (plan->vignette > 0) {
+            float t = (sqrtf(plan->dx2[x] + dy2) - FX_VIGNETTE_INNER) /
+                      ((float)M_SQRT2 - FX_VIGNETTE_INNER);
+            t = (t < 0) ? 0 : (t > 1) ? 1 : t;
+            factor = 256 - (uint32_t)(plan->vignette * t * t);
+        }
+
+        for (int c = 0; c < 4; ++c) {
+            const uint32_t v = (src[4 * x + c] * keep + tint[c]) >> 8;
+            dst[4 * x + c] = (v * factor + 128) >> 8;
+        }
+    }
+}
+
+/* Scratch of a thread, for either kind of blur pass */
+struct scratch {
+    uint32_t *sum;
+    uint8_t *ext;
+};
+
+static void run_tile(const struct plan *plan, const struct pass *pass,
+                     int y0, int y1, const struct scratch *scratch)
+{
+    switch (pass->kind) {
+        case PASS_ROWS:
+            for (int y = y0; y < y1; ++y) {
+                extend_row(pass->src + (size_t)y * plan->stride, scratch->ext,
+                           plan->width, pass->radius);
+                blur_row(scratch->ext, pass->dst + (size_t)y * plan->stride,
+                         plan->width, pass->radius, pass->inv);
+            }
+            break;
+
+        case PASS_COLUMNS:
+            blur_columns(plan, pass, y0, y1, scratch->sum);
+            break;
+
+        case PASS_COLOR:
+            for (int y = y0; y < y1; ++y) {
+                color_row(plan, pass->src + (size_t)y * plan->stride,
+                          pass->dst + (size_t)y * plan->stride, y);
+            }
+            break;
+    }
+}
+
+/* Takes tiles of each pass until there are none left, then waits for the
+ * others to finish theirs before the next pass */
+static void run(struct plan *plan)
+{
+    const struct scratch scratch = {
+        .sum = malloc((size_t)plan->width * 4 * sizeof (uint32_t)),
+        .ext = malloc(((size_t)plan->width + 2 * plan->radius_max + 2) * 4),
+    };
+
+    for (int p = 0; p < plan->count; ++p) {
+        int tile;
+        while ((tile = atomic_fetch_add(&plan->next[p], 1)) < plan->tiles) {
+            const int y0 = tile * FX_TILE_ROWS;
+            const int y1 = (y0 + FX_TILE_ROWS < plan->height) ? y0 + FX_TILE_ROWS : plan->height;
+            run_tile(plan, &plan->passes[p], y0, y1, &scratch);
+        }
+        pthread_barrier_wait(&plan->barrier);
+    }
+
+    free(scratch.sum);
+    free(scratch.ext);
+}
+
+static void *helper_thread(void *data)
+{
+    struct plan *plan = data;
+
+    pthread_mutex_lock(&plan->lock);
+    while (!plan->ready) {
+        pthread_cond_wait(&plan->cond, &plan->lock);
+    }
+    pthread_mutex_unlock(&plan->lock);
+
+    run(plan);
+    return NULL;
+}
+
+static int helpers_for(const struct plan *plan)
+{
+    if ((long)plan->width * plan->height < FX_THREADS_MIN_PIXELS) {
+        return 0;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus > FX_THREADS_MAX) {
+        cpus = FX_THREADS_MAX;
+    }
+    if (cpus > plan->tiles) {
+        cpus = plan->tiles;
+    }
+    return (cpus > 1) ? cpus - 1 : 0;
+}
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+bool fx_apply(const struct fx *fx, pixman_image_t *src, pixman_image_t *dst,
+              double scale, const pixman_box32_t *visible)
+{
+    [[maybe_unused]] const double start = now_ms(); /* logged in debug builds */
+    const int width = pixman_image_get_width(src);
+    const int height = pixman_image_get_height(src);
+    pixman_image_t *tmp = NULL;
+
+    struct plan plan = {
+        .width = width,
+        .height = height,
+        .stride = pixman_image_get_stride(dst),
+        .tiles = (height + FX_TILE_ROWS - 1) / FX_TILE_ROWS,
+        .dim = fx->dim,
+        .vignette = fx->vignette,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+    };
+
+    const uint8_t *from = (const uint8_t *)pixman_image_get_data(src);
+    uint8_t *to = (uint8_t *)pixman_image_get_data(dst);
+
+    if (pixman_image_get_stride(src) != plan.stride) {
+        LOG_ERR("fx: images of different layout");
+        return false;
+    }
+
+    if (fx->blur > 0) {
+        double sigma = fx->blur / scale;
+        if (sigma > FX_SIGMA_MAX) {
+            sigma = FX_SIGMA_MAX;
+        }
+
+        int radii[FX_BOXES];
+        box_radii(sigma, radii);
+
+        tmp = budget_image_create(BUDGET_FLATTENED, PIXMAN_x8r8g8b8, width, height, false);
+        if (tmp == NULL) {
+            LOG_WARN("fx: failed to allocate %dx%d image", width, height);
+            return false;
+        }
+        uint8_t *between = (uint8_t *)pixman_image_get_data(tmp);
+
+        for (int i = 0; i < FX_BOXES; ++i) {
+            if (radii[i] == 0) {
+                continue;
+            }
+
+            const uint32_t inv = (65536 + radii[i]) / (2 * radii[i] + 1);
+            if (radii[i] > plan.radius_max) {
+                plan.radius_max = radii[i];
+            }
+            plan.passes[plan.count++] = (struct pass){ PASS_ROWS, radii[i], inv, from, between };
+            plan.passes[plan.count++] = (struct pass){ PASS_COLUMNS, radii[i], inv, between, to };
+            from = to;
+        }
+    }
+
+    if (fx->dim > 0 || fx->vignette > 0 || from != to) {
+        /* Also a plain copy, for a blur too small to run */
+        plan.passes[plan.count++] = (struct pass){ .kind = PASS_COLOR, .src = from, .dst = to };
+    }
+
+    const uint32_t tint = 0xffu << 24 |
+                          (uint32_t)(fx->tint.red >> 8) << 16 |
+                          (uint32_t)(fx->tint.green >> 8) << 8 |
+                          (uint32_t)(fx->tint.blue >> 8);
+    memcpy(plan.tint, &tint, sizeof (plan.tint));
+
+    if (fx->vignette > 0) {
+        plan.cx = (visible->x1 + visible->x2) / 2.0f;
+        plan.cy = (visible->y1 + visible->y2) / 2.0f;
+        plan.rx = 2.0f / (visible->x2 - visible->x1);
+        plan.ry = 2.0f / (visible->y2 - visible->y1);
+
+        plan.dx2 = malloc(width * sizeof (float));
+        for (int x = 0; x < width; ++x) {
+            const float dx = (x + 0.5f - plan.cx) * plan.rx;
+            plan.dx2[x] = dx * dx;
+        }
+    }
+
+    /* The calling thread takes tiles too */
+    pthread_t threads[FX_THREADS_MAX];
+    int helpers = 0;
+    for (int n = helpers_for(&plan); helpers < n; ++helpers) {
+        if (!prio_spawn("fx", &helper_thread, &plan, &threads[helpers])) {
+            break;
+        }
+    }
+
+    pthread_barrier_init(&plan.barrier, NULL, helpers + 1);
+    pthread_mutex_lock(&plan.lock);
+    plan.ready = true;
+    pthread_cond_broadcast(&plan.cond);
+    pthread_mutex_unlock(&plan.lock);
+
+    run(&plan);
+
+    for (int i = 0; i < helpers; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_barrier_destroy(&plan.barrier);
+    pthread_cond_destroy(&plan.cond);
+    pthread_mutex_destroy(&plan.lock);
+    free(plan.dx2);
+    if (tmp != NULL) {
+        pixman_image_unref(tmp);
+    }
+
+    LOG_DEBUG("fx: %dx%d image in %.1f ms, %d passes on %d threads",
+              width, height, now_ms() - start, plan.count, helpers + 1);
+    return true;
+}
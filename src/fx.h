@@ -0,0 +1,42 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#ifndef FX_H_
+#define FX_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <pixman.h>
+
+/*
+ * Effects of image layers, applied to the image at the lowest resolution
+ * it is scaled from (see mip_render_fx()), before it is scaled up to the
+ * output: blur, as three box blurs (constant time per pixel, whatever the
+ * radius, and close to Gaussian), then dim towards a tint color, then
+ * vignette. Rows are split in tiles, run on a few background threads.
+ */
+struct fx {
+    int blur;            /* standard deviation, in output pixels; 0 for none */
+    uint16_t dim;        /* towards tint, 0 to 256 */
+    pixman_color_t tint; /* black by default */
+    uint16_t vignette;   /* darkening of corners, 0 to 256 */
+};
+
+/* Whether any effect is set */
+bool fx_any(const struct fx *fx);
+
+/* How many times smaller the image may be for the blur not to show it */
+int fx_reduction(const struct fx *fx);
+
+/*
+ * Applies effects to x8r8g8b8 `src`, writing `dst` of the same size.
+ * `src` is to be scaled by `scale` afterwards, showing only its `visible`
+ * part (the blur is scaled down and the vignette centred accordingly).
+ * False if out of memory.
+ */
+bool fx_apply(const struct fx *fx, pixman_image_t *src, pixman_image_t *dst,
+              double scale, const pixman_box32_t *visible);
+
+#endif // FX_H_
@@ -0,0 +1,581 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#include "gif.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "limit.h"
+#include "log.h"
+
+#define LZW_MAX_CODES 4096
+
+/* At best, every 12-bit code expands to a string as long as the table */
+#define LZW_MAX_RATIO (LZW_MAX_CODES * 8 / 12 + 1)
+
+enum disposal {
+    DISPOSE_NONE = 0,
+    DISPOSE_KEEP = 1,
+    DISPOSE_BACKGROUND = 2,
+    DISPOSE_PREVIOUS = 3,
+};
+
+struct gif {
+    const uint8_t *data;
+    size_t size;
+    size_t pos;
+    size_t first_frame; /* offset of first block after the header */
+
+    int width;
+    int height;
+
+    uint32_t bg;
+    uint32_t global_palette[256];
+    int global_colors;
+
+    /* -1 means forever */
+    int loops_left;
+    bool seen_loop_ext;
+    int frames_in_loop;
+
+    uint32_t *canvas;
+    uint32_t *saved;  /* canvas under previous frame, for DISPOSE_PREVIOUS */
+    uint8_t *indices; /* LZW output of a single frame */
+    size_t indices_size;
+
+    bool full_damage;
+
+    /* Pending disposal of previously drawn frame */
+    enum disposal disposal;
+    pixman_box32_t prev_rect;
+
+    /* Graphic control extension for the upcoming image */
+    int delay;
+    int transparent;
+    enum disposal next_disposal;
+};
+
+static bool read_u8(struct gif *gif, uint8_t *v)
+{
+    if (gif->pos >= gif->size) {
+        return false;
+    }
+    *v = gif->data[gif->pos++];
+    return true;
+}
+
+static bool read_u16(struct gif *gif, uint16_t *v)
+{
+    if (gif->size - gif->pos < 2) {
+        return false;
+    }
+    *v = (uint16_t)(gif->data[gif->pos] | (gif->data[gif->pos + 1] << 8));
+    gif->pos += 2;
+    return true;
+}
+
+static bool skip_sub_blocks(struct gif *gif)
+{
+    uint8_t len;
+    do {
+        if (!read_u8(gif, &len) || gif->size - gif->pos < len) {
+            return false;
+        }
+        gif->pos += len;
+    } while (len != 0);
+
+    return true;
+}
+
+static bool read_palette(struct gif *gif, uint32_t *palette, int count)
+{
+    if (gif->size - gif->pos < (size_t)count * 3) {
+        return false;
+    }
+
+    const uint8_t *p = gif->data + gif->pos;
+    for (int i = 0; i < count; ++i, p += 3) {
+        palette[i] = 0xff000000u | (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+    }
+
+    gif->pos += (size_t)count * 3;
+    return true;
+}
+
+/* Bit reader over the chain of data sub-blocks */
+struct lzw_reader {
+    struct gif *gif;
+    size_t block_left;
+    bool ended;
+    uint32_t bits;
+    int nbits;
+};
+
+static int lzw_read_code(struct lzw_reader *r, int size)
+{
+    while (r->nbits < size) {
+        if (r->block_left == 0) {
+            uint8_t len;
+            if (r->ended || !read_u8(r->gif, &len) || len == 0) {
+                r->ended = true;
+                return -1;
+            }
+            r->block_left = len;
+        }
+
+        uint8_t byte;
+        if (!read_u8(r->gif, &byte)) {
+            r->ended = true;
+            return -1;
+        }
+        r->block_left--;
+
+        r->bits |= (uint32_t)byte << r->nbits;
+        r->nbits += 8;
+    }
+
+    const int code = (int)(r->bits & ((1u << size) - 1));
+    r->bits >>= size;
+    r->nbits -= size;
+    return code;
+}
+
+/* Decodes up to `npix` indices; short images are padded with zeroes */
+static bool lzw_decode(struct gif *gif, int min_code_size, uint8_t *out, size_t npix)
+{
+    static_assert(LZW_MAX_CODES == 1 << 12);
+
+    if (min_code_size < 2 || min_code_size > 11) {
+        return false;
+    }
+
+    uint16_t prefix[LZW_MAX_CODES];
+    uint8_t suffix[LZW_MAX_CODES];
+    uint8_t stack[LZW_MAX_CODES + 1];
+
+    const int clear = 1 << min_code_size;
+    const int eoi = clear + 1;
+
+    for (int i = 0; i < clear; ++i) {
+        prefix[i] = 0;
+        suffix[i] = (uint8_t)i;
+    }
+
+    struct lzw_reader r = { .gif = gif };
+    int code_size = min_code_size + 1;
+    int next = clear + 2;
+    int prev = -1;
+    uint8_t first = 0;
+    size_t n = 0;
+
+    while (n < npix) {
+        const int code = lzw_read_code(&r, code_size);
+        if (code < 0 || code == eoi) {
+            break;
+        }
+
+        if (code == clear) {
+            code_size = min_code_size + 1;
+            next = clear + 2;
+            prev = -1;
+            continue;
+        }
+
+        int cur = code;
+        size_t sp = 0;
+
+        if (code >= next) {
+            /* KwKwK case: code being defined right now */
+            if (code > next || prev < 0) {
+                return false;
+            }
+            stack[sp++] = first;
+            cur = prev;
+        } else if (prev < 0 && code > clear) {
+            return false;
+        }
+
+        while (cur >= clear) {
+            stack[sp++] = suffix[cur];
+            cur = prefix[cur];
+        }
+
+        first = (uint8_t)cur;
+        stack[sp++] = first;
+
+        if (prev >= 0 && next < LZW_MAX_CODES) {
+            prefix[next] = (uint16_t)prev;
+            suffix[next] = first;
+            if (++next == 1 << code_size && code_size < 12) {
+                code_size++;
+            }
+        }
+
+        while (sp > 0 && n < npix) {
+            out[n++] = stack[--sp];
+        }
+
+        prev = code;
+    }
+
+    memset(out + n, 0, npix - n);
+
+    /* Skip whatever is left of the image data */
+    if (!r.ended) {
+        if (gif->size - gif->pos < r.block_left) {
+            return false;
+        }
+        gif->pos += r.block_left;
+        return skip_sub_blocks(gif);
+    }
+
+    return true;
+}
+
+static void fill_rect(struct gif *gif, const pixman_box32_t *rect, uint32_t pixel)
+{
+    for (int y = rect->y1; y < rect->y2; ++y) {
+        uint32_t *row = gif->canvas + (size_t)y * gif->width;
+        for (int x = rect->x1; x < rect->x2; ++x) {
+            row[x] = pixel;
+        }
+    }
+}
+
+static void copy_rect(struct gif *gif, uint32_t *dst, const uint32_t *src,
+                      const pixman_box32_t *rect)
+{
+    const size_t len = (size_t)(rect->x2 - rect->x1) * sizeof (uint32_t);
+    for (int y = rect->y1; y < rect->y2; ++y) {
+        const size_t off = (size_t)y * gif->width + rect->x1;
+        memcpy(dst + off, src + off, len);
+    }
+}
+
+static void union_box(pixman_box32_t *a, const pixman_box32_t *b)
+{
+    if (a->x1 >= a->x2 || a->y1 >= a->y2) {
+        *a = *b;
+        return;
+    }
+    if (b->x1 >= b->x2 || b->y1 >= b->y2) {
+        return;
+    }
+
+    a->x1 = (b->x1 < a->x1) ? b->x1 : a->x1;
+    a->y1 = (b->y1 < a->y1) ? b->y1 : a->y1;
+    a->x2 = (b->x2 > a->x2) ? b->x2 : a->x2;
+    a->y2 = (b->y2 > a->y2) ? b->y2 : a->y2;
+}
+
+static void rewind_gif(struct gif *gif)
+{
+    gif->pos = gif->first_frame;
+    gif->frames_in_loop = 0;
+    gif->disposal = DISPOSE_NONE;
+    gif->next_disposal = DISPOSE_NONE;
+    gif->transparent = -1;
+    gif->delay = 0;
+
+    const pixman_box32_t all = { 0, 0, gif->width, gif->height };
+    fill_rect(gif, &all, gif->bg);
+    gif->full_damage = true;
+}
+
+static bool draw_image(struct gif *gif, struct gif_frame *frame)
+{
+    uint16_t fx, fy, fw, fh;
+    uint8_t flags;
+    if (!read_u16(gif, &fx) || !read_u16(gif, &fy) ||
+        !read_u16(gif, &fw) || !read_u16(gif, &fh) ||
+        !read_u8(gif, &flags)) {
+        return false;
+    }
+
+    uint32_t local_palette[256];
+    const uint32_t *palette = gif->global_palette;
+    int colors = gif->global_colors;
+
+    if (flags & 0x80) {
+        colors = 2 << (flags & 0x07);
+        if (!read_palette(gif, local_palette, colors)) {
+            return false;
+        }
+        palette = local_palette;
+    }
+
+    uint8_t min_code_size;
+    if (!read_u8(gif, &min_code_size)) {
+        return false;
+    }
+
+    /* Decoding work is to stay in proportion with both the canvas, and
+     * the data: pixels no LZW data left could fill are a bomb, not padding */
+    const size_t npix = (size_t)fw * fh;
+    if (npix > (size_t)gif->width * gif->height ||
+        npix / LZW_MAX_RATIO > gif->size - gif->pos) {
+        LOG_ERR("gif: %ux%u frame is too big for its canvas or data", fw, fh);
+        return false;
+    }
+
+    if (npix > gif->indices_size) {
+        uint8_t *indices = realloc(gif->indices, npix);
+        if (indices == NULL) {
+            LOG_ERR("gif: out of memory for %ux%u frame", fw, fh);
+            return false;
+        }
+        gif->indices = indices;
+        gif->indices_size = npix;
+    }
+
+    if (!lzw_decode(gif, min_code_size, gif->indices, npix)) {
+        LOG_ERR("gif: corrupt image data");
+        return false;
+    }
+
+    /* Undo previous frame as it asked */
+    pixman_box32_t damage = { 0, 0, 0, 0 };
+    if (gif->disposal == DISPOSE_BACKGROUND) {
+        fill_rect(gif, &gif->prev_rect, gif->bg);
+        damage = gif->prev_rect;
+    } else if (gif->disposal == DISPOSE_PREVIOUS) {
+        copy_rect(gif, gif->canvas, gif->saved, &gif->prev_rect);
+        damage = gif->prev_rect;
+    }
+
+    /* Frame may extend past the logical screen; clip it */
+    const pixman_box32_t rect = {
+        .x1 = (fx < gif->width) ? fx : gif->width,
+        .y1 = (fy < gif->height) ? fy : gif->height,
+        .x2 = (fx + fw < gif->width) ? fx + fw : gif->width,
+        .y2 = (fy + fh < gif->height) ? fy + fh : gif->height,
+    };
+
+    if (gif->next_disposal == DISPOSE_PREVIOUS) {
+        copy_rect(gif, gif->saved, gif->canvas, &rect);
+    }
+
+    const bool interlaced = flags & 0x40;
+    static const int pass_start[] = { 0, 4, 2, 1 };
+    static const int pass_step[] = { 8, 8, 4, 2 };
+    int pass = 0;
+    int row = 0;
+
+    for (int i = 0; i < fh; ++i) {
+        if (interlaced) {
+            while (pass < 4 && row >= fh) {
+                ++pass;
+                row = (pass < 4) ? pass_start[pass] : fh;
+            }
+        } else {
+            row = i;
+        }
+
+        const int y = fy + row;
+        if (y < rect.y2) {
+            const uint8_t *src = gif->indices + (size_t)i * fw;
+            uint32_t *dst = gif->canvas + (size_t)y * gif->width;
+
+            for (int x = rect.x1; x < rect.x2; ++x) {
+                const uint8_t idx = src[x - fx];
+                if (idx == gif->transparent || idx >= colors) {
+                    continue;
+                }
+                dst[x] = palette[idx];
+            }
+        }
+
+        row += interlaced ? pass_step[pass] : 1;
+    }
+
+    union_box(&damage, &rect);
+    if (gif->full_damage) {
+        damage = (pixman_box32_t){ 0, 0, gif->width, gif->height };
+        gif->full_damage = false;
+    }
+
+    frame->damage = damage;
+    frame->delay = (gif->delay < 2) ? 100 : gif->delay * 10;
+
+    gif->disposal = gif->next_disposal;
+    gif->prev_rect = rect;
+
+    /* Control extension only applies to the image right after it */
+    gif->next_disposal = DISPOSE_NONE;
+    gif->transparent = -1;
+    gif->delay = 0;
+
+    return true;
+}
+
+static bool read_extension(struct gif *gif)
+{
+    uint8_t label;
+    if (!read_u8(gif, &label)) {
+        return false;
+    }
+
+    if (label == 0xf9) {
+        /* Graphic control extension */
+        uint8_t len, flags, transparent;
+        uint16_t delay;
+        if (!read_u8(gif, &len) || len != 4 ||
+            !read_u8(gif, &flags) || !read_u16(gif, &delay) ||
+            !read_u8(gif, &transparent)) {
+            return false;
+        }
+
+        const int disposal = (flags >> 2) & 0x07;
+        gif->next_disposal = (disposal <= DISPOSE_PREVIOUS) ? disposal : DISPOSE_NONE;
+        gif->transparent = (flags & 0x01) ? transparent : -1;
+        gif->delay = delay;
+    } else if (label == 0xff && gif->size - gif->pos >= 16 &&
+               gif->data[gif->pos] == 11 &&
+               memcmp(gif->data + gif->pos + 1, "NETSCAPE2.0", 11) == 0 &&
+               gif->data[gif->pos + 12] == 3 &&
+               gif->data[gif->pos + 13] == 1) {
+        /* Looping extension; 0 means forever */
+        if (!gif->seen_loop_ext) {
+            const int loops = gif->data[gif->pos + 14] | (gif->data[gif->pos + 15] << 8);
+            gif->loops_left = (loops == 0) ? -1 : loops;
+            gif->seen_loop_ext = true;
+        }
+        gif->pos += 12;
+    }
+
+    return skip_sub_blocks(gif);
+}
+
+bool gif_next_frame(struct gif *gif, struct gif_frame *frame)
+{
+    while (true) {
+        uint8_t block;
+        if (!read_u8(gif, &block)) {
+            LOG_ERR("gif: truncated file");
+            return false;
+        }
+
+        switch (block) {
+            case 0x2c:
+                if (!draw_image(gif, frame)) {
+                    return false;
+                }
+                gif->frames_in_loop++;
+                return true;
+
+            case 0x21:
+                if (!read_extension(gif)) {
+                    LOG_ERR("gif: malformed extension");
+                    return false;
+                }
+                break;
+
+            case 0x3b:
+                /* Trailer; still images are never replayed */
+                if (gif->frames_in_loop <= 1 || gif->loops_left == 0) {
+                    return false;
+                }
+                if (gif->loops_left > 0) {
+                    gif->loops_left--;
+                }
+                rewind_gif(gif);
+                break;
+
+            default:
+                LOG_ERR("gif: unknown block 0x%02x", block);
+                return false;
+        }
+    }
+}
+
+struct gif *gif_open(const uint8_t *data, size_t size, uint32_t bg)
+{
+    if (size < 13 ||
+        (memcmp(data, "GIF87a", 6) != 0 && memcmp(data, "GIF89a", 6) != 0)) {
+        return NULL;
+    }
+
+    struct gif *gif = calloc(1, sizeof (*gif));
+    gif->data = data;
+    gif->size = size;
+    gif->pos = 6;
+    gif->bg = bg;
+    gif->loops_left = 0; /* without looping extension, play once */
+
+    uint16_t w, h;
+    uint8_t flags, bg_index, aspect;
+    read_u16(gif, &w);
+    read_u16(gif, &h);
+    read_u8(gif, &flags);
+    read_u8(gif, &bg_index);
+    read_u8(gif, &aspect);
+
+    if (!limit_check_size("gif", w, h)) {
+        goto err;
+    }
+
+    /* Canvas no frame in the file could cover is not worth allocating */
+    if ((size_t)w * h / LZW_MAX_RATIO > size) {
+        LOG_ERR("gif: %ux%u canvas is too big for %zu bytes of data", w, h, size);
+        goto err;
+    }
+
+    gif->width = w;
+    gif->height = h;
+
+    if (flags & 0x80) {
+        gif->global_colors = 2 << (flags & 0x07);
+        if (!read_palette(gif, gif->global_palette, gif->global_colors)) {
+            LOG_ERR("gif: truncated palette");
+            goto err;
+        }
+    }
+
+    gif->first_frame = gif->pos;
+
+    const size_t npix = (size_t)w * h;
+    gif->canvas = malloc(npix * sizeof (uint32_t));
+    gif->saved = malloc(npix * sizeof (uint32_t));
+    if (gif->canvas == NULL || gif->saved == NULL) {
+        LOG_ERR("gif: out of memory for %ux%u canvas", w, h);
+        goto err;
+    }
+
+    rewind_gif(gif);
+    return gif;
+
+err:
+    gif_close(gif);
+    return NULL;
+}
+
+void gif_close(struct gif *gif)
+{
+    if (gif == NULL) {
+        return;
+    }
+
+    free(gif->canvas);
+    free(gif->saved);
+    free(gif->indices);
+    free(gif);
+}
+
+int gif_width(const struct gif *gif)
+{
+    return gif->width;
+}
+
+int gif_height(const struct gif *gif)
+{
+    return gif->height;
+}
+
+const uint32_t *gif_canvas(const struct gif *gif)
+{
+    return gif->canvas;
+}
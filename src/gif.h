@@ -0,0 +1,40 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#ifndef GIF_H_
+#define GIF_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <pixman.h>
+
+struct gif;
+
+struct gif_frame {
+    pixman_box32_t damage; /* area changed since previous frame */
+    int delay;             /* milliseconds */
+};
+
+/*
+ * Decoder reads directly from `data`, which must stay valid for the
+ * lifetime of the decoder. Transparent pixels are composited over `bg`.
+ */
+struct gif *gif_open(const uint8_t *data, size_t size, uint32_t bg);
+void gif_close(struct gif *gif);
+
+int gif_width(const struct gif *gif);
+int gif_height(const struct gif *gif);
+
+/*
+ * Decodes next frame onto the canvas, looping as many times as the file
+ * asks for. Returns false once there are no more frames (or on error).
+ */
+bool gif_next_frame(struct gif *gif, struct gif_frame *frame);
+
+/* XRGB8888 canvas holding the composited last decoded frame */
+const uint32_t *gif_canvas(const struct gif *gif);
+
+#endif // GIF_H_
@@ -0,0 +1,379 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#include "icc.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "log.h"
+
+#define ICC_HEADER_SIZE 128
+
+/* Matrix entries, in fixed point */
+#define MATRIX_BITS 12
+
+/* sRGB primaries in the profile connection space (XYZ, D50) */
+static const double srgb_to_pcs[9] = {
+    0.4360747, 0.3850649, 0.1430804,
+    0.2225045, 0.7168786, 0.0606169,
+    0.0139322, 0.0971045, 0.7141733,
+};
+
+struct trc {
+    enum { TRC_GAMMA, TRC_TABLE, TRC_PARAMETRIC } type;
+    int function; /* parametric */
+    double p[7];  /* g, a, b, c, d, e, f */
+    const uint8_t *table;
+    uint32_t count;
+};
+
+static uint32_t be32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static uint16_t be16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static double s15f16(const uint8_t *p)
+{
+    return (int32_t)be32(p) / 65536.0;
+}
+
+static bool find_tag(const uint8_t *data, size_t size, const char *sig,
+                     const uint8_t **tag, uint32_t *len)
+{
+    if (size < ICC_HEADER_SIZE + 4) {
+        return false;
+    }
+
+    const uint32_t count = be32(data + ICC_HEADER_SIZE);
+    if (count > (size - ICC_HEADER_SIZE - 4) / 12) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < count; ++i) {
+        const uint8_t *entry = data + ICC_HEADER_SIZE + 4 + i * 12;
+        if (memcmp(entry, sig, 4) != 0) {
+            continue;
+        }
+
+        const uint32_t offset = be32(entry + 4);
+        *len = be32(entry + 8);
+        if (offset > size || *len > size - offset) {
+            return false;
+        }
+
+        *tag = data + offset;
+        return true;
+    }
+
+    return false;
+}
+
+static bool read_xyz(const uint8_t *data, size_t size, const char *sig, double xyz[3])
+{
+    const uint8_t *tag;
+    uint32_t len;
+    if (!find_tag(data, size, sig, &tag, &len) || len < 20 || memcmp(tag, "XYZ ", 4) != 0) {
+        return false;
+    }
+
+    for (int i = 0; i < 3; ++i) {
+        xyz[i] = s15f16(tag + 8 + i * 4);
+    }
+    return true;
+}
+
+static bool read_trc(const uint8_t *data, size_t size, const char *sig, struct trc *trc)
+{
+    static const int param_count[] = { 1, 3, 4, 5, 7 };
+
+    const uint8_t *tag;
+    uint32_t len;
+    if (!find_tag(data, size, sig, &tag, &len) || len < 12) {
+        return false;
+    }
+
+    if (memcmp(tag, "curv", 4) == 0) {
+        const uint32_t count = be32(tag + 8);
+        if (count > (len - 12) / 2) {
+            return false;
+        }
+
+        if (count == 0) {
+            *trc = (struct trc){ .type = TRC_GAMMA, .p = { 1 } };
+        } else if (count == 1) {
+            *trc = (struct trc){ .type = TRC_GAMMA, .p = { be16(tag + 12) / 256.0 } };
+        } else {
+            *trc = (struct trc){ .type = TRC_TABLE, .table = tag + 12, .count = count };
+        }
+        return true;
+    }
+
+    if (memcmp(tag, "para", 4) == 0) {
+        const int function = be16(tag + 8);
+        if (function > 4 || len < 12 + 4 * (uint32_t)param_count[function]) {
+            return false;
+        }
+
+        *trc = (struct trc){ .type = TRC_PARAMETRIC, .function = function };
+        for (int i = 0; i < param_count[function]; ++i) {
+            trc->p[i] = s15f16(tag + 12 + i * 4);
+        }
+        return true;
+    }
+
+    return false;
+}
+
+/* Device value (0..1) to linear light (0..1) */
+static double trc_eval(const struct trc *trc, double x)
+{
+    const double *p = trc->p;
+
+    switch (trc->type) {
+        case TRC_GAMMA:
+            return pow(x, p[0]);
+
+        case TRC_TABLE: {
+            const double pos = x * (trc->count - 1);
+            const uint32_t i = (uint32_t)pos;
+            if (i + 1 >= trc->count) {
+                return be16(trc->table + (trc->count - 1) * 2) / 65535.0;
+            }
+            const double a = be16(trc->table + i * 2) / 65535.0;
+            const double b = be16(trc->table + (i + 1) * 2) / 65535.0;
+            return a + (b - a) * (pos - i);
+        }
+
+        case TRC_PARAMETRIC:
+            switch (trc->function) {
+                case 0:
+                    return pow(x, p[0]);
+                case 1:
+                    return (x >= -p[2] / p[1]) ? pow(p[1] * x + p[2], p[0]) : 0;
+                case 2:
+                    return (x >= -p[2] / p[1]) ? pow(p[1] * x + p[2], p[0]) + p[3] : p[3];
+                case 3:
+                    return (x >= p[4]) ? pow(p[1] * x + p[2], p[0]) : p[3] * x;
+                default:
+                    return (x >= p[4]) ? pow(p[1] * x + p[2], p[0]) + p[5] : p[3] * x + p[6];
+            }
+    }
+
+    return x;
+}
+
+static double srgb_to_linear(double x)
+{
+    return (x <= 0.04045) ? x / 12.92 : pow((x + 0.055) / 1.055, 2.4);
+}
+
+static bool invert3(const double m[9], double inv[9])
+{
+    const double det =
+        m[0] * (m[4] * m[8] - m[5] * m[7]) -
+        m[1] * (m[3] * m[8] - m[5] * m[6]) +
+        m[2] * (m[3] * m[7] - m[4] * m[6]);
+
+    if (fabs(det) < 1e-9) {
+        return false;
+    }
+
+    inv[0] =  (m[4] * m[8] - m[5] * m[7]) / det;
+    inv[1] = -(m[1] * m[8] - m[2] * m[7]) / det;
+    inv[2] =  (m[1] * m[5] - m[2] * m[4]) / det;
+    inv[3] = -(m[3] * m[8] - m[5] * m[6]) / det;
+    inv[4] =  (m[0] * m[8] - m[2] * m[6]) / det;
+    inv[5] = -(m[0] * m[5] - m[2] * m[3]) / det;
+    inv[6] =  (m[3] * m[7] - m[4] * m[6]) / det;
+    inv[7] = -(m[0] * m[7] - m[1] * m[6]) / det;
+    inv[8] =  (m[0] * m[4] - m[1] * m[3]) / det;
+    return true;
+}
+
+/* Tabulates inverse of (monotonic) tone curve */
+static void invert_trc(const struct trc *trc, uint8_t table[ICC_LINEAR_SIZE])
+{
+    double curve[256];
+    for (int v = 0; v < 256; ++v) {
+        curve[v] = trc_eval(trc, v / 255.0);
+    }
+
+    int v = 0;
+    for (int i = 0; i < ICC_LINEAR_SIZE; ++i) {
+        const double y = (double)i / (ICC_LINEAR_SIZE - 1);
+        while (v < 255 && curve[v] < y) {
+            v++;
+        }
+        table[i] = (v > 0 && y - curve[v - 1] < curve[v] - y) ? v - 1 : v;
+    }
+}
+
+static bool bake(struct icc_lut *lut, const uint8_t *data, size_t size, const char *path)
+{
+    if (size < ICC_HEADER_SIZE || be32(data) > size) {
+        LOG_ERR("%s: not an ICC profile", path);
+        return false;
+    }
+
+    if (memcmp(data + 36, "acsp", 4) != 0 ||
+        memcmp(data + 16, "RGB ", 4) != 0 ||
+        memcmp(data + 20, "XYZ ", 4) != 0) {
+        LOG_ERR("%s: not an RGB display profile", path);
+        return false;
+    }
+
+    double primaries[3][3];
+    struct trc trc[3];
+
+    if (!read_xyz(data, size, "rXYZ", primaries[0]) ||
+        !read_xyz(data, size, "gXYZ", primaries[1]) ||
+        !read_xyz(data, size, "bXYZ", primaries[2]) ||
+        !read_trc(data, size, "rTRC", &trc[0]) ||
+        !read_trc(data, size, "gTRC", &trc[1]) ||
+        !read_trc(data, size, "bTRC", &trc[2])) {
+        LOG_ERR("%s: only matrix/TRC profiles are supported", path);
+        return false;
+    }
+
+    /* Columns are the primaries */
+    const double device_to_pcs[9] = {
+        primaries[0][0], primaries[1][0], primaries[2][0],
+        primaries[0][1], primaries[1][1], primaries[2][1],
+        primaries[0][2], primaries[1][2], primaries[2][2],
+    };
+
+    double pcs_to_device[9];
+    if (!invert3(device_to_pcs, pcs_to_device)) {
+        LOG_ERR("%s: degenerate primaries", path);
+        return false;
+    }
+
+    for (int r = 0; r < 3; ++r) {
+        for (int c = 0; c < 3; ++c) {
+            double m = 0;
+            for (int k = 0; k < 3; ++k) {
+                m += pcs_to_device[r * 3 + k] * srgb_to_pcs[k * 3 + c];
+            }
+            lut->matrix[r * 3 + c] = (int32_t)lround(m * (1 << MATRIX_BITS));
+        }
+    }
+
+    for (int v = 0; v < 256; ++v) {
+        lut->to_linear[v] = (uint16_t)lround(srgb_to_linear(v / 255.0) * (ICC_LINEAR_SIZE - 1));
+    }
+
+    for (int i = 0; i < 3; ++i) {
+        invert_trc(&trc[i], lut->from_linear[i]);
+    }
+
+    return true;
+}
+
+struct icc_lut *icc_load(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOG_ERRNO("%s: failed to open", path);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        LOG_ERR("%s: failed to stat or empty file", path);
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        LOG_ERRNO("%s: failed to mmap", path);
+        return NULL;
+    }
+
+    struct icc_lut *lut = malloc(sizeof (*lut));
+    if (!bake(lut, map, st.st_size, path)) {
+        free(lut);
+        lut = NULL;
+    }
+
+    munmap(map, st.st_size);
+    return lut;
+}
+
+void icc_destroy(struct icc_lut *lut)
+{
+    free(lut);
+}
+
+static inline int clamp_linear(int32_t v)
+{
+    v >>= MATRIX_BITS;
+    return (v < 0) ? 0 : (v >= ICC_LINEAR_SIZE) ? ICC_LINEAR_SIZE - 1 : v;
+}
+
+static inline uint32_t map_pixel(const struct icc_lut *lut, uint32_t px)
+{
+    const int32_t r = lut->to_linear[(px >> 16) & 0xff];
+    const int32_t g = lut->to_linear[(px >> 8) & 0xff];
+    const int32_t b = lut->to_linear[px & 0xff];
+    const int32_t *m = lut->matrix;
+
+    return (px & 0xff000000u) |
+           (uint32_t)lut->from_linear[0][clamp_linear(m[0] * r + m[1] * g + m[2] * b)] << 16 |
+           (uint32_t)lut->from_linear[1][clamp_linear(m[3] * r + m[4] * g + m[5] * b)] << 8 |
+           (uint32_t)lut->from_linear[2][clamp_linear(m[6] * r + m[7] * g + m[8] * b)];
+}
+
+pixman_color_t icc_map_color(const struct icc_lut *lut, pixman_color_t color)
+{
+    const uint32_t px = map_pixel(lut,
+                                  (uint32_t)(color.red >> 8) << 16 |
+                                  (uint32_t)(color.green >> 8) << 8 |
+                                  (uint32_t)(color.blue >> 8));
+
+    return (pixman_color_t){
+        .red   = (uint16_t)(((px >> 16) & 0xff) * 0x0101),
+        .green = (uint16_t)(((px >> 8) & 0xff) * 0x0101),
+        .blue  = (uint16_t)((px & 0xff) * 0x0101),
+        .alpha = color.alpha,
+    };
+}
+
+void icc_apply(const struct icc_lut *lut, pixman_image_t *pix, const pixman_box32_t *box)
+{
+    uint8_t *data = (uint8_t *)pixman_image_get_data(pix);
+    const int stride = pixman_image_get_stride(pix);
+
+    /* Wallpapers have long runs of equal pixels (fills, gradients) */
+    uint32_t last_in = 0;
+    uint32_t last_out = map_pixel(lut, 0);
+
+    for (int y = box->y1; y < box->y2; ++y) {
+        uint32_t *row = (uint32_t *)(data + (size_t)y * stride);
+
+        for (int x = box->x1; x < box->x2; ++x) {
+            const uint32_t px = row[x] & 0x00ffffffu;
+            if (px != last_in) {
+                last_in = px;
+                last_out = map_pixel(lut, px);
+            }
+            row[x] = last_out;
+        }
+    }
+}
@@ -0,0 +1,36 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#ifndef ICC_H_
+#define ICC_H_
+
+#include <stdint.h>
+
+#include <pixman.h>
+
+/* Linear light, in fixed point */
+#define ICC_LINEAR_BITS 12
+#define ICC_LINEAR_SIZE (1 << ICC_LINEAR_BITS)
+
+/*
+ * Conversion from sRGB to the colour space of a display, baked from its
+ * (matrix/TRC) ICC profile: sRGB decoding table, 3x3 matrix in linear
+ * light, and inverse of the display's tone curves.
+ */
+struct icc_lut {
+    uint16_t to_linear[256];                 /* sRGB -> linear */
+    int32_t matrix[9];                       /* linear -> device linear */
+    uint8_t from_linear[3][ICC_LINEAR_SIZE]; /* device linear -> device */
+};
+
+struct icc_lut *icc_load(const char *path);
+void icc_destroy(struct icc_lut *lut);
+
+/* Converts single colour; meant for solid fills, gradient stops, etc. */
+pixman_color_t icc_map_color(const struct icc_lut *lut, pixman_color_t color);
+
+/* Converts pixels of x8r8g8b8 image within `box`, in place */
+void icc_apply(const struct icc_lut *lut, pixman_image_t *pix, const pixman_box32_t *box);
+
+#endif // ICC_H_
@@ -0,0 +1,202 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#include "image.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "aio.h"
+#include "budget.h"
+#include "export.h"
+#include "gif.h"
+#include "limit.h"
+#include "log.h"
+
+static bool has_suffix(const char *str, const char *suffix)
+{
+    const size_t len = strlen(str);
+    const size_t slen = strlen(suffix);
+    return len >= slen && strcasecmp(str + len - slen, suffix) == 0;
+}
+
+static uint32_t get32le(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static size_t pixels_size(pixman_image_t *pix)
+{
+    return (size_t)pixman_image_get_stride(pix) * pixman_image_get_height(pix);
+}
+
+static void free_data(pixman_image_t *pix, void *data)
+{
+    budget_release(BUDGET_IMAGES, pixels_size(pix));
+    free(data);
+}
+
+/* Takes ownership of `data`; pixels are used in place, with no copy */
+static pixman_image_t *wbgraw_decode(const char *path, uint8_t *data, size_t size)
+{
+    if (size < WBGRAW_OFFSET || memcmp(data, WBGRAW_MAGIC, 8) != 0) {
+        LOG_ERR("%s: not a wbgraw image", path);
+        goto err;
+    }
+
+    const uint32_t width = get32le(data + 8);
+    const uint32_t height = get32le(data + 12);
+    const uint32_t stride = get32le(data + 16);
+    const uint32_t format = get32le(data + 20);
+    const uint32_t offset = get32le(data + 24);
+
+    if (format != 1 /* WL_SHM_FORMAT_XRGB8888 */ || offset % WBGRAW_OFFSET != 0 ||
+        width == 0 || height == 0 || width > INT16_MAX || height > INT16_MAX ||
+        stride % 4 != 0 || stride < width * 4 ||
+        offset > size || (size - offset) / stride < height)
+    {
+        LOG_ERR("%s: invalid or truncated wbgraw image", path);
+        goto err;
+    }
+
+    if (!limit_check_size(path, width, height)) {
+        goto err;
+    }
+
+    if (!budget_reserve(BUDGET_IMAGES, (size_t)stride * height)) {
+        LOG_ERR("%s: %ux%u image is over memory budget", path, width, height);
+        goto err;
+    }
+
+    pixman_image_t *pix = pixman_image_create_bits(
+        PIXMAN_x8r8g8b8, width, height, (uint32_t *)(data + offset), stride);
+    if (pix == NULL) {
+        LOG_ERR("%s: failed to create %ux%u image", path, width, height);
+        budget_release(BUDGET_IMAGES, (size_t)stride * height);
+        goto err;
+    }
+
+    pixman_image_set_destroy_function(pix, &free_data, data);
+    return pix;
+
+err:
+    free(data);
+    return NULL;
+}
+
+static pixman_image_t *gif_decode(const char *path, const uint8_t *data, size_t size)
+{
+    pixman_image_t *pix = NULL;
+
+    struct gif *gif = gif_open(data, size, 0xff000000u);
+    if (gif == NULL) {
+        LOG_ERR("%s: not a GIF image", path);
+        goto out;
+    }
+
+    struct gif_frame frame;
+    if (!gif_next_frame(gif, &frame)) {
+        LOG_ERR("%s: no image data", path);
+        goto out;
+    }
+
+    const int width = gif_width(gif);
+    const int height = gif_height(gif);
+
+    /* Bits are allocated (and owned) by pixman; every row is copied over */
+    pix = budget_image_create(BUDGET_IMAGES, PIXMAN_x8r8g8b8, width, height, false);
+    if (pix == NULL) {
+        LOG_ERR("%s: failed to allocate %dx%d image (over memory budget?)", path, width, height);
+        goto out;
+    }
+
+    const uint32_t *src = gif_canvas(gif);
+    uint8_t *dst = (uint8_t *)pixman_image_get_data(pix);
+    const int stride = pixman_image_get_stride(pix);
+
+    for (int y = 0; y < height; ++y) {
+        memcpy(dst + (size_t)y * stride, src + (size_t)y * width, (size_t)width * sizeof (uint32_t));
+    }
+
+out:
+    gif_close(gif);
+    return pix;
+}
+
+pixman_image_t *image_load(const char *path)
+{
+    /* Pre-rendered images are read once, no point keeping them in page cache */
+    const bool raw = has_suffix(path, ".wbgraw");
+
+    size_t size;
+    uint8_t *data = aio_read_file(path, raw ? AIO_DIRECT : 0, &size);
+    if (data == NULL) {
+        return NULL;
+    }
+
+    if (raw) {
+        return wbgraw_decode(path, data, size);
+    }
+
+    pixman_image_t *pix = gif_decode(path, data, size);
+    free(data);
+    return pix;
+}
+
+/* Average colour of a wbgraw image, or background of a GIF */
+static uint32_t stored_color(const char *path, const uint8_t *header, size_t size)
+{
+    if (size >= 32 && memcmp(header, WBGRAW_MAGIC, 8) == 0) {
+        return get32le(header + 28); /* 0 in files written before it was stored */
+    }
+
+    if (size < 13 || memcmp(header, "GIF", 3) != 0) {
+        LOG_ERR("%s: not a GIF nor wbgraw image", path);
+        return 0;
+    }
+
+    /* Logical screen descriptor, followed by the global color table */
+    const uint8_t packed = header[10];
+    const uint8_t index = header[11];
+    if (!(packed & 0x80) || index >= 2u << (packed & 7) || 13 + (size_t)index * 3 + 3 > size) {
+        return 0;
+    }
+
+    const uint8_t *rgb = header + 13 + index * 3;
+    return 0xff000000u | (uint32_t)rgb[0] << 16 | (uint32_t)rgb[1] << 8 | rgb[2];
+}
+
+pixman_image_t *image_peek(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOG_ERRNO("%s: failed to open", path);
+        return NULL;
+    }
+
+    /* Enough for the header and a full color table */
+    uint8_t header[13 + 256 * 3];
+    const ssize_t size = pread(fd, header, sizeof (header), 0);
+    close(fd);
+    if (size < 0) {
+        LOG_ERRNO("%s: failed to read", path);
+        return NULL;
+    }
+
+    const uint32_t color = stored_color(path, header, size);
+    if (color == 0) {
+        return NULL;
+    }
+
+    pixman_image_t *pix = pixman_image_create_bits(PIXMAN_x8r8g8b8, 1, 1, NULL, 0);
+    if (pix != NULL) {
+        *pixman_image_get_data(pix) = color;
+    }
+    return pix;
+}
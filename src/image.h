@@ -0,0 +1,19 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#ifndef IMAGE_H_
+#define IMAGE_H_
+
+#include <pixman.h>
+
+/* Decodes still image (first frame of a GIF) into a x8r8g8b8 image */
+pixman_image_t *image_load(const char *path);
+
+/*
+ * Colour stored in the header of image (average of a wbgraw, background
+ * of a GIF) as a 1x1 image, read without decoding; NULL if there is none.
+ */
+pixman_image_t *image_peek(const char *path);
+
+#endif // IMAGE_H_
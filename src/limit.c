@@ -0,0 +1,27 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#include "limit.h"
+
+#include <unistd.h>
+
+#include "log.h"
+
+bool limit_check_size(const char *what, long long width, long long height)
+{
+    if (width <= 0 || height <= 0) {
+        LOG_ERR("%s: invalid dimensions %lldx%lld", what, width, height);
+        return false;
+    }
+
+    if (width > LIMIT_DIMENSION || height > LIMIT_DIMENSION ||
+        width * height > LIMIT_PIXELS) {
+        LOG_ERR("%s: %lldx%lld image is over the limit of %dx%d or %d megapixels",
+                what, width, height, LIMIT_DIMENSION, LIMIT_DIMENSION,
+                LIMIT_PIXELS >> 20);
+        return false;
+    }
+
+    return true;
+}
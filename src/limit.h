@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#ifndef LIMIT_H_
+#define LIMIT_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Bounds on what is accepted from files, checked before anything is
+ * allocated for them, so that a small crafted file cannot turn into
+ * seconds of decoding and hundreds of megabytes at login.
+ */
+#define LIMIT_DIMENSION 16384                /* width or height of an image */
+#define LIMIT_PIXELS    (64 * 1024 * 1024)   /* area of an image */
+#define LIMIT_FILE_SIZE ((size_t)512 << 20)  /* files read whole into memory */
+#define LIMIT_LAYERS    64                   /* layers of a scene */
+#define LIMIT_KEYFRAMES 1024                 /* keyframes of a timeline */
+
+/* Logs and returns false if `width`x`height` image is invalid or too big */
+bool limit_check_size(const char *what, long long width, long long height);
+
+#endif // LIMIT_H_
@@ -0,0 +1,597 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#include "loop.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include <tllist.h>
+
+#include "log.h"
+
+/* Events taken per wake-up; more are left for the next */
+#define LOOP_EVENTS_MAX 16
+
+#define NS_PER_SEC 1000000000ull
+
+enum source_kind {
+    SOURCE_FD,
+    SOURCE_TIMER,
+    SOURCE_WAYLAND,
+};
+
+struct loop_source {
+    struct loop *loop;
+    enum source_kind kind;
+    int fd;
+    clockid_t clock;          /* of timer */
+    struct wl_display *display;
+
+    loop_fd_fn fd_fn;         /* also `lost` of Wayland connection */
+    loop_fn timer_fn;
+    void *data;
+
+    uint32_t revents;         /* of the events being handled */
+    bool prepared;            /* to read Wayland events */
+    bool removed;             /* freed once events are handled */
+};
+
+struct deferred {
+    loop_fn fn;
+    void *data;
+};
+
+struct loop {
+    int epoll_fd;
+    tll(struct loop_source *) sources;
+    tll(struct deferred) deferred;
+    bool dispatching;
+
+    /* Of waiting, and reading what woke the loop */
+    uint64_t wakeups;
+    uint64_t syscalls;
+};
+
+struct loop *loop_create(void)
+{
+    const int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        LOG_ERRNO("failed to create epoll instance");
+        return NULL;
+    }
+
+    struct loop *loop = calloc(1, sizeof (*loop));
+    loop->epoll_fd = epoll_fd;
+    return loop;
+}
+
+static void source_free(struct loop_source *source)
+{
+    if (source->kind == SOURCE_TIMER) {
+        close(source->fd);
+    }
+    free(source);
+}
+
+void loop_destroy(struct loop *loop)
+{
+    if (loop == NULL) {
+        return;
+    }
+
+    tll_foreach(loop->sources, it) {
+        source_free(it->item);
+        tll_remove(loop->sources, it);
+    }
+    tll_free(loop->deferred);
+
+    close(loop->epoll_fd);
+    free(loop);
+}
+
+static struct loop_source *add(struct loop *loop, struct loop_source source, uint32_t events)
+{
+    struct loop_source *added = malloc(sizeof (*added));
+    *added = source;
+    added->loop = loop;
+
+    struct epoll_event ev = { .events = events, .data.ptr = added };
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, added->fd, &ev) < 0) {
+        LOG_ERRNO("failed to watch FD %d", added->fd);
+        free(added);
+        return NULL;
+    }
+
+    tll_push_back(loop->sources, added);
+    return added;
+}
+
+struct loop_source *loop_add_fd(struct loop *loop, int fd, uint32_t events,
+                                loop_fd_fn fn, void *data)
+{
+    return add(loop, (struct loop_source){
+        .kind = SOURCE_FD, .fd = fd, .fd_fn = fn, .data = data,
+    }, events);
+}
+
+struct loop_source *loop_add_timer(struct loop *loop, clockid_t clock,
+                                   loop_fn fn, void *data)
+{
+    const int fd = timerfd_create(clock, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (fd < 0) {
+        LOG_ERRNO("failed to create timer");
+        return NULL;
+    }
+
+    struct loop_source *timer = add(loop, (struct loop_source){
+        .kind = SOURCE_TIMER, .fd = fd, .clock = clock, .timer_fn = fn, .data = data,
+    }, EPOLLIN);
+    if (timer == NULL) {
+        close(fd);
+    }
+    return timer;
+}
+
+struct loop_source *loop_add_wayland(struct loop *loop, struct wl_display *display,
+                                     loop_fd_fn lost, void *data)
+{
+    return add(loop, (struct loop_source){
+        .kind = SOURCE_WAYLAND, .fd = wl_display_get_fd(display), .display = display,
+        .fd_fn = lost, .data = data,
+    }, EPOLLIN);
+}
+
+void loop_remove(struct loop_source *source)
+{
+    if (source == NULL) {
+        return;
+    }
+
+    struct loop *loop = source->loop;
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+
+    if (source->prepared) {
+        wl_display_cancel_read(source->display);
+        source->prepared = false;
+    }
+
+    /* Events being handled may still refer to it */
+    if (loop->dispatching) {
+        source->removed = true;
+        return;
+    }
+
+    tll_foreach(loop->sources, it) {
+        if (it->item == source) {
+            tll_remove(loop->sources, it);
+            break;
+        }
+    }
+    source_free(source);
+}
+
+void loop_timer_at(struct loop_source *timer, uint64_t deadline, uint64_t slack)
+{
+    if (deadline != 0 && slack > 0) {
+        deadline = (deadline + slack) / slack * slack;
+    }
+
+    const struct itimerspec spec = {
+        .it_value = {
+            .tv_sec = deadline / NS_PER_SEC,
+            .tv_nsec = deadline % NS_PER_SEC,
+        },
+    };
+
+    const int flags = TFD_TIMER_ABSTIME |
+                      ((timer->clock == CLOCK_REALTIME) ? TFD_TIMER_CANCEL_ON_SET : 0);
+
+    if (timerfd_settime(timer->fd, flags, &spec, NULL) < 0) {
+        LOG_ERRNO("failed to arm timer");
+    }
+}
+
+void loop_timer_in(struct loop_source *timer, uint64_t delay, uint64_t slack)
+{
+    struct timespec now;
+    clock_gettime(timer->clock, &now);
+    loop_timer_at(timer, (uint64_t)now.tv_sec * NS_PER_SEC + now.tv_nsec + delay, slack);
+}
+
+void loop_defer(struct loop *loop, loop_fn fn, void *data)
+{
+    tll_foreach(loop->deferred, it) {
+        if (it->item.fn == fn && it->item.data == data) {
+            return;
+        }
+    }
+    tll_push_back(loop->deferred, ((struct deferred){ fn, data }));
+}
+
+/* Those deferred so far; those they defer wait for the next round */
+static void run_deferred(struct loop *loop)
+{
+    for (size_t n = tll_length(loop->deferred); n > 0; --n) {
+        const struct deferred d = tll_pop_front(loop->deferred);
+        d.fn(d.data);
+    }
+}
+
+/* Threads reading their own queues rely on the loop to read the socket
+ * too; whoever reads last does the read for all */
+static void prepare_wayland(struct loop *loop)
+{
+    tll_foreach(loop->sources, it) {
+        struct loop_source *source = it->item;
+        if (source->kind != SOURCE_WAYLAND || source->removed) {
+            continue;
+        }
+
+        while (wl_display_prepare_read(source->display) != 0) {
+            wl_display_dispatch_pending(source->display);
+        }
+        wl_display_flush(source->display);
+        source->prepared = true;
+    }
+}
+
+/* Every prepared connection is either read or cancelled */
+static void read_wayland(struct loop *loop)
+{
+    tll_foreach(loop->sources, it) {
+        struct loop_source *source = it->item;
+        if (!source->prepared) {
+            continue;
+        }
+        source->prepared = false;
+
+        const uint32_t events = source->revents;
+        bool lost = false;
+
+        if (events & (EPOLLHUP | EPOLLERR)) {
+            wl_display_cancel_read(source->display);
+            lost = true;
+        } else if (events & EPOLLIN) {
+            loop->syscalls++;
+            lost = wl_display_read_events(source->display) < 0 ||
+                   wl_display_dispatch_pending(source->display) < 0;
+        } else {
+            wl_display_cancel_read(source->display);
+        }
+
+        if (lost) {
+            source->fd_fn(source->data, events);
+        }
+    }
+}
+
+bool loop_dispatch(struct loop *loop)
+{
+    run_deferred(loop);
+    prepare_wayland(loop);
+
+    struct epoll_event events[LOOP_EVENTS_MAX];
+    const int count = epoll_wait(loop->epoll_fd, events, LOOP_EVENTS_MAX, -1);
+    loop->syscalls++;
+
+    if (count < 0) {
+        const int err = errno;
+        tll_foreach(loop->sources, it) {
+            if (it->item->prepared) {
+                wl_display_cancel_read(it->item->display);
+                it->item->prepared = false;
+            }
+        }
+
+        if (err == EINTR) {
+            return true;
+        }
+
+        errno = err;
+        LOG_ERRNO("failed to wait for events");
+        return false;
+    }
+
+    loop->wakeups++;
+    loop->dispatching = true;
+
+    tll_foreach(loop->sources, it) {
+        it->item->revents = 0;
+    }
+    for (int i = 0; i < count; ++i) {
+        struct loop_source *source = events[i].data.ptr;
+        source->revents = events[i].events;
+    }
+
+    read_wayland(loop);
+
+    for (int i = 0; i < count; ++i) {
+        struct loop_source *source = events[i].data.ptr;
+        if (source->removed) {
+            continue;
+        }
+
+        switch (source->kind) {
+            case SOURCE_FD:
+                source->fd_fn(source->data, source->revents);
+                break;
+
+            case SOURCE_TIMER: {
+                /* ECANCELED means the clock has been set; re-evaluate too */
+                uint64_t expirations;
+                loop->syscalls++;
+                if (read(source->fd, &expirations, sizeof (expirations)) > 0 || errno == ECANCELED) {
+                    source->timer_fn(source->data);
+                }
+                break;
+            }
+
+            case SOURCE_WAYLAND:
+                break;
+        }
+    }
+
+    run_deferred(loop);
+
+    loop->dispatching = false;
+    tll_foreach(loop->sources, it) {
+        if (it->item->removed) {
+            source_free(it->item);
+            tll_remove(loop->sources, it);
+        }
+    }
+
+    return true;
+}
+
+void loop_dump_stats(struct loop *loop)
+{
+    if (loop->wakeups == 0) {
+        return;
+    }
+
+    LOG_INFO("loop: %zu sources, %llu wake-ups, %.2f syscalls per wake-up",
+             tll_length(loop->sources), (unsigned long long)loop->wakeups,
+             (double)loop->syscalls / loop->wakeups);
+}
+
+/* Benchmark ---------------------------------------------------------------- */
+
+enum {
+    BENCH_SOURCES = 9,       /* as main() has: signals, timers, a display */
+    BENCH_WAKEUPS = 100000,
+    BENCH_TIMERS = 8,
+    BENCH_ROUNDS = 20,
+};
+
+#define BENCH_SPREAD_NS 1000000ull /* between deadlines of timers */
+#define BENCH_SLACK_NS 10000000ull
+
+struct bench {
+    int fds[BENCH_SOURCES];
+    int expired;
+};
+
+static double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void bench_read(void *data, uint32_t events)
+{
+    const int *fd = data;
+    uint64_t value;
+    if (read(*fd, &value, sizeof (value)) < 0) {
+        LOG_ERRNO("bench: failed to read");
+    }
+}
+
+static void bench_expired(void *data)
+{
+    struct bench *bench = data;
+    bench->expired++;
+}
+
+/* The loop main() had: an array rebuilt, then scanned, on every wake-up */
+static void bench_poll(const struct bench *bench, int wakeups, uint64_t *syscalls)
+{
+    struct pollfd fds[BENCH_SOURCES];
+
+    for (int n = 0; n < wakeups; ++n) {
+        if (eventfd_write(bench->fds[BENCH_SOURCES - 1], 1) < 0) {
+            return;
+        }
+
+        for (int i = 0; i < BENCH_SOURCES; ++i) {
+            fds[i] = (struct pollfd){ .fd = bench->fds[i], .events = POLLIN };
+        }
+
+        poll(fds, BENCH_SOURCES, -1);
+        (*syscalls)++;
+
+        for (int i = 0; i < BENCH_SOURCES; ++i) {
+            if (fds[i].revents & POLLIN) {
+                uint64_t value;
+                (*syscalls)++;
+                if (read(fds[i].fd, &value, sizeof (value)) < 0) {
+                    return;
+                }
+            }
+        }
+    }
+}
+
+static void arm_spread(int fds[BENCH_TIMERS])
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    const uint64_t base = (uint64_t)now.tv_sec * NS_PER_SEC + now.tv_nsec + BENCH_SPREAD_NS;
+
+    for (int i = 0; i < BENCH_TIMERS; ++i) {
+        const uint64_t deadline = base + i * BENCH_SPREAD_NS;
+        const struct itimerspec spec = {
+            .it_value = { deadline / NS_PER_SEC, deadline % NS_PER_SEC },
+        };
+        timerfd_settime(fds[i], TFD_TIMER_ABSTIME, &spec, NULL);
+    }
+}
+
+/* Timers due 1 ms apart, waited for by poll(); per round */
+static void bench_poll_timers(double *wakeups, double *syscalls)
+{
+    int fds[BENCH_TIMERS];
+    for (int i = 0; i < BENCH_TIMERS; ++i) {
+        fds[i] = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    }
+
+    uint64_t woken = 0, calls = 0;
+    for (int round = 0; round < BENCH_ROUNDS; ++round) {
+        arm_spread(fds);
+
+        for (int expired = 0; expired < BENCH_TIMERS;) {
+            struct pollfd pfds[BENCH_TIMERS];
+            for (int i = 0; i < BENCH_TIMERS; ++i) {
+                pfds[i] = (struct pollfd){ .fd = fds[i], .events = POLLIN };
+            }
+
+            poll(pfds, BENCH_TIMERS, -1);
+            woken++;
+            calls++;
+
+            for (int i = 0; i < BENCH_TIMERS; ++i) {
+                if (!(pfds[i].revents & POLLIN)) {
+                    continue;
+                }
+
+                uint64_t value;
+                calls++;
+                if (read(fds[i], &value, sizeof (value)) > 0) {
+                    expired++;
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < BENCH_TIMERS; ++i) {
+        close(fds[i]);
+    }
+    *wakeups = (double)woken / BENCH_ROUNDS;
+    *syscalls = (double)calls / BENCH_ROUNDS;
+}
+
+/* Same timers on the loop, with `slack` */
+static bool bench_loop_timers(uint64_t slack, double *wakeups, double *syscalls)
+{
+    struct loop *loop = loop_create();
+    if (loop == NULL) {
+        return false;
+    }
+
+    struct bench bench = { 0 };
+    struct loop_source *timers[BENCH_TIMERS];
+    for (int i = 0; i < BENCH_TIMERS; ++i) {
+        timers[i] = loop_add_timer(loop, CLOCK_MONOTONIC, &bench_expired, &bench);
+        if (timers[i] == NULL) {
+            loop_destroy(loop);
+            return false;
+        }
+    }
+
+    for (int round = 0; round < BENCH_ROUNDS; ++round) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        const uint64_t base = (uint64_t)now.tv_sec * NS_PER_SEC + now.tv_nsec + BENCH_SPREAD_NS;
+
+        for (int i = 0; i < BENCH_TIMERS; ++i) {
+            loop_timer_at(timers[i], base + i * BENCH_SPREAD_NS, slack);
+        }
+
+        bench.expired = 0;
+        while (bench.expired < BENCH_TIMERS) {
+            if (!loop_dispatch(loop)) {
+                loop_destroy(loop);
+                return false;
+            }
+        }
+    }
+
+    *wakeups = (double)loop->wakeups / BENCH_ROUNDS;
+    *syscalls = (double)loop->syscalls / BENCH_ROUNDS;
+    loop_destroy(loop);
+    return true;
+}
+
+bool loop_bench(void)
+{
+    struct bench bench;
+    for (int i = 0; i < BENCH_SOURCES; ++i) {
+        bench.fds[i] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (bench.fds[i] < 0) {
+            LOG_ERRNO("bench: failed to create eventfd");
+            return false;
+        }
+    }
+
+    struct loop *loop = loop_create();
+    if (loop == NULL) {
+        return false;
+    }
+    for (int i = 0; i < BENCH_SOURCES; ++i) {
+        loop_add_fd(loop, bench.fds[i], EPOLLIN, &bench_read, &bench.fds[i]);
+    }
+
+    uint64_t poll_calls = 0;
+    double start = bench_now();
+    bench_poll(&bench, BENCH_WAKEUPS, &poll_calls);
+    const double poll_ns = (bench_now() - start) / BENCH_WAKEUPS;
+
+    start = bench_now();
+    for (int n = 0; n < BENCH_WAKEUPS; ++n) {
+        if (eventfd_write(bench.fds[BENCH_SOURCES - 1], 1) < 0 || !loop_dispatch(loop)) {
+            break;
+        }
+    }
+    const double epoll_ns = (bench_now() - start) / BENCH_WAKEUPS;
+
+    /* Callbacks read once per wake-up */
+    const double epoll_calls = (double)(loop->syscalls + loop->wakeups) / loop->wakeups;
+    loop_destroy(loop);
+
+    for (int i = 0; i < BENCH_SOURCES; ++i) {
+        close(bench.fds[i]);
+    }
+
+    double poll_wakeups, poll_timer_calls, none_wakeups, none_calls, slack_wakeups, slack_calls;
+    bench_poll_timers(&poll_wakeups, &poll_timer_calls);
+    if (!bench_loop_timers(0, &none_wakeups, &none_calls) ||
+        !bench_loop_timers(BENCH_SLACK_NS, &slack_wakeups, &slack_calls)) {
+        return false;
+    }
+
+    printf("\nMain loop, one of %d sources ready; per wake-up, system calls made\n"
+           "to wait and read (not to produce the event)\n\n", BENCH_SOURCES);
+    printf("%-28s %10s %10s\n", "", "syscalls", "ns");
+    printf("%-28s %10.2f %10.0f\n", "poll, array rebuilt",
+           (double)poll_calls / BENCH_WAKEUPS, poll_ns);
+    printf("%-28s %10.2f %10.0f\n", "epoll", epoll_calls, epoll_ns);
+
+    printf("\n%d timers due %llu ms apart; per round\n\n",
+           BENCH_TIMERS, BENCH_SPREAD_NS / 1000000);
+    printf("%-28s %10s %10s\n", "", "wake-ups", "syscalls");
+    printf("%-28s %10.1f %10.1f\n", "poll", poll_wakeups, poll_timer_calls);
+    printf("%-28s %10.1f %10.1f\n", "epoll", none_wakeups, none_calls);
+    printf("%-28s %10.1f %10.1f\n", "epoll, 10 ms slack", slack_wakeups, slack_calls);
+    return true;
+}
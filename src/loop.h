@@ -0,0 +1,85 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#ifndef LOOP_H_
+#define LOOP_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <wayland-client.h>
+
+/*
+ * Event loop of the main thread, on epoll: sources are registered once,
+ * and stay registered in the kernel, so that a wake-up costs a single
+ * epoll_wait() plus reading whatever woke it, however many sources there
+ * are. Sources are file descriptors, timers (timerfd) and Wayland
+ * connections; callbacks may add and remove sources, including their own.
+ */
+struct loop;
+struct loop_source;
+
+/* `events` as of epoll, e.g. EPOLLIN, EPOLLHUP */
+typedef void (*loop_fd_fn)(void *data, uint32_t events);
+typedef void (*loop_fn)(void *data);
+
+struct loop *loop_create(void);
+
+/* Removes all sources left; their file descriptors are not closed */
+void loop_destroy(struct loop *loop);
+
+struct loop_source *loop_add_fd(struct loop *loop, int fd, uint32_t events,
+                                loop_fd_fn fn, void *data);
+
+/*
+ * Timer ticking in `clock`, disarmed until armed; fn is called once it
+ * expires. Timers of CLOCK_REALTIME also expire when the clock is set,
+ * to re-evaluate what depended on it.
+ */
+struct loop_source *loop_add_timer(struct loop *loop, clockid_t clock,
+                                   loop_fn fn, void *data);
+
+/*
+ * Arms timer to expire at `deadline` (nanoseconds of its clock), or up to
+ * `slack` later: on the last multiple of `slack` before then, so that
+ * timers of the same slack expire together, in a single wake-up. Re-arming
+ * replaces the deadline; 0 disarms. Safe to call from any thread.
+ */
+void loop_timer_at(struct loop_source *timer, uint64_t deadline, uint64_t slack);
+
+/* Same, `delay` nanoseconds from now */
+void loop_timer_in(struct loop_source *timer, uint64_t delay, uint64_t slack);
+
+/*
+ * Wayland connection, shared with threads reading their own queues: the
+ * loop prepares to read before sleeping and reads only when the socket is
+ * readable (see wl_display_prepare_read()), then dispatches the default
+ * queue. `lost` is called if the connection fails or is closed.
+ */
+struct loop_source *loop_add_wayland(struct loop *loop, struct wl_display *display,
+                                     loop_fd_fn lost, void *data);
+
+/* Timers are disarmed and their timerfd closed; others are left open */
+void loop_remove(struct loop_source *source);
+
+/* Calls fn(data) once, after the events being handled, before sleeping
+ * again; deferring what is deferred already is a no-op */
+void loop_defer(struct loop *loop, loop_fn fn, void *data);
+
+/* Waits for events and handles them, once; false on error */
+bool loop_dispatch(struct loop *loop);
+
+/* Logs wake-ups, and system calls made by the loop per wake-up */
+void loop_dump_stats(struct loop *loop);
+
+/*
+ * Counts system calls per wake-up of a loop rebuilding a poll(2) array on
+ * every iteration, as before this one, against this loop, for the sources
+ * main() has; also with timers due close together, without and with
+ * slack. Prints them along with time per wake-up.
+ */
+bool loop_bench(void);
+
+#endif // LOOP_H_
@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <poll.h>
 #include <errno.h>
@@ -13,482 +14,2526 @@
 #include <unistd.h>
 #include <locale.h>
 #include <assert.h>
+#include <getopt.h>
+#include <fnmatch.h>
 
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/signalfd.h>
+#include <time.h>
 
 #include <wayland-client.h>
 #include <wayland-cursor.h>
 
 #include <wlr-layer-shell-unstable-v1.h>
+#include <wlr-output-power-management-unstable-v1.h>
+#include <xdg-output-unstable-v1.h>
+#include <viewporter.h>
+#include <presentation-time.h>
 #include <pixman.h>
 #include <tllist.h>
 
+#include "anim.h"
+#include "budget.h"
+#include "check.h"
+#include "color.h"
+#include "export.h"
+#include "icc.h"
 #include "log.h"
+#include "loop.h"
+#include "night.h"
+#include "park.h"
+#include "pixconv.h"
+#include "prio.h"
+#include "render.h"
 #include "shm.h"
-
-static struct wl_compositor *compositor;
-static struct wl_shm *shm;
-static struct zwlr_layer_shell_v1 *layer_shell;
+#include "trace.h"
+#include "wbg.h"
 
 static pixman_color_t color = { 0, 0, 0, 0xffff };
+static const char *image_path;
+
+/* Span mode: content is rendered once into a canvas covering the bounding
+ * box of all outputs, and each output is given a view of its own part */
+static bool span = false;
+
+/* Progressive mode: until content is loaded, outputs show a single pixel
+ * of its guessed average colour; the first render is preceded by one at
+ * an eighth of the size, shown while the full one is being rendered */
+#define PREVIEW_DIVISOR 8
+static bool progressive = false;
+static pixman_color_t placeholder;
+
+/* After a resize, the last buffer is stretched by the viewport and the
+ * native resolution render is delayed until the size is stable */
+static long settle_ms = 250;
+static struct loop_source *rerender_timer;
+
+/* Animation is presented frame by frame, paced by frame callbacks of the
+ * outputs and a timer for the frame delays */
+static struct anim *anim;
+static struct anim_frame *anim_current;
+static uint64_t anim_due; /* nanoseconds, in anim_clock */
+static struct loop_source *anim_timer;
+
+/* Without viewporter, frames are scaled into buffers of the output, reused
+ * once released; one shown, one being drawn */
+#define ANIM_SCALED_BUFS 2
+
+/* Clock of the presentation timestamps, if compositor tells us one */
+static clockid_t anim_clock = CLOCK_MONOTONIC;
+
+/* Everything but animations is rendered by the library, as a scene of
+ * layers; buffers are tagged with the key of their content, so that
+ * dynamic layers (e.g. a clock) are brought up to date in place */
+static struct wbg *wbg;
+static struct loop_source *scene_timer;
+
+/* Images are read and decoded by a thread of their own, while outputs are
+ * being set up; until it is done, wbg is NULL and nothing is attached */
+static pthread_t load_thread;
+static bool loading = false;
+static int load_fd = -1;
+static struct loop_source *load_source;
+
+/* Time-of-day timeline; outputs are re-rendered only when it changes */
+static struct loop_source *timeline_timer;
+
+/* Night shift of a solid background; each step is a single pixel buffer,
+ * stretched over the output by the viewport */
+static struct night night;
+static bool have_night = false;
+static struct loop_source *night_timer;
+
+/* A step of the night shift may come this late, along with other timers */
+#define NIGHT_SLACK_NS (10 * 1000000000ull)
+
+/* Main loop; ends once quit_code is set */
+static struct loop *loop;
+static int quit_code = -1;
+
+/* Power saving: while an output is powered off, its buffer is given up
+ * for a single pixel one, keeping a compressed copy of the content if it
+ * compresses well; on power on, content is restored from that copy, or
+ * rendered anew if it does not match anymore */
+static bool power_save = false;
+
+/* Totals over all outputs, logged on SIGUSR1 */
+static struct {
+    pthread_mutex_t lock;
+    unsigned wakes;
+    unsigned restored;     /* wakes served from the compressed copy */
+    double released_mib_h; /* memory given up, times hours it was */
+    double wake_ms;        /* power on to wallpaper committed, summed */
+    double wake_ms_max;
+} power_stats = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Colour profiles, matched against "MAKE MODEL" of outputs */
+struct profile {
+    char *match; /* fnmatch(3) pattern */
+    const char *path;
+    struct icc_lut *lut;
+};
+static tll(struct profile) profiles;
 
-static bool have_xrgb8888 = false;
+struct display;
 
 struct output {
+    struct display *display;
+
+    /* Outputs rendered on their own (i.e. neither spanned nor animated)
+     * have their events dispatched on a queue and thread of their own, so
+     * that a slow render does not hold back the others. State is guarded
+     * by the lock, taken by the thread for dispatching and by the main
+     * thread whenever it renders. */
+    struct wl_event_queue *queue; /* NULL if dispatched by main thread */
+    pthread_t thread;
+    int stop_fd;
+    pthread_mutex_t lock;
+
+    struct wl_shm *shm; /* creating buffers on the queue */
+
     struct wl_output *wl_output;
     uint32_t wl_name;
 
+    struct zxdg_output_v1 *xdg_output;
+
     char *make;
     char *model;
 
+    /* Position in the global compositor space (logical coordinates) */
+    int x;
+    int y;
+
     int width;
     int height;
+    int scale;
 
     int render_width;
     int render_height;
 
     struct wl_surface *surf;
     struct zwlr_layer_surface_v1 *layer;
+    struct wp_viewport *viewport;
     bool configured;
-};
-static tll(struct output) outputs;
 
-static void render(struct output *output)
-{
-    const int width = output->render_width;
-    const int height = output->render_height;
+    struct buffer *buf; /* last rendered buffer */
 
-    struct buffer *buf = shm_get_buffer(
-        shm, width, height, (uintptr_t)(void *)output);
+    struct wl_callback *frame_cb;
+    uint64_t anim_seq; /* animation frame shown, 0 if none */
+    struct buffer *anim_bufs[ANIM_SCALED_BUFS];
+    int anim_buf_next;
 
-    if (buf == NULL) {
-        return;
-    }
+    struct wp_presentation_feedback *feedback;
+    uint32_t refresh_ns; /* 0 if unknown (or variable) */
 
-    pixman_image_t *fill = pixman_image_create_solid_fill(&color);
+    /* Power saving; while parked, nothing is rendered */
+    struct zwlr_output_power_v1 *power;
+    bool parked;
+    struct park *park;  /* compressed content, NULL if it did not compress */
+    uint64_t park_key;  /* of the content */
+    uint64_t parked_at; /* now_ns() */
+    size_t released;    /* bytes of memory given up */
 
-    pixman_image_composite(
-        PIXMAN_OP_SRC,
-        fill, NULL, buf->pix, 0, 0, 0, 0, 0, 0,
-        width, height);
+    const struct icc_lut *lut; /* NULL if colours are not managed */
 
-    pixman_image_unref(fill);
+    /* Offset of the currently attached view into the span canvas */
+    int span_x;
+    int span_y;
+};
 
-    wl_surface_attach(output->surf, buf->wl_buf, 0, 0);
-    wl_surface_damage_buffer(output->surf, 0, 0, width, height);
-    wl_surface_commit(output->surf);
-}
+/*
+ * Connection to a compositor, with its own globals and outputs. All of
+ * them are served by one loop and share the renderer (thus its caches)
+ * and the memory of buffers with the same content.
+ */
+struct display {
+    const char *name; /* NULL for $WAYLAND_DISPLAY */
 
-static void layer_surface_configure(void *data, struct zwlr_layer_surface_v1 *surface,
-                                    uint32_t serial, uint32_t w, uint32_t h)
-{
-    struct output *output = data;
-    zwlr_layer_surface_v1_ack_configure(surface, serial);
+    struct wl_display *wl_display;
+    struct wl_registry *registry;
 
-    /* If the size of the last committed buffer has not change, do not
-     * render a new buffer because it will be identical to the old one. */
-    if (output->configured &&
-        output->render_width == w &&
-        output->render_height == h) {
-        wl_surface_commit(output->surf);
-        return;
-    }
+    struct wl_compositor *compositor;
+    struct wl_shm *shm;
+    struct zwlr_layer_shell_v1 *layer_shell;
+    struct zxdg_output_manager_v1 *xdg_output_manager;
+    struct wp_viewporter *viewporter;
+    struct wp_presentation *presentation;
+    struct zwlr_output_power_manager_v1 *power_manager;
 
-    output->render_width = w;
-    output->render_height = h;
-    output->configured = true;
-    render(output);
-}
+    struct loop_source *source; /* of the main loop */
+    bool have_xrgb8888;
 
-static void output_layer_destroy(struct output *output)
+    tll(struct output) outputs;
+
+    /* Span mode canvas, covering the outputs of this compositor */
+    struct canvas *span_canvas;
+    pixman_box32_t span_box;
+};
+static tll(struct display) displays;
+
+/* Only the first display is traced, as it is replayed on its own */
+static bool traced(const struct display *display)
 {
-    if (output->layer != NULL) {
-        zwlr_layer_surface_v1_destroy(output->layer);
-    }
-    if (output->surf != NULL) {
-        wl_surface_destroy(output->surf);
-    }
+    return trace_enabled() && display == &tll_front(displays);
+}
 
-    output->layer = NULL;
-    output->surf = NULL;
-    output->configured = false;
+/* Wrapper of proxy, creating objects whose events go to output's queue */
+static void *on_queue(void *proxy, const struct output *output)
+{
+    struct wl_proxy *wrapper = wl_proxy_create_wrapper(proxy);
+    wl_proxy_set_queue(wrapper, output->queue);
+    return wrapper;
 }
 
-static void layer_surface_closed(void *data, struct zwlr_layer_surface_v1 *surface)
+/* Dispatches events of the output's queue until told to stop */
+static void *output_thread(void *data)
 {
     struct output *output = data;
+    struct wl_display *wl_display = output->display->wl_display;
+
+    /*
+     * Normal priority: configure events are acked from here, reads of the
+     * connection are shared with the main loop, and the main loop takes
+     * output->lock, held while rendering; all would wait on an idle thread
+     */
+    pthread_setname_np(pthread_self(), "wbg-output");
+
+    while (true) {
+        pthread_mutex_lock(&output->lock);
+        while (wl_display_prepare_read_queue(wl_display, output->queue) != 0) {
+            wl_display_dispatch_queue_pending(wl_display, output->queue);
+        }
+        pthread_mutex_unlock(&output->lock);
+
+        wl_display_flush(wl_display);
+
+        struct pollfd fds[] = {
+            { .fd = wl_display_get_fd(wl_display), .events = POLLIN },
+            { .fd = output->stop_fd, .events = POLLIN },
+        };
+
+        if (poll(fds, 2, -1) < 0) {
+            wl_display_cancel_read(wl_display);
+            if (errno == EINTR) {
+                continue;
+            }
 
-    /* Don’t trust ‘output’ to be valid, in case compositor destroyed
-     * if before calling closed() */
-    tll_foreach(outputs, it) {
-        if (&it->item == output) {
-            output_layer_destroy(output);
+            LOG_ERRNO("failed to poll");
             break;
         }
-    }
-}
 
-static const struct zwlr_layer_surface_v1_listener layer_surface_listener = {
-    .configure = &layer_surface_configure,
-    .closed = &layer_surface_closed,
-};
+        if (fds[1].revents & POLLIN) {
+            wl_display_cancel_read(wl_display);
+            break;
+        }
 
-static void output_destroy(struct output *output)
-{
-    output_layer_destroy(output);
+        if (!(fds[0].revents & POLLIN)) {
+            wl_display_cancel_read(wl_display);
+            if (fds[0].revents & (POLLHUP | POLLERR)) {
+                break; /* main thread deals with that */
+            }
+            continue;
+        }
 
-    if (output->wl_output != NULL) {
-        wl_output_release(output->wl_output);
+        if (wl_display_read_events(wl_display) < 0) {
+            break;
+        }
+
+        pthread_mutex_lock(&output->lock);
+        wl_display_dispatch_queue_pending(wl_display, output->queue);
+        pthread_mutex_unlock(&output->lock);
     }
-    output->wl_output = NULL;
 
-    free(output->make);
-    free(output->model);
+    return NULL;
 }
 
-static void output_geometry(void *data, struct wl_output *wl_output, int32_t x, int32_t y,
-                            int32_t physical_width, int32_t physical_height,
-                            int32_t subpixel, const char *make, const char *model,
-                            int32_t transform)
+static bool output_start_thread(struct output *output)
 {
-    struct output *output = data;
+    output->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (output->stop_fd < 0) {
+        LOG_ERRNO("failed to create eventfd");
+        return false;
+    }
 
-    free(output->make);
-    free(output->model);
+    int err = pthread_create(&output->thread, NULL, &output_thread, output);
+    if (err != 0) {
+        errno = err;
+        LOG_ERRNO("failed to start output thread");
+        close(output->stop_fd);
+        output->stop_fd = -1;
+        return false;
+    }
 
-    output->make = (make != NULL) ? strdup(make) : NULL;
-    output->model = (model != NULL) ? strdup(model) : NULL;
+    return true;
 }
 
-static void output_mode(void *data, struct wl_output *wl_output, uint32_t flags,
-                        int32_t width, int32_t height, int32_t refresh)
+static void output_stop_thread(struct output *output)
 {
-    if ((flags & WL_OUTPUT_MODE_CURRENT) == 0) {
+    if (output->stop_fd < 0) {
         return;
     }
 
-    struct output *output = data;
-    output->width = width;
-    output->height = height;
-}
-
-static void output_done(void *data, struct wl_output *wl_output)
-{
-    struct output *output = data;
-    const int width = output->width;
-    const int height = output->height;
+    const uint64_t one = 1;
+    if (write(output->stop_fd, &one, sizeof (one)) < 0) {
+        LOG_ERRNO("failed to stop output thread");
+    }
 
-    LOG_INFO("output: %s %s (%dx%d)",
-             output->make, output->model, width, height);
+    pthread_join(output->thread, NULL);
+    close(output->stop_fd);
+    output->stop_fd = -1;
 }
 
-static void output_scale(void*, struct wl_output*, int32_t)
+static struct wp_viewport *output_viewport(struct output *output)
 {
-    // scale is hardcoded to 1
-}
+    struct wp_viewporter *viewporter = output->display->viewporter;
+    if (output->viewport == NULL && viewporter != NULL) {
+        output->viewport = wp_viewporter_get_viewport(viewporter, output->surf);
+    }
 
-static const struct wl_output_listener output_listener = {
-    .geometry = &output_geometry,
-    .mode = &output_mode,
-    .done = &output_done,
-    .scale = &output_scale,
-};
+    return output->viewport;
+}
 
-static void shm_format(void *data, struct wl_shm *wl_shm, uint32_t format)
+/*
+ * Stretches buffer of given size over the whole surface, cropping it
+ * to keep the aspect ratio.
+ */
+static void viewport_cover(struct output *output, int buf_width, int buf_height)
 {
-    if (format == WL_SHM_FORMAT_XRGB8888) {
-        have_xrgb8888 = true;
+    const double w = output->render_width;
+    const double h = output->render_height;
+
+    double src_w = buf_width;
+    double src_h = buf_height;
+    if (src_w * h > src_h * w) {
+        src_w = src_h * w / h;
+    } else {
+        src_h = src_w * h / w;
     }
-}
 
-static const struct wl_shm_listener shm_listener = {
-    .format = &shm_format,
-};
+    wp_viewport_set_source(output->viewport,
+                           wl_fixed_from_double((buf_width - src_w) / 2),
+                           wl_fixed_from_double((buf_height - src_h) / 2),
+                           wl_fixed_from_double(src_w),
+                           wl_fixed_from_double(src_h));
+    wp_viewport_set_destination(output->viewport,
+                                output->render_width, output->render_height);
+}
 
-static void add_surface_to_output(struct output *output)
+static void present(struct output *output, struct buffer *buf, int scale)
 {
-    if (compositor == NULL || layer_shell == NULL) {
-        return;
+    if (output_viewport(output) != NULL) {
+        /* Unset source rectangle possibly left over from a re-fit */
+        wp_viewport_set_source(output->viewport,
+                               wl_fixed_from_int(-1), wl_fixed_from_int(-1),
+                               wl_fixed_from_int(-1), wl_fixed_from_int(-1));
+        wp_viewport_set_destination(output->viewport,
+                                    output->render_width, output->render_height);
+    } else {
+        wl_surface_set_buffer_scale(output->surf, scale);
     }
 
-    if (output->surf != NULL) {
-        return;
-    }
+    buf->busy = true;
+    wl_surface_attach(output->surf, buf->wl_buf, 0, 0);
+    wl_surface_damage_buffer(output->surf, 0, 0, buf->width, buf->height);
+    wl_surface_commit(output->surf);
 
-    struct wl_surface *surf = wl_compositor_create_surface(compositor);
+    shm_buffer_discard(output->buf);
+    output->buf = buf;
+}
 
-    /* Default input region is 'infinite', while we want it to be empty */
-    struct wl_region *empty_region = wl_compositor_create_region(compositor);
-    wl_surface_set_input_region(surf, empty_region);
-    wl_region_destroy(empty_region);
+/* Bounding box of all configured outputs */
+static bool span_bounds(struct display *display, pixman_box32_t *box)
+{
+    bool found = false;
 
-    /* Surface is fully opaque (i.e. non-transparent) */
-    struct wl_region *opaque_region = wl_compositor_create_region(compositor);
-    wl_surface_set_opaque_region(surf, opaque_region);
-    wl_region_destroy(opaque_region);
+    tll_foreach(display->outputs, it) {
+        const struct output *output = &it->item;
+        if (!output->configured) {
+            continue;
+        }
 
-    struct zwlr_layer_surface_v1 *layer = zwlr_layer_shell_v1_get_layer_surface(
-        layer_shell, surf, output->wl_output,
-        ZWLR_LAYER_SHELL_V1_LAYER_BACKGROUND, "wallpaper");
+        const pixman_box32_t b = {
+            .x1 = output->x,
+            .y1 = output->y,
+            .x2 = output->x + output->render_width,
+            .y2 = output->y + output->render_height,
+        };
 
-    zwlr_layer_surface_v1_set_exclusive_zone(layer, -1);
-    zwlr_layer_surface_v1_set_anchor(layer,
-                                     ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP |
-                                     ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT |
-                                     ZWLR_LAYER_SURFACE_V1_ANCHOR_BOTTOM |
-                                     ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT);
+        if (!found) {
+            *box = b;
+            found = true;
+            continue;
+        }
 
-    output->surf = surf;
-    output->layer = layer;
+        box->x1 = (b.x1 < box->x1) ? b.x1 : box->x1;
+        box->y1 = (b.y1 < box->y1) ? b.y1 : box->y1;
+        box->x2 = (b.x2 > box->x2) ? b.x2 : box->x2;
+        box->y2 = (b.y2 > box->y2) ? b.y2 : box->y2;
+    }
 
-    zwlr_layer_surface_v1_add_listener(layer, &layer_surface_listener, output);
-    wl_surface_commit(surf);
+    return found;
 }
 
-static bool verify_iface_version(const char *iface, uint32_t version, uint32_t wanted)
+/*
+ * Re-renders the span canvas if the layout of outputs has changed, then
+ * attaches fresh views to those outputs which need them. Passing NULL
+ * for output only reacts to layout changes.
+ */
+static void render_span(struct display *display, struct output *output)
 {
-    if (version >= wanted) {
-        return true;
+    pixman_box32_t box;
+    if (!span_bounds(display, &box)) {
+        return;
     }
 
-    LOG_ERR("%s: need interface version %u, but compositor only implements %u",
-            iface, wanted, version);
-    return false;
-}
+    const pixman_box32_t *old = &display->span_box;
+    const bool relayout = display->span_canvas == NULL ||
+                          box.x1 != old->x1 || box.y1 != old->y1 ||
+                          box.x2 != old->x2 || box.y2 != old->y2;
 
-static void handle_global(void *data, struct wl_registry *registry,
-                          uint32_t name, const char *interface, uint32_t version)
-{
-    if (strcmp(interface, wl_compositor_interface.name) == 0) {
-        const uint32_t required = 4;
-        if (!verify_iface_version(interface, version, required)) {
-            return;
-        }
+    if (relayout) {
+        /* Views already attached keep their own reference */
+        shm_canvas_unref(display->span_canvas);
 
-        compositor = wl_registry_bind(
-            registry, name, &wl_compositor_interface, required);
-    } else if (strcmp(interface, wl_shm_interface.name) == 0) {
-        const uint32_t required = 1;
-        if (!verify_iface_version(interface, version, required)) {
+        display->span_box = box;
+        display->span_canvas = shm_canvas_create(
+            display->shm, box.x2 - box.x1, box.y2 - box.y1);
+        if (display->span_canvas == NULL) {
             return;
         }
 
-        shm = wl_registry_bind(
-            registry, name, &wl_shm_interface, required);
-        wl_shm_add_listener(shm, &shm_listener, NULL);
-    } else if (strcmp(interface, wl_output_interface.name) == 0) {
-        const uint32_t required = 3;
-        if (!verify_iface_version(interface, version, required)) {
-            return;
+        const struct canvas *canvas = display->span_canvas;
+        LOG_INFO("span: %dx%d%+d%+d", canvas->width, canvas->height, box.x1, box.y1);
+
+        const struct wbg_target target = {
+            canvas->pix, canvas->width, canvas->height, 1, NULL,
+        };
+        wbg_render(wbg, &target);
+    }
+
+    tll_foreach(display->outputs, it) {
+        struct output *o = &it->item;
+        if (!o->configured || o->surf == NULL) {
+            continue;
         }
 
-        struct wl_output *wl_output = wl_registry_bind(
-            registry, name, &wl_output_interface, required);
+        const int x = o->x - display->span_box.x1;
+        const int y = o->y - display->span_box.y1;
 
-        tll_push_back(
-            outputs, ((struct output){
-            .wl_output = wl_output, .wl_name = name,
-            .surf = NULL, .layer = NULL
-        }));
+        if (!relayout && o != output && x == o->span_x && y == o->span_y) {
+            continue;
+        }
 
-        struct output *output = &tll_back(outputs);
-        wl_output_add_listener(wl_output, &output_listener, output);
-        add_surface_to_output(output);
-    } else if (strcmp(interface, zwlr_layer_shell_v1_interface.name) == 0) {
-        const uint32_t required = 2;
-        if (!verify_iface_version(interface, version, required)) {
-            return;
+        struct buffer *buf = shm_canvas_view(
+            display->span_canvas, x, y, o->render_width, o->render_height,
+            (uintptr_t)(void *)o);
+
+        if (buf == NULL) {
+            continue;
         }
 
-        layer_shell = wl_registry_bind(
-            registry, name, &zwlr_layer_shell_v1_interface, required);
+        o->span_x = x;
+        o->span_y = y;
+        present(o, buf, 1);
     }
 }
 
-static void handle_global_remove(void *data, struct wl_registry *registry, uint32_t name)
+static uint64_t now_ns(void)
 {
-    tll_foreach(outputs, it) {
-        if (it->item.wl_name == name) {
-            LOG_DEBUG("destroyed: %s %s", it->item.make, it->item.model);
-            output_destroy(&it->item);
-            tll_remove(outputs, it);
-            return;
-        }
+    struct timespec ts;
+    clock_gettime(anim_clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void feedback_sync_output(void *, struct wp_presentation_feedback *, struct wl_output *) {}
+
+static void feedback_presented(void *data, struct wp_presentation_feedback *feedback,
+                               uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec,
+                               uint32_t refresh, uint32_t seq_hi, uint32_t seq_lo,
+                               uint32_t flags)
+{
+    struct output *output = data;
+
+    wp_presentation_feedback_destroy(feedback);
+    output->feedback = NULL;
+
+    if (output->refresh_ns != refresh) {
+        LOG_DEBUG("%s %s: refresh %u ns", output->make, output->model, refresh);
     }
+    output->refresh_ns = refresh;
 }
 
-static const struct wl_registry_listener registry_listener = {
-    .global = &handle_global,
-    .global_remove = &handle_global_remove,
+static void feedback_discarded(void *data, struct wp_presentation_feedback *feedback)
+{
+    struct output *output = data;
+
+    wp_presentation_feedback_destroy(feedback);
+    output->feedback = NULL;
+}
+
+static const struct wp_presentation_feedback_listener feedback_listener = {
+    .sync_output = &feedback_sync_output,
+    .presented = &feedback_presented,
+    .discarded = &feedback_discarded,
 };
 
-static pixman_color_t parse_color(const char *hex_color)
+/*
+ * Half the shortest refresh period among outputs. Committing that much
+ * ahead of the due time lets the frame hit the vblank closest to it,
+ * rather than the one after.
+ */
+static uint64_t anim_lead_ns(void)
 {
-    if (strlen(hex_color) != 7 || hex_color[0] != '#') {
-        LOG_ERR("Invalid input format");
-        return (pixman_color_t) { 0, 0, 0, 0xffff };
+    uint32_t refresh = 0;
+    tll_foreach(tll_front(displays).outputs, it) {
+        const uint32_t r = it->item.refresh_ns;
+        if (r != 0 && (refresh == 0 || r < refresh)) {
+            refresh = r;
+        }
     }
+    return refresh / 2;
+}
 
-    unsigned int r;
-    unsigned int g;
-    unsigned int b;
+static void anim_tick(void);
 
-    sscanf(hex_color + 1, "%02x%02x%02x", &r, &g, &b);
+static void frame_done(void *data, struct wl_callback *cb, uint32_t time)
+{
+    struct output *output = data;
 
-    return (pixman_color_t){
-               .red   = (uint16_t)(r * 0x0101),
-               .green = (uint16_t)(g * 0x0101),
-               .blue  = (uint16_t)(b * 0x0101),
-               .alpha = 0xffff,
-    };
+    wl_callback_destroy(cb);
+    output->frame_cb = NULL;
+
+    anim_tick();
 }
 
-int main(int argc, const char *const *argv)
+static const struct wl_callback_listener frame_listener = {
+    .done = &frame_done,
+};
+
+/* Released buffer of the size to scale frames into, or a new one */
+static struct buffer *anim_scaled_buffer(struct output *output, int width, int height)
 {
-    if (argc > 1) {
-        color = parse_color(argv[1]);
+    for (int i = 0; i < ANIM_SCALED_BUFS; ++i) {
+        struct buffer *buf = output->anim_bufs[i];
+        if (buf != NULL && !buf->busy && buf->width == width && buf->height == height) {
+            return buf;
+        }
     }
 
-    setlocale(LC_CTYPE, "");
+    /* Replaced one is destroyed once released, if still busy */
+    const int i = output->anim_buf_next;
+    output->anim_buf_next = (i + 1) % ANIM_SCALED_BUFS;
 
-    LOG_INFO("%s v%s", argv[0], WBG_VERSION);
+    shm_buffer_discard(output->anim_bufs[i]);
+    output->anim_bufs[i] = shm_get_buffer(output->shm, width, height, (uintptr_t)(void *)output);
+    return output->anim_bufs[i];
+}
 
-    int exit_code = EXIT_FAILURE;
-    int sig_fd = -1;
+static void anim_scaled_release(struct output *output)
+{
+    for (int i = 0; i < ANIM_SCALED_BUFS; ++i) {
+        shm_buffer_discard(output->anim_bufs[i]);
+        output->anim_bufs[i] = NULL;
+    }
+}
 
-    struct wl_display *display = wl_display_connect(NULL);
-    if (display == NULL) {
-        LOG_ERR("failed to connect to wayland; no compositor running?");
-        goto out;
+/*
+ * Shows animation frame on output. Only the area which changed since the
+ * frame previously shown there is damaged.
+ */
+static void present_frame(struct output *output, struct anim_frame *frame)
+{
+    struct wp_presentation *presentation = output->display->presentation;
+
+    if (output->frame_cb == NULL) {
+        output->frame_cb = wl_surface_frame(output->surf);
+        wl_callback_add_listener(output->frame_cb, &frame_listener, output);
     }
 
-    static struct wl_registry *registry; /* for some reason, without this
-                                          *   static, compiler warns about
-                                          *   uninitialized value...
-                                          */
-    registry = wl_display_get_registry(display);
-    if (registry == NULL) {
-        LOG_ERR("failed to get wayland registry");
-        goto out;
+    if (presentation != NULL && output->feedback == NULL) {
+        output->feedback = wp_presentation_feedback(presentation, output->surf);
+        wp_presentation_feedback_add_listener(output->feedback, &feedback_listener, output);
     }
 
-    wl_registry_add_listener(registry, &registry_listener, NULL);
-    wl_display_roundtrip(display);
+    /* Frame buffers are owned by the animation ring, scaled ones by anim_bufs */
+    shm_buffer_discard(output->buf);
+    output->buf = NULL;
 
-    if (compositor == NULL) {
-        LOG_ERR("no compositor");
-        goto out;
-    }
-    if (shm == NULL) {
-        LOG_ERR("no shared memory buffers interface");
-        goto out;
-    }
-    if (layer_shell == NULL) {
-        LOG_ERR("no layer shell interface");
-        goto out;
-    }
+    struct buffer *buf = frame->buf;
 
-    tll_foreach(outputs, it)
-    add_surface_to_output(&it->item);
+    if (output_viewport(output) == NULL) {
+        /* Compositor cannot scale for us; render a scaled copy */
+        const int width = output->render_width * output->scale;
+        const int height = output->render_height * output->scale;
 
-    wl_display_roundtrip(display);
+        struct buffer *scaled = anim_scaled_buffer(output, width, height);
+        if (scaled != NULL) {
+            render_scaled(buf->pix, buf->width, buf->height, scaled->pix, width, height);
 
-    if (!have_xrgb8888) {
-        LOG_ERR("shm: XRGB image format not available");
-        goto out;
+            wl_surface_set_buffer_scale(output->surf, output->scale);
+            scaled->busy = true;
+            wl_surface_attach(output->surf, scaled->wl_buf, 0, 0);
+            wl_surface_damage_buffer(output->surf, 0, 0, width, height);
+            wl_surface_commit(output->surf);
+        }
+
+        output->anim_seq = frame->seq;
+        return;
+    }
+
+    pixman_box32_t damage = { 0, 0, buf->width, buf->height };
+    if (output->anim_seq != 0 && output->anim_seq + 1 == frame->seq) {
+        damage = frame->damage;
+    }
+
+    viewport_cover(output, buf->width, buf->height);
+
+    buf->busy = true;
+    wl_surface_attach(output->surf, buf->wl_buf, 0, 0);
+    wl_surface_damage_buffer(output->surf, damage.x1, damage.y1,
+                             damage.x2 - damage.x1, damage.y2 - damage.y1);
+    wl_surface_commit(output->surf);
+
+    output->anim_seq = frame->seq;
+}
+
+static void arm_anim_timer(uint64_t deadline)
+{
+    loop_timer_at(anim_timer, deadline, 0);
+}
+
+/*
+ * Advances the animation when its frame is due and decoded. Outputs take
+ * a new frame only after their frame callback fired; if none do (e.g. all
+ * are hidden), playback pauses and so does decoding, once the ring fills.
+ */
+static void anim_tick(void)
+{
+    anim_collect(anim);
+
+    /* Animations are played on a single display */
+    struct display *display = &tll_front(displays);
+
+    bool any_ready = false;
+    tll_foreach(display->outputs, it) {
+        struct output *output = &it->item;
+        if (!output->configured || output->surf == NULL || output->frame_cb != NULL) {
+            continue;
+        }
+
+        any_ready = true;
+
+        /* Output missed some frames while it was not drawing */
+        if (anim_current != NULL && output->anim_seq != anim_current->seq) {
+            present_frame(output, anim_current);
+        }
+    }
+
+    if (!any_ready) {
+        arm_anim_timer(0); /* disarm */
+        return;
+    }
+
+    const uint64_t now = now_ns();
+    const uint64_t lead = anim_lead_ns();
+    if (anim_current != NULL && now + lead < anim_due) {
+        arm_anim_timer(anim_due - lead);
+        return;
+    }
+
+    struct anim_frame *next = anim_next(anim);
+    if (next == NULL) {
+        /* Not decoded yet (worker will wake us up), or animation is over */
+        return;
+    }
+
+    struct anim_frame *prev = anim_current;
+    anim_current = next;
+
+    /*
+     * Keep cadence, unless playback was paused or is lagging behind; woken
+     * `lead` early as we are, `now` is usually still before anim_due
+     */
+    const uint64_t delay = (uint64_t)next->delay * 1000;
+    const int64_t late = (int64_t)(now - anim_due);
+    anim_due = (prev != NULL && late < (int64_t)delay) ? anim_due + delay : now + delay;
+
+    tll_foreach(display->outputs, it) {
+        struct output *output = &it->item;
+        if (output->configured && output->surf != NULL && output->frame_cb == NULL) {
+            present_frame(output, anim_current);
+        }
+    }
+
+    if (prev != NULL) {
+        anim_put(anim, prev);
+    }
+
+    arm_anim_timer(anim_due > lead ? anim_due - lead : anim_due);
+}
+
+/* Whether the last rendered buffer matches current size and scale */
+static bool output_is_native(const struct output *output)
+{
+    if (have_night && output->viewport != NULL) {
+        return output->buf != NULL; /* single pixel fits any size */
+    }
+
+    const int scale = span ? 1 : output->scale;
+    return output->buf != NULL &&
+           output->buf->width == output->render_width * scale &&
+           output->buf->height == output->render_height * scale;
+}
+
+/* Solid color, as a single pixel stretched by the viewport if possible */
+static void present_color(struct output *output, pixman_color_t c)
+{
+    if (output->lut != NULL) {
+        c = icc_map_color(output->lut, c);
+    }
+
+    if (output_viewport(output) == NULL) {
+        /* Compositor cannot scale for us; fill whole buffer */
+        const int width = output->render_width * output->scale;
+        const int height = output->render_height * output->scale;
+
+        struct buffer *buf = shm_get_buffer(output->shm, width, height, 0);
+        if (buf != NULL) {
+            pixman_image_fill_boxes(PIXMAN_OP_SRC, buf->pix, &c,
+                                    1, &(pixman_box32_t){ 0, 0, width, height });
+            present(output, buf, output->scale);
+        }
+        return;
+    }
+
+    const uint32_t pixel = 0xff000000u |
+                           (uint32_t)(c.red >> 8) << 16 |
+                           (uint32_t)(c.green >> 8) << 8 |
+                           (uint32_t)(c.blue >> 8);
+
+    struct buffer *buf = output->buf;
+    if (buf == NULL || buf->width != 1 || buf->height != 1 || buf->busy) {
+        buf = shm_get_buffer(output->shm, 1, 1, 0);
+        if (buf == NULL) {
+            return;
+        }
+
+        *(uint32_t *)buf->mmapped = pixel;
+        present(output, buf, 1);
+        return;
+    }
+
+    /* Released already; rewrite it in place */
+    *(uint32_t *)buf->mmapped = pixel;
+
+    wp_viewport_set_source(output->viewport,
+                           wl_fixed_from_int(-1), wl_fixed_from_int(-1),
+                           wl_fixed_from_int(-1), wl_fixed_from_int(-1));
+    wp_viewport_set_destination(output->viewport,
+                                output->render_width, output->render_height);
+
+    buf->busy = true;
+    wl_surface_attach(output->surf, buf->wl_buf, 0, 0);
+    wl_surface_damage_buffer(output->surf, 0, 0, 1, 1);
+    wl_surface_commit(output->surf);
+}
+
+/* Solid background, tinted by the night shift */
+static void render_night(struct output *output)
+{
+    present_color(output, night_color(&night, color, time(NULL)));
+}
+
+/* Content at a fraction of the size, stretched over the output */
+static void present_preview(struct output *output, const struct wbg_target *full)
+{
+    struct wbg_target target = *full;
+    target.width = full->width / PREVIEW_DIVISOR > 0 ? full->width / PREVIEW_DIVISOR : 1;
+    target.height = full->height / PREVIEW_DIVISOR > 0 ? full->height / PREVIEW_DIVISOR : 1;
+    target.scale = 1;
+
+    struct buffer *buf = shm_get_buffer(output->shm, target.width, target.height, 0);
+    if (buf == NULL) {
+        return;
+    }
+
+    target.dst = buf->pix;
+    wbg_render(wbg, &target);
+    present(output, buf, 1);
+
+    /* Out now, not after the full render */
+    wl_display_flush(output->display->wl_display);
+}
+
+static void render(struct output *output)
+{
+    if (output->parked) {
+        return; /* rendered on power on */
+    }
+
+    if (anim != NULL) {
+        if (anim_current != NULL) {
+            output->anim_seq = 0; /* size changed; damage everything */
+            present_frame(output, anim_current);
+        } else {
+            anim_tick();
+        }
+        return;
+    }
+
+    if (have_night) {
+        render_night(output);
+        return;
+    }
+
+    if (wbg == NULL) {
+        /* Rendered once loaded */
+        if (progressive) {
+            present_color(output, placeholder);
+        }
+        return;
+    }
+
+    if (span) {
+        render_span(output->display, output);
+        return;
+    }
+
+    const int scale = output->scale;
+    struct wbg_target target = {
+        .width = output->render_width * scale,
+        .height = output->render_height * scale,
+        .scale = scale,
+        .lut = output->lut,
+    };
+    const uint64_t key = wbg_key(wbg, &target);
+
+    if (output->buf != NULL && output->buf->cookie == key && output_is_native(output)) {
+        /* Same content is on screen already; only undo a re-fit */
+        if (output->viewport != NULL) {
+            wp_viewport_set_source(output->viewport,
+                                   wl_fixed_from_int(-1), wl_fixed_from_int(-1),
+                                   wl_fixed_from_int(-1), wl_fixed_from_int(-1));
+            wp_viewport_set_destination(output->viewport,
+                                        output->render_width, output->render_height);
+            wl_surface_commit(output->surf);
+        }
+        return;
+    }
+
+    /* Content may have been rendered for another output already */
+    bool fresh;
+    struct buffer *buf = shm_get_shared_buffer(
+        output->shm, target.width, target.height, key, &fresh);
+
+    if (buf == NULL) {
+        /* Over memory budget; something smaller rather than nothing */
+        if (output_viewport(output) != NULL) {
+            present_preview(output, &target);
+        } else {
+            present_color(output, progressive ? placeholder : color);
+        }
+        return;
+    }
+
+    if (fresh) {
+        /* First content on this output; nothing else to show meanwhile */
+        const bool first = output->buf == NULL || output->buf->cookie == 0;
+        if (progressive && first && output_viewport(output) != NULL) {
+            present_preview(output, &target);
+        }
+
+        target.dst = buf->pix;
+        wbg_render(wbg, &target);
+        shm_buffer_publish(buf, key);
+    }
+    present(output, buf, scale);
+}
+
+/*
+ * Brings dynamic layers up to date straight in the buffer on screen,
+ * damaging only what they changed. Buffer still held by the compositor,
+ * shared with other outputs, or not holding the previous content, gets a
+ * full render instead.
+ */
+static void update(struct output *output)
+{
+    struct buffer *buf = output->buf;
+
+    if (output->parked) {
+        return;
+    }
+
+    if (buf == NULL) {
+        render(output);
+        return;
+    }
+
+    const struct wbg_target target = {
+        buf->pix, buf->width, buf->height, output->scale, output->lut,
+    };
+
+    if (buf->busy || !output_is_native(output) ||
+        buf->cookie != wbg_prev_key(wbg, &target) || !shm_buffer_claim(buf)) {
+        render(output);
+        return;
+    }
+
+    pixman_region32_t damage;
+    pixman_region32_init(&damage);
+
+    wbg_update(wbg, &target, &damage);
+    shm_buffer_publish(buf, wbg_key(wbg, &target));
+
+    if (pixman_region32_not_empty(&damage)) {
+        int count;
+        const pixman_box32_t *boxes = pixman_region32_rectangles(&damage, &count);
+
+        buf->busy = true;
+        wl_surface_attach(output->surf, buf->wl_buf, 0, 0);
+        for (int i = 0; i < count; ++i) {
+            wl_surface_damage_buffer(output->surf, boxes[i].x1, boxes[i].y1,
+                                     boxes[i].x2 - boxes[i].x1, boxes[i].y2 - boxes[i].y1);
+        }
+        wl_surface_commit(output->surf);
+    }
+
+    pixman_region32_fini(&damage);
+}
+
+/*
+ * Output was powered off: gives up its buffer for a single black pixel,
+ * keeping a compressed copy of the content. Only content rendered for
+ * the output alone is parked; spans, animations and the night shift
+ * (which is a single pixel already) are left alone.
+ */
+static void output_park(struct output *output)
+{
+    struct buffer *buf = output->buf;
+    if (output->parked || wbg == NULL || span || anim != NULL || have_night ||
+        buf == NULL || buf->cookie == 0 || output_viewport(output) == NULL) {
+        return;
+    }
+
+    output->released = shm_buffer_shared(buf) ? 0 : buf->size;
+    output->park = park_store(buf->mmapped, buf->width, buf->height, buf->stride);
+    output->park_key = buf->cookie;
+
+    /* Old buffer is destroyed once the compositor lets go of it */
+    present_color(output, (pixman_color_t){ 0, 0, 0, 0xffff });
+
+    output->parked = true;
+    output->parked_at = now_ns();
+
+    LOG_INFO("%s %s: powered off; releasing %zu KiB, keeping %zu KiB compressed",
+             output->make, output->model, output->released / 1024,
+             (output->park != NULL) ? park_size(output->park) / 1024 : 0);
+}
+
+/* Attaches the parked content, if it is still what is to be shown */
+static bool present_parked(struct output *output)
+{
+    const int scale = output->scale;
+    const struct wbg_target target = {
+        .width = output->render_width * scale,
+        .height = output->render_height * scale,
+        .scale = scale,
+        .lut = output->lut,
+    };
+
+    const struct park *park = output->park;
+    if (park == NULL || park_width(park) != target.width ||
+        park_height(park) != target.height || wbg_key(wbg, &target) != output->park_key) {
+        return false;
+    }
+
+    bool fresh;
+    struct buffer *buf = shm_get_shared_buffer(
+        output->shm, target.width, target.height, output->park_key, &fresh);
+    if (buf == NULL) {
+        return false;
+    }
+
+    if (fresh) {
+        park_restore(park, buf->mmapped, buf->stride);
+        shm_buffer_publish(buf, output->park_key);
+    }
+    present(output, buf, scale);
+    return true;
+}
+
+static void output_unpark(struct output *output)
+{
+    if (!output->parked) {
+        return;
+    }
+
+    const uint64_t start = now_ns();
+    output->parked = false;
+
+    const bool restored = present_parked(output);
+    if (!restored) {
+        render(output);
+    }
+    wl_display_flush(output->display->wl_display);
+
+    const double wake_ms = (now_ns() - start) / 1e6;
+    const double hours = (start - output->parked_at) / 3.6e12;
+
+    pthread_mutex_lock(&power_stats.lock);
+    power_stats.wakes++;
+    power_stats.restored += restored;
+    power_stats.released_mib_h += output->released / 1048576.0 * hours;
+    power_stats.wake_ms += wake_ms;
+    if (wake_ms > power_stats.wake_ms_max) {
+        power_stats.wake_ms_max = wake_ms;
+    }
+    pthread_mutex_unlock(&power_stats.lock);
+
+    LOG_INFO("%s %s: powered on after %.1f h with %zu KiB released; "
+             "wallpaper back in %.1f ms (%s)",
+             output->make, output->model, hours, output->released / 1024,
+             wake_ms, restored ? "restored" : "rendered");
+
+    park_free(output->park);
+    output->park = NULL;
+    output->released = 0;
+}
+
+static void power_dump_stats(void)
+{
+    pthread_mutex_lock(&power_stats.lock);
+    if (power_stats.wakes > 0) {
+        LOG_INFO("power: %u wakes (%u restored), wallpaper back in %.1f ms on average, "
+                 "%.1f ms at worst; %.1f MiB*h released",
+                 power_stats.wakes, power_stats.restored,
+                 power_stats.wake_ms / power_stats.wakes, power_stats.wake_ms_max,
+                 power_stats.released_mib_h);
+    }
+    pthread_mutex_unlock(&power_stats.lock);
+}
+
+/* Advances scene to current time, and outputs with it */
+static void scene_tick(void)
+{
+    if (!wbg_advance(wbg, time(NULL))) {
+        return;
+    }
+
+    tll_foreach(displays, d) {
+        struct display *display = &d->item;
+
+        if (span) {
+            /* Drop the canvas so that it gets rendered anew */
+            shm_canvas_unref(display->span_canvas);
+            display->span_canvas = NULL;
+            render_span(display, NULL);
+            continue;
+        }
+
+        tll_foreach(display->outputs, it) {
+            struct output *output = &it->item;
+            pthread_mutex_lock(&output->lock);
+            if (output->configured && output->surf != NULL) {
+                update(output);
+            }
+            pthread_mutex_unlock(&output->lock);
+        }
+    }
+}
+
+/* Wakes up on the next minute (or second) boundary */
+static void arm_scene_timer(void)
+{
+    const long period = wbg_period(wbg);
+    const time_t now = time(NULL);
+    loop_timer_at(scene_timer, (uint64_t)((now / period + 1) * period) * 1000000000, 0);
+}
+
+/*
+ * Stretches the last rendered buffer over the current surface size,
+ * cropping it to keep the aspect ratio. No rendering involved.
+ */
+static void refit(struct output *output)
+{
+    viewport_cover(output, output->buf->width, output->buf->height);
+    wl_surface_commit(output->surf);
+}
+
+static void schedule_rerender(void)
+{
+    /* Re-arming pushes the deadline back; renders only once size is stable */
+    loop_timer_in(rerender_timer, (uint64_t)settle_ms * 1000000, 0);
+}
+
+static void rerender_stale(void *data)
+{
+    tll_foreach(displays, d) {
+        tll_foreach(d->item.outputs, it) {
+            struct output *output = &it->item;
+            pthread_mutex_lock(&output->lock);
+            if (output->configured && output->surf != NULL && !output_is_native(output)) {
+                render(output);
+            }
+            pthread_mutex_unlock(&output->lock);
+        }
+    }
+
+    if (wbg != NULL) {
+        wbg_trim(wbg);
+    }
+}
+
+/*
+ * Sleeps until the timeline changes next. Deadlines are whole seconds of
+ * wall-clock time, so the wake-ups coalesce with other second aligned
+ * timers; the timer is cancelled (and timeline re-evaluated) whenever the
+ * clock is set.
+ */
+static void arm_timeline_timer(void)
+{
+    loop_timer_at(timeline_timer, (uint64_t)wbg_next_change(wbg, time(NULL)) * 1000000000, 0);
+}
+
+/* Once per wake-up, even if the timeline and the scene timer (usually on
+ * the same minute) expire together */
+static void advance_scene(void *data)
+{
+    scene_tick();
+}
+
+static void timeline_expired(void *data)
+{
+    arm_timeline_timer();
+    loop_defer(loop, &advance_scene, NULL);
+}
+
+static void scene_expired(void *data)
+{
+    arm_scene_timer();
+    loop_defer(loop, &advance_scene, NULL);
+}
+
+/* Sleeps until the tinted colour changes by at least one 8-bit step */
+static void arm_night_timer(void)
+{
+    loop_timer_at(night_timer, (uint64_t)night_next_change(&night, color, time(NULL)) * 1000000000,
+                  NIGHT_SLACK_NS);
+}
+
+static void night_tick(void *data)
+{
+    tll_foreach(displays, d) {
+        tll_foreach(d->item.outputs, it) {
+            struct output *output = &it->item;
+            pthread_mutex_lock(&output->lock);
+            if (output->configured && output->surf != NULL) {
+                render_night(output);
+            }
+            pthread_mutex_unlock(&output->lock);
+        }
+    }
+
+    arm_night_timer();
+}
+
+/* Size or scale of an already configured output has changed */
+static void output_resized(struct output *output)
+{
+    const bool can_refit = !span &&
+                           output->buf != NULL &&
+                           output->viewport != NULL &&
+                           rerender_timer != NULL && settle_ms > 0 &&
+                           output->render_width > 0 && output->render_height > 0;
+
+    if (!can_refit) {
+        render(output);
+        return;
+    }
+
+    refit(output);
+    schedule_rerender();
+}
+
+static void layer_surface_configure(void *data, struct zwlr_layer_surface_v1 *surface,
+                                    uint32_t serial, uint32_t w, uint32_t h)
+{
+    struct output *output = data;
+    if (traced(output->display)) {
+        trace_event("configure", "%u %u %u %u", output->wl_name, serial, w, h);
+    }
+
+    zwlr_layer_surface_v1_ack_configure(surface, serial);
+
+    /* If the size of the last committed buffer has not change, do not
+     * render a new buffer because it will be identical to the old one. */
+    if (output->configured &&
+        output->render_width == w &&
+        output->render_height == h) {
+        wl_surface_commit(output->surf);
+        return;
+    }
+
+    output->render_width = w;
+    output->render_height = h;
+
+    if (output->configured) {
+        output_resized(output);
+        return;
+    }
+
+    output->configured = true;
+    render(output);
+}
+
+static void output_layer_destroy(struct output *output)
+{
+    shm_buffer_discard(output->buf);
+    output->buf = NULL;
+
+    if (output->frame_cb != NULL) {
+        wl_callback_destroy(output->frame_cb);
+    }
+    output->frame_cb = NULL;
+    output->anim_seq = 0;
+    anim_scaled_release(output);
+
+    if (output->feedback != NULL) {
+        wp_presentation_feedback_destroy(output->feedback);
+    }
+    output->feedback = NULL;
+
+    if (output->viewport != NULL) {
+        wp_viewport_destroy(output->viewport);
+    }
+    output->viewport = NULL;
+
+    if (output->layer != NULL) {
+        zwlr_layer_surface_v1_destroy(output->layer);
+    }
+    if (output->surf != NULL) {
+        wl_surface_destroy(output->surf);
+    }
+
+    output->layer = NULL;
+    output->surf = NULL;
+    output->configured = false;
+}
+
+static void layer_surface_closed(void *data, struct zwlr_layer_surface_v1 *surface)
+{
+    struct output *output = data;
+    if (traced(output->display)) {
+        trace_event("closed", "%u", output->wl_name);
+    }
+
+    /* Events of a destroyed layer surface are dropped, and an output's
+     * queue is drained before the output goes away; ‘output’ is valid */
+    output_layer_destroy(output);
+}
+
+static const struct zwlr_layer_surface_v1_listener layer_surface_listener = {
+    .configure = &layer_surface_configure,
+    .closed = &layer_surface_closed,
+};
+
+static void output_destroy(struct output *output)
+{
+    output_stop_thread(output);
+    output_layer_destroy(output);
+
+    if (output->queue != NULL) {
+        /* Collect releases of buffers still held by the compositor */
+        wl_display_roundtrip_queue(output->display->wl_display, output->queue);
+    }
+
+    if (output->xdg_output != NULL) {
+        zxdg_output_v1_destroy(output->xdg_output);
+    }
+    output->xdg_output = NULL;
+
+    if (output->power != NULL) {
+        zwlr_output_power_v1_destroy(output->power);
+    }
+    output->power = NULL;
+
+    park_free(output->park);
+    output->park = NULL;
+
+    if (output->wl_output != NULL) {
+        wl_output_release(output->wl_output);
+    }
+    output->wl_output = NULL;
+
+    if (output->shm != NULL) {
+        wl_proxy_wrapper_destroy(output->shm);
+    }
+    output->shm = NULL;
+
+    if (output->queue != NULL) {
+        wl_event_queue_destroy(output->queue);
+    }
+    output->queue = NULL;
+
+    pthread_mutex_destroy(&output->lock);
+
+    free(output->make);
+    free(output->model);
+}
+
+static void output_geometry(void *data, struct wl_output *wl_output, int32_t x, int32_t y,
+                            int32_t physical_width, int32_t physical_height,
+                            int32_t subpixel, const char *make, const char *model,
+                            int32_t transform)
+{
+    struct output *output = data;
+    if (traced(output->display)) {
+        char make_str[256], model_str[256];
+        trace_event("geometry", "%u %d %d %d %d %d %s %s %d", output->wl_name, x, y,
+                    physical_width, physical_height, subpixel,
+                    trace_escape(make_str, sizeof (make_str), make),
+                    trace_escape(model_str, sizeof (model_str), model), transform);
+    }
+
+    free(output->make);
+    free(output->model);
+
+    output->make = (make != NULL) ? strdup(make) : NULL;
+    output->model = (model != NULL) ? strdup(model) : NULL;
+
+    /* xdg-output, when available, reports the logical position */
+    if (output->xdg_output == NULL) {
+        output->x = x;
+        output->y = y;
+    }
+}
+
+static void output_mode(void *data, struct wl_output *wl_output, uint32_t flags,
+                        int32_t width, int32_t height, int32_t refresh)
+{
+    struct output *output = data;
+    if (traced(output->display)) {
+        trace_event("mode", "%u %u %d %d %d", output->wl_name, flags, width, height, refresh);
+    }
+
+    if ((flags & WL_OUTPUT_MODE_CURRENT) == 0) {
+        return;
+    }
+
+    output->width = width;
+    output->height = height;
+}
+
+/* First profile whose pattern matches "MAKE MODEL" of output */
+static const struct icc_lut *output_profile(const struct output *output)
+{
+    char name[256];
+    snprintf(name, sizeof (name), "%s %s",
+             output->make != NULL ? output->make : "",
+             output->model != NULL ? output->model : "");
+
+    tll_foreach(profiles, it) {
+        if (fnmatch(it->item.match, name, 0) == 0) {
+            return it->item.lut;
+        }
+    }
+    return NULL;
+}
+
+static void output_done(void *data, struct wl_output *wl_output)
+{
+    struct output *output = data;
+    if (traced(output->display)) {
+        trace_event("done", "%u", output->wl_name);
+    }
+
+    const int width = output->width;
+    const int height = output->height;
+
+    const struct icc_lut *lut = output_profile(output);
+    const bool recolor = lut != output->lut;
+    output->lut = lut;
+
+    LOG_INFO("output: %s %s (%dx%d%+d%+d)%s",
+             output->make, output->model, width, height, output->x, output->y,
+             lut != NULL ? ", color managed" : "");
+
+    if (span && output->configured) {
+        render_span(output->display, NULL);
+    } else if (output->configured && output->buf != NULL && !output_is_native(output)) {
+        output_resized(output);
+    } else if (output->configured && recolor) {
+        render(output);
+    }
+}
+
+static void output_scale(void *data, struct wl_output *wl_output, int32_t factor)
+{
+    struct output *output = data;
+    if (traced(output->display)) {
+        trace_event("scale", "%u %d", output->wl_name, factor);
+    }
+
+    output->scale = factor;
+}
+
+static const struct wl_output_listener output_listener = {
+    .geometry = &output_geometry,
+    .mode = &output_mode,
+    .done = &output_done,
+    .scale = &output_scale,
+};
+
+static void xdg_output_logical_position(void *data, struct zxdg_output_v1 *xdg_output,
+                                        int32_t x, int32_t y)
+{
+    struct output *output = data;
+    if (traced(output->display)) {
+        trace_event("logical_position", "%u %d %d", output->wl_name, x, y);
+    }
+
+    output->x = x;
+    output->y = y;
+}
+
+static void xdg_output_logical_size(void *data, struct zxdg_output_v1 *xdg_output,
+                                    int32_t width, int32_t height)
+{
+    struct output *output = data;
+    if (traced(output->display)) {
+        trace_event("logical_size", "%u %d %d", output->wl_name, width, height);
+    }
+
+    // size is taken from the layer surface configure
+}
+
+static void xdg_output_done(void*, struct zxdg_output_v1*)
+{
+    // since version 3, wl_output.done is sent instead
+}
+
+static void xdg_output_name(void*, struct zxdg_output_v1*, const char*)
+{
+}
+
+static void xdg_output_description(void*, struct zxdg_output_v1*, const char*)
+{
+}
+
+static const struct zxdg_output_v1_listener xdg_output_listener = {
+    .logical_position = &xdg_output_logical_position,
+    .logical_size = &xdg_output_logical_size,
+    .done = &xdg_output_done,
+    .name = &xdg_output_name,
+    .description = &xdg_output_description,
+};
+
+static void add_xdg_output(struct output *output)
+{
+    struct zxdg_output_manager_v1 *xdg_output_manager = output->display->xdg_output_manager;
+    if (xdg_output_manager == NULL || output->xdg_output != NULL) {
+        return;
+    }
+
+    struct zxdg_output_manager_v1 *manager = on_queue(xdg_output_manager, output);
+    output->xdg_output = zxdg_output_manager_v1_get_xdg_output(manager, output->wl_output);
+    wl_proxy_wrapper_destroy(manager);
+
+    zxdg_output_v1_add_listener(output->xdg_output, &xdg_output_listener, output);
+}
+
+static void output_power_mode(void *data, struct zwlr_output_power_v1 *power, uint32_t mode)
+{
+    struct output *output = data;
+    if (traced(output->display)) {
+        trace_event("power", "%u %u", output->wl_name, mode);
+    }
+
+    if (mode == ZWLR_OUTPUT_POWER_V1_MODE_OFF) {
+        output_park(output);
+    } else if (mode == ZWLR_OUTPUT_POWER_V1_MODE_ON) {
+        output_unpark(output);
+    }
+}
+
+static void output_power_failed(void *data, struct zwlr_output_power_v1 *power)
+{
+    struct output *output = data;
+    if (traced(output->display)) {
+        trace_event("power_failed", "%u", output->wl_name);
+    }
+
+    LOG_WARN("%s %s: power mode is not reported", output->make, output->model);
+
+    zwlr_output_power_v1_destroy(output->power);
+    output->power = NULL;
+    output_unpark(output);
+}
+
+static const struct zwlr_output_power_v1_listener output_power_listener = {
+    .mode = &output_power_mode,
+    .failed = &output_power_failed,
+};
+
+static void add_output_power(struct output *output)
+{
+    struct zwlr_output_power_manager_v1 *power_manager = output->display->power_manager;
+    if (power_manager == NULL || output->power != NULL) {
+        return;
+    }
+
+    struct zwlr_output_power_manager_v1 *manager = on_queue(power_manager, output);
+    output->power = zwlr_output_power_manager_v1_get_output_power(manager, output->wl_output);
+    wl_proxy_wrapper_destroy(manager);
+
+    zwlr_output_power_v1_add_listener(output->power, &output_power_listener, output);
+}
+
+static void shm_format(void *data, struct wl_shm *wl_shm, uint32_t format)
+{
+    struct display *display = data;
+    if (traced(display)) {
+        trace_event("shm_format", "%u", format);
+    }
+
+    if (format == WL_SHM_FORMAT_XRGB8888) {
+        display->have_xrgb8888 = true;
+    }
+}
+
+static const struct wl_shm_listener shm_listener = {
+    .format = &shm_format,
+};
+
+static void presentation_clock_id(void *data, struct wp_presentation *wp_presentation, uint32_t clk_id)
+{
+    if (traced(data)) {
+        trace_event("clock_id", "%u", clk_id);
+    }
+
+    /* Timer has to tick in the same clock; timerfd supports only some */
+    switch (clk_id) {
+        case CLOCK_MONOTONIC:
+        case CLOCK_REALTIME:
+        case CLOCK_BOOTTIME:
+            anim_clock = clk_id;
+            break;
+        default:
+            LOG_WARN("presentation: unsupported clock %u, using monotonic", clk_id);
+            break;
+    }
+}
+
+static const struct wp_presentation_listener presentation_listener = {
+    .clock_id = &presentation_clock_id,
+};
+
+static void add_surface_to_output(struct output *output)
+{
+    const struct display *display = output->display;
+    if (display->compositor == NULL || display->layer_shell == NULL || display->shm == NULL) {
+        return;
+    }
+
+    if (output->surf != NULL) {
+        return;
+    }
+
+    if (output->shm == NULL) {
+        output->shm = on_queue(display->shm, output);
+    }
+
+    struct wl_compositor *compositor = on_queue(display->compositor, output);
+    struct zwlr_layer_shell_v1 *layer_shell = on_queue(display->layer_shell, output);
+
+    struct wl_surface *surf = wl_compositor_create_surface(compositor);
+
+    /* Default input region is 'infinite', while we want it to be empty */
+    struct wl_region *empty_region = wl_compositor_create_region(compositor);
+    wl_surface_set_input_region(surf, empty_region);
+    wl_region_destroy(empty_region);
+
+    /* Surface is fully opaque (i.e. non-transparent) */
+    struct wl_region *opaque_region = wl_compositor_create_region(compositor);
+    wl_surface_set_opaque_region(surf, opaque_region);
+    wl_region_destroy(opaque_region);
+
+    struct zwlr_layer_surface_v1 *layer = zwlr_layer_shell_v1_get_layer_surface(
+        layer_shell, surf, output->wl_output,
+        ZWLR_LAYER_SHELL_V1_LAYER_BACKGROUND, "wallpaper");
+
+    wl_proxy_wrapper_destroy(layer_shell);
+    wl_proxy_wrapper_destroy(compositor);
+
+    zwlr_layer_surface_v1_set_exclusive_zone(layer, -1);
+    zwlr_layer_surface_v1_set_anchor(layer,
+                                     ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP |
+                                     ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT |
+                                     ZWLR_LAYER_SURFACE_V1_ANCHOR_BOTTOM |
+                                     ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT);
+
+    output->surf = surf;
+    output->layer = layer;
+
+    zwlr_layer_surface_v1_add_listener(layer, &layer_surface_listener, output);
+    wl_surface_commit(surf);
+}
+
+static bool verify_iface_version(const char *iface, uint32_t version, uint32_t wanted)
+{
+    if (version >= wanted) {
+        return true;
+    }
+
+    LOG_ERR("%s: need interface version %u, but compositor only implements %u",
+            iface, wanted, version);
+    return false;
+}
+
+static void handle_global(void *data, struct wl_registry *registry,
+                          uint32_t name, const char *interface, uint32_t version)
+{
+    struct display *display = data;
+    if (traced(display)) {
+        trace_event("global", "%u %s %u", name, interface, version);
+    }
+
+    if (strcmp(interface, wl_compositor_interface.name) == 0) {
+        const uint32_t required = 4;
+        if (!verify_iface_version(interface, version, required)) {
+            return;
+        }
+
+        display->compositor = wl_registry_bind(
+            registry, name, &wl_compositor_interface, required);
+    } else if (strcmp(interface, wl_shm_interface.name) == 0) {
+        const uint32_t required = 1;
+        if (!verify_iface_version(interface, version, required)) {
+            return;
+        }
+
+        display->shm = wl_registry_bind(
+            registry, name, &wl_shm_interface, required);
+        wl_shm_add_listener(display->shm, &shm_listener, display);
+    } else if (strcmp(interface, wl_output_interface.name) == 0) {
+        const uint32_t required = 3;
+        if (!verify_iface_version(interface, version, required)) {
+            return;
+        }
+
+        tll_push_back(
+            display->outputs, ((struct output){
+            .display = display,
+            .stop_fd = -1,
+            .wl_name = name,
+            .scale = 1,
+            .surf = NULL, .layer = NULL
+        }));
+
+        struct output *output = &tll_back(display->outputs);
+        pthread_mutex_init(&output->lock, NULL);
+
+        /* Spanned and animated outputs are coordinated by main thread */
+        if (!span && image_path == NULL) {
+            output->queue = wl_display_create_queue(display->wl_display);
+            if (!output_start_thread(output)) {
+                wl_event_queue_destroy(output->queue);
+                output->queue = NULL;
+            }
+        }
+
+        pthread_mutex_lock(&output->lock);
+
+        struct wl_registry *wrapper = on_queue(registry, output);
+        output->wl_output = wl_registry_bind(
+            wrapper, name, &wl_output_interface, required);
+        wl_proxy_wrapper_destroy(wrapper);
+
+        wl_output_add_listener(output->wl_output, &output_listener, output);
+        add_xdg_output(output);
+        add_output_power(output);
+        add_surface_to_output(output);
+
+        pthread_mutex_unlock(&output->lock);
+    } else if (strcmp(interface, zwlr_layer_shell_v1_interface.name) == 0) {
+        const uint32_t required = 2;
+        if (!verify_iface_version(interface, version, required)) {
+            return;
+        }
+
+        display->layer_shell = wl_registry_bind(
+            registry, name, &zwlr_layer_shell_v1_interface, required);
+    } else if (strcmp(interface, zxdg_output_manager_v1_interface.name) == 0) {
+        const uint32_t required = 2;
+        if (!verify_iface_version(interface, version, required)) {
+            return;
+        }
+
+        display->xdg_output_manager = wl_registry_bind(
+            registry, name, &zxdg_output_manager_v1_interface, required);
+    } else if (power_save &&
+               strcmp(interface, zwlr_output_power_manager_v1_interface.name) == 0) {
+        const uint32_t required = 1;
+        if (!verify_iface_version(interface, version, required)) {
+            return;
+        }
+
+        display->power_manager = wl_registry_bind(
+            registry, name, &zwlr_output_power_manager_v1_interface, required);
+    } else if (strcmp(interface, wp_viewporter_interface.name) == 0) {
+        const uint32_t required = 1;
+        if (!verify_iface_version(interface, version, required)) {
+            return;
+        }
+
+        display->viewporter = wl_registry_bind(
+            registry, name, &wp_viewporter_interface, required);
+    } else if (strcmp(interface, wp_presentation_interface.name) == 0) {
+        const uint32_t required = 1;
+        if (!verify_iface_version(interface, version, required)) {
+            return;
+        }
+
+        display->presentation = wl_registry_bind(
+            registry, name, &wp_presentation_interface, required);
+        wp_presentation_add_listener(display->presentation, &presentation_listener, display);
+    }
+}
+
+static void handle_global_remove(void *data, struct wl_registry *registry, uint32_t name)
+{
+    struct display *display = data;
+    if (traced(display)) {
+        trace_event("global_remove", "%u", name);
+    }
+
+    tll_foreach(display->outputs, it) {
+        if (it->item.wl_name == name) {
+            LOG_DEBUG("destroyed: %s %s", it->item.make, it->item.model);
+            output_destroy(&it->item);
+            tll_remove(display->outputs, it);
+            if (span) {
+                render_span(display, NULL);
+            }
+            return;
+        }
+    }
+}
+
+static const struct wl_registry_listener registry_listener = {
+    .global = &handle_global,
+    .global_remove = &handle_global_remove,
+};
+
+static const char *display_name(const struct display *display)
+{
+    return (display->name != NULL) ? display->name : "default display";
+}
+
+/* Connects to compositor and binds its globals */
+static bool display_connect(struct display *display)
+{
+    const char *name = display_name(display);
+
+    display->wl_display = wl_display_connect(display->name);
+    if (display->wl_display == NULL) {
+        LOG_ERR("%s: failed to connect to wayland; no compositor running?", name);
+        return false;
     }
 
+    display->registry = wl_display_get_registry(display->wl_display);
+    if (display->registry == NULL) {
+        LOG_ERR("%s: failed to get wayland registry", name);
+        return false;
+    }
+
+    wl_registry_add_listener(display->registry, &registry_listener, display);
+    wl_display_roundtrip(display->wl_display);
+
+    if (display->compositor == NULL) {
+        LOG_ERR("%s: no compositor", name);
+        return false;
+    }
+    if (display->shm == NULL) {
+        LOG_ERR("%s: no shared memory buffers interface", name);
+        return false;
+    }
+    if (display->layer_shell == NULL) {
+        LOG_ERR("%s: no layer shell interface", name);
+        return false;
+    }
+
+    return true;
+}
+
+static void display_destroy(struct display *display)
+{
+    tll_foreach(display->outputs, it) {
+        output_destroy(&it->item);
+        tll_remove(display->outputs, it);
+    }
+
+    shm_canvas_unref(display->span_canvas);
+
+    if (display->presentation != NULL) {
+        wp_presentation_destroy(display->presentation);
+    }
+    if (display->viewporter != NULL) {
+        wp_viewporter_destroy(display->viewporter);
+    }
+    if (display->xdg_output_manager != NULL) {
+        zxdg_output_manager_v1_destroy(display->xdg_output_manager);
+    }
+    if (display->power_manager != NULL) {
+        zwlr_output_power_manager_v1_destroy(display->power_manager);
+    }
+    if (display->layer_shell != NULL) {
+        zwlr_layer_shell_v1_destroy(display->layer_shell);
+    }
+    if (display->shm != NULL) {
+        wl_shm_destroy(display->shm);
+    }
+    if (display->compositor != NULL) {
+        wl_compositor_destroy(display->compositor);
+    }
+    if (display->registry != NULL) {
+        wl_registry_destroy(display->registry);
+    }
+    if (display->wl_display != NULL) {
+        wl_display_disconnect(display->wl_display);
+    }
+}
+
+static void *load_wbg(void *data)
+{
+    struct wbg_options *options = data;
+    struct wbg *loaded = wbg_create(options);
+    free(options);
+
+    if (eventfd_write(load_fd, 1) < 0) {
+        LOG_ERRNO("failed to signal end of loading");
+    }
+    return loaded;
+}
+
+/* Takes over result of the loading thread, and renders configured outputs */
+static bool finish_loading(void)
+{
+    void *loaded;
+    pthread_join(load_thread, &loaded);
+    loading = false;
+
+    if (loaded == NULL) {
+        return false;
+    }
+
+    /* Output threads read it under their lock */
+    tll_foreach(displays, d) {
+        tll_foreach(d->item.outputs, it) {
+            pthread_mutex_lock(&it->item.lock);
+        }
+    }
+
+    wbg = loaded;
+
+    tll_foreach(displays, d) {
+        tll_foreach(d->item.outputs, it) {
+            pthread_mutex_unlock(&it->item.lock);
+        }
+    }
+
+    if (wbg_next_change(wbg, time(NULL)) != 0) {
+        timeline_timer = loop_add_timer(loop, CLOCK_REALTIME, &timeline_expired, NULL);
+        if (timeline_timer == NULL) {
+            return false;
+        }
+
+        arm_timeline_timer();
+    }
+
+    if (wbg_period(wbg) > 0) {
+        scene_timer = loop_add_timer(loop, CLOCK_REALTIME, &scene_expired, NULL);
+        if (scene_timer == NULL) {
+            return false;
+        }
+
+        arm_scene_timer();
+    }
+
+    tll_foreach(displays, d) {
+        tll_foreach(d->item.outputs, it) {
+            struct output *output = &it->item;
+            pthread_mutex_lock(&output->lock);
+            if (output->configured && output->surf != NULL) {
+                render(output);
+            }
+            pthread_mutex_unlock(&output->lock);
+        }
+    }
+
+    /* Scaled for every output there is; outputs to come rebuild them */
+    wbg_trim(wbg);
+    return true;
+}
+
+static void loading_done(void *data, uint32_t events)
+{
+    loop_remove(load_source);
+    load_source = NULL;
+
+    if (!finish_loading()) {
+        quit_code = EXIT_FAILURE;
+    }
+}
+
+static void anim_ready(void *data, uint32_t events)
+{
+    anim_drain_fd(anim);
+    anim_tick();
+}
+
+static void anim_expired(void *data)
+{
+    anim_tick();
+}
+
+static void signal_received(void *data, uint32_t events)
+{
+    const int *sig_fd = data;
+
+    if (events & EPOLLHUP) {
+        abort();
+    }
+
+    struct signalfd_siginfo info;
+    ssize_t count = read(*sig_fd, &info, sizeof (info));
+    if (count < 0) {
+        if (errno != EINTR) {
+            LOG_ERRNO("failed to read from signal FD");
+            quit_code = EXIT_FAILURE;
+        }
+        return;
+    }
+
+    assert(count == sizeof (info));
+
+    if (info.ssi_signo == SIGUSR1) {
+        prio_dump_stats();
+        if (power_save) {
+            power_dump_stats();
+        }
+        budget_dump_stats();
+        loop_dump_stats(loop);
+    } else {
+        assert(info.ssi_signo == SIGINT || info.ssi_signo == SIGQUIT);
+
+        LOG_INFO("goodbye");
+        quit_code = EXIT_SUCCESS;
+    }
+}
+
+static void display_lost(void *data, uint32_t events)
+{
+    struct display *display = data;
+
+    if (events & EPOLLHUP) {
+        LOG_WARN("%s: disconnected by compositor", display_name(display));
+    } else {
+        LOG_ERRNO("%s: failed to dispatch Wayland events", display_name(display));
+    }
+
+    if (tll_length(displays) == 1) {
+        /* Last one is torn down on exit, after what still uses it */
+        quit_code = EXIT_FAILURE;
+        return;
+    }
+
+    loop_remove(display->source);
+    tll_foreach(displays, it) {
+        if (&it->item == display) {
+            display_destroy(display);
+            tll_remove(displays, it);
+            break;
+        }
+    }
+}
+
+static double ms_between(const struct timespec *from, const struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) * 1e3 + (to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+/*
+ * Renders the scene, as it is now, into a memory buffer and writes it to
+ * file; no compositor involved. Time of each phase is reported.
+ */
+static int render_offline(const char *path, int width, int height, int scale,
+                          struct wbg_options *options)
+{
+    int exit_code = EXIT_FAILURE;
+    struct buffer *buf = NULL;
+
+    struct timespec t[5];
+    clock_gettime(CLOCK_MONOTONIC, &t[0]);
+
+    if (have_night) {
+        options->color = night_color(&night, color, time(NULL));
+    }
+    options->image = image_path;
+
+    wbg = wbg_create(options);
+    if (wbg == NULL) {
+        goto out;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t[1]);
+
+    buf = shm_get_buffer(NULL, width * scale, height * scale, 0);
+    if (buf == NULL) {
+        goto out;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t[2]);
+
+    const struct wbg_target target = { buf->pix, buf->width, buf->height, scale, NULL };
+    wbg_render(wbg, &target);
+
+    clock_gettime(CLOCK_MONOTONIC, &t[3]);
+
+    if (!export_image(path, buf->pix)) {
+        goto out;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t[4]);
+
+    LOG_INFO("%s: %dx%d, load %.3f ms, allocate %.3f ms, render %.3f ms, write %.3f ms",
+             path, buf->width, buf->height,
+             ms_between(&t[0], &t[1]), ms_between(&t[1], &t[2]),
+             ms_between(&t[2], &t[3]), ms_between(&t[3], &t[4]));
+
+    exit_code = EXIT_SUCCESS;
+
+out:
+    shm_buffer_discard(buf);
+    wbg_unref(wbg);
+    return exit_code;
+}
+
+static void print_usage(FILE *stream, const char *prog)
+{
+    fprintf(stream,
+            "Usage: %s [OPTIONS] [COLOR] [IMAGE]\n"
+            "\n"
+            "COLOR is a CSS color (#RGB[A], #RRGGBB[AA], name, rgb(), hsl()\n"
+            "or oklch()); IMAGE is an (animated) GIF,\n"
+            "shown over COLOR where it is transparent, or a Y4M video\n"
+            "\n"
+            "Options:\n"
+            "  -s, --span        stretch the wallpaper across all outputs\n"
+            "  -d, --settle=MS   after a resize, wait until size is stable\n"
+            "                    for MS milliseconds before re-rendering\n"
+            "                    (default: %ld)\n"
+            "  -t, --timeline=FILE\n"
+            "                    change wallpaper with time of day, following\n"
+            "                    keyframes in FILE (instead of COLOR and IMAGE)\n"
+            "  -l, --location=LAT,LON\n"
+            "                    position in degrees, for sun based keyframes\n"
+            "  -o, --overlay[=FORMAT]\n"
+            "                    show text in the bottom right corner; FORMAT\n"
+            "                    is for strftime(3), {host} being the hostname\n"
+            "                    (default: \"%%H:%%M%%n{host}\")\n"
+            "  -S, --scene=FILE  add layers listed in FILE over the wallpaper\n"
+            "  -n, --night=HH:MM-HH:MM[,KELVIN]\n"
+            "                    lower color temperature of COLOR to KELVIN\n"
+            "                    (default: 3400) for the night, drifting into\n"
+            "                    it over the evening\n"
+            "  -p, --profile=MATCH=FILE\n"
+            "                    convert colors with ICC profile FILE on outputs\n"
+            "                    whose \"MAKE MODEL\" matches glob MATCH\n"
+            "  -r, --render-to=FILE\n"
+            "                    render once into FILE (.ppm, .qoi or .wbgraw)\n"
+            "                    instead of showing the wallpaper; IMAGE may\n"
+            "                    only be a GIF then\n"
+            "  -g, --size=WxH[@SCALE]\n"
+            "                    size of the render (default: 1920x1080@1)\n"
+            "  -P, --priority=idle|NICE\n"
+            "                    priority of rendering and decoding threads:\n"
+            "                    SCHED_IDLE, or nice value 1-19 (default: idle)\n"
+            "  -B, --bench       check pixel conversion kernels and color parser\n"
+            "                    against reference, and print their throughput;\n"
+            "                    count system calls per wake-up of the main loop\n"
+            "  -C, --check=FILE  decode or parse FILE under budgets of time and\n"
+            "                    memory, aborting when over them (for fuzzers)\n"
+            "  -F, --progressive show a placeholder of the average color at\n"
+            "                    once, and a low resolution preview before the\n"
+            "                    first full render\n"
+            "  -W, --power-save  release memory of outputs while they are\n"
+            "                    powered off, keeping content compressed\n"
+            "  -M, --memory=MIB  keep memory holding pixels under MIB, dropping\n"
+            "                    caches and showing less detail when over it\n"
+            "  -D, --display=NAME\n"
+            "                    connect to Wayland display NAME (instead of\n"
+            "                    $WAYLAND_DISPLAY); may be given repeatedly,\n"
+            "                    all displays sharing rendered content\n"
+            "  -R, --record=FILE write events received from the compositor\n"
+            "                    into FILE, for tools/wbg-replay.c\n"
+            "  -h, --help        show this help and exit\n",
+            prog, settle_ms);
+}
+
+int main(int argc, char *const *argv)
+{
+    static const struct option longopts[] = {
+        { "span",     no_argument,       NULL, 's' },
+        { "settle",   required_argument, NULL, 'd' },
+        { "timeline", required_argument, NULL, 't' },
+        { "location", required_argument, NULL, 'l' },
+        { "overlay",  optional_argument, NULL, 'o' },
+        { "scene",    required_argument, NULL, 'S' },
+        { "night",    required_argument, NULL, 'n' },
+        { "profile",  required_argument, NULL, 'p' },
+        { "render-to", required_argument, NULL, 'r' },
+        { "size",     required_argument, NULL, 'g' },
+        { "display",  required_argument, NULL, 'D' },
+        { "record",   required_argument, NULL, 'R' },
+        { "priority", required_argument, NULL, 'P' },
+        { "progressive", no_argument,    NULL, 'F' },
+        { "power-save", no_argument,     NULL, 'W' },
+        { "memory",   required_argument, NULL, 'M' },
+        { "bench",    no_argument,       NULL, 'B' },
+        { "check",    required_argument, NULL, 'C' },
+        { "help",     no_argument,       NULL, 'h' },
+        { NULL,       0,                 NULL, 0 },
+    };
+
+    struct wbg_options options = { 0 };
+    const char *render_to = NULL;
+    const char *record = NULL;
+    int render_width = 1920;
+    int render_height = 1080;
+    int render_scale = 1;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "sd:t:l:o::S:n:p:r:g:D:R:P:FBC:WM:h", longopts, NULL)) != -1) {
+        switch (opt) {
+            case 's':
+                span = true;
+                break;
+            case 'd': {
+                char *end;
+                errno = 0;
+                settle_ms = strtol(optarg, &end, 10);
+                if (errno != 0 || *end != '\0' || settle_ms < 0) {
+                    LOG_ERR("invalid settle time: %s", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            }
+            case 't':
+                options.timeline = optarg;
+                break;
+            case 'l': {
+                char trailing;
+                if (sscanf(optarg, "%lf,%lf%c",
+                           &options.latitude, &options.longitude, &trailing) != 2 ||
+                    options.latitude < -90 || options.latitude > 90 ||
+                    options.longitude < -180 || options.longitude > 180) {
+                    LOG_ERR("invalid location: %s", optarg);
+                    return EXIT_FAILURE;
+                }
+                options.has_location = true;
+                break;
+            }
+            case 'o':
+                options.overlay = (optarg != NULL) ? optarg : "%H:%M%n{host}";
+                break;
+            case 'S':
+                options.scene = optarg;
+                break;
+            case 'n':
+                if (!night_parse(optarg, &night)) {
+                    LOG_ERR("invalid night shift: %s", optarg);
+                    return EXIT_FAILURE;
+                }
+                have_night = true;
+                break;
+            case 'p': {
+                const char *sep = strrchr(optarg, '=');
+                if (sep == NULL || sep == optarg || sep[1] == '\0') {
+                    LOG_ERR("invalid profile: %s (expected MATCH=FILE)", optarg);
+                    return EXIT_FAILURE;
+                }
+
+                tll_push_back(profiles, ((struct profile){
+                    .match = strndup(optarg, sep - optarg), .path = sep + 1,
+                }));
+                break;
+            }
+            case 'r':
+                render_to = optarg;
+                break;
+            case 'g': {
+                int len = 0;
+                char trailing;
+                render_scale = 1;
+                if (sscanf(optarg, "%dx%d%n", &render_width, &render_height, &len) != 2 ||
+                    (optarg[len] == '@' && sscanf(optarg + len, "@%d%c", &render_scale, &trailing) != 1) ||
+                    (optarg[len] != '@' && optarg[len] != '\0') ||
+                    render_width <= 0 || render_height <= 0 || render_scale <= 0 ||
+                    render_width > 16384 || render_height > 16384 || render_scale > 8) {
+                    LOG_ERR("invalid size: %s", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            }
+            case 'P':
+                if (!prio_parse(optarg)) {
+                    LOG_ERR("invalid priority: %s (expected idle or 1-19)", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'F':
+                progressive = true;
+                break;
+            case 'W':
+                power_save = true;
+                break;
+            case 'M': {
+                char *end;
+                errno = 0;
+                const long mib = strtol(optarg, &end, 10);
+                if (errno != 0 || *end != '\0' || mib <= 0 || (unsigned long)mib > SIZE_MAX >> 20) {
+                    LOG_ERR("invalid memory budget: %s", optarg);
+                    return EXIT_FAILURE;
+                }
+                budget_set_limit((size_t)mib << 20);
+                break;
+            }
+            case 'B':
+                return (pixconv_bench() && color_bench() && loop_bench()) ? EXIT_SUCCESS : EXIT_FAILURE;
+            case 'C':
+                return check_file(optarg) ? EXIT_SUCCESS : EXIT_FAILURE;
+            case 'D':
+                tll_push_back(displays, ((struct display){ .name = optarg }));
+                break;
+            case 'R':
+                record = optarg;
+                break;
+            case 'h':
+                print_usage(stdout, argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                print_usage(stderr, argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    for (int i = optind; i < argc; ++i) {
+        /* Names are colors unless there is such a file; what looks like a
+         * color but is neither is reported as one */
+        pixman_color_t parsed;
+        const char *err = color_parse_error(argv[i], &parsed);
+        if (err == NULL && (argv[i][0] == '#' || access(argv[i], F_OK) != 0)) {
+            color = parsed;
+        } else if (err != NULL && (argv[i][0] == '#' || strchr(argv[i], '(') != NULL) &&
+                   access(argv[i], F_OK) != 0) {
+            LOG_ERR("invalid color: %s: %s", argv[i], err);
+            return EXIT_FAILURE;
+        } else {
+            image_path = argv[i];
+        }
+    }
+
+    if (render_to != NULL) {
+        options.color = color;
+        return render_offline(render_to, render_width, render_height, render_scale, &options);
+    }
+
+    if (options.timeline != NULL && image_path != NULL) {
+        LOG_WARN("image is not used with a timeline; ignoring");
+        image_path = NULL;
+    }
+
+    if (span && image_path != NULL) {
+        LOG_WARN("span mode is not supported for animations; ignoring");
+        span = false;
+    }
+
+    if (tll_length(displays) > 1 && image_path != NULL) {
+        LOG_WARN("animations are played on a single display; ignoring all but %s",
+                 tll_front(displays).name);
+        while (tll_length(displays) > 1) {
+            tll_pop_back(displays);
+        }
+    }
+
+    if (tll_length(displays) == 0) {
+        tll_push_back(displays, ((struct display){ .name = NULL }));
+    }
+
+    if ((options.overlay != NULL || options.scene != NULL) && image_path != NULL) {
+        LOG_WARN("overlay and scene are not supported for animations; ignoring");
+        options.overlay = NULL;
+        options.scene = NULL;
+    }
+
+    if (have_night && (options.timeline != NULL || image_path != NULL ||
+                       options.scene != NULL || options.overlay != NULL)) {
+        LOG_WARN("night shift is supported only for a solid color; ignoring");
+        have_night = false;
+    }
+
+    if (tll_length(profiles) > 0 && (span || image_path != NULL)) {
+        LOG_WARN("color profiles are not supported in span mode nor for animations; ignoring");
+        tll_foreach(profiles, it) {
+            free(it->item.match);
+            tll_remove(profiles, it);
+        }
+    }
+
+    setlocale(LC_CTYPE, "");
+
+    LOG_INFO("%s v%s", argv[0], WBG_VERSION);
+
+    int exit_code = EXIT_FAILURE;
+    int sig_fd = -1;
+
+    /* Blocked before any thread is started, so that all inherit it */
     sigset_t mask;
     sigemptyset(&mask);
     sigaddset(&mask, SIGINT);
     sigaddset(&mask, SIGQUIT);
+    sigaddset(&mask, SIGUSR1);
 
     sigprocmask(SIG_BLOCK, &mask, NULL);
 
-    if ((sig_fd = signalfd(-1, &mask, 0)) < 0) {
-        LOG_ERRNO("failed to create signal FD");
+    loop = loop_create();
+    if (loop == NULL) {
         goto out;
     }
 
-    while (true) {
-        wl_display_flush(display);
+    rerender_timer = loop_add_timer(loop, CLOCK_MONOTONIC, &rerender_stale, NULL);
+    if (rerender_timer == NULL) {
+        LOG_WARN("no re-render timer; resizes will re-render immediately");
+    }
 
-        struct pollfd fds[] = {
-            { .fd = wl_display_get_fd(display), .events = POLLIN },
-            { .fd = sig_fd, .events = POLLIN },
-        };
-        int ret = poll(fds, sizeof (fds) / sizeof (fds[0]), -1);
+    /* Before connecting, so that the trace starts with the globals */
+    if (record != NULL && !trace_open(record)) {
+        goto out;
+    }
 
-        if (ret < 0) {
-            if (errno == EINTR) {
-                continue;
-            }
+    tll_foreach(displays, it) {
+        if (!display_connect(&it->item)) {
+            goto out;
+        }
+    }
 
-            LOG_ERRNO("failed to poll");
-            break;
+    /* Outputs are matched once their make and model are known */
+    tll_foreach(profiles, it) {
+        it->item.lut = icc_load(it->item.path);
+        if (it->item.lut == NULL) {
+            goto out;
         }
+    }
 
-        if (fds[0].revents & POLLHUP) {
-            LOG_WARN("disconnected by compositor");
-            break;
+    /* Decoding images, possibly while the session is starting up */
+    load_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (load_fd < 0) {
+        LOG_ERRNO("failed to create eventfd");
+        goto out;
+    }
+
+    struct wbg_options *load_options = malloc(sizeof (*load_options));
+    *load_options = options;
+    load_options->color = color;
+
+    /* Before any output is configured */
+    if (progressive && !wbg_guess_color(load_options, &placeholder)) {
+        free(load_options);
+        goto out;
+    }
+
+    load_source = loop_add_fd(loop, load_fd, EPOLLIN, &loading_done, NULL);
+    if (load_source == NULL) {
+        free(load_options);
+        goto out;
+    }
+
+    if (!prio_spawn("wbg-load", &load_wbg, load_options, &load_thread)) {
+        free(load_options);
+        goto out;
+    }
+    loading = true;
+
+    if (have_night) {
+        night_timer = loop_add_timer(loop, CLOCK_REALTIME, &night_tick, NULL);
+        if (night_timer == NULL) {
+            goto out;
         }
 
-        if (fds[0].revents & POLLIN) {
-            if (wl_display_dispatch(display) < 0) {
-                LOG_ERRNO("failed to dispatch Wayland events");
-                break;
-            }
+        arm_night_timer();
+    }
+
+    if (image_path != NULL) {
+        const uint32_t bg = 0xff000000u |
+                            (uint32_t)(color.red >> 8) << 16 |
+                            (uint32_t)(color.green >> 8) << 8 |
+                            (uint32_t)(color.blue >> 8);
+
+        struct display *display = &tll_front(displays);
+
+        anim = anim_load(display->shm, image_path, bg);
+        if (anim == NULL) {
+            goto out;
         }
 
-        if (fds[1].revents & POLLHUP) {
-            abort();
+        /* Clock ID is sent in response to the bind; timer must use it */
+        if (display->presentation != NULL) {
+            wl_display_roundtrip(display->wl_display);
         }
 
-        if (fds[1].revents & POLLIN) {
-            struct signalfd_siginfo info;
-            ssize_t count = read(sig_fd, &info, sizeof (info));
-            if (count < 0) {
-                if (errno == EINTR) {
-                    continue;
-                }
+        anim_timer = loop_add_timer(loop, anim_clock, &anim_expired, NULL);
+        if (anim_timer == NULL ||
+            loop_add_fd(loop, anim_fd(anim), EPOLLIN, &anim_ready, NULL) == NULL) {
+            goto out;
+        }
+    }
 
-                LOG_ERRNO("failed to read from signal FD");
-                break;
-            }
+    tll_foreach(displays, it) {
+        struct display *display = &it->item;
 
-            assert(count == sizeof (info));
-            assert(info.ssi_signo == SIGINT || info.ssi_signo == SIGQUIT);
+        tll_foreach(display->outputs, o) {
+            pthread_mutex_lock(&o->item.lock);
+            add_xdg_output(&o->item);
+            add_output_power(&o->item);
+            add_surface_to_output(&o->item);
+            pthread_mutex_unlock(&o->item.lock);
+        }
 
-            LOG_INFO("goodbye");
-            exit_code = EXIT_SUCCESS;
-            break;
+        wl_display_roundtrip(display->wl_display);
+
+        if (!display->have_xrgb8888) {
+            LOG_ERR("%s: shm: XRGB image format not available", display_name(display));
+            goto out;
         }
     }
 
-out:
+    if ((sig_fd = signalfd(-1, &mask, 0)) < 0) {
+        LOG_ERRNO("failed to create signal FD");
+        goto out;
+    }
 
-    if (sig_fd >= 0) {
-        close(sig_fd);
+    if (loop_add_fd(loop, sig_fd, EPOLLIN, &signal_received, &sig_fd) == NULL) {
+        goto out;
+    }
+
+    tll_foreach(displays, it) {
+        it->item.source = loop_add_wayland(loop, it->item.wl_display, &display_lost, &it->item);
+        if (it->item.source == NULL) {
+            goto out;
+        }
     }
 
-    tll_foreach(outputs, it)
-    output_destroy(&it->item);
-    tll_free(outputs);
+    while (quit_code < 0 && loop_dispatch(loop)) {
+    }
 
-    if (layer_shell != NULL) {
-        zwlr_layer_shell_v1_destroy(layer_shell);
+    if (quit_code >= 0) {
+        exit_code = quit_code;
     }
-    if (shm != NULL) {
-        wl_shm_destroy(shm);
+
+out:
+
+    if (sig_fd >= 0) {
+        close(sig_fd);
     }
-    if (compositor != NULL) {
-        wl_compositor_destroy(compositor);
+
+    if (loading) {
+        /* Not worth waiting for; dies with the process */
+        pthread_detach(load_thread);
+    } else if (load_fd >= 0) {
+        close(load_fd);
     }
-    if (registry != NULL) {
-        wl_registry_destroy(registry);
+
+    /* Animation buffers belong to the first connection */
+    anim_destroy(anim);
+
+    tll_foreach(displays, it) {
+        display_destroy(&it->item);
+        tll_remove(displays, it);
     }
-    if (display != NULL) {
-        wl_display_disconnect(display);
+
+    /* Timers with it, once no output thread may arm them */
+    loop_destroy(loop);
+
+    trace_close();
+    wbg_unref(wbg);
+
+    tll_foreach(profiles, it) {
+        free(it->item.match);
+        icc_destroy(it->item.lut);
+        tll_remove(profiles, it);
     }
 
     return exit_code;
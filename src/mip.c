@@ -0,0 +1,222 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#include "mip.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "budget.h"
+#include "log.h"
+#include "render.h"
+
+/* Down to a few pixels; enough for any cover scale */
+#define MIP_LEVELS 16
+
+struct mip {
+    pixman_image_t *levels[MIP_LEVELS]; /* levels[0] is the base */
+    int count;                          /* levels built, base included */
+
+    size_t bytes;                       /* of levels but the base */
+    size_t peak;
+
+    pixman_image_t *fx;                 /* level with effects applied */
+    int fx_width;                       /* size it was scaled to */
+    int fx_height;
+};
+
+struct mip *mip_create(pixman_image_t *base)
+{
+    struct mip *mip = calloc(1, sizeof (*mip));
+    mip->levels[0] = base;
+    mip->count = 1;
+    return mip;
+}
+
+void mip_destroy(struct mip *mip)
+{
+    if (mip == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < mip->count; ++i) {
+        pixman_image_unref(mip->levels[i]);
+    }
+    if (mip->fx != NULL) {
+        pixman_image_unref(mip->fx);
+    }
+    free(mip);
+}
+
+/*
+ * Averages each 2x2 block of x8r8g8b8 pixels into one; an odd last row or
+ * column is dropped. Two channels are summed at once, in 16-bit lanes of
+ * a 32-bit word (at most 4 * 255 + 2, so they do not carry into each other).
+ */
+static void halve(const uint32_t *src, int src_stride, uint32_t *dst, int dst_stride,
+                  int width, int height)
+{
+    const uint32_t mask = 0x00ff00ff;
+    const uint32_t round = 0x00020002;
+
+    for (int y = 0; y < height; ++y) {
+        const uint32_t *restrict r0 = src + (size_t)(2 * y) * src_stride;
+        const uint32_t *restrict r1 = r0 + src_stride;
+        uint32_t *restrict out = dst + (size_t)y * dst_stride;
+
+        for (int x = 0; x < width; ++x) {
+            const uint32_t a = r0[2 * x];
+            const uint32_t b = r0[2 * x + 1];
+            const uint32_t c = r1[2 * x];
+            const uint32_t d = r1[2 * x + 1];
+
+            const uint32_t rb = (a & mask) + (b & mask) + (c & mask) + (d & mask) + round;
+            const uint32_t xg = ((a >> 8) & mask) + ((b >> 8) & mask) +
+                                ((c >> 8) & mask) + ((d >> 8) & mask) + round;
+
+            out[x] = ((rb >> 2) & mask) | ((xg >> 2) & mask) << 8;
+        }
+    }
+}
+
+static bool build_level(struct mip *mip)
+{
+    pixman_image_t *src = mip->levels[mip->count - 1];
+    const int width = pixman_image_get_width(src) / 2;
+    const int height = pixman_image_get_height(src) / 2;
+
+    /* Over budget, the level above is scaled from instead */
+    pixman_image_t *dst = budget_image_create(BUDGET_PYRAMIDS, PIXMAN_x8r8g8b8,
+                                              width, height, false);
+    if (dst == NULL) {
+        LOG_WARN("mip: failed to allocate %dx%d level", width, height);
+        return false;
+    }
+
+    halve(pixman_image_get_data(src), pixman_image_get_stride(src) / sizeof (uint32_t),
+          pixman_image_get_data(dst), pixman_image_get_stride(dst) / sizeof (uint32_t),
+          width, height);
+
+    mip->levels[mip->count++] = dst;
+    mip->bytes += (size_t)pixman_image_get_stride(dst) * height;
+    if (mip->bytes > mip->peak) {
+        mip->peak = mip->bytes;
+    }
+    return true;
+}
+
+pixman_image_t *mip_level(struct mip *mip, int width, int height)
+{
+    const int base_width = pixman_image_get_width(mip->levels[0]);
+    const int base_height = pixman_image_get_height(mip->levels[0]);
+    int level = 0;
+
+    while (level + 1 < MIP_LEVELS) {
+        const int w = base_width >> (level + 1);
+        const int h = base_height >> (level + 1);
+        if (w < width || h < height || w == 0 || h == 0) {
+            break; /* next one would have to be upscaled */
+        }
+
+        if (level + 1 >= mip->count && !build_level(mip)) {
+            break;
+        }
+        level++;
+    }
+
+    return mip->levels[level];
+}
+
+void mip_render(struct mip *mip, pixman_image_t *dst, int width, int height)
+{
+    pixman_image_t *src = mip_level(mip, width, height);
+    render_scaled(src, pixman_image_get_width(src), pixman_image_get_height(src),
+                  dst, width, height);
+}
+
+void mip_render_fx(struct mip *mip, const struct fx *fx, pixman_image_t *dst,
+                   int width, int height)
+{
+    if (!fx_any(fx)) {
+        mip_render(mip, dst, width, height);
+        return;
+    }
+
+    if (mip->fx != NULL && mip->fx_width == width && mip->fx_height == height) {
+        render_scaled(mip->fx, pixman_image_get_width(mip->fx), pixman_image_get_height(mip->fx),
+                      dst, width, height);
+        return;
+    }
+
+    if (mip->fx != NULL) {
+        pixman_image_unref(mip->fx);
+        mip->fx = NULL;
+    }
+
+    /* Blur leaves no detail for the levels in between */
+    const int reduction = fx_reduction(fx);
+    pixman_image_t *src = mip_level(mip, (width + reduction - 1) / reduction,
+                                    (height + reduction - 1) / reduction);
+    const int src_width = pixman_image_get_width(src);
+    const int src_height = pixman_image_get_height(src);
+
+    /* What render_scaled() shows of it */
+    const double sx = (double)width / src_width;
+    const double sy = (double)height / src_height;
+    const double s = (sx > sy) ? sx : sy;
+    const int visible_width = (int)(width / s + 0.5);
+    const int visible_height = (int)(height / s + 0.5);
+    const pixman_box32_t visible = {
+        (src_width - visible_width) / 2, (src_height - visible_height) / 2,
+        (src_width + visible_width) / 2, (src_height + visible_height) / 2,
+    };
+
+    pixman_image_t *pix = budget_image_create(BUDGET_FLATTENED, PIXMAN_x8r8g8b8,
+                                              src_width, src_height, false);
+    if (pix == NULL || !fx_apply(fx, src, pix, s, &visible)) {
+        LOG_WARN("mip: rendering %dx%d image without effects", src_width, src_height);
+        if (pix != NULL) {
+            pixman_image_unref(pix);
+        }
+        mip_render(mip, dst, width, height);
+        return;
+    }
+
+    mip->fx = pix;
+    mip->fx_width = width;
+    mip->fx_height = height;
+    render_scaled(pix, src_width, src_height, dst, width, height);
+}
+
+void mip_trim(struct mip *mip)
+{
+    if (mip->count == 1) {
+        return;
+    }
+
+    LOG_INFO("mip: released %d levels of %dx%d image, %zu KiB at peak",
+             mip->count - 1,
+             pixman_image_get_width(mip->levels[0]), pixman_image_get_height(mip->levels[0]),
+             mip->peak / 1024);
+
+    for (int i = 1; i < mip->count; ++i) {
+        pixman_image_unref(mip->levels[i]);
+        mip->levels[i] = NULL;
+    }
+    mip->count = 1;
+    mip->bytes = 0;
+}
+
+void mip_release(struct mip *mip)
+{
+    mip_trim(mip);
+
+    if (mip->fx != NULL) {
+        pixman_image_unref(mip->fx);
+        mip->fx = NULL;
+    }
+}
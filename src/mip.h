@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#ifndef MIP_H_
+#define MIP_H_
+
+#include <pixman.h>
+
+#include "fx.h"
+
+/*
+ * Image along with copies of it halved again and again (2x2 box filter),
+ * so that each output size is scaled from the nearest level at least as
+ * large instead of from the full size: fewer pixels to filter, and no
+ * aliasing of bilinear filtering over more than 2x2 source pixels.
+ * Levels are built when first needed; together they take at most a third
+ * of the memory of the base image, and are released by mip_trim().
+ */
+struct mip;
+
+/* Takes over reference to x8r8g8b8 `base` */
+struct mip *mip_create(pixman_image_t *base);
+void mip_destroy(struct mip *mip);
+
+/* Smallest level still covering width by height without upscaling (the
+ * base if none does) */
+pixman_image_t *mip_level(struct mip *mip, int width, int height);
+
+/* Scales image to cover `dst`, from the nearest level */
+void mip_render(struct mip *mip, pixman_image_t *dst, int width, int height);
+
+/* Same with effects, applied to the smallest level they allow; the
+ * result is kept for the next render at the same size */
+void mip_render_fx(struct mip *mip, const struct fx *fx, pixman_image_t *dst,
+                   int width, int height);
+
+/* Releases all levels but the base; logs their peak memory */
+void mip_trim(struct mip *mip);
+
+/* Also releases the result of effects */
+void mip_release(struct mip *mip);
+
+#endif // MIP_H_
@@ -0,0 +1,131 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#include "night.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "color.h"
+
+/* Minutes over which the temperature drifts, before and after the night */
+#define NIGHT_EVENING 120
+#define NIGHT_MORNING 30
+
+/* Coarse probing step when looking for the next change, in seconds */
+#define NIGHT_PROBE 60
+
+#define DAY_MINUTES (24 * 60)
+
+static bool parse_clock(const char *str, int *minutes, int *len)
+{
+    int hours, mins;
+    if (sscanf(str, "%2d:%2d%n", &hours, &mins, len) != 2 ||
+        hours < 0 || hours > 23 || mins < 0 || mins > 59) {
+        return false;
+    }
+    *minutes = hours * 60 + mins;
+    return true;
+}
+
+bool night_parse(const char *spec, struct night *night)
+{
+    int len;
+    if (!parse_clock(spec, &night->start, &len) || spec[len] != '-') {
+        return false;
+    }
+    spec += len + 1;
+
+    if (!parse_clock(spec, &night->end, &len)) {
+        return false;
+    }
+    spec += len;
+
+    night->kelvin = 3400;
+    if (*spec == '\0') {
+        return true;
+    }
+
+    int kelvin;
+    char trailing;
+    if (sscanf(spec, ",%d%c", &kelvin, &trailing) != 1 ||
+        kelvin < 1000 || kelvin > NIGHT_KELVIN_DAY) {
+        return false;
+    }
+
+    night->kelvin = kelvin;
+    return true;
+}
+
+/* Minutes from `from` to `to`, going forward across midnight */
+static double minutes_between(double from, double to)
+{
+    return fmod(to - from + DAY_MINUTES, DAY_MINUTES);
+}
+
+double night_temperature(const struct night *night, time_t t)
+{
+    struct tm tm;
+    localtime_r(&t, &tm);
+    const double now = tm.tm_hour * 60 + tm.tm_min + tm.tm_sec / 60.0;
+
+    const double length = minutes_between(night->start, night->end);
+    const double since_start = minutes_between(night->start, now);
+    const double since_end = minutes_between(night->end, now);
+    const double until_start = minutes_between(now, night->start);
+
+    /* Weight of the night temperature */
+    double w = 0;
+    if (since_start < length) {
+        w = 1;
+    } else if (since_end < NIGHT_MORNING) {
+        w = 1 - since_end / NIGHT_MORNING;
+    } else if (until_start < NIGHT_EVENING) {
+        w = 1 - until_start / NIGHT_EVENING;
+    }
+
+    /* Mireds are (roughly) perceptually uniform */
+    const double day = 1e6 / NIGHT_KELVIN_DAY;
+    const double dark = 1e6 / night->kelvin;
+    return 1e6 / (day + (dark - day) * w);
+}
+
+pixman_color_t night_color(const struct night *night, pixman_color_t color, time_t t)
+{
+    return color_temperature(color, night_temperature(night, t));
+}
+
+static uint32_t quantized(const struct night *night, pixman_color_t color, time_t t)
+{
+    const pixman_color_t c = night_color(night, color, t);
+    return (uint32_t)(c.red >> 8) << 16 | (uint32_t)(c.green >> 8) << 8 | (c.blue >> 8);
+}
+
+time_t night_next_change(const struct night *night, pixman_color_t color, time_t now)
+{
+    const uint32_t current = quantized(night, color, now);
+
+    /* Drift is slow; probe coarsely, then narrow down to the second */
+    time_t lo = now;
+    time_t hi = now + NIGHT_PROBE;
+    while (quantized(night, color, hi) == current) {
+        lo = hi;
+        hi += NIGHT_PROBE;
+        if (hi - now > 24 * 60 * 60) {
+            return hi; /* nothing changes; re-check once a day */
+        }
+    }
+
+    while (hi - lo > 1) {
+        const time_t mid = lo + (hi - lo) / 2;
+        if (quantized(night, color, mid) == current) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return hi;
+}
@@ -0,0 +1,37 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#ifndef NIGHT_H_
+#define NIGHT_H_
+
+#include <stdbool.h>
+#include <time.h>
+
+#include <pixman.h>
+
+/* Colour temperature of daylight, i.e. no tint */
+#define NIGHT_KELVIN_DAY 6500
+
+/*
+ * Night shift: colour temperature is lowered to `kelvin` for the night,
+ * drifting into it over the evening, and back out of it in the morning.
+ */
+struct night {
+    int start; /* minutes since midnight */
+    int end;
+    double kelvin;
+};
+
+/* Parses `HH:MM-HH:MM[,KELVIN]` */
+bool night_parse(const char *spec, struct night *night);
+
+double night_temperature(const struct night *night, time_t t);
+
+/* `color` as tinted at `t` */
+pixman_color_t night_color(const struct night *night, pixman_color_t color, time_t t);
+
+/* Next wall-clock second at which the tinted `color`, in 8 bits, changes */
+time_t night_next_change(const struct night *night, pixman_color_t color, time_t now);
+
+#endif // NIGHT_H_
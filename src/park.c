@@ -0,0 +1,222 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#include "park.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "budget.h"
+
+/*
+ * Stream of 32-bit words, each starting an op: its kind in the top two
+ * bits, count in the rest. Runs and literals do not cross rows.
+ */
+enum op {
+    OP_LITERAL = 0, /* `count` pixels follow */
+    OP_RUN = 1,     /* next pixel, `count` times */
+    OP_ROWS = 2,    /* `count` copies of the row above */
+};
+
+#define OP_SHIFT 30
+#define OP_COUNT_MAX ((1u << OP_SHIFT) - 1)
+
+/* Runs shorter than this are cheaper as part of a literal */
+#define RUN_MIN 3
+
+struct park {
+    int width;
+    int height;
+    size_t words;
+    uint32_t data[];
+};
+
+struct encoder {
+    uint32_t *out;
+    size_t words;
+    size_t max;
+};
+
+static bool emit(struct encoder *e, enum op op, uint32_t count, const uint32_t *pixels, size_t n)
+{
+    if (e->words + 1 + n > e->max) {
+        return false;
+    }
+
+    e->out[e->words++] = (uint32_t)op << OP_SHIFT | count;
+    if (n > 0) {
+        memcpy(e->out + e->words, pixels, n * sizeof (uint32_t));
+        e->words += n;
+    }
+    return true;
+}
+
+static bool encode_row(struct encoder *e, const uint32_t *row, int width)
+{
+    int lit = 0; /* start of pending literal */
+    int x = 0;
+
+    while (x < width) {
+        int run = 1;
+        while (x + run < width && row[x + run] == row[x]) {
+            run++;
+        }
+
+        if (run < RUN_MIN) {
+            x += run;
+            continue;
+        }
+
+        if (x > lit && !emit(e, OP_LITERAL, x - lit, row + lit, x - lit)) {
+            return false;
+        }
+        if (!emit(e, OP_RUN, run, row + x, 1)) {
+            return false;
+        }
+
+        x += run;
+        lit = x;
+    }
+
+    return x == lit || emit(e, OP_LITERAL, x - lit, row + lit, x - lit);
+}
+
+struct park *park_store(const void *pixels, int width, int height, int stride)
+{
+    const size_t max = (size_t)width * height / 4;
+    if (width <= 0 || height <= 0 || (uint32_t)width > OP_COUNT_MAX) {
+        return NULL;
+    }
+
+    const size_t reserved = sizeof (struct park) + max * sizeof (uint32_t);
+    if (!budget_reserve(BUDGET_PARKED, reserved)) {
+        return NULL;
+    }
+
+    struct park *park = malloc(reserved);
+    if (park == NULL) {
+        budget_release(BUDGET_PARKED, reserved);
+        return NULL;
+    }
+
+    struct encoder e = { .out = park->data, .max = max };
+    const uint8_t *base = pixels;
+
+    for (int y = 0; y < height;) {
+        const uint32_t *row = (const uint32_t *)(base + (size_t)y * stride);
+
+        /* Rows equal to the one above, all at once */
+        int same = 0;
+        while (y > 0 && y + same < height &&
+               memcmp(base + (size_t)(y + same) * stride,
+                      base + (size_t)(y - 1) * stride, (size_t)width * 4) == 0) {
+            same++;
+        }
+
+        if (same > 0) {
+            if (!emit(&e, OP_ROWS, same, NULL, 0)) {
+                goto fail;
+            }
+            y += same;
+            continue;
+        }
+
+        if (!encode_row(&e, row, width)) {
+            goto fail;
+        }
+        y++;
+    }
+
+    park->width = width;
+    park->height = height;
+    park->words = e.words;
+
+    /* Give back what was reserved for the worst case */
+    budget_release(BUDGET_PARKED, reserved - park_size(park));
+    struct park *shrunk = realloc(park, park_size(park));
+    return (shrunk != NULL) ? shrunk : park;
+
+fail:
+    budget_release(BUDGET_PARKED, reserved);
+    free(park);
+    return NULL;
+}
+
+void park_free(struct park *park)
+{
+    if (park != NULL) {
+        budget_release(BUDGET_PARKED, park_size(park));
+    }
+    free(park);
+}
+
+int park_width(const struct park *park)
+{
+    return park->width;
+}
+
+int park_height(const struct park *park)
+{
+    return park->height;
+}
+
+size_t park_size(const struct park *park)
+{
+    return sizeof (*park) + park->words * sizeof (uint32_t);
+}
+
+/* By doubling copies, which unlike a plain loop are vectorized at -O2 */
+static void fill(uint32_t *dst, uint32_t pixel, size_t count)
+{
+    dst[0] = pixel;
+    for (size_t done = 1; done < count;) {
+        const size_t n = (done < count - done) ? done : count - done;
+        memcpy(dst + done, dst, n * sizeof (uint32_t));
+        done += n;
+    }
+}
+
+void park_restore(const struct park *park, void *pixels, int stride)
+{
+    uint8_t *base = pixels;
+    const uint32_t *in = park->data;
+    const uint32_t *end = in + park->words;
+    const size_t row_bytes = (size_t)park->width * 4;
+
+    int y = 0;
+    int x = 0;
+
+    while (in < end) {
+        const enum op op = in[0] >> OP_SHIFT;
+        const uint32_t count = in[0] & OP_COUNT_MAX;
+        uint32_t *row = (uint32_t *)(base + (size_t)y * stride);
+        in++;
+
+        switch (op) {
+            case OP_LITERAL:
+                memcpy(row + x, in, count * sizeof (uint32_t));
+                in += count;
+                x += count;
+                break;
+
+            case OP_RUN:
+                fill(row + x, in[0], count);
+                in++;
+                x += count;
+                break;
+
+            case OP_ROWS:
+                for (uint32_t i = 0; i < count; ++i, ++y) {
+                    memcpy(base + (size_t)y * stride, base + (size_t)(y - 1) * stride, row_bytes);
+                }
+                break;
+        }
+
+        if (x == park->width) {
+            x = 0;
+            y++;
+        }
+    }
+}
@@ -0,0 +1,32 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#ifndef PARK_H_
+#define PARK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Compressed copy of rendered pixels, kept in place of a buffer while
+ * nobody looks at it. Wallpapers are mostly made of runs of a pixel
+ * (solid colors, rows of a vertical gradient, stripes) and of rows equal
+ * to the one above (horizontal gradients); those are all it encodes, so
+ * that both ways run at about the speed of memory.
+ */
+struct park;
+
+/* NULL if pixels do not compress to at most a quarter of their size */
+struct park *park_store(const void *pixels, int width, int height, int stride);
+void park_free(struct park *park);
+
+int park_width(const struct park *park);
+int park_height(const struct park *park);
+
+/* Bytes taken by the compressed copy */
+size_t park_size(const struct park *park);
+
+void park_restore(const struct park *park, void *pixels, int stride);
+
+#endif // PARK_H_
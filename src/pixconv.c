@@ -0,0 +1,565 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#include "pixconv.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+ #include <immintrin.h>
+#elif defined(__aarch64__)
+ #include <arm_neon.h>
+#endif
+
+/* 4x4 Bayer matrix, as thresholds added to 16-bit values before dropping
+ * the low 8 bits */
+static const uint16_t dither[4][4] = {
+    {   8, 136,  40, 168 },
+    { 200,  72, 232, 104 },
+    {  56, 184,  24, 152 },
+    { 248, 120, 216,  88 },
+};
+
+/* Reference implementations; SIMD kernels below must match them exactly */
+
+static void rgba_scalar(uint32_t *dst, const void *src, int width, int y)
+{
+    const uint8_t *s = src;
+    for (int i = 0; i < width; ++i, s += 4) {
+        dst[i] = (uint32_t)s[3] << 24 | (uint32_t)s[0] << 16 | (uint32_t)s[1] << 8 | s[2];
+    }
+}
+
+static void bgra_scalar(uint32_t *dst, const void *src, int width, int y)
+{
+    const uint8_t *s = src;
+    for (int i = 0; i < width; ++i, s += 4) {
+        dst[i] = (uint32_t)s[3] << 24 | (uint32_t)s[2] << 16 | (uint32_t)s[1] << 8 | s[0];
+    }
+}
+
+static void rgb_scalar(uint32_t *dst, const void *src, int width, int y)
+{
+    const uint8_t *s = src;
+    for (int i = 0; i < width; ++i, s += 3) {
+        dst[i] = 0xff000000u | (uint32_t)s[0] << 16 | (uint32_t)s[1] << 8 | s[2];
+    }
+}
+
+/* c * a / 255, rounded; exact for all 8-bit c and a */
+static inline uint32_t mul_div255(uint32_t c, uint32_t a)
+{
+    const uint32_t t = c * a + 128;
+    return (t + (t >> 8)) >> 8;
+}
+
+static void premultiply_scalar(uint32_t *dst, const void *src, int width, int y)
+{
+    const uint32_t *s = src;
+    for (int i = 0; i < width; ++i) {
+        const uint32_t p = s[i];
+        const uint32_t a = p >> 24;
+        dst[i] = a << 24 |
+                 mul_div255((p >> 16) & 0xff, a) << 16 |
+                 mul_div255((p >> 8) & 0xff, a) << 8 |
+                 mul_div255(p & 0xff, a);
+    }
+}
+
+static inline uint32_t dither_u16(uint32_t v, uint32_t t)
+{
+    v += t;
+    return ((v > 0xffff) ? 0xffff : v) >> 8;
+}
+
+static void rgba16_scalar(uint32_t *dst, const void *src, int width, int y)
+{
+    const uint16_t *s = src;
+    for (int i = 0; i < width; ++i, s += 4) {
+        const uint32_t t = dither[y & 3][i & 3];
+        dst[i] = dither_u16(s[3], t) << 24 | dither_u16(s[0], t) << 16 |
+                 dither_u16(s[1], t) << 8 | dither_u16(s[2], t);
+    }
+}
+
+static void x2101010_scalar(uint32_t *dst, const void *src, int width, int y)
+{
+    const uint16_t *s = src;
+    for (int i = 0; i < width; ++i, s += 4) {
+        dst[i] = 0xc0000000u | (uint32_t)(s[0] >> 6) << 20 |
+                 (uint32_t)(s[1] >> 6) << 10 | (uint32_t)(s[2] >> 6);
+    }
+}
+
+static const pixconv_row_fn scalar[PIXCONV_KERNEL_COUNT] = {
+    [PIXCONV_RGBA_TO_ARGB] = &rgba_scalar,
+    [PIXCONV_BGRA_TO_ARGB] = &bgra_scalar,
+    [PIXCONV_RGB_TO_XRGB] = &rgb_scalar,
+    [PIXCONV_PREMULTIPLY] = &premultiply_scalar,
+    [PIXCONV_RGBA16_TO_ARGB] = &rgba16_scalar,
+    [PIXCONV_RGBA16_TO_X2101010] = &x2101010_scalar,
+};
+
+/*
+ * SIMD kernels convert whole blocks of pixels, leaving the rest to the
+ * scalar code; blocks are multiples of 4 pixels, so the dither phase of
+ * the rest starts at 0 just as it does in the reference.
+ */
+
+#if defined(__x86_64__) || defined(__i386__) || defined(__aarch64__)
+
+/* B,G,R,A bytes are native ARGB32 on little endian */
+static void bgra_copy(uint32_t *dst, const void *src, int width, int y)
+{
+    memcpy(dst, src, (size_t)width * 4);
+}
+
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/* R,G,B,A to B,G,R,A within each pixel */
+#define SWAP_RB_EPI8 \
+    2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15
+
+__attribute__((target("avx2")))
+static void rgba_avx2(uint32_t *dst, const void *src, int width, int y)
+{
+    const uint8_t *s = src;
+    const __m256i swap = _mm256_setr_epi8(SWAP_RB_EPI8, SWAP_RB_EPI8);
+
+    int i = 0;
+    for (; i + 8 <= width; i += 8) {
+        const __m256i v = _mm256_loadu_si256((const __m256i *)(s + 4 * i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_shuffle_epi8(v, swap));
+    }
+
+    rgba_scalar(dst + i, s + 4 * i, width - i, y);
+}
+
+__attribute__((target("avx2")))
+static void rgb_avx2(uint32_t *dst, const void *src, int width, int y)
+{
+    const uint8_t *s = src;
+    const __m256i expand = _mm256_setr_epi8(
+        2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1,
+        2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+    const __m256i alpha = _mm256_set1_epi32((int)0xff000000u);
+
+    /* 4 pixels (12 bytes) per 16-byte load; loads read 4 bytes past
+     * their pixels, hence stopping 2 pixels short of the end */
+    int i = 0;
+    for (; i + 10 <= width; i += 8) {
+        const __m128i lo = _mm_loadu_si128((const __m128i *)(s + 3 * i));
+        const __m128i hi = _mm_loadu_si128((const __m128i *)(s + 3 * i + 12));
+        const __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+        _mm256_storeu_si256((__m256i *)(dst + i),
+                            _mm256_or_si256(_mm256_shuffle_epi8(v, expand), alpha));
+    }
+
+    rgb_scalar(dst + i, s + 3 * i, width - i, y);
+}
+
+__attribute__((target("avx2")))
+static void premultiply_avx2(uint32_t *dst, const void *src, int width, int y)
+{
+    const uint32_t *s = src;
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i round = _mm256_set1_epi16(128);
+    const __m256i spread = _mm256_setr_epi8(
+        6, 7, 6, 7, 6, 7, 6, 7, 14, 15, 14, 15, 14, 15, 14, 15,
+        6, 7, 6, 7, 6, 7, 6, 7, 14, 15, 14, 15, 14, 15, 14, 15);
+
+    int i = 0;
+    for (; i + 8 <= width; i += 8) {
+        const __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+
+        /* Two pixels per 128-bit lane, one 16-bit word per channel */
+        __m256i half[2] = {
+            _mm256_unpacklo_epi8(v, zero),
+            _mm256_unpackhi_epi8(v, zero),
+        };
+
+        for (int h = 0; h < 2; ++h) {
+            const __m256i a = _mm256_shuffle_epi8(half[h], spread);
+            __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(half[h], a), round);
+            t = _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+            half[h] = _mm256_blend_epi16(t, half[h], 0x88); /* alpha as it was */
+        }
+
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_packus_epi16(half[0], half[1]));
+    }
+
+    premultiply_scalar(dst + i, s + i, width - i, y);
+}
+
+__attribute__((target("avx2")))
+static void rgba16_avx2(uint32_t *dst, const void *src, int width, int y)
+{
+    const uint16_t *s = src;
+    const uint16_t *d = dither[y & 3];
+
+    /* Pixels 0 and 1 in the low lane, 2 and 3 in the high one */
+    const __m256i t = _mm256_setr_epi16(
+        d[0], d[0], d[0], d[0], d[1], d[1], d[1], d[1],
+        d[2], d[2], d[2], d[2], d[3], d[3], d[3], d[3]);
+    const __m256i order = _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7);
+    const __m256i swap = _mm256_setr_epi8(SWAP_RB_EPI8, SWAP_RB_EPI8);
+
+    int i = 0;
+    for (; i + 8 <= width; i += 8) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(s + 4 * i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(s + 4 * i + 16));
+        a = _mm256_srli_epi16(_mm256_adds_epu16(a, t), 8);
+        b = _mm256_srli_epi16(_mm256_adds_epu16(b, t), 8);
+
+        /* Packing works within lanes: pixels come out as 0,1,4,5,2,3,6,7 */
+        __m256i p = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(a, b), order);
+        p = _mm256_shuffle_epi8(p, swap);
+        _mm256_storeu_si256((__m256i *)(dst + i), p);
+    }
+
+    rgba16_scalar(dst + i, s + 4 * i, width - i, y);
+}
+
+__attribute__((target("avx2")))
+static void x2101010_avx2(uint32_t *dst, const void *src, int width, int y)
+{
+    const uint16_t *s = src;
+
+    /* R * 1024 + G and B in the two 32-bit halves of each pixel */
+    const __m256i weights = _mm256_setr_epi16(
+        1024, 1, 1, 0, 1024, 1, 1, 0, 1024, 1, 1, 0, 1024, 1, 1, 0);
+    const __m256i low = _mm256_set1_epi64x(0xffffffff);
+    const __m256i pad = _mm256_set1_epi64x(0xc0000000);
+    const __m256i order = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+
+    int i = 0;
+    for (; i + 8 <= width; i += 8) {
+        __m256i px[2];
+        for (int h = 0; h < 2; ++h) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(s + 4 * i + 16 * h));
+            v = _mm256_madd_epi16(_mm256_srli_epi16(v, 6), weights);
+            px[h] = _mm256_or_si256(
+                _mm256_or_si256(_mm256_slli_epi64(_mm256_and_si256(v, low), 10),
+                                _mm256_srli_epi64(v, 32)),
+                pad);
+        }
+
+        /* Pixels 0-3 in even words, 4-7 in odd ones */
+        const __m256i p = _mm256_or_si256(px[0], _mm256_slli_epi64(px[1], 32));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_permutevar8x32_epi32(p, order));
+    }
+
+    x2101010_scalar(dst + i, s + 4 * i, width - i, y);
+}
+
+static const pixconv_row_fn avx2[PIXCONV_KERNEL_COUNT] = {
+    [PIXCONV_RGBA_TO_ARGB] = &rgba_avx2,
+    [PIXCONV_BGRA_TO_ARGB] = &bgra_copy,
+    [PIXCONV_RGB_TO_XRGB] = &rgb_avx2,
+    [PIXCONV_PREMULTIPLY] = &premultiply_avx2,
+    [PIXCONV_RGBA16_TO_ARGB] = &rgba16_avx2,
+    [PIXCONV_RGBA16_TO_X2101010] = &x2101010_avx2,
+};
+
+#elif defined(__aarch64__)
+
+static void rgba_neon(uint32_t *dst, const void *src, int width, int y)
+{
+    const uint8_t *s = src;
+
+    int i = 0;
+    for (; i + 16 <= width; i += 16) {
+        const uint8x16x4_t v = vld4q_u8(s + 4 * i);
+        const uint8x16x4_t px = { .val = { v.val[2], v.val[1], v.val[0], v.val[3] } };
+        vst4q_u8((uint8_t *)(dst + i), px);
+    }
+
+    rgba_scalar(dst + i, s + 4 * i, width - i, y);
+}
+
+static void rgb_neon(uint32_t *dst, const void *src, int width, int y)
+{
+    const uint8_t *s = src;
+
+    int i = 0;
+    for (; i + 16 <= width; i += 16) {
+        const uint8x16x3_t v = vld3q_u8(s + 3 * i);
+        const uint8x16x4_t px = { .val = { v.val[2], v.val[1], v.val[0], vdupq_n_u8(255) } };
+        vst4q_u8((uint8_t *)(dst + i), px);
+    }
+
+    rgb_scalar(dst + i, s + 3 * i, width - i, y);
+}
+
+/* (t + (t >> 8)) >> 8 with t = c * a + 128, as mul_div255() */
+static inline uint8x8_t mul_div255_neon(uint8x8_t c, uint8x8_t a)
+{
+    const uint16x8_t t = vmlal_u8(vdupq_n_u16(128), c, a);
+    return vaddhn_u16(t, vshrq_n_u16(t, 8));
+}
+
+static void premultiply_neon(uint32_t *dst, const void *src, int width, int y)
+{
+    const uint32_t *s = src;
+
+    int i = 0;
+    for (; i + 16 <= width; i += 16) {
+        uint8x16x4_t v = vld4q_u8((const uint8_t *)(s + i));
+        const uint8x16_t a = v.val[3];
+
+        for (int c = 0; c < 3; ++c) {
+            v.val[c] = vcombine_u8(mul_div255_neon(vget_low_u8(v.val[c]), vget_low_u8(a)),
+                                   mul_div255_neon(vget_high_u8(v.val[c]), vget_high_u8(a)));
+        }
+
+        vst4q_u8((uint8_t *)(dst + i), v);
+    }
+
+    premultiply_scalar(dst + i, s + i, width - i, y);
+}
+
+static void rgba16_neon(uint32_t *dst, const void *src, int width, int y)
+{
+    const uint16_t *s = src;
+    const uint16_t *d = dither[y & 3];
+    const uint16_t phase[8] = { d[0], d[1], d[2], d[3], d[0], d[1], d[2], d[3] };
+    const uint16x8_t t = vld1q_u16(phase);
+
+    int i = 0;
+    for (; i + 8 <= width; i += 8) {
+        const uint16x8x4_t v = vld4q_u16(s + 4 * i);
+        const uint8x8x4_t px = { .val = {
+            vshrn_n_u16(vqaddq_u16(v.val[2], t), 8),
+            vshrn_n_u16(vqaddq_u16(v.val[1], t), 8),
+            vshrn_n_u16(vqaddq_u16(v.val[0], t), 8),
+            vshrn_n_u16(vqaddq_u16(v.val[3], t), 8),
+        } };
+        vst4_u8((uint8_t *)(dst + i), px);
+    }
+
+    rgba16_scalar(dst + i, s + 4 * i, width - i, y);
+}
+
+static inline uint32x4_t pack2101010_neon(uint16x4_t r, uint16x4_t g, uint16x4_t b)
+{
+    return vorrq_u32(vorrq_u32(vshlq_n_u32(vmovl_u16(r), 20), vshlq_n_u32(vmovl_u16(g), 10)),
+                     vorrq_u32(vmovl_u16(b), vdupq_n_u32(0xc0000000u)));
+}
+
+static void x2101010_neon(uint32_t *dst, const void *src, int width, int y)
+{
+    const uint16_t *s = src;
+
+    int i = 0;
+    for (; i + 8 <= width; i += 8) {
+        const uint16x8x4_t v = vld4q_u16(s + 4 * i);
+        const uint16x8_t r = vshrq_n_u16(v.val[0], 6);
+        const uint16x8_t g = vshrq_n_u16(v.val[1], 6);
+        const uint16x8_t b = vshrq_n_u16(v.val[2], 6);
+
+        vst1q_u32(dst + i, pack2101010_neon(vget_low_u16(r), vget_low_u16(g), vget_low_u16(b)));
+        vst1q_u32(dst + i + 4, pack2101010_neon(vget_high_u16(r), vget_high_u16(g), vget_high_u16(b)));
+    }
+
+    x2101010_scalar(dst + i, s + 4 * i, width - i, y);
+}
+
+static const pixconv_row_fn neon[PIXCONV_KERNEL_COUNT] = {
+    [PIXCONV_RGBA_TO_ARGB] = &rgba_neon,
+    [PIXCONV_BGRA_TO_ARGB] = &bgra_copy,
+    [PIXCONV_RGB_TO_XRGB] = &rgb_neon,
+    [PIXCONV_PREMULTIPLY] = &premultiply_neon,
+    [PIXCONV_RGBA16_TO_ARGB] = &rgba16_neon,
+    [PIXCONV_RGBA16_TO_X2101010] = &x2101010_neon,
+};
+
+#endif
+
+static const pixconv_row_fn *best(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_cpu_supports("avx2") ? avx2 : scalar;
+#elif defined(__aarch64__)
+    return neon;
+#else
+    return scalar;
+#endif
+}
+
+pixconv_row_fn pixconv_row(enum pixconv_kernel kernel)
+{
+    return best()[kernel];
+}
+
+pixconv_row_fn pixconv_row_scalar(enum pixconv_kernel kernel)
+{
+    return scalar[kernel];
+}
+
+const char *pixconv_isa(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_cpu_supports("avx2") ? "avx2" : "scalar";
+#elif defined(__aarch64__)
+    return "neon";
+#else
+    return "scalar";
+#endif
+}
+
+static const struct {
+    const char *name;
+    int src_bpp; /* bytes per source pixel */
+} kernels[PIXCONV_KERNEL_COUNT] = {
+    [PIXCONV_RGBA_TO_ARGB] = { "rgba -> argb", 4 },
+    [PIXCONV_BGRA_TO_ARGB] = { "bgra -> argb", 4 },
+    [PIXCONV_RGB_TO_XRGB] = { "rgb -> xrgb", 3 },
+    [PIXCONV_PREMULTIPLY] = { "premultiply", 4 },
+    [PIXCONV_RGBA16_TO_ARGB] = { "rgba16 -> argb", 8 },
+    [PIXCONV_RGBA16_TO_X2101010] = { "rgba16 -> x2101010", 8 },
+};
+
+static uint64_t rand_state = 0x9e3779b97f4a7c15u;
+
+/* xorshift64*, reproducible across runs */
+static uint64_t next_rand(void)
+{
+    rand_state ^= rand_state >> 12;
+    rand_state ^= rand_state << 25;
+    rand_state ^= rand_state >> 27;
+    return rand_state * 0x2545f4914f6cdd1du;
+}
+
+static void fill_random(void *buf, size_t size)
+{
+    uint8_t *p = buf;
+    for (size_t i = 0; i < size; ++i) {
+        p[i] = next_rand() >> 56;
+    }
+}
+
+static bool check(void)
+{
+    bool ok = true;
+
+    /* Premultiplication of every color and alpha pair; reference against
+     * exact rounding first */
+    enum { PAIRS = 256 * 256 };
+    uint32_t *src = malloc(PAIRS * sizeof (uint32_t));
+    uint32_t *want = malloc(PAIRS * sizeof (uint32_t));
+    uint32_t *got = malloc(PAIRS * sizeof (uint32_t));
+
+    for (uint32_t a = 0; a < 256; ++a) {
+        for (uint32_t c = 0; c < 256; ++c) {
+            src[a * 256 + c] = a << 24 | c << 16 | (255 - c) << 8 | c;
+            if (mul_div255(c, a) != (c * a * 2 + 255) / 510) {
+                fprintf(stderr, "premultiply: reference off for c=%u a=%u\n", c, a);
+                ok = false;
+            }
+        }
+    }
+
+    scalar[PIXCONV_PREMULTIPLY](want, src, PAIRS, 0);
+    pixconv_row(PIXCONV_PREMULTIPLY)(got, src, PAIRS, 0);
+    if (memcmp(want, got, PAIRS * sizeof (uint32_t)) != 0) {
+        fprintf(stderr, "premultiply: mismatch against reference\n");
+        ok = false;
+    }
+
+    /* Every kernel, over each tail length and dither phase */
+    enum { MAX_WIDTH = 67 };
+    uint8_t row[MAX_WIDTH * 8];
+
+    for (int k = 0; k < PIXCONV_KERNEL_COUNT; ++k) {
+        for (int width = 1; width <= MAX_WIDTH; ++width) {
+            for (int y = 0; y < 4; ++y) {
+                fill_random(row, sizeof (row));
+                memset(want, 0xa5, MAX_WIDTH * sizeof (uint32_t));
+                memset(got, 0xa5, MAX_WIDTH * sizeof (uint32_t));
+
+                scalar[k](want, row, width, y);
+                pixconv_row(k)(got, row, width, y);
+
+                /* Including what is past the row, which must be left alone */
+                if (memcmp(want, got, MAX_WIDTH * sizeof (uint32_t)) != 0) {
+                    fprintf(stderr, "%s: mismatch at width %d, row %d\n",
+                            kernels[k].name, width, y);
+                    ok = false;
+                    break;
+                }
+            }
+        }
+    }
+
+    free(src);
+    free(want);
+    free(got);
+    return ok;
+}
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+enum { BENCH_WIDTH = 1920, BENCH_HEIGHT = 1080 };
+
+/* GB/s of bytes read and written, over at least a quarter of a second */
+static double throughput(pixconv_row_fn fn, const uint8_t *src, int src_bpp, uint32_t *dst)
+{
+    const double start = now_s();
+    double elapsed;
+    size_t frames = 0;
+
+    do {
+        for (int y = 0; y < BENCH_HEIGHT; ++y) {
+            fn(dst + (size_t)y * BENCH_WIDTH,
+               src + (size_t)y * BENCH_WIDTH * src_bpp, BENCH_WIDTH, y);
+        }
+        frames++;
+        elapsed = now_s() - start;
+    } while (elapsed < 0.25);
+
+    return frames * (double)BENCH_WIDTH * BENCH_HEIGHT * (src_bpp + 4) / elapsed / 1e9;
+}
+
+static void copy_row(uint32_t *dst, const void *src, int width, int y)
+{
+    memcpy(dst, src, (size_t)width * 4);
+}
+
+bool pixconv_bench(void)
+{
+    if (!check()) {
+        return false;
+    }
+
+    const size_t pixels = (size_t)BENCH_WIDTH * BENCH_HEIGHT;
+    uint8_t *src = malloc(pixels * 8);
+    uint32_t *dst = malloc(pixels * 4);
+    fill_random(src, pixels * 8);
+
+    const char *isa = pixconv_isa();
+    printf("%dx%d, GB/s read and written; kernels match the scalar reference\n\n",
+           BENCH_WIDTH, BENCH_HEIGHT);
+    printf("%-20s %10s %10s\n", "", isa, "scalar");
+    printf("%-20s %10.2f\n", "memcpy", throughput(&copy_row, src, 4, dst));
+
+    for (int k = 0; k < PIXCONV_KERNEL_COUNT; ++k) {
+        const double fast = throughput(pixconv_row(k), src, kernels[k].src_bpp, dst);
+        const double ref = throughput(scalar[k], src, kernels[k].src_bpp, dst);
+        printf("%-20s %10.2f %10.2f\n", kernels[k].name, fast, ref);
+    }
+
+    free(src);
+    free(dst);
+    return true;
+}
@@ -0,0 +1,47 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#ifndef PIXCONV_H_
+#define PIXCONV_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Row kernels converting decoded pixels into what shm buffers hold, i.e.
+ * 32-bit native endian words (ARGB32, or XRGB2101010 for deep color).
+ * Each kernel has a scalar reference implementation; SIMD versions, picked
+ * at runtime for the CPU, must match it bit for bit.
+ */
+enum pixconv_kernel {
+    PIXCONV_RGBA_TO_ARGB,     /* R,G,B,A bytes */
+    PIXCONV_BGRA_TO_ARGB,     /* B,G,R,A bytes */
+    PIXCONV_RGB_TO_XRGB,      /* R,G,B bytes, alpha set opaque */
+    PIXCONV_PREMULTIPLY,      /* ARGB32 of straight alpha; may be in place */
+    PIXCONV_RGBA16_TO_ARGB,   /* 16-bit R,G,B,A, ordered dithering to 8 bits */
+    PIXCONV_RGBA16_TO_X2101010, /* 16-bit R,G,B,A, alpha dropped */
+    PIXCONV_KERNEL_COUNT,
+};
+
+/* `y` is the row, selecting the dither pattern */
+typedef void (*pixconv_row_fn)(uint32_t *dst, const void *src, int width, int y);
+
+/* Fastest implementation for this CPU */
+pixconv_row_fn pixconv_row(enum pixconv_kernel kernel);
+
+/* Reference implementation */
+pixconv_row_fn pixconv_row_scalar(enum pixconv_kernel kernel);
+
+/* Name of the instruction set used by pixconv_row() */
+const char *pixconv_isa(void);
+
+/*
+ * Checks every kernel against its reference (premultiplication over all
+ * color and alpha pairs, the others over random rows of every tail
+ * length and dither phase), then prints throughput of each next to
+ * memcpy(). Returns false on mismatch.
+ */
+bool pixconv_bench(void);
+
+#endif // PIXCONV_H_
@@ -0,0 +1,157 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#include "prio.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "log.h"
+
+/* From linux/ioprio.h, which is not always installed */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+
+static int background_nice = 0; /* 0 for SCHED_IDLE */
+
+bool prio_parse(const char *spec)
+{
+    if (strcmp(spec, "idle") == 0) {
+        background_nice = 0;
+        return true;
+    }
+
+    char *end;
+    errno = 0;
+    const long nice = strtol(spec, &end, 10);
+    if (errno != 0 || *end != '\0' || nice < 1 || nice > 19) {
+        return false;
+    }
+
+    background_nice = nice;
+    return true;
+}
+
+void prio_background(const char *name)
+{
+    pthread_setname_np(pthread_self(), name);
+
+    const pid_t tid = gettid();
+
+    if (background_nice == 0) {
+        const struct sched_param param = { .sched_priority = 0 };
+        int err = pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+        if (err != 0) {
+            errno = err;
+            LOG_ERRNO("%s: failed to set SCHED_IDLE", name);
+        }
+    } else if (setpriority(PRIO_PROCESS, tid, background_nice) < 0) {
+        LOG_ERRNO("%s: failed to set nice value %d", name, background_nice);
+    }
+
+    /* Reads (including page faults of mmapped files) of this thread only */
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid,
+                IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) < 0) {
+        LOG_ERRNO("%s: failed to set idle I/O priority", name);
+    }
+}
+
+struct job {
+    const char *name;
+    void *(*fn)(void *);
+    void *data;
+};
+
+static void *run_job(void *data)
+{
+    const struct job job = *(struct job *)data;
+    free(data);
+
+    prio_background(job.name);
+    return job.fn(job.data);
+}
+
+bool prio_spawn(const char *name, void *(*fn)(void *), void *data, pthread_t *thread)
+{
+    struct job *job = malloc(sizeof (*job));
+    *job = (struct job){ name, fn, data };
+
+    int err = pthread_create(thread, NULL, &run_job, job);
+    if (err != 0) {
+        errno = err;
+        LOG_ERRNO("%s: failed to start thread", name);
+        free(job);
+        return false;
+    }
+
+    return true;
+}
+
+/* Reads first line of /proc/self/task/TID/FILE */
+static bool read_task(const char *tid, const char *file, char *buf, size_t size)
+{
+    char path[64];
+    snprintf(path, sizeof (path), "/proc/self/task/%s/%s", tid, file);
+
+    FILE *f = fopen(path, "re");
+    if (f == NULL) {
+        return false;
+    }
+
+    const bool ok = fgets(buf, size, f) != NULL;
+    fclose(f);
+
+    buf[strcspn(buf, "\n")] = '\0';
+    return ok;
+}
+
+void prio_dump_stats(void)
+{
+    DIR *dir = opendir("/proc/self/task");
+    if (dir == NULL) {
+        LOG_ERRNO("failed to open /proc/self/task");
+        return;
+    }
+
+    const struct dirent *e;
+    while ((e = readdir(dir)) != NULL) {
+        if (e->d_name[0] == '.') {
+            continue;
+        }
+
+        char comm[32] = "?";
+        read_task(e->d_name, "comm", comm, sizeof (comm));
+
+        const pid_t tid = atoi(e->d_name);
+        const int policy = sched_getscheduler(tid);
+        errno = 0;
+        const int nice = getpriority(PRIO_PROCESS, tid);
+
+        /* CPU time (ns), runqueue wait (ns), timeslices */
+        char schedstat[96];
+        unsigned long long cpu, wait, slices;
+        if (!read_task(e->d_name, "schedstat", schedstat, sizeof (schedstat)) ||
+            sscanf(schedstat, "%llu %llu %llu", &cpu, &wait, &slices) != 3) {
+            LOG_INFO("thread %s (%s): no scheduler statistics", e->d_name, comm);
+            continue;
+        }
+
+        LOG_INFO("thread %s (%s): %s, nice %d, cpu %.3f ms, runqueue wait %.3f ms, %llu slices",
+                 e->d_name, comm,
+                 policy == SCHED_IDLE ? "idle" : policy == SCHED_BATCH ? "batch" : "normal",
+                 nice, cpu / 1e6, wait / 1e6, slices);
+    }
+
+    closedir(dir);
+}
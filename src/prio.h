@@ -0,0 +1,31 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#ifndef PRIO_H_
+#define PRIO_H_
+
+#include <stdbool.h>
+
+#include <pthread.h>
+
+/*
+ * Rendering and decoding run on threads of their own with lowered CPU
+ * (SCHED_IDLE, or a nice value) and I/O (IOPRIO_CLASS_IDLE) priority, so
+ * that they do not compete with whatever the user is starting; the main
+ * loop keeps normal priority.
+ */
+
+/* "idle" (default), or nice value from 1 to 19 */
+bool prio_parse(const char *spec);
+
+/* Lowers priority of calling thread, for good, and names it */
+void prio_background(const char *name);
+
+/* Starts fn(data) on a background thread, to be joined by caller */
+bool prio_spawn(const char *name, void *(*fn)(void *), void *data, pthread_t *thread);
+
+/* Logs policy, CPU time and time spent waiting on runqueue of each thread */
+void prio_dump_stats(void);
+
+#endif // PRIO_H_
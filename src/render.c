@@ -0,0 +1,32 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#include "render.h"
+
+#include <stddef.h>
+
+void render_scaled(pixman_image_t *src, int src_width, int src_height,
+                   pixman_image_t *dst, int width, int height)
+{
+    const double sx = (double)width / src_width;
+    const double sy = (double)height / src_height;
+    const double s = (sx > sy) ? sx : sy;
+
+    pixman_transform_t t;
+    pixman_transform_init_scale(&t, pixman_double_to_fixed(1 / s), pixman_double_to_fixed(1 / s));
+    pixman_transform_translate(&t, NULL,
+                               pixman_double_to_fixed((src_width - width / s) / 2),
+                               pixman_double_to_fixed((src_height - height / s) / 2));
+
+    pixman_image_set_transform(src, &t);
+    pixman_image_set_filter(src, PIXMAN_FILTER_BILINEAR, NULL, 0);
+    pixman_image_set_repeat(src, PIXMAN_REPEAT_PAD);
+
+    pixman_image_composite32(
+        PIXMAN_OP_SRC,
+        src, NULL, dst, 0, 0, 0, 0, 0, 0,
+        width, height);
+
+    pixman_image_set_transform(src, NULL);
+}
@@ -0,0 +1,14 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#ifndef RENDER_H_
+#define RENDER_H_
+
+#include <pixman.h>
+
+/* Scales `src` to cover `dst` (cropping to keep aspect ratio) */
+void render_scaled(pixman_image_t *src, int src_width, int src_height,
+                   pixman_image_t *dst, int width, int height);
+
+#endif // RENDER_H_
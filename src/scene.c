@@ -0,0 +1,1062 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#include "scene.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <tllist.h>
+
+#include "budget.h"
+#include "color.h"
+#include "font.h"
+#include "icc.h"
+#include "image.h"
+#include "limit.h"
+#include "log.h"
+#include "mip.h"
+
+/* Flattened static layers kept, per buffer size */
+#define SCENE_CACHE_MAX 4
+
+/* Font pixel size of text, at scale 1 */
+#define TEXT_UNIT 4
+
+/* Text cells have room for spacing and the shadow, in font pixels */
+#define CELL_WIDTH  (FONT_WIDTH + 1)
+#define CELL_HEIGHT (FONT_HEIGHT + 2)
+
+/* Distance of text from the buffer edges, in cells */
+#define TEXT_MARGIN 2
+
+#define NOISE_TILE 128
+
+enum layer_type {
+    LAYER_SOLID,
+    LAYER_GRADIENT,
+    LAYER_IMAGE,
+    LAYER_PATTERN,
+    LAYER_NOISE,
+    LAYER_TEXT,
+    LAYER_TIMELINE,
+};
+
+struct layer {
+    enum layer_type type;
+    pixman_op_t op;
+    uint16_t opacity;
+
+    /* Content keys, as of the last and the one before last advance */
+    uint64_t key;
+    uint64_t prev_key;
+
+    pixman_color_t color;
+    pixman_color_t color2;
+    int size;               /* pattern cell or font pixel, at scale 1 */
+    bool stripes;
+    pixman_image_t *image;  /* noise tile */
+    struct mip *mip;        /* decoded image */
+    struct fx fx;           /* effects of image */
+    struct timeline *timeline;
+
+    char *format;
+    char *text;
+    char *prev_text;
+    tll(struct glyph_atlas *) atlases;
+};
+
+struct flat {
+    uint64_t key;
+    int width;
+    int height;
+    int scale;
+    const struct icc_lut *lut;
+    pixman_image_t *pix;
+};
+
+struct scene {
+    struct layer *layers;
+    size_t count;
+
+    time_t now;
+    uint64_t key;
+    uint64_t prev_key;
+
+    tll(struct flat) cache;
+
+    bool preview; /* images stand in as their stored colour */
+};
+
+struct text_layout {
+    int unit;
+    int lines;
+    int cols;
+    pixman_box32_t box; /* empty if text does not fit */
+};
+
+/* FNV-1a */
+static uint64_t hash(uint64_t h, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    for (size_t i = 0; i < len; ++i) {
+        h = (h ^ p[i]) * 0x100000001b3;
+    }
+    return h;
+}
+
+#define HASH_INIT 0xcbf29ce484222325
+
+static uint64_t hash_u64(uint64_t h, uint64_t v)
+{
+    return hash(h, &v, sizeof (v));
+}
+
+struct scene *scene_create(bool preview)
+{
+    struct scene *scene = calloc(1, sizeof (*scene));
+    scene->preview = preview;
+    return scene;
+}
+
+/* Entries flattened for the same output as `like`, or all if NULL */
+static void cache_drop(struct scene *scene, const struct flat *like)
+{
+    tll_foreach(scene->cache, it) {
+        if (like == NULL ||
+            (it->item.width == like->width && it->item.height == like->height &&
+             it->item.scale == like->scale && it->item.lut == like->lut)) {
+            pixman_image_unref(it->item.pix);
+            tll_remove(scene->cache, it);
+        }
+    }
+}
+
+void scene_destroy(struct scene *scene)
+{
+    if (scene == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i < scene->count; ++i) {
+        struct layer *layer = &scene->layers[i];
+        if (layer->image != NULL) {
+            pixman_image_unref(layer->image);
+        }
+        mip_destroy(layer->mip);
+        tll_foreach(layer->atlases, it) {
+            glyph_atlas_unref(it->item);
+            tll_remove(layer->atlases, it);
+        }
+        free(layer->format);
+        free(layer->text);
+        free(layer->prev_text);
+    }
+
+    cache_drop(scene, NULL);
+    free(scene->layers);
+    free(scene);
+}
+
+/* Replaces {host} with the hostname, escaped from strftime() */
+static char *expand_format(const char *format)
+{
+    char host[256] = { 0 };
+    if (gethostname(host, sizeof (host) - 1) < 0) {
+        LOG_ERRNO("failed to get hostname");
+    }
+
+    char *expanded = malloc(strlen(format) * (1 + strlen(host)) + 1);
+    char *out = expanded;
+
+    while (*format != '\0') {
+        if (strncmp(format, "{host}", 6) != 0) {
+            *out++ = *format++;
+            continue;
+        }
+
+        for (const char *h = host; *h != '\0'; ++h) {
+            if (*h == '%') {
+                *out++ = '%';
+            }
+            *out++ = *h;
+        }
+        format += 6;
+    }
+
+    *out = '\0';
+    return expanded;
+}
+
+static bool parse_op(const char *name, pixman_op_t *op)
+{
+    static const struct {
+        const char *name;
+        pixman_op_t op;
+    } ops[] = {
+        { "over",     PIXMAN_OP_OVER },
+        { "src",      PIXMAN_OP_SRC },
+        { "add",      PIXMAN_OP_ADD },
+        { "multiply", PIXMAN_OP_MULTIPLY },
+        { "screen",   PIXMAN_OP_SCREEN },
+        { "overlay",  PIXMAN_OP_OVERLAY },
+        { "darken",   PIXMAN_OP_DARKEN },
+        { "lighten",  PIXMAN_OP_LIGHTEN },
+    };
+
+    for (size_t i = 0; i < sizeof (ops) / sizeof (ops[0]); ++i) {
+        if (strcmp(name, ops[i].name) == 0) {
+            *op = ops[i].op;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool parse_int(const char *str, int min, int max, int *value)
+{
+    char *end;
+    errno = 0;
+    const long v = strtol(str, &end, 10);
+    if (errno != 0 || end == str || *end != '\0' || v < min || v > max) {
+        return false;
+    }
+    *value = (int)v;
+    return true;
+}
+
+/* Premultiplied ARGB of `color` */
+static uint32_t premultiply(pixman_color_t color, uint8_t alpha)
+{
+    return (uint32_t)alpha << 24 |
+           (uint32_t)((color.red >> 8) * alpha / 255) << 16 |
+           (uint32_t)((color.green >> 8) * alpha / 255) << 8 |
+           (uint32_t)((color.blue >> 8) * alpha / 255);
+}
+
+/* Colours are parsed with straight alpha; solid fills take it premultiplied */
+static pixman_color_t premultiplied(pixman_color_t color)
+{
+    const uint32_t a = color.alpha;
+    return (pixman_color_t){
+        .red = (uint16_t)(color.red * a / 0xffff),
+        .green = (uint16_t)(color.green * a / 0xffff),
+        .blue = (uint16_t)(color.blue * a / 0xffff),
+        .alpha = color.alpha,
+    };
+}
+
+static pixman_image_t *noise_tile(int percent)
+{
+    pixman_image_t *pix = pixman_image_create_bits(
+        PIXMAN_a8r8g8b8, NOISE_TILE, NOISE_TILE, NULL, 0);
+    if (pix == NULL) {
+        return NULL;
+    }
+
+    uint32_t *data = pixman_image_get_data(pix);
+    const uint8_t alpha = (uint8_t)(percent * 255 / 100);
+
+    /* Fixed seed; same grain on every run, and every output */
+    uint32_t state = 0x9e3779b9;
+    for (int i = 0; i < NOISE_TILE * NOISE_TILE; ++i) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+
+        const uint16_t v = (uint16_t)((state & 0xff) * 0x0101);
+        data[i] = premultiply((pixman_color_t){ v, v, v, 0xffff }, alpha);
+    }
+
+    return pix;
+}
+
+bool scene_add(struct scene *scene, const char *line)
+{
+    char *copy = strdup(line);
+    char *save;
+
+    const char *type = strtok_r(copy, " \t\r\n", &save);
+    if (type == NULL || type[0] == '#') {
+        free(copy);
+        return true; /* empty line or comment */
+    }
+
+    /* Every layer is drawn on every frame */
+    if (scene->count >= LIMIT_LAYERS) {
+        LOG_ERR("scene: more than %d layers", LIMIT_LAYERS);
+        goto err;
+    }
+
+    struct layer layer = {
+        .op = PIXMAN_OP_OVER,
+        .opacity = 0xffff,
+        .color = { 0xffff, 0xffff, 0xffff, 0xffff },
+        .size = TEXT_UNIT,
+        .fx.tint = { 0, 0, 0, 0xffff },
+    };
+
+    const char *args[16];
+    size_t nargs = 0;
+    char text[256] = { 0 };
+
+    for (char *tok = strtok_r(NULL, " \t\r\n", &save); tok != NULL; tok = strtok_r(NULL, " \t\r\n", &save)) {
+        int percent;
+
+        if (strncmp(tok, "op=", 3) == 0) {
+            if (!parse_op(tok + 3, &layer.op)) {
+                LOG_ERR("scene: unknown operator: %s", tok + 3);
+                goto err;
+            }
+        } else if (strncmp(tok, "opacity=", 8) == 0) {
+            if (!parse_int(tok + 8, 0, 100, &percent)) {
+                LOG_ERR("scene: invalid opacity: %s", tok + 8);
+                goto err;
+            }
+            layer.opacity = (uint16_t)(percent * 0xffff / 100);
+        } else if (strncmp(tok, "size=", 5) == 0) {
+            if (!parse_int(tok + 5, 1, 64, &layer.size)) {
+                LOG_ERR("scene: invalid size: %s", tok + 5);
+                goto err;
+            }
+        } else if (strncmp(tok, "blur=", 5) == 0) {
+            if (!parse_int(tok + 5, 0, 1000, &layer.fx.blur)) {
+                LOG_ERR("scene: invalid blur: %s", tok + 5);
+                goto err;
+            }
+        } else if (strncmp(tok, "dim=", 4) == 0) {
+            if (!parse_int(tok + 4, 0, 100, &percent)) {
+                LOG_ERR("scene: invalid dim: %s", tok + 4);
+                goto err;
+            }
+            layer.fx.dim = (uint16_t)(percent * 256 / 100);
+        } else if (strncmp(tok, "tint=", 5) == 0) {
+            const char *reason = color_parse_error(tok + 5, &layer.fx.tint);
+            if (reason != NULL) {
+                LOG_ERR("scene: invalid tint: %s: %s", tok + 5, reason);
+                goto err;
+            }
+            /* Dimmed towards, opaque; a translucent tint is darker */
+            layer.fx.tint = premultiplied(layer.fx.tint);
+        } else if (strncmp(tok, "vignette=", 9) == 0) {
+            if (!parse_int(tok + 9, 0, 100, &percent)) {
+                LOG_ERR("scene: invalid vignette: %s", tok + 9);
+                goto err;
+            }
+            layer.fx.vignette = (uint16_t)(percent * 256 / 100);
+        } else if (strncmp(tok, "color=", 6) == 0) {
+            const char *reason = color_parse_error(tok + 6, &layer.color);
+            if (reason != NULL) {
+                LOG_ERR("scene: invalid color: %s: %s", tok + 6, reason);
+                goto err;
+            }
+        } else if (strcmp(type, "text") == 0) {
+            /* Text is everything else, words separated by single spaces */
+            if (text[0] != '\0') {
+                strncat(text, " ", sizeof (text) - strlen(text) - 1);
+            }
+            strncat(text, tok, sizeof (text) - strlen(text) - 1);
+        } else if (nargs < sizeof (args) / sizeof (args[0])) {
+            args[nargs++] = tok;
+        }
+    }
+
+    if (strcmp(type, "solid") == 0 && nargs == 1) {
+        layer.type = LAYER_SOLID;
+        const char *reason = color_parse_error(args[0], &layer.color);
+        if (reason != NULL) {
+            LOG_ERR("scene: invalid color: %s: %s", args[0], reason);
+            goto err;
+        }
+    } else if (strcmp(type, "gradient") == 0 && nargs == 1) {
+        layer.type = LAYER_GRADIENT;
+        const char *sep = strchr(args[0], ':');
+        char top[64] = { 0 };
+        if (sep == NULL || sep - args[0] >= (ptrdiff_t)sizeof (top) ||
+            (memcpy(top, args[0], sep - args[0]), !color_parse(top, &layer.color)) ||
+            !color_parse(sep + 1, &layer.color2)) {
+            LOG_ERR("scene: invalid gradient: %s", args[0]);
+            goto err;
+        }
+    } else if (strcmp(type, "image") == 0 && nargs == 1 && scene->preview) {
+        layer.type = LAYER_IMAGE;
+        pixman_image_t *image = image_peek(args[0]);
+        if (image == NULL) {
+            /* Nothing to show in its place */
+            free(copy);
+            return true;
+        }
+        layer.mip = mip_create(image);
+    } else if (strcmp(type, "image") == 0 && nargs == 1) {
+        layer.type = LAYER_IMAGE;
+        pixman_image_t *image = image_load(args[0]);
+        if (image == NULL) {
+            goto err;
+        }
+        layer.mip = mip_create(image);
+    } else if (strcmp(type, "pattern") == 0 && nargs == 3) {
+        layer.type = LAYER_PATTERN;
+        layer.stripes = strcmp(args[0], "stripes") == 0;
+        if ((!layer.stripes && strcmp(args[0], "checker") != 0) ||
+            !parse_int(args[1], 1, 1024, &layer.size) ||
+            !color_parse(args[2], &layer.color)) {
+            LOG_ERR("scene: invalid pattern: %s %s %s", args[0], args[1], args[2]);
+            goto err;
+        }
+    } else if (strcmp(type, "noise") == 0 && nargs == 1) {
+        layer.type = LAYER_NOISE;
+        int percent;
+        if (!parse_int(args[0], 0, 100, &percent)) {
+            LOG_ERR("scene: invalid noise amount: %s", args[0]);
+            goto err;
+        }
+        layer.image = noise_tile(percent);
+        if (layer.image == NULL) {
+            goto err;
+        }
+    } else if (strcmp(type, "text") == 0 && text[0] != '\0') {
+        layer.type = LAYER_TEXT;
+        layer.format = expand_format(text);
+    } else {
+        LOG_ERR("scene: invalid layer: %s", line);
+        goto err;
+    }
+
+    /* Static layers are identified by their description */
+    layer.key = layer.prev_key = hash(HASH_INIT, line, strlen(line));
+
+    scene->layers = realloc(scene->layers, (scene->count + 1) * sizeof (scene->layers[0]));
+    scene->layers[scene->count++] = layer;
+
+    free(copy);
+    return true;
+
+err:
+    free(copy);
+    return false;
+}
+
+bool scene_load(struct scene *scene, const char *path)
+{
+    FILE *f = fopen(path, "re");
+    if (f == NULL) {
+        LOG_ERRNO("%s: failed to open", path);
+        return false;
+    }
+
+    char *line = NULL;
+    size_t line_size = 0;
+    int lineno = 0;
+    bool ok = true;
+
+    while (ok && getline(&line, &line_size, f) >= 0) {
+        lineno++;
+        ok = scene_add(scene, line);
+        if (!ok) {
+            LOG_ERR("%s:%d: invalid layer", path, lineno);
+        }
+    }
+
+    free(line);
+    fclose(f);
+    return ok;
+}
+
+void scene_trim(struct scene *scene)
+{
+    for (size_t i = 0; i < scene->count; ++i) {
+        if (scene->layers[i].mip != NULL) {
+            mip_trim(scene->layers[i].mip);
+        }
+    }
+}
+
+void scene_reclaim(struct scene *scene, size_t wanted)
+{
+    size_t freed = 0;
+    while (freed < wanted && tll_length(scene->cache) > 0) {
+        struct flat old = tll_pop_front(scene->cache);
+        freed += (size_t)pixman_image_get_stride(old.pix) * old.height;
+        pixman_image_unref(old.pix);
+    }
+
+    if (freed >= wanted) {
+        return;
+    }
+
+    /* Rebuilt, or rendered from a larger level, when needed again */
+    for (size_t i = 0; i < scene->count; ++i) {
+        if (scene->layers[i].mip != NULL) {
+            mip_release(scene->layers[i].mip);
+        }
+        if (scene->layers[i].type == LAYER_TIMELINE) {
+            timeline_reclaim(scene->layers[i].timeline);
+        }
+    }
+}
+
+void scene_add_timeline(struct scene *scene, struct timeline *tl)
+{
+    scene->layers = realloc(scene->layers, (scene->count + 1) * sizeof (scene->layers[0]));
+    scene->layers[scene->count++] = (struct layer){
+        .type = LAYER_TIMELINE,
+        .op = PIXMAN_OP_OVER,
+        .opacity = 0xffff,
+        .timeline = tl,
+    };
+}
+
+/* Index of the first layer which changes on its own */
+static size_t first_dynamic(const struct scene *scene)
+{
+    size_t i = 0;
+    while (i < scene->count && scene->layers[i].type != LAYER_TEXT) {
+        i++;
+    }
+    return i;
+}
+
+static uint64_t combine_keys(const struct scene *scene, size_t count, int scale)
+{
+    uint64_t h = hash_u64(HASH_INIT, (uint64_t)scale);
+    for (size_t i = 0; i < count; ++i) {
+        h = hash_u64(h, scene->layers[i].key);
+    }
+    return h;
+}
+
+bool scene_advance(struct scene *scene, time_t now)
+{
+    scene->now = now;
+
+    struct tm tm;
+    localtime_r(&now, &tm);
+
+    for (size_t i = 0; i < scene->count; ++i) {
+        struct layer *layer = &scene->layers[i];
+        layer->prev_key = layer->key;
+
+        switch (layer->type) {
+            case LAYER_TEXT: {
+                char text[256];
+                /* Format is the user's, from the scene file */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+                if (strftime(text, sizeof (text), layer->format, &tm) == 0) {
+                    text[0] = '\0';
+                }
+#pragma GCC diagnostic pop
+
+                free(layer->prev_text);
+                layer->prev_text = layer->text;
+                layer->text = strdup(text);
+                layer->key = hash(HASH_INIT, text, strlen(text));
+                break;
+            }
+
+            case LAYER_TIMELINE:
+                layer->key = timeline_key(layer->timeline, now);
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    scene->prev_key = scene->key;
+    scene->key = combine_keys(scene, scene->count, 0);
+    return scene->key != scene->prev_key;
+}
+
+int scene_period(const struct scene *scene)
+{
+    static const char *const with_seconds[] = { "%S", "%T", "%s", "%r", "%X", "%c", "%+" };
+
+    int period = 0;
+    for (size_t i = 0; i < scene->count; ++i) {
+        const struct layer *layer = &scene->layers[i];
+        if (layer->type != LAYER_TEXT) {
+            continue;
+        }
+
+        period = 60;
+        for (size_t j = 0; j < sizeof (with_seconds) / sizeof (with_seconds[0]); ++j) {
+            if (strstr(layer->format, with_seconds[j]) != NULL) {
+                return 1;
+            }
+        }
+    }
+    return period;
+}
+
+uint64_t scene_key(const struct scene *scene, int scale, const struct icc_lut *lut)
+{
+    return hash_u64(hash_u64(scene->key, (uint64_t)scale), (uint64_t)(uintptr_t)lut);
+}
+
+uint64_t scene_prev_key(const struct scene *scene, int scale, const struct icc_lut *lut)
+{
+    return hash_u64(hash_u64(scene->prev_key, (uint64_t)scale), (uint64_t)(uintptr_t)lut);
+}
+
+static void measure(const char *text, int *lines, int *cols)
+{
+    *lines = 0;
+    *cols = 0;
+
+    while (*text != '\0') {
+        const char *end = strchrnul(text, '\n');
+        if (end - text > *cols) {
+            *cols = end - text;
+        }
+        (*lines)++;
+        text = (*end == '\n') ? end + 1 : end;
+    }
+}
+
+/* Character in given cell; blank past the end of line */
+static char char_at(const char *text, int line, int col)
+{
+    for (; line > 0; --line) {
+        text = strchr(text, '\n');
+        if (text == NULL) {
+            return ' ';
+        }
+        text++;
+    }
+
+    const char *end = strchrnul(text, '\n');
+    return (col < end - text) ? text[col] : ' ';
+}
+
+static bool box_empty(const pixman_box32_t *box)
+{
+    return box->x2 <= box->x1 || box->y2 <= box->y1;
+}
+
+static struct text_layout layout_text(const struct layer *layer, const char *text,
+                                      int width, int height, int scale)
+{
+    struct text_layout l = { .unit = layer->size * scale };
+    measure(text, &l.lines, &l.cols);
+
+    const int w = l.cols * CELL_WIDTH * l.unit;
+    const int h = l.lines * CELL_HEIGHT * l.unit;
+    const int margin = TEXT_MARGIN * CELL_WIDTH * l.unit;
+
+    if (w > 0 && w + 2 * margin <= width && h + 2 * margin <= height) {
+        l.box = (pixman_box32_t){
+            width - margin - w, height - margin - h, width - margin, height - margin,
+        };
+    }
+    return l;
+}
+
+static pixman_box32_t cell_box(const struct text_layout *l, int line, int col)
+{
+    const int w = CELL_WIDTH * l->unit;
+    const int h = CELL_HEIGHT * l->unit;
+    const int x = l->box.x1 + col * w;
+    const int y = l->box.y1 + line * h;
+    return (pixman_box32_t){ x, y, x + w, y + h };
+}
+
+static void damage_box(pixman_region32_t *damage, const pixman_box32_t *box)
+{
+    if (!box_empty(box)) {
+        pixman_region32_union_rect(damage, damage, box->x1, box->y1,
+                                   box->x2 - box->x1, box->y2 - box->y1);
+    }
+}
+
+/* Cells whose character differs from the previous text */
+static void text_damage(const struct layer *layer, int width, int height, int scale,
+                        pixman_region32_t *damage)
+{
+    if (layer->prev_text == NULL) {
+        const struct text_layout l = layout_text(layer, layer->text, width, height, scale);
+        damage_box(damage, &l.box);
+        return;
+    }
+
+    const struct text_layout old = layout_text(layer, layer->prev_text, width, height, scale);
+    const struct text_layout new = layout_text(layer, layer->text, width, height, scale);
+
+    if (old.lines != new.lines || old.cols != new.cols) {
+        damage_box(damage, &old.box);
+        damage_box(damage, &new.box);
+        return;
+    }
+
+    if (box_empty(&new.box)) {
+        return;
+    }
+
+    for (int line = 0; line < new.lines; ++line) {
+        for (int col = 0; col < new.cols; ++col) {
+            if (char_at(layer->text, line, col) != char_at(layer->prev_text, line, col)) {
+                const pixman_box32_t cell = cell_box(&new, line, col);
+                damage_box(damage, &cell);
+            }
+        }
+    }
+}
+
+static struct glyph_atlas *layer_atlas(struct layer *layer, int unit)
+{
+    tll_foreach(layer->atlases, it) {
+        if (it->item->unit == unit) {
+            return it->item;
+        }
+    }
+
+    struct glyph_atlas *atlas = glyph_atlas_get(unit);
+    if (atlas != NULL) {
+        tll_push_back(layer->atlases, atlas);
+    }
+    return atlas;
+}
+
+static void draw_text(struct layer *layer, pixman_image_t *dst, int width, int height,
+                      int scale, const struct icc_lut *lut)
+{
+    const struct text_layout l = layout_text(layer, layer->text, width, height, scale);
+    if (box_empty(&l.box)) {
+        return;
+    }
+
+    struct glyph_atlas *atlas = layer_atlas(layer, l.unit);
+    if (atlas == NULL) {
+        return;
+    }
+
+    const uint16_t a = (uint16_t)((uint32_t)layer->opacity * layer->color.alpha / 0xffff);
+    pixman_color_t fg = (lut != NULL) ? icc_map_color(lut, layer->color) : layer->color;
+    fg.alpha = a;
+    fg = premultiplied(fg);
+
+    pixman_image_t *fg_pix = pixman_image_create_solid_fill(&fg);
+    pixman_image_t *shadow_pix = pixman_image_create_solid_fill(
+        &(pixman_color_t){ 0, 0, 0, (uint16_t)(a * 0.6) });
+
+    const int off = (l.unit > 1) ? l.unit / 2 : 1;
+
+    for (int line = 0; line < l.lines; ++line) {
+        for (int col = 0; col < l.cols; ++col) {
+            const char c = char_at(layer->text, line, col);
+            if (c == ' ') {
+                continue;
+            }
+
+            const pixman_box32_t cell = cell_box(&l, line, col);
+            glyph_atlas_draw(atlas, c, shadow_pix, dst, cell.x1 + off, cell.y1 + l.unit + off);
+            glyph_atlas_draw(atlas, c, fg_pix, dst, cell.x1, cell.y1 + l.unit);
+        }
+    }
+
+    pixman_image_unref(fg_pix);
+    pixman_image_unref(shadow_pix);
+}
+
+static pixman_image_t *pattern_tile(const struct layer *layer, int scale)
+{
+    const int size = layer->size * scale;
+    const int width = 2 * size;
+    const int height = layer->stripes ? 1 : 2 * size;
+
+    pixman_image_t *tile = pixman_image_create_bits(PIXMAN_a8r8g8b8, width, height, NULL, 0);
+    if (tile == NULL) {
+        return NULL;
+    }
+
+    uint32_t *data = pixman_image_get_data(tile);
+    const uint32_t pixel = premultiply(layer->color, layer->color.alpha >> 8);
+
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            const bool on = layer->stripes ? x < size : (x < size) == (y < size);
+            data[y * width + x] = on ? pixel : 0;
+        }
+    }
+
+    pixman_image_set_repeat(tile, PIXMAN_REPEAT_NORMAL);
+    return tile;
+}
+
+/* Colours of solid and text layers are converted through `lut`, if given */
+static void draw_layer(struct scene *scene, struct layer *layer, pixman_image_t *dst,
+                       int width, int height, int scale, const struct icc_lut *lut)
+{
+    pixman_image_t *src = NULL;
+
+    switch (layer->type) {
+        case LAYER_SOLID: {
+            const pixman_color_t color = premultiplied(
+                (lut != NULL) ? icc_map_color(lut, layer->color) : layer->color);
+            src = pixman_image_create_solid_fill(&color);
+            break;
+        }
+
+        case LAYER_GRADIENT: {
+            const pixman_point_fixed_t p1 = { 0, 0 };
+            const pixman_point_fixed_t p2 = { 0, pixman_int_to_fixed(height) };
+            const pixman_gradient_stop_t stops[] = {
+                { .x = 0,              .color = layer->color },
+                { .x = pixman_fixed_1, .color = layer->color2 },
+            };
+            src = pixman_image_create_linear_gradient(&p1, &p2, stops, 2);
+            break;
+        }
+
+        case LAYER_IMAGE:
+            if ((layer->op == PIXMAN_OP_OVER || layer->op == PIXMAN_OP_SRC) &&
+                layer->opacity == 0xffff) {
+                /* Opaque; scale straight into destination */
+                mip_render_fx(layer->mip, &layer->fx, dst, width, height);
+                return;
+            }
+
+            src = budget_image_create(BUDGET_FLATTENED, PIXMAN_x8r8g8b8, width, height, true);
+            if (src != NULL) {
+                mip_render_fx(layer->mip, &layer->fx, src, width, height);
+            }
+            break;
+
+        case LAYER_PATTERN:
+            src = pattern_tile(layer, scale);
+            break;
+
+        case LAYER_NOISE:
+            pixman_image_set_repeat(layer->image, PIXMAN_REPEAT_NORMAL);
+            src = pixman_image_ref(layer->image);
+            break;
+
+        case LAYER_TEXT:
+            draw_text(layer, dst, width, height, scale, lut);
+            return;
+
+        case LAYER_TIMELINE:
+            timeline_render(layer->timeline, scene->now, dst, width, height);
+            return;
+    }
+
+    if (src == NULL) {
+        LOG_ERR("scene: failed to render layer");
+        return;
+    }
+
+    pixman_image_t *mask = NULL;
+    if (layer->opacity != 0xffff) {
+        mask = pixman_image_create_solid_fill(&(pixman_color_t){ 0, 0, 0, layer->opacity });
+    }
+
+    pixman_image_composite32(
+        layer->op,
+        src, mask, dst, 0, 0, 0, 0, 0, 0,
+        width, height);
+
+    if (mask != NULL) {
+        pixman_image_unref(mask);
+    }
+    pixman_image_unref(src);
+}
+
+/* Whether layer alone fully determines every pixel beneath it */
+static bool layer_covers(const struct layer *layer)
+{
+    switch (layer->type) {
+        case LAYER_SOLID:
+            if (layer->color.alpha != 0xffff) {
+                return false;
+            }
+            break;
+        case LAYER_GRADIENT:
+            if (layer->color.alpha != 0xffff || layer->color2.alpha != 0xffff) {
+                return false;
+            }
+            break;
+        case LAYER_IMAGE:
+        case LAYER_TIMELINE:
+            break;
+        default:
+            return false;
+    }
+
+    return (layer->op == PIXMAN_OP_OVER || layer->op == PIXMAN_OP_SRC) &&
+           layer->opacity == 0xffff;
+}
+
+/* Moves what is found to the back; the front is least recently used */
+static const struct flat *cache_find(struct scene *scene, uint64_t key, int width, int height)
+{
+    tll_foreach(scene->cache, it) {
+        if (it->item.key == key && it->item.width == width && it->item.height == height) {
+            const struct flat found = it->item;
+            tll_remove(scene->cache, it);
+            tll_push_back(scene->cache, found);
+            return &tll_back(scene->cache);
+        }
+    }
+    return NULL;
+}
+
+static void cache_store(struct scene *scene, uint64_t key, pixman_image_t *src,
+                        int width, int height, int scale, const struct icc_lut *lut)
+{
+    /* Older content for the same output is not coming back; that of other
+     * outputs (size, scale or profile) is left to the LRU */
+    const struct flat like = {
+        .key = key, .width = width, .height = height, .scale = scale, .lut = lut,
+    };
+    cache_drop(scene, &like);
+
+    if (tll_length(scene->cache) >= SCENE_CACHE_MAX) {
+        struct flat old = tll_pop_front(scene->cache);
+        pixman_image_unref(old.pix);
+    }
+
+    /* Over budget, older sizes make room; else layers are drawn each time.
+     * Caches of this scene are not reclaimed by the budget meanwhile, as
+     * its lock is held by the caller */
+    pixman_image_t *pix;
+    while ((pix = budget_image_create(BUDGET_FLATTENED, PIXMAN_x8r8g8b8,
+                                      width, height, false)) == NULL &&
+           tll_length(scene->cache) > 0) {
+        struct flat old = tll_pop_front(scene->cache);
+        pixman_image_unref(old.pix);
+    }
+    if (pix == NULL) {
+        return;
+    }
+
+    pixman_image_composite32(
+        PIXMAN_OP_SRC,
+        src, NULL, pix, 0, 0, 0, 0, 0, 0,
+        width, height);
+
+    struct flat flat = like;
+    flat.pix = pix;
+    tll_push_back(scene->cache, flat);
+}
+
+/* Key of the static layers, as flattened for given scale and display */
+static uint64_t static_key(const struct scene *scene, size_t split, int scale,
+                           const struct icc_lut *lut)
+{
+    return hash_u64(combine_keys(scene, split, scale), (uint64_t)(uintptr_t)lut);
+}
+
+/* Draws layers [0, split), converted for display as a whole */
+static void render_static(struct scene *scene, size_t split, pixman_image_t *dst,
+                          int width, int height, int scale, const struct icc_lut *lut)
+{
+    /* Whatever is beneath the topmost opaque layer is not visible */
+    size_t first = split;
+    while (first > 0 && !layer_covers(&scene->layers[first - 1])) {
+        first--;
+    }
+    first = (first > 0) ? first - 1 : 0;
+
+    if (split == 0 || !layer_covers(&scene->layers[first])) {
+        pixman_image_fill_boxes(
+            PIXMAN_OP_SRC, dst, &(pixman_color_t){ 0, 0, 0, 0xffff },
+            1, &(pixman_box32_t){ 0, 0, width, height });
+    }
+
+    /* Single solid colour is converted once, rather than per pixel */
+    const bool solid = split > 0 && first == split - 1 &&
+                       scene->layers[first].type == LAYER_SOLID;
+
+    for (size_t i = first; i < split; ++i) {
+        draw_layer(scene, &scene->layers[i], dst, width, height, scale, solid ? lut : NULL);
+    }
+
+    if (lut != NULL && !solid) {
+        icc_apply(lut, dst, &(pixman_box32_t){ 0, 0, width, height });
+    }
+}
+
+void scene_render(struct scene *scene, pixman_image_t *dst, int width, int height,
+                  int scale, const struct icc_lut *lut)
+{
+    const size_t split = first_dynamic(scene);
+    const uint64_t key = static_key(scene, split, scale, lut);
+
+    const struct flat *flat = (split < scene->count)
+        ? cache_find(scene, key, width, height)
+        : NULL;
+
+    if (flat != NULL) {
+        pixman_image_composite32(
+            PIXMAN_OP_SRC,
+            flat->pix, NULL, dst, 0, 0, 0, 0, 0, 0,
+            width, height);
+    } else {
+        render_static(scene, split, dst, width, height, scale, lut);
+
+        if (split < scene->count) {
+            cache_store(scene, key, dst, width, height, scale, lut);
+        }
+    }
+
+    for (size_t i = split; i < scene->count; ++i) {
+        draw_layer(scene, &scene->layers[i], dst, width, height, scale, lut);
+    }
+}
+
+void scene_update(struct scene *scene, pixman_image_t *dst, int width, int height,
+                  int scale, const struct icc_lut *lut, pixman_region32_t *damage)
+{
+    const size_t split = first_dynamic(scene);
+    const struct flat *flat = cache_find(
+        scene, static_key(scene, split, scale, lut), width, height);
+
+    bool full = flat == NULL;
+
+    pixman_region32_t changed;
+    pixman_region32_init(&changed);
+
+    for (size_t i = 0; i < scene->count && !full; ++i) {
+        const struct layer *layer = &scene->layers[i];
+        if (layer->key == layer->prev_key) {
+            continue;
+        }
+
+        if (layer->type == LAYER_TEXT) {
+            text_damage(layer, width, height, scale, &changed);
+        } else {
+            full = true; /* e.g. timeline moved on */
+        }
+    }
+
+    if (full) {
+        scene_render(scene, dst, width, height, scale, lut);
+        pixman_region32_union_rect(damage, damage, 0, 0, width, height);
+        pixman_region32_fini(&changed);
+        return;
+    }
+
+    if (pixman_region32_not_empty(&changed)) {
+        /* Static content back under the changed area, then everything above */
+        pixman_image_set_clip_region32(dst, &changed);
+
+        pixman_image_composite32(
+            PIXMAN_OP_SRC,
+            flat->pix, NULL, dst, 0, 0, 0, 0, 0, 0,
+            width, height);
+
+        for (size_t i = split; i < scene->count; ++i) {
+            draw_layer(scene, &scene->layers[i], dst, width, height, scale, lut);
+        }
+
+        pixman_image_set_clip_region32(dst, NULL);
+        pixman_region32_union(damage, damage, &changed);
+    }
+
+    pixman_region32_fini(&changed);
+}
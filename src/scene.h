@@ -0,0 +1,78 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#ifndef SCENE_H_
+#define SCENE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <pixman.h>
+
+#include "icc.h"
+#include "timeline.h"
+
+/*
+ * Wallpaper as a stack of layers, bottom first. Layers below the first
+ * dynamic one (text) are static; their flattened result is cached, so
+ * that dynamic layers can be recomposited over just the area they change.
+ */
+struct scene;
+
+/* In `preview`, images are not decoded but stand in as their stored colour
+ * (see image_peek()) */
+struct scene *scene_create(bool preview);
+void scene_destroy(struct scene *scene);
+
+/*
+ * Appends layer described as `TYPE ARGS... [op=OP] [opacity=PERCENT]`:
+ *
+ *     solid COLOR
+ *     gradient COLOR:COLOR         (top to bottom)
+ *     image PATH                   (GIF, scaled to cover)
+ *     pattern checker|stripes SIZE COLOR
+ *     noise PERCENT
+ *     text [size=N] [color=COLOR] FORMAT...
+ *
+ * Text is placed in the bottom right corner; FORMAT is for strftime(),
+ * `{host}` being replaced by the hostname.
+ */
+bool scene_add(struct scene *scene, const char *line);
+
+/* Appends layers listed in file, one per line */
+bool scene_load(struct scene *scene, const char *path);
+
+/* Appends timeline (still owned by caller) as a layer */
+void scene_add_timeline(struct scene *scene, struct timeline *tl);
+
+/* Releases what only rendering at a new size needs (image pyramids) */
+void scene_trim(struct scene *scene);
+
+/* Frees flattened layers, least recently used first, until `wanted` bytes
+ * are freed; then also pyramids, effects and timeline content */
+void scene_reclaim(struct scene *scene, size_t wanted);
+
+/* Evaluates layers at `now`; returns whether dynamic layers have changed */
+bool scene_advance(struct scene *scene, time_t now);
+
+/* Seconds between changes of dynamic layers, 0 if there are none */
+int scene_period(const struct scene *scene);
+
+/* Identifies rendered content, as of the last and the one before last advance */
+uint64_t scene_key(const struct scene *scene, int scale, const struct icc_lut *lut);
+uint64_t scene_prev_key(const struct scene *scene, int scale, const struct icc_lut *lut);
+
+/* Renders scene, converted for display by `lut` (NULL if not managed) */
+void scene_render(struct scene *scene, pixman_image_t *dst, int width, int height,
+                  int scale, const struct icc_lut *lut);
+
+/*
+ * Brings `dst`, holding the scene as of scene_prev_key(), up to date by
+ * recompositing only changed areas, which are added to `damage`.
+ */
+void scene_update(struct scene *scene, pixman_image_t *dst, int width, int height,
+                  int scale, const struct icc_lut *lut, pixman_region32_t *damage);
+
+#endif // SCENE_H_
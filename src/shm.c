@@ -8,6 +8,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <unistd.h>
 
 #include <sys/types.h>
@@ -16,6 +17,7 @@
 
 #include <tllist.h>
 
+#include "budget.h"
 #include "log.h"
 #include "stride.h"
 
@@ -27,101 +29,201 @@
  #define MFD_NOEXEC_SEAL 0
 #endif
 
+/*
+ * Memory of some rendered content, identified by cookie and size. Kept
+ * open, so that every connection showing the content can create its own
+ * wl_buffer from it.
+ */
+struct blob {
+    unsigned long cookie;
+    int width;
+    int height;
+    int refcount;
+    bool ready; /* content matches cookie; not being (re)rendered */
+
+    int fd;
+    size_t size;
+    void *mmapped;
+};
+
+/* Outputs may be served from different threads */
+static tll(struct blob *) blobs;
+static pthread_mutex_t blobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t blobs_cond = PTHREAD_COND_INITIALIZER;
+
+static void blob_unref(struct blob *blob)
+{
+    pthread_mutex_lock(&blobs_lock);
+
+    if (--blob->refcount > 0) {
+        pthread_mutex_unlock(&blobs_lock);
+        return;
+    }
+
+    tll_foreach(blobs, it) {
+        if (it->item == blob) {
+            tll_remove(blobs, it);
+            break;
+        }
+    }
+
+    /* Someone may be waiting for content which is not coming */
+    pthread_cond_broadcast(&blobs_cond);
+    pthread_mutex_unlock(&blobs_lock);
+
+    munmap(blob->mmapped, blob->size);
+    close(blob->fd);
+    budget_release(BUDGET_BUFFERS, blob->size);
+    free(blob);
+}
+
 static void buffer_destroy(struct buffer *buf)
 {
     pixman_image_unref(buf->pix);
-    wl_buffer_destroy(buf->wl_buf);
-    munmap(buf->mmapped, buf->size);
+    if (buf->wl_buf != NULL) {
+        wl_buffer_destroy(buf->wl_buf);
+    }
+    if (buf->canvas != NULL) {
+        shm_canvas_unref(buf->canvas);
+    } else if (buf->blob != NULL) {
+        blob_unref(buf->blob);
+    } else {
+        munmap(buf->mmapped, buf->size);
+        budget_release(BUDGET_BUFFERS, buf->size);
+    }
     free(buf);
 }
 
 static void buffer_release(void *data, struct wl_buffer *wl_buffer)
 {
     struct buffer *buffer = data;
-    buffer_destroy(buffer);
+    buffer->busy = false;
+
+    if (buffer->purge) {
+        buffer_destroy(buffer);
+    }
 }
 
 static const struct wl_buffer_listener buffer_listener = {
     .release = &buffer_release,
 };
 
-struct buffer *shm_get_buffer(struct wl_shm *shm, int width, int height, unsigned long cookie)
+/*
+ * Opens a memory backed "file" of given size and maps it. On success,
+ * returns the file descriptor and stores the mapping in *mmapped.
+ */
+static int memfd_map(size_t size, void **mmapped)
 {
-    /*
-     * 1. open a memory backed "file" with memfd_create()
-     * 2. mmap() the memory file, to be used by the pixman image
-     * 3. create a wayland shm buffer for the same memory file
-     *
-     * The pixman image and the wayland buffer are now sharing memory.
-     */
-
-    int pool_fd = -1;
-    void *mmapped = NULL;
-    size_t size = 0;
-
-    struct wl_shm_pool *pool = NULL;
-    struct wl_buffer *buf = NULL;
-    pixman_image_t *pix = NULL;
-
-    /* Backing memory for SHM */
-
     /*
      * Older kernels reject MFD_NOEXEC_SEAL with EINVAL. Try first
      * *with* it, and if that fails, try again *without* it.
      */
     errno = 0;
-    pool_fd = memfd_create(
+    int fd = memfd_create(
         "wbg-wayland-shm-buffer-pool",
         MFD_CLOEXEC | MFD_ALLOW_SEALING | MFD_NOEXEC_SEAL);
 
-    if (pool_fd < 0 && errno == EINVAL) {
-        pool_fd = memfd_create(
+    if (fd < 0 && errno == EINVAL) {
+        fd = memfd_create(
             "wbg-wayland-shm-buffer-pool", MFD_CLOEXEC | MFD_ALLOW_SEALING);
     }
 
-    if (pool_fd == -1) {
+    if (fd == -1) {
         LOG_ERRNO("failed to create SHM backing memory file");
-        goto err;
+        return -1;
     }
 
-    /* Total size */
-    const uint32_t stride = stride_for_format_and_width(PIXMAN_x8r8g8b8, width);
-    size = stride * height;
-    if (ftruncate(pool_fd, size) == -1) {
+    if (ftruncate(fd, size) == -1) {
         LOG_ERRNO("failed to truncate SHM pool");
-        goto err;
+        close(fd);
+        return -1;
     }
 
-    mmapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, pool_fd, 0);
-    if (mmapped == MAP_FAILED) {
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
         LOG_ERR("failed to mmap SHM backing memory file");
-        goto err;
+        close(fd);
+        return -1;
     }
 
     /* Seal file - we no longer allow any kind of resizing */
     /* TODO: wayland mmaps(PROT_WRITE), for some unknown reason, hence we cannot use F_SEAL_FUTURE_WRITE */
-    if (fcntl(pool_fd, F_ADD_SEALS,
+    if (fcntl(fd, F_ADD_SEALS,
               F_SEAL_GROW | F_SEAL_SHRINK | /*F_SEAL_FUTURE_WRITE |*/ F_SEAL_SEAL) < 0) {
         LOG_ERRNO("failed to seal SHM backing memory file");
         /* This is not a fatal error */
     }
 
-    pool = wl_shm_create_pool(shm, pool_fd, size);
-    if (pool == NULL) {
-        LOG_ERR("failed to create SHM pool");
-        goto err;
-    }
+    *mmapped = map;
+    return fd;
+}
 
-    buf = wl_shm_pool_create_buffer(
-        pool, 0, width, height, stride, WL_SHM_FORMAT_XRGB8888);
+void shm_buffer_discard(struct buffer *buf)
+{
     if (buf == NULL) {
-        LOG_ERR("failed to create SHM buffer");
+        return;
+    }
+
+    /* Compositor may still be reading from it; destroy once released */
+    if (buf->busy) {
+        buf->purge = true;
+        return;
+    }
+
+    buffer_destroy(buf);
+}
+
+struct buffer *shm_get_buffer(struct wl_shm *shm, int width, int height, unsigned long cookie)
+{
+    /*
+     * 1. open a memory backed "file" with memfd_create()
+     * 2. mmap() the memory file, to be used by the pixman image
+     * 3. create a wayland shm buffer for the same memory file
+     *
+     * The pixman image and the wayland buffer are now sharing memory.
+     */
+
+    int pool_fd = -1;
+    void *mmapped = NULL;
+    size_t size = 0;
+
+    struct wl_shm_pool *pool = NULL;
+    struct wl_buffer *buf = NULL;
+    pixman_image_t *pix = NULL;
+
+    /* Total size */
+    const uint32_t stride = stride_for_format_and_width(PIXMAN_x8r8g8b8, width);
+    size = stride * height;
+
+    if (!budget_reserve(BUDGET_BUFFERS, size)) {
+        return NULL;
+    }
+
+    /* Backing memory for SHM */
+    pool_fd = memfd_map(size, &mmapped);
+    if (pool_fd == -1) {
         goto err;
     }
 
-    /* We use the entire pool for our single buffer */
-    wl_shm_pool_destroy(pool);
-    pool = NULL;
+    if (shm != NULL) {
+        pool = wl_shm_create_pool(shm, pool_fd, size);
+        if (pool == NULL) {
+            LOG_ERR("failed to create SHM pool");
+            goto err;
+        }
+
+        buf = wl_shm_pool_create_buffer(
+            pool, 0, width, height, stride, WL_SHM_FORMAT_XRGB8888);
+        if (buf == NULL) {
+            LOG_ERR("failed to create SHM buffer");
+            goto err;
+        }
+
+        /* We use the entire pool for our single buffer */
+        wl_shm_pool_destroy(pool);
+        pool = NULL;
+    }
+
     close(pool_fd);
     pool_fd = -1;
 
@@ -138,14 +240,16 @@ struct buffer *shm_get_buffer(struct wl_shm *shm, int width, int height, unsigne
         .height = height,
         .stride = stride,
         .cookie = cookie,
-        .busy = true,
+        .busy = false,
         .size = size,
         .mmapped = mmapped,
         .wl_buf = buf,
         .pix = pix,
     };
 
-    wl_buffer_add_listener(buffer->wl_buf, &buffer_listener, buffer);
+    if (buffer->wl_buf != NULL) {
+        wl_buffer_add_listener(buffer->wl_buf, &buffer_listener, buffer);
+    }
     return buffer;
 
 err:
@@ -165,5 +269,283 @@ err:
         munmap(mmapped, size);
     }
 
+    budget_release(BUDGET_BUFFERS, size);
     return NULL;
 }
+
+static struct blob *blob_find(int width, int height, unsigned long cookie)
+{
+    tll_foreach(blobs, it) {
+        struct blob *blob = it->item;
+        if (blob->cookie == cookie && blob->width == width && blob->height == height) {
+            return blob;
+        }
+    }
+    return NULL;
+}
+
+static struct blob *blob_get(int width, int height, unsigned long cookie, bool *fresh)
+{
+    pthread_mutex_lock(&blobs_lock);
+
+    struct blob *found;
+    while ((found = blob_find(width, height, cookie)) != NULL && !found->ready) {
+        pthread_cond_wait(&blobs_cond, &blobs_lock);
+    }
+
+    if (found != NULL) {
+        found->refcount++;
+        pthread_mutex_unlock(&blobs_lock);
+        *fresh = false;
+        return found;
+    }
+
+    const size_t size = (size_t)stride_for_format_and_width(PIXMAN_x8r8g8b8, width) * height;
+    if (!budget_reserve(BUDGET_BUFFERS, size)) {
+        pthread_mutex_unlock(&blobs_lock);
+        return NULL;
+    }
+
+    void *mmapped;
+    const int fd = memfd_map(size, &mmapped);
+    if (fd == -1) {
+        budget_release(BUDGET_BUFFERS, size);
+        pthread_mutex_unlock(&blobs_lock);
+        return NULL;
+    }
+
+    struct blob *blob = malloc(sizeof (*blob));
+    *blob = (struct blob){
+        .cookie = cookie,
+        .width = width,
+        .height = height,
+        .refcount = 1,
+        .ready = false,
+        .fd = fd,
+        .size = size,
+        .mmapped = mmapped,
+    };
+
+    tll_push_back(blobs, blob);
+    pthread_mutex_unlock(&blobs_lock);
+
+    *fresh = true;
+    return blob;
+}
+
+struct buffer *shm_get_shared_buffer(struct wl_shm *shm, int width, int height,
+                                     unsigned long cookie, bool *fresh)
+{
+    struct blob *blob = blob_get(width, height, cookie, fresh);
+    if (blob == NULL) {
+        return NULL;
+    }
+
+    const int stride = stride_for_format_and_width(PIXMAN_x8r8g8b8, width);
+
+    struct wl_shm_pool *pool = wl_shm_create_pool(shm, blob->fd, blob->size);
+    if (pool == NULL) {
+        LOG_ERR("failed to create SHM pool");
+        blob_unref(blob);
+        return NULL;
+    }
+
+    struct wl_buffer *buf = wl_shm_pool_create_buffer(
+        pool, 0, width, height, stride, WL_SHM_FORMAT_XRGB8888);
+    wl_shm_pool_destroy(pool);
+    if (buf == NULL) {
+        LOG_ERR("failed to create SHM buffer");
+        blob_unref(blob);
+        return NULL;
+    }
+
+    pixman_image_t *pix = pixman_image_create_bits_no_clear(
+        PIXMAN_x8r8g8b8, width, height, blob->mmapped, stride);
+    if (pix == NULL) {
+        LOG_ERR("failed to create pixman image");
+        wl_buffer_destroy(buf);
+        blob_unref(blob);
+        return NULL;
+    }
+
+    struct buffer *buffer = malloc(sizeof (*buffer));
+    *buffer = (struct buffer){
+        .width = width,
+        .height = height,
+        .stride = stride,
+        .cookie = cookie,
+        .busy = false,
+        .size = blob->size,
+        .mmapped = blob->mmapped,
+        .wl_buf = buf,
+        .pix = pix,
+        .blob = blob,
+    };
+
+    wl_buffer_add_listener(buffer->wl_buf, &buffer_listener, buffer);
+    return buffer;
+}
+
+bool shm_buffer_shared(const struct buffer *buf)
+{
+    if (buf->canvas != NULL) {
+        return true;
+    }
+    if (buf->blob == NULL) {
+        return false;
+    }
+
+    pthread_mutex_lock(&blobs_lock);
+    const bool shared = buf->blob->refcount > 1;
+    pthread_mutex_unlock(&blobs_lock);
+
+    return shared;
+}
+
+bool shm_buffer_claim(struct buffer *buf)
+{
+    if (buf->canvas != NULL) {
+        return false;
+    }
+    if (buf->blob == NULL) {
+        return true;
+    }
+
+    pthread_mutex_lock(&blobs_lock);
+    const bool exclusive = buf->blob->refcount == 1;
+    if (exclusive) {
+        buf->blob->ready = false;
+    }
+    pthread_mutex_unlock(&blobs_lock);
+
+    return exclusive;
+}
+
+void shm_buffer_publish(struct buffer *buf, unsigned long cookie)
+{
+    buf->cookie = cookie;
+    if (buf->blob == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&blobs_lock);
+    buf->blob->cookie = cookie;
+    buf->blob->ready = true;
+    pthread_cond_broadcast(&blobs_cond);
+    pthread_mutex_unlock(&blobs_lock);
+}
+
+struct canvas *shm_canvas_create(struct wl_shm *shm, int width, int height)
+{
+    void *mmapped = NULL;
+    const int stride = stride_for_format_and_width(PIXMAN_x8r8g8b8, width);
+    const size_t size = (size_t)stride * height;
+
+    if (!budget_reserve(BUDGET_BUFFERS, size)) {
+        return NULL;
+    }
+
+    int pool_fd = memfd_map(size, &mmapped);
+    if (pool_fd == -1) {
+        budget_release(BUDGET_BUFFERS, size);
+        return NULL;
+    }
+
+    /* Unlike in shm_get_buffer(), the pool is kept alive, so that views
+     * can be carved out of it whenever an output needs one */
+    struct wl_shm_pool *pool = wl_shm_create_pool(shm, pool_fd, size);
+    close(pool_fd);
+    if (pool == NULL) {
+        LOG_ERR("failed to create SHM pool");
+        munmap(mmapped, size);
+        budget_release(BUDGET_BUFFERS, size);
+        return NULL;
+    }
+
+    pixman_image_t *pix = pixman_image_create_bits_no_clear(
+        PIXMAN_x8r8g8b8, width, height, mmapped, stride);
+    if (pix == NULL) {
+        LOG_ERR("failed to create pixman image");
+        wl_shm_pool_destroy(pool);
+        munmap(mmapped, size);
+        budget_release(BUDGET_BUFFERS, size);
+        return NULL;
+    }
+
+    struct canvas *canvas = malloc(sizeof (*canvas));
+    *canvas = (struct canvas){
+        .width = width,
+        .height = height,
+        .stride = stride,
+        .size = size,
+        .mmapped = mmapped,
+        .refcount = 1,
+        .pool = pool,
+        .pix = pix,
+    };
+
+    return canvas;
+}
+
+struct canvas *shm_canvas_ref(struct canvas *canvas)
+{
+    canvas->refcount++;
+    return canvas;
+}
+
+void shm_canvas_unref(struct canvas *canvas)
+{
+    if (canvas == NULL || --canvas->refcount > 0) {
+        return;
+    }
+
+    pixman_image_unref(canvas->pix);
+    wl_shm_pool_destroy(canvas->pool);
+    munmap(canvas->mmapped, canvas->size);
+    budget_release(BUDGET_BUFFERS, canvas->size);
+    free(canvas);
+}
+
+struct buffer *shm_canvas_view(struct canvas *canvas, int x, int y,
+                               int width, int height, unsigned long cookie)
+{
+    assert(x >= 0 && y >= 0);
+    assert(x + width <= canvas->width && y + height <= canvas->height);
+
+    const int32_t offset = y * canvas->stride + x * 4;
+    uint8_t *origin = (uint8_t *)canvas->mmapped + offset;
+
+    /* Both the wl_buffer and the pixman image alias the canvas memory;
+     * nothing gets copied */
+    struct wl_buffer *buf = wl_shm_pool_create_buffer(
+        canvas->pool, offset, width, height, canvas->stride, WL_SHM_FORMAT_XRGB8888);
+    if (buf == NULL) {
+        LOG_ERR("failed to create SHM buffer");
+        return NULL;
+    }
+
+    pixman_image_t *pix = pixman_image_create_bits_no_clear(
+        PIXMAN_x8r8g8b8, width, height, (uint32_t *)origin, canvas->stride);
+    if (pix == NULL) {
+        LOG_ERR("failed to create pixman image");
+        wl_buffer_destroy(buf);
+        return NULL;
+    }
+
+    struct buffer *buffer = malloc(sizeof (*buffer));
+    *buffer = (struct buffer){
+        .width = width,
+        .height = height,
+        .stride = canvas->stride,
+        .cookie = cookie,
+        .busy = false,
+        .size = (size_t)canvas->stride * height,
+        .mmapped = origin,
+        .wl_buf = buf,
+        .pix = pix,
+        .canvas = shm_canvas_ref(canvas),
+    };
+
+    wl_buffer_add_listener(buffer->wl_buf, &buffer_listener, buffer);
+    return buffer;
+}
@@ -12,21 +12,67 @@
 #include <pixman.h>
 #include <wayland-client.h>
 
+struct canvas;
+struct blob;
+
 struct buffer {
     int width;
     int height;
     int stride;
     unsigned long cookie;
 
-    bool busy;
-    bool purge;
+    bool busy;  /* attached, and not yet released by compositor */
+    bool purge; /* destroy once released */
     size_t size;
     void *mmapped;
 
     struct wl_buffer *wl_buf;
     pixman_image_t *pix;
+
+    struct canvas *canvas; /* set if buffer is a view into a canvas */
+    struct blob *blob;     /* set if memory is shared by content */
+};
+
+/* Single SHM pool, out of which several buffers can be carved */
+struct canvas {
+    int width;
+    int height;
+    int stride;
+    int refcount;
+
+    size_t size;
+    void *mmapped;
+
+    struct wl_shm_pool *pool;
+    pixman_image_t *pix;
 };
 
+/* Without `shm` (i.e. headless), buffer has memory but no wl_buffer */
 struct buffer *shm_get_buffer(struct wl_shm *shm, int width, int height, unsigned long cookie);
+void shm_buffer_discard(struct buffer *buf);
+
+/*
+ * Buffer whose memory is shared with all other (shared) buffers of the
+ * same size and cookie, whichever connection or thread they belong to.
+ * `*fresh` is set if memory has just been allocated; content is then to
+ * be rendered and published, while others asking for it wait.
+ */
+struct buffer *shm_get_shared_buffer(struct wl_shm *shm, int width, int height,
+                                     unsigned long cookie, bool *fresh);
+
+/* Whether memory is shared, thus not freed along with the buffer */
+bool shm_buffer_shared(const struct buffer *buf);
+
+/* Takes hold of memory to change it in place; fails if it is shared */
+bool shm_buffer_claim(struct buffer *buf);
+
+/* Memory now holds content identified by `cookie` */
+void shm_buffer_publish(struct buffer *buf, unsigned long cookie);
+
+struct canvas *shm_canvas_create(struct wl_shm *shm, int width, int height);
+struct canvas *shm_canvas_ref(struct canvas *canvas);
+void shm_canvas_unref(struct canvas *canvas);
+struct buffer *shm_canvas_view(struct canvas *canvas, int x, int y,
+                               int width, int height, unsigned long cookie);
 
 #endif // SHM_H_
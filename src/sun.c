@@ -0,0 +1,71 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#include "sun.h"
+
+#include <math.h>
+
+#define J2000 946728000 /* 2000-01-01 12:00 UTC */
+#define DAY   86400
+
+static double rad(double deg)
+{
+    return deg * M_PI / 180;
+}
+
+static double deg(double rad)
+{
+    return rad * 180 / M_PI;
+}
+
+/* Low precision solar coordinates (Astronomical Almanac) */
+static void sun_position(time_t t, double *declination, double *eq_of_time)
+{
+    const double n = (double)(t - J2000) / DAY;
+
+    const double L = fmod(280.460 + 0.9856474 * n, 360);
+    const double g = rad(357.528 + 0.9856003 * n);
+    const double lambda = rad(L + 1.915 * sin(g) + 0.020 * sin(2 * g));
+    const double eps = rad(23.439 - 0.0000004 * n);
+
+    *declination = asin(sin(eps) * sin(lambda));
+
+    const double ra = deg(atan2(cos(eps) * sin(lambda), cos(lambda)));
+    *eq_of_time = remainder(L - ra, 360); /* degrees; 1° is 4 minutes */
+}
+
+bool sun_crossing(const struct sun_location *loc, time_t t,
+                  double elevation, bool rising, time_t *when)
+{
+    const double lat = rad(loc->lat);
+
+    /* Start from the solar noon and refine using sun position at the
+     * estimated crossing; one round is enough for minute precision */
+    double estimate = (double)t;
+    for (int i = 0; i < 2; ++i) {
+        double dec, eot;
+        sun_position((time_t)estimate, &dec, &eot);
+
+        /* Solar noon is when the hour angle is zero */
+        const time_t midnight = t - (((t % DAY) + DAY) % DAY);
+        double noon = midnight + (180 - loc->lon - eot) * 240;
+        if (noon - t > DAY / 2) {
+            noon -= DAY;
+        } else if (t - noon > DAY / 2) {
+            noon += DAY;
+        }
+
+        const double cos_h = (sin(rad(elevation)) - sin(lat) * sin(dec)) /
+                             (cos(lat) * cos(dec));
+        if (cos_h < -1 || cos_h > 1) {
+            return false;
+        }
+
+        const double h = deg(acos(cos_h)) * 240; /* seconds */
+        estimate = rising ? noon - h : noon + h;
+    }
+
+    *when = (time_t)estimate;
+    return true;
+}
@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#ifndef SUN_H_
+#define SUN_H_
+
+#include <stdbool.h>
+#include <time.h>
+
+struct sun_location {
+    double lat; /* degrees, north positive */
+    double lon; /* degrees, east positive */
+};
+
+/*
+ * Finds when the sun crosses `elevation` (degrees above horizon) while
+ * rising or setting, on the solar day whose noon is nearest to `t`.
+ * Returns false if it does not cross it that day (polar day or night).
+ * Accurate to about a minute, which is plenty for a wallpaper.
+ */
+bool sun_crossing(const struct sun_location *loc, time_t t,
+                  double elevation, bool rising, time_t *when);
+
+#endif // SUN_H_
@@ -0,0 +1,500 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#include "timeline.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <tllist.h>
+
+#include "budget.h"
+#include "color.h"
+#include "image.h"
+#include "limit.h"
+#include "log.h"
+#include "mip.h"
+
+/* Distinct frames rendered during one transition */
+#define TIMELINE_STEPS 64
+
+/* Default transition length, in minutes */
+#define TIMELINE_FADE 30
+
+enum content_type {
+    CONTENT_COLOR,
+    CONTENT_GRADIENT,
+    CONTENT_IMAGE,
+};
+
+struct content {
+    enum content_type type;
+    pixman_color_t top;
+    pixman_color_t bottom;
+    struct mip *mip;       /* decoded at load time, in its own size */
+};
+
+enum when_type {
+    WHEN_CLOCK,
+    WHEN_RISE,
+    WHEN_SET,
+};
+
+struct keyframe {
+    enum when_type when;
+    int minutes;      /* since local midnight, WHEN_CLOCK */
+    double elevation; /* degrees, WHEN_RISE and WHEN_SET */
+    int fade;         /* seconds */
+    struct content content;
+};
+
+/* Keyframe image scaled to an output size */
+struct cached {
+    const struct keyframe *key;
+    int width;
+    int height;
+    pixman_image_t *pix;
+};
+
+struct event {
+    time_t time;
+    const struct keyframe *key;
+};
+
+/* What is shown at a point in time */
+struct state {
+    const struct keyframe *from;
+    const struct keyframe *to; /* NULL unless transitioning */
+    int step;                  /* progress of transition, 0..TIMELINE_STEPS-1 */
+    time_t next_change;
+};
+
+struct timeline {
+    struct keyframe *keys;
+    size_t count;
+
+    struct sun_location loc;
+    bool have_loc;
+
+    tll(struct cached) cache;
+};
+
+static bool parse_when(const char *str, struct keyframe *key)
+{
+    static const struct {
+        const char *name;
+        enum when_type when;
+        double elevation;
+    } aliases[] = {
+        { "dawn",    WHEN_RISE, -6 },
+        { "sunrise", WHEN_RISE, -0.833 }, /* upper limb, with refraction */
+        { "sunset",  WHEN_SET,  -0.833 },
+        { "dusk",    WHEN_SET,  -6 },
+    };
+
+    for (size_t i = 0; i < sizeof (aliases) / sizeof (aliases[0]); ++i) {
+        if (strcmp(str, aliases[i].name) == 0) {
+            key->when = aliases[i].when;
+            key->elevation = aliases[i].elevation;
+            return true;
+        }
+    }
+
+    const bool rise = strncmp(str, "rise:", 5) == 0;
+    const bool set = strncmp(str, "set:", 4) == 0;
+    if (rise || set) {
+        const char *num = strchr(str, ':') + 1;
+        char *end;
+        errno = 0;
+        key->elevation = strtod(num, &end);
+        key->when = rise ? WHEN_RISE : WHEN_SET;
+        return errno == 0 && end != num && *end == '\0' &&
+               key->elevation > -90 && key->elevation < 90;
+    }
+
+    int hours, minutes;
+    char trailing;
+    if (sscanf(str, "%d:%d%c", &hours, &minutes, &trailing) != 2 ||
+        hours < 0 || hours > 23 || minutes < 0 || minutes > 59) {
+        return false;
+    }
+
+    key->when = WHEN_CLOCK;
+    key->minutes = hours * 60 + minutes;
+    return true;
+}
+
+/* Color, vertical gradient `TOP:BOTTOM`, otherwise path to an image */
+static bool parse_content(const char *str, struct content *content, bool preview)
+{
+    const char *reason = color_parse_error(str, &content->top);
+    if (reason == NULL) {
+        content->type = CONTENT_COLOR;
+        content->bottom = content->top;
+        return true;
+    }
+
+    const char *sep = strchr(str, ':');
+    char top[64] = { 0 };
+    if (sep != NULL && sep - str < (ptrdiff_t)sizeof (top)) {
+        memcpy(top, str, sep - str);
+        reason = color_parse_error(top, &content->top);
+        if (reason == NULL) {
+            reason = color_parse_error(sep + 1, &content->bottom);
+        }
+        if (reason == NULL) {
+            content->type = CONTENT_GRADIENT;
+            return true;
+        }
+    }
+
+    if (str[0] == '#' || strchr(str, '(') != NULL) {
+        LOG_ERR("%s: %s", str, reason);
+        return false;
+    }
+
+    pixman_image_t *image = preview ? image_peek(str) : image_load(str);
+    if (image == NULL && preview) {
+        /* No colour stored; black, as the image would be without data */
+        content->type = CONTENT_COLOR;
+        content->top = content->bottom = (pixman_color_t){ 0, 0, 0, 0xffff };
+        return true;
+    }
+    if (image == NULL) {
+        return false;
+    }
+
+    content->type = CONTENT_IMAGE;
+    content->mip = mip_create(image);
+    return true;
+}
+
+struct timeline *timeline_load(const char *path, const struct sun_location *loc, bool preview)
+{
+    FILE *f = fopen(path, "re");
+    if (f == NULL) {
+        LOG_ERRNO("%s: failed to open", path);
+        return NULL;
+    }
+
+    struct timeline *tl = calloc(1, sizeof (*tl));
+    if (loc != NULL) {
+        tl->loc = *loc;
+        tl->have_loc = true;
+    }
+
+    char *line = NULL;
+    size_t line_size = 0;
+    int lineno = 0;
+
+    while (getline(&line, &line_size, f) >= 0) {
+        lineno++;
+
+        char *save;
+        char *when = strtok_r(line, " \t\r\n", &save);
+        if (when == NULL || when[0] == '#') {
+            continue; /* empty line or comment */
+        }
+
+        char *what = strtok_r(NULL, " \t\r\n", &save);
+        char *fade = strtok_r(NULL, " \t\r\n", &save);
+
+        if (tl->count >= LIMIT_KEYFRAMES) {
+            LOG_ERR("%s:%d: more than %d keyframes", path, lineno, LIMIT_KEYFRAMES);
+            goto err;
+        }
+
+        struct keyframe key = { .fade = TIMELINE_FADE * 60 };
+
+        if (!parse_when(when, &key)) {
+            LOG_ERR("%s:%d: invalid time: %s", path, lineno, when);
+            goto err;
+        }
+        if (key.when != WHEN_CLOCK && !tl->have_loc) {
+            LOG_ERR("%s:%d: sun position needs a location", path, lineno);
+            goto err;
+        }
+
+        if (what == NULL || !parse_content(what, &key.content, preview)) {
+            LOG_ERR("%s:%d: invalid content: %s", path, lineno, (what != NULL) ? what : "");
+            goto err;
+        }
+
+        if (fade != NULL) {
+            char *end;
+            errno = 0;
+            const long minutes = strtol(fade, &end, 10);
+            if (errno != 0 || *end != '\0' || minutes < 0 || minutes > 24 * 60) {
+                LOG_ERR("%s:%d: invalid fade time: %s", path, lineno, fade);
+                mip_destroy(key.content.mip);
+                goto err;
+            }
+            key.fade = (int)minutes * 60;
+        }
+
+        tl->keys = realloc(tl->keys, (tl->count + 1) * sizeof (tl->keys[0]));
+        tl->keys[tl->count++] = key;
+    }
+
+    if (tl->count == 0) {
+        LOG_ERR("%s: no keyframes", path);
+        goto err;
+    }
+
+    if (!preview) {
+        LOG_INFO("%s: %zu keyframes", path, tl->count);
+    }
+
+    free(line);
+    fclose(f);
+    return tl;
+
+err:
+    free(line);
+    fclose(f);
+    timeline_destroy(tl);
+    return NULL;
+}
+
+static void cache_drop(struct timeline *tl, const struct keyframe *keep_a,
+                       const struct keyframe *keep_b)
+{
+    tll_foreach(tl->cache, it) {
+        if (it->item.key != keep_a && it->item.key != keep_b) {
+            pixman_image_unref(it->item.pix);
+            tll_remove(tl->cache, it);
+        }
+    }
+}
+
+void timeline_destroy(struct timeline *tl)
+{
+    if (tl == NULL) {
+        return;
+    }
+
+    cache_drop(tl, NULL, NULL);
+
+    for (size_t i = 0; i < tl->count; ++i) {
+        mip_destroy(tl->keys[i].content.mip);
+    }
+
+    free(tl->keys);
+    free(tl);
+}
+
+void timeline_trim(struct timeline *tl)
+{
+    for (size_t i = 0; i < tl->count; ++i) {
+        if (tl->keys[i].content.mip != NULL) {
+            mip_trim(tl->keys[i].content.mip);
+        }
+    }
+}
+
+void timeline_reclaim(struct timeline *tl)
+{
+    /* Images in use by a transition stay referenced by it meanwhile */
+    cache_drop(tl, NULL, NULL);
+    timeline_trim(tl);
+}
+
+/* Time of keyframe on the local day `day` days away from `now` */
+static bool event_time(const struct timeline *tl, const struct keyframe *key,
+                       time_t now, int day, time_t *when)
+{
+    struct tm tm;
+    localtime_r(&now, &tm);
+    tm.tm_mday += day;
+    tm.tm_hour = 12;
+    tm.tm_min = 0;
+    tm.tm_sec = 0;
+    tm.tm_isdst = -1;
+
+    if (key->when == WHEN_CLOCK) {
+        tm.tm_hour = key->minutes / 60;
+        tm.tm_min = key->minutes % 60;
+        *when = mktime(&tm);
+        return true;
+    }
+
+    return sun_crossing(&tl->loc, mktime(&tm), key->elevation,
+                        key->when == WHEN_RISE, when);
+}
+
+static int event_cmp(const void *a, const void *b)
+{
+    const time_t ta = ((const struct event *)a)->time;
+    const time_t tb = ((const struct event *)b)->time;
+    return (ta > tb) - (ta < tb);
+}
+
+static struct state timeline_state(const struct timeline *tl, time_t now)
+{
+    /* Keyframes resolved for yesterday, today and tomorrow */
+    const size_t max_events = tl->count * 3;
+    struct event *events = malloc(max_events * sizeof (events[0]));
+    size_t count = 0;
+
+    for (int day = -1; day <= 1; ++day) {
+        for (size_t i = 0; i < tl->count; ++i) {
+            time_t t;
+            if (event_time(tl, &tl->keys[i], now, day, &t)) {
+                events[count++] = (struct event){ .time = t, .key = &tl->keys[i] };
+            }
+        }
+    }
+
+    qsort(events, count, sizeof (events[0]), &event_cmp);
+
+    const struct event *cur = NULL;
+    const struct event *next = NULL;
+    for (size_t i = 0; i < count; ++i) {
+        if (events[i].time <= now) {
+            cur = &events[i];
+        } else {
+            next = &events[i];
+            break;
+        }
+    }
+
+    struct state state = {
+        .from = (cur != NULL) ? cur->key : &tl->keys[0],
+        .next_change = now + 60 * 60, /* sun may not rise; check again later */
+    };
+
+    if (next != NULL) {
+        /* Transitions end at the keyframe, and do not begin before the
+         * previous keyframe has been reached */
+        time_t start = next->time - next->key->fade;
+        if (cur != NULL && start < cur->time) {
+            start = cur->time;
+        }
+
+        const time_t span = next->time - start;
+
+        if (start > now || span == 0) {
+            state.next_change = (start > now) ? start : next->time;
+        } else {
+            state.to = next->key;
+            state.step = (int)((now - start) * TIMELINE_STEPS / span);
+            state.next_change = start + ((state.step + 1) * span + TIMELINE_STEPS - 1) / TIMELINE_STEPS;
+        }
+    }
+
+    free(events);
+    return state;
+}
+
+time_t timeline_next_change(const struct timeline *tl, time_t now)
+{
+    return timeline_state(tl, now).next_change;
+}
+
+uint64_t timeline_key(const struct timeline *tl, time_t now)
+{
+    const struct state state = timeline_state(tl, now);
+    const uint64_t from = state.from - tl->keys;
+    const uint64_t to = (state.to != NULL) ? state.to - tl->keys + 1 : 0;
+
+    return from << 40 | to << 16 | (uint64_t)state.step;
+}
+
+static pixman_image_t *content_source(struct timeline *tl, const struct keyframe *key,
+                                      int width, int height)
+{
+    const struct content *content = &key->content;
+
+    switch (content->type) {
+        case CONTENT_COLOR:
+            return pixman_image_create_solid_fill(&content->top);
+
+        case CONTENT_GRADIENT: {
+            const pixman_point_fixed_t p1 = { 0, 0 };
+            const pixman_point_fixed_t p2 = { 0, pixman_int_to_fixed(height) };
+            const pixman_gradient_stop_t stops[] = {
+                { .x = 0,              .color = content->top },
+                { .x = pixman_fixed_1, .color = content->bottom },
+            };
+            return pixman_image_create_linear_gradient(&p1, &p2, stops, 2);
+        }
+
+        case CONTENT_IMAGE:
+            break;
+    }
+
+    tll_foreach(tl->cache, it) {
+        if (it->item.key == key && it->item.width == width && it->item.height == height) {
+            return pixman_image_ref(it->item.pix);
+        }
+    }
+
+    pixman_image_t *pix = budget_image_create(BUDGET_FLATTENED, PIXMAN_x8r8g8b8,
+                                              width, height, true);
+    if (pix == NULL) {
+        LOG_ERR("timeline: failed to allocate %dx%d image", width, height);
+        return pixman_image_create_solid_fill(&(pixman_color_t){ 0, 0, 0, 0xffff });
+    }
+
+    mip_render(content->mip, pix, width, height);
+
+    tll_push_back(tl->cache, ((struct cached){
+        .key = key, .width = width, .height = height, .pix = pix,
+    }));
+
+    return pixman_image_ref(pix);
+}
+
+static void composite(pixman_image_t *src, pixman_image_t *mask,
+                      pixman_image_t *dst, int width, int height)
+{
+    pixman_image_composite32(
+        (mask == NULL) ? PIXMAN_OP_SRC : PIXMAN_OP_OVER,
+        src, mask, dst, 0, 0, 0, 0, 0, 0,
+        width, height);
+    pixman_image_unref(src);
+}
+
+void timeline_render(struct timeline *tl, time_t now,
+                     pixman_image_t *dst, int width, int height)
+{
+    const struct state state = timeline_state(tl, now);
+
+    /* Scaled images are only kept for the keyframes on screen */
+    cache_drop(tl, state.from, state.to);
+
+    if (state.to == NULL) {
+        composite(content_source(tl, state.from, width, height), NULL, dst, width, height);
+        return;
+    }
+
+    const double t = (double)state.step / TIMELINE_STEPS;
+    const struct content *a = &state.from->content;
+    const struct content *b = &state.to->content;
+
+    if (a->type != CONTENT_IMAGE && b->type != CONTENT_IMAGE) {
+        /* Blend of two (flat) gradients is a gradient itself */
+        const struct keyframe mixed = {
+            .content = {
+                .type = CONTENT_GRADIENT,
+                .top = color_mix(a->top, b->top, t),
+                .bottom = color_mix(a->bottom, b->bottom, t),
+            },
+        };
+        composite(content_source(tl, &mixed, width, height), NULL, dst, width, height);
+        return;
+    }
+
+    pixman_image_t *alpha = pixman_image_create_solid_fill(
+        &(pixman_color_t){ 0, 0, 0, (uint16_t)(t * 0xffff) });
+
+    composite(content_source(tl, state.from, width, height), NULL, dst, width, height);
+    composite(content_source(tl, state.to, width, height), alpha, dst, width, height);
+
+    pixman_image_unref(alpha);
+}
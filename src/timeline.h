@@ -0,0 +1,50 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#ifndef TIMELINE_H_
+#define TIMELINE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <pixman.h>
+
+#include "sun.h"
+
+struct timeline;
+
+/*
+ * Loads time-of-day timeline from `path`. Each line is a keyframe:
+ *
+ *     WHEN CONTENT [FADE]
+ *
+ * WHEN is local time (`HH:MM`), or sun elevation crossed in the morning
+ * (`rise:DEG`) or evening (`set:DEG`); `sunrise`, `sunset`, `dawn` and
+ * `dusk` are shortcuts. CONTENT is a `#RRGGBB` color, a vertical gradient
+ * `#RRGGBB:#RRGGBB` or a path to a GIF image. The wallpaper cross-fades
+ * into a keyframe during FADE minutes before it (default 30). Sun based
+ * keyframes require `loc`. In `preview`, images are not decoded but stand
+ * in as their stored colour (see image_peek()).
+ */
+struct timeline *timeline_load(const char *path, const struct sun_location *loc, bool preview);
+void timeline_destroy(struct timeline *tl);
+
+/* Releases what only rendering at a new size needs (image pyramids) */
+void timeline_trim(struct timeline *tl);
+
+/* Also drops images scaled for the current size, to be scaled again */
+void timeline_reclaim(struct timeline *tl);
+
+/* Renders the wallpaper as it looks at `now` */
+void timeline_render(struct timeline *tl, time_t now,
+                     pixman_image_t *dst, int width, int height);
+
+/* Time after `now` at which the rendered wallpaper changes next */
+time_t timeline_next_change(const struct timeline *tl, time_t now);
+
+/* Identifies what the wallpaper looks like at `now` */
+uint64_t timeline_key(const struct timeline *tl, time_t now);
+
+#endif // TIMELINE_H_
@@ -0,0 +1,105 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#include "trace.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+static FILE *trace;
+static uint64_t trace_start;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+bool trace_open(const char *path)
+{
+    trace = fopen(path, "we");
+    if (trace == NULL) {
+        LOG_ERRNO("%s: failed to open trace", path);
+        return false;
+    }
+
+    fprintf(trace, "%s\n", TRACE_MAGIC);
+    trace_start = now_us();
+    return true;
+}
+
+void trace_close(void)
+{
+    if (trace == NULL) {
+        return;
+    }
+
+    if (fclose(trace) != 0) {
+        LOG_ERRNO("failed to write trace");
+    }
+    trace = NULL;
+}
+
+bool trace_enabled(void)
+{
+    return trace != NULL;
+}
+
+void trace_event(const char *event, const char *fmt, ...)
+{
+    if (trace == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&trace_lock);
+
+    fprintf(trace, "%llu %s", (unsigned long long)(now_us() - trace_start), event);
+    if (fmt != NULL) {
+        va_list ap;
+        va_start(ap, fmt);
+        fputc(' ', trace);
+        vfprintf(trace, fmt, ap);
+        va_end(ap);
+    }
+    fputc('\n', trace);
+
+    /* Kept whole even if the session ends in a crash */
+    fflush(trace);
+
+    pthread_mutex_unlock(&trace_lock);
+}
+
+const char *trace_escape(char *dst, size_t size, const char *str)
+{
+    if (str == NULL) {
+        return "-";
+    }
+
+    static const char hex[] = "0123456789ABCDEF";
+    size_t len = 0;
+
+    for (; *str != '\0' && len + 4 <= size; ++str) {
+        const unsigned char c = *str;
+        if (c <= ' ' || c == '%' || c == '-' || c >= 0x7f) {
+            dst[len++] = '%';
+            dst[len++] = hex[c >> 4];
+            dst[len++] = hex[c & 0xf];
+        } else {
+            dst[len++] = c;
+        }
+    }
+
+    dst[len] = '\0';
+    return dst;
+}
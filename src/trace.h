@@ -0,0 +1,52 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Session trace: events received from the compositor, as they were
+ * handled, for tools/wbg-replay.c to play them back. One event per line:
+ *
+ *     USEC EVENT ARGS...
+ *
+ * USEC being microseconds since the trace was opened, ARGS integers or
+ * strings; strings are percent-encoded (no spaces, `-` for NULL). Outputs
+ * are referred to by their registry name. Events are:
+ *
+ *     global NAME INTERFACE VERSION
+ *     global_remove NAME
+ *     shm_format FORMAT
+ *     clock_id CLOCK
+ *     geometry OUTPUT X Y PHYS_W PHYS_H SUBPIXEL MAKE MODEL TRANSFORM
+ *     mode OUTPUT FLAGS W H REFRESH
+ *     scale OUTPUT FACTOR
+ *     done OUTPUT
+ *     logical_position OUTPUT X Y
+ *     logical_size OUTPUT W H
+ *     configure OUTPUT SERIAL W H
+ *     closed OUTPUT
+ *     power OUTPUT MODE
+ *     power_failed OUTPUT
+ */
+
+#define TRACE_MAGIC "# wbg-color trace 1"
+
+bool trace_open(const char *path);
+void trace_close(void);
+
+/* Whether a trace is being recorded */
+bool trace_enabled(void);
+
+/* Appends an event, timestamped, `fmt` formatting its arguments; safe to
+ * call from any thread */
+void trace_event(const char *event, const char *fmt, ...);
+
+/* Percent-encodes `str` into `dst` of `size` bytes, truncating */
+const char *trace_escape(char *dst, size_t size, const char *str);
+
+#endif // TRACE_H_
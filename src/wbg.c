@@ -0,0 +1,274 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#include "wbg.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "budget.h"
+#include "log.h"
+#include "scene.h"
+#include "sun.h"
+#include "timeline.h"
+
+struct wbg {
+    int refcount;
+    pthread_mutex_t lock;
+
+    struct timeline *timeline;
+    struct scene *scene;
+};
+
+/* Appends layer of given type, e.g. "image" and path */
+static bool add_layer(struct scene *scene, const char *type, const char *args)
+{
+    char *line = malloc(strlen(type) + 1 + strlen(args) + 1);
+    sprintf(line, "%s %s", type, args);
+    const bool ok = scene_add(scene, line);
+    free(line);
+    return ok;
+}
+
+/* Budget reclaimer; skips a wallpaper busy rendering, which makes room in
+ * its own caches itself (see scene.c) */
+static void reclaim(void *data, size_t wanted)
+{
+    struct wbg *wbg = data;
+    if (pthread_mutex_trylock(&wbg->lock) != 0) {
+        return;
+    }
+
+    scene_reclaim(wbg->scene, wanted);
+    pthread_mutex_unlock(&wbg->lock);
+}
+
+static struct wbg *create(const struct wbg_options *options, bool preview)
+{
+    struct wbg *wbg = calloc(1, sizeof (*wbg));
+    wbg->refcount = 1;
+    pthread_mutex_init(&wbg->lock, NULL);
+    wbg->scene = scene_create(preview);
+
+    if (options->timeline != NULL) {
+        const struct sun_location loc = { options->latitude, options->longitude };
+        wbg->timeline = timeline_load(options->timeline, options->has_location ? &loc : NULL,
+                                      preview);
+        if (wbg->timeline == NULL) {
+            goto err;
+        }
+
+        scene_add_timeline(wbg->scene, wbg->timeline);
+    } else {
+        char color[8];
+        snprintf(color, sizeof (color), "#%02x%02x%02x",
+                 options->color.red >> 8, options->color.green >> 8, options->color.blue >> 8);
+        add_layer(wbg->scene, "solid", color);
+    }
+
+    if (options->image != NULL && !add_layer(wbg->scene, "image", options->image)) {
+        goto err;
+    }
+
+    if (options->scene != NULL && !scene_load(wbg->scene, options->scene)) {
+        goto err;
+    }
+
+    if (options->overlay != NULL && !add_layer(wbg->scene, "text", options->overlay)) {
+        goto err;
+    }
+
+    scene_advance(wbg->scene, time(NULL));
+    budget_add_reclaimer(&reclaim, wbg);
+    return wbg;
+
+err:
+    wbg_unref(wbg);
+    return NULL;
+}
+
+struct wbg *wbg_create(const struct wbg_options *options)
+{
+    return create(options, false);
+}
+
+bool wbg_guess_color(const struct wbg_options *options, pixman_color_t *color)
+{
+    /* Text would not fit anyway */
+    struct wbg_options opts = *options;
+    opts.overlay = NULL;
+
+    struct wbg *preview = create(&opts, true);
+    if (preview == NULL) {
+        return false;
+    }
+
+    enum { SIZE = 16 };
+    uint32_t pixels[SIZE * SIZE];
+    pixman_image_t *pix = pixman_image_create_bits(
+        PIXMAN_x8r8g8b8, SIZE, SIZE, pixels, SIZE * sizeof (uint32_t));
+
+    const struct wbg_target target = { pix, SIZE, SIZE, 1, NULL };
+    wbg_render(preview, &target);
+
+    uint32_t r = 0, g = 0, b = 0;
+    for (size_t i = 0; i < SIZE * SIZE; ++i) {
+        r += (pixels[i] >> 16) & 0xff;
+        g += (pixels[i] >> 8) & 0xff;
+        b += pixels[i] & 0xff;
+    }
+
+    /* 8 bits to 16, i.e. times 257 */
+    *color = (pixman_color_t){
+        .red = r / (SIZE * SIZE) * 257,
+        .green = g / (SIZE * SIZE) * 257,
+        .blue = b / (SIZE * SIZE) * 257,
+        .alpha = 0xffff,
+    };
+
+    pixman_image_unref(pix);
+    wbg_unref(preview);
+    return true;
+}
+
+struct wbg *wbg_ref(struct wbg *wbg)
+{
+    pthread_mutex_lock(&wbg->lock);
+    wbg->refcount++;
+    pthread_mutex_unlock(&wbg->lock);
+    return wbg;
+}
+
+void wbg_unref(struct wbg *wbg)
+{
+    if (wbg == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&wbg->lock);
+    const int refcount = --wbg->refcount;
+    pthread_mutex_unlock(&wbg->lock);
+
+    if (refcount > 0) {
+        return;
+    }
+
+    budget_remove_reclaimer(&reclaim, wbg);
+    scene_destroy(wbg->scene);
+    timeline_destroy(wbg->timeline);
+    pthread_mutex_destroy(&wbg->lock);
+    free(wbg);
+}
+
+bool wbg_add_layer(struct wbg *wbg, const char *line)
+{
+    pthread_mutex_lock(&wbg->lock);
+    const bool ok = scene_add(wbg->scene, line);
+    pthread_mutex_unlock(&wbg->lock);
+    return ok;
+}
+
+bool wbg_advance(struct wbg *wbg, time_t now)
+{
+    pthread_mutex_lock(&wbg->lock);
+    const bool changed = scene_advance(wbg->scene, now);
+    pthread_mutex_unlock(&wbg->lock);
+    return changed;
+}
+
+int wbg_period(struct wbg *wbg)
+{
+    pthread_mutex_lock(&wbg->lock);
+    const int period = scene_period(wbg->scene);
+    pthread_mutex_unlock(&wbg->lock);
+    return period;
+}
+
+time_t wbg_next_change(struct wbg *wbg, time_t now)
+{
+    /* Timeline itself is immutable */
+    return (wbg->timeline != NULL) ? timeline_next_change(wbg->timeline, now) : 0;
+}
+
+uint64_t wbg_key(struct wbg *wbg, const struct wbg_target *target)
+{
+    pthread_mutex_lock(&wbg->lock);
+    const uint64_t key = scene_key(wbg->scene, target->scale, target->lut);
+    pthread_mutex_unlock(&wbg->lock);
+    return key;
+}
+
+uint64_t wbg_prev_key(struct wbg *wbg, const struct wbg_target *target)
+{
+    pthread_mutex_lock(&wbg->lock);
+    const uint64_t key = scene_prev_key(wbg->scene, target->scale, target->lut);
+    pthread_mutex_unlock(&wbg->lock);
+    return key;
+}
+
+void wbg_render(struct wbg *wbg, const struct wbg_target *target)
+{
+    pthread_mutex_lock(&wbg->lock);
+    scene_render(wbg->scene, target->dst, target->width, target->height,
+                 target->scale, target->lut);
+    pthread_mutex_unlock(&wbg->lock);
+}
+
+void wbg_update(struct wbg *wbg, const struct wbg_target *target, pixman_region32_t *damage)
+{
+    pthread_mutex_lock(&wbg->lock);
+    scene_update(wbg->scene, target->dst, target->width, target->height,
+                 target->scale, target->lut, damage);
+    pthread_mutex_unlock(&wbg->lock);
+}
+
+void wbg_trim(struct wbg *wbg)
+{
+    pthread_mutex_lock(&wbg->lock);
+    scene_trim(wbg->scene);
+    if (wbg->timeline != NULL) {
+        timeline_trim(wbg->timeline);
+    }
+    pthread_mutex_unlock(&wbg->lock);
+}
+
+static bool same_content(const struct wbg_target *a, const struct wbg_target *b)
+{
+    return a->width == b->width && a->height == b->height &&
+           a->scale == b->scale && a->lut == b->lut;
+}
+
+void wbg_render_batch(struct wbg *wbg, const struct wbg_target *targets, size_t count)
+{
+    pthread_mutex_lock(&wbg->lock);
+
+    for (size_t i = 0; i < count; ++i) {
+        const struct wbg_target *t = &targets[i];
+
+        size_t same = 0;
+        while (same < i && !same_content(&targets[same], t)) {
+            same++;
+        }
+
+        if (same < i) {
+            pixman_image_composite32(
+                PIXMAN_OP_SRC,
+                targets[same].dst, NULL, t->dst, 0, 0, 0, 0, 0, 0,
+                t->width, t->height);
+            continue;
+        }
+
+        scene_render(wbg->scene, t->dst, t->width, t->height, t->scale, t->lut);
+    }
+
+    /* Every size there is has been rendered */
+    scene_trim(wbg->scene);
+    if (wbg->timeline != NULL) {
+        timeline_trim(wbg->timeline);
+    }
+
+    pthread_mutex_unlock(&wbg->lock);
+}
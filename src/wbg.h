@@ -0,0 +1,91 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#ifndef WBG_H_
+#define WBG_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <pixman.h>
+
+#include "icc.h"
+
+/*
+ * Wallpaper renderer, independent of Wayland; what wbg-color shows, for
+ * lock screens, greeters and the like to embed. Context is reference
+ * counted and may be shared by several consumers (threads included), which
+ * then share its caches: decoded images, flattened static layers, content
+ * keys. Each call locks the context for its duration.
+ */
+struct wbg;
+
+struct wbg_options {
+    pixman_color_t color;    /* solid base, unless there is a timeline */
+    const char *image;       /* GIF (first frame) over the base, or NULL */
+    const char *timeline;    /* timeline file, or NULL */
+    bool has_location;       /* needed by sun based keyframes */
+    double latitude;
+    double longitude;
+    const char *scene;       /* scene file, or NULL */
+    const char *overlay;     /* strftime() format of text on top, or NULL */
+};
+
+struct wbg_target {
+    pixman_image_t *dst;        /* x8r8g8b8, width by height */
+    int width;
+    int height;
+    int scale;                  /* of text and patterns */
+    const struct icc_lut *lut;  /* NULL if colours are not managed */
+};
+
+/* Loads everything up front; evaluated at current time */
+struct wbg *wbg_create(const struct wbg_options *options);
+
+/*
+ * Average colour of the wallpaper, guessed without decoding images (they
+ * stand in as the colour stored in their header); cheap enough to be shown
+ * while the real thing is loading.
+ */
+bool wbg_guess_color(const struct wbg_options *options, pixman_color_t *color);
+struct wbg *wbg_ref(struct wbg *wbg);
+void wbg_unref(struct wbg *wbg);
+
+/* Appends scene layer on top (see scene.h for the syntax) */
+bool wbg_add_layer(struct wbg *wbg, const char *line);
+
+/* Evaluates time dependent layers; returns whether content has changed */
+bool wbg_advance(struct wbg *wbg, time_t now);
+
+/* Seconds between changes of text layers, 0 if there are none */
+int wbg_period(struct wbg *wbg);
+
+/* When timeline changes next, 0 if there is no timeline */
+time_t wbg_next_change(struct wbg *wbg, time_t now);
+
+/* Identifies content rendered for target, as of the last (and the one
+ * before last) advance; suitable as a buffer cookie */
+uint64_t wbg_key(struct wbg *wbg, const struct wbg_target *target);
+uint64_t wbg_prev_key(struct wbg *wbg, const struct wbg_target *target);
+
+void wbg_render(struct wbg *wbg, const struct wbg_target *target);
+
+/* Brings target holding content of wbg_prev_key() up to date, adding
+ * what was redrawn to `damage` */
+void wbg_update(struct wbg *wbg, const struct wbg_target *target, pixman_region32_t *damage);
+
+/*
+ * Releases memory needed only to render at sizes not rendered before
+ * (pyramids of images, see mip.h), e.g. once all outputs are rendered;
+ * rebuilt if needed again.
+ */
+void wbg_trim(struct wbg *wbg);
+
+/* Renders all targets in one go; identical ones are rendered only once,
+ * and trimmed after */
+void wbg_render_batch(struct wbg *wbg, const struct wbg_target *targets, size_t count);
+
+#endif // WBG_H_
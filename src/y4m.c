@@ -0,0 +1,266 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#include "y4m.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include "limit.h"
+#include "log.h"
+#include "yuv.h"
+
+#define Y4M_MAGIC "YUV4MPEG2 "
+#define Y4M_MAX_HEADER 1024
+
+/* Shortest frame duration (µs) honoured; faster streams would just spin */
+#define Y4M_MIN_DURATION (1000000 / 240)
+
+struct y4m {
+    const uint8_t *data;
+    size_t size;
+    size_t pos;
+    size_t first_frame;
+
+    int width;
+    int height;
+    int chroma_shift; /* 1 for 4:2:0, 0 for 4:4:4 */
+    int duration;
+
+    size_t luma_size;
+    size_t chroma_size;
+
+    struct yuv_converter conv;
+};
+
+static size_t page_size(void)
+{
+    static size_t size;
+    if (size == 0) {
+        size = (size_t)sysconf(_SC_PAGESIZE);
+    }
+    return size;
+}
+
+/* Applies advice to the whole pages within [from, to) of the mapping */
+static void advise(const struct y4m *y4m, size_t from, size_t to, int advice)
+{
+    const size_t page = page_size();
+    const uintptr_t base = (uintptr_t)y4m->data;
+
+    uintptr_t start = (base + from + page - 1) & ~(page - 1);
+    uintptr_t end = (base + (to < y4m->size ? to : y4m->size)) & ~(page - 1);
+
+    if (advice == MADV_WILLNEED) {
+        /* Read-ahead may as well include partial pages */
+        start = (base + from) & ~(page - 1);
+        end = base + (to < y4m->size ? to : y4m->size);
+    }
+
+    if (end > start) {
+        madvise((void *)start, end - start, advice);
+    }
+}
+
+static bool parse_header(struct y4m *y4m, const char *line, size_t len)
+{
+    long long width = 0;
+    long long height = 0;
+    int fps_num = 30;
+    int fps_den = 1;
+    bool full_range = false;
+
+    y4m->chroma_shift = 1;
+
+    /* Space separated tokens, each tagged by its first letter */
+    const char *p = line + strlen(Y4M_MAGIC);
+    const char *end = line + len;
+
+    while (p < end) {
+        const char *tok_end = memchr(p, ' ', end - p);
+        if (tok_end == NULL) {
+            tok_end = end;
+        }
+
+        const size_t tok_len = tok_end - p;
+        char tok[64] = { 0 };
+        memcpy(tok, p, (tok_len < sizeof (tok) - 1) ? tok_len : sizeof (tok) - 1);
+
+        switch (tok[0]) {
+            case 'W':
+                width = strtoll(tok + 1, NULL, 10);
+                break;
+            case 'H':
+                height = strtoll(tok + 1, NULL, 10);
+                break;
+            case 'F':
+                if (sscanf(tok + 1, "%d:%d", &fps_num, &fps_den) != 2 ||
+                    fps_num <= 0 || fps_den <= 0) {
+                    LOG_ERR("y4m: invalid frame rate: %s", tok + 1);
+                    return false;
+                }
+                break;
+            case 'C':
+                if (strcmp(tok + 1, "444") == 0) {
+                    y4m->chroma_shift = 0;
+                } else if (strcmp(tok + 1, "420") != 0 &&
+                           strcmp(tok + 1, "420jpeg") != 0 &&
+                           strcmp(tok + 1, "420paldv") != 0 &&
+                           strcmp(tok + 1, "420mpeg2") != 0) {
+                    LOG_ERR("y4m: unsupported colorspace: %s", tok + 1);
+                    return false;
+                }
+                break;
+            case 'X':
+                if (strcmp(tok + 1, "COLORRANGE=FULL") == 0) {
+                    full_range = true;
+                }
+                break;
+            default:
+                /* Interlacing, aspect ratio: irrelevant for us */
+                break;
+        }
+
+        p = tok_end + 1;
+    }
+
+    if (!limit_check_size("y4m", width, height)) {
+        return false;
+    }
+
+    y4m->width = (int)width;
+    y4m->height = (int)height;
+
+    const long long duration = 1000000LL * fps_den / fps_num;
+    y4m->duration = (duration < Y4M_MIN_DURATION) ? Y4M_MIN_DURATION :
+                    (duration > INT_MAX) ? INT_MAX : (int)duration;
+
+    const size_t cw = ((size_t)y4m->width + y4m->chroma_shift) >> y4m->chroma_shift;
+    const size_t ch = ((size_t)y4m->height + y4m->chroma_shift) >> y4m->chroma_shift;
+    y4m->luma_size = (size_t)y4m->width * y4m->height;
+    y4m->chroma_size = cw * ch;
+
+    /* Stream does not say; go with the usual convention */
+    yuv_converter_init(&y4m->conv, y4m->height > 576, full_range);
+
+    return true;
+}
+
+/* Returns offset of planes of the frame at `pos`, 0 if there is none */
+static size_t frame_planes(const struct y4m *y4m, size_t pos)
+{
+    const size_t left = y4m->size - pos;
+    if (pos >= y4m->size || left < 6 || memcmp(y4m->data + pos, "FRAME", 5) != 0) {
+        return 0;
+    }
+
+    /* Frame header may carry parameters; skip them */
+    const uint8_t *nl = memchr(y4m->data + pos, '\n', (left < Y4M_MAX_HEADER) ? left : Y4M_MAX_HEADER);
+    if (nl == NULL) {
+        return 0;
+    }
+
+    const size_t planes = (nl - y4m->data) + 1;
+    if (y4m->size - planes < y4m->luma_size + 2 * y4m->chroma_size) {
+        return 0; /* truncated */
+    }
+
+    return planes;
+}
+
+struct y4m *y4m_open(const uint8_t *data, size_t size)
+{
+    if (size < strlen(Y4M_MAGIC) || memcmp(data, Y4M_MAGIC, strlen(Y4M_MAGIC)) != 0) {
+        return NULL;
+    }
+
+    const uint8_t *nl = memchr(data, '\n', (size < Y4M_MAX_HEADER) ? size : Y4M_MAX_HEADER);
+    if (nl == NULL) {
+        LOG_ERR("y4m: header too long or truncated");
+        return NULL;
+    }
+
+    struct y4m *y4m = calloc(1, sizeof (*y4m));
+    y4m->data = data;
+    y4m->size = size;
+
+    if (!parse_header(y4m, (const char *)data, nl - data)) {
+        free(y4m);
+        return NULL;
+    }
+
+    y4m->first_frame = y4m->pos = (nl - data) + 1;
+
+    /* Otherwise buffers for the video would be allocated for nothing */
+    if (frame_planes(y4m, y4m->first_frame) == 0) {
+        LOG_ERR("y4m: no complete frame in stream");
+        free(y4m);
+        return NULL;
+    }
+
+    return y4m;
+}
+
+void y4m_close(struct y4m *y4m)
+{
+    free(y4m);
+}
+
+int y4m_width(const struct y4m *y4m)
+{
+    return y4m->width;
+}
+
+int y4m_height(const struct y4m *y4m)
+{
+    return y4m->height;
+}
+
+int y4m_frame_duration(const struct y4m *y4m)
+{
+    return y4m->duration;
+}
+
+bool y4m_next_frame(struct y4m *y4m, uint8_t *dst, int stride)
+{
+    size_t planes = frame_planes(y4m, y4m->pos);
+    if (planes == 0) {
+        /* End of stream (or garbage); start over */
+        y4m->pos = y4m->first_frame;
+        planes = frame_planes(y4m, y4m->pos);
+        if (planes == 0) {
+            LOG_ERR("y4m: no frames in stream");
+            return false;
+        }
+    }
+
+    const size_t cw = ((size_t)y4m->width + y4m->chroma_shift) >> y4m->chroma_shift;
+    const uint8_t *y_plane = y4m->data + planes;
+    const uint8_t *u_plane = y_plane + y4m->luma_size;
+    const uint8_t *v_plane = u_plane + y4m->chroma_size;
+
+    for (int row = 0; row < y4m->height; ++row) {
+        const size_t crow = (size_t)(row >> y4m->chroma_shift) * cw;
+        yuv_to_xrgb_row(&y4m->conv,
+                        y_plane + (size_t)row * y4m->width,
+                        u_plane + crow, v_plane + crow,
+                        (uint32_t *)(dst + (size_t)row * stride),
+                        y4m->width, y4m->chroma_shift);
+    }
+
+    const size_t frame_end = planes + y4m->luma_size + 2 * y4m->chroma_size;
+
+    /* Stream is read once per loop; do not let it pile up in our RSS, and
+     * have the next frame paged in while this one is being shown */
+    advise(y4m, y4m->pos, frame_end, MADV_DONTNEED);
+    advise(y4m, frame_end, frame_end + (frame_end - y4m->pos), MADV_WILLNEED);
+
+    y4m->pos = frame_end;
+    return true;
+}
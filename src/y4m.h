@@ -0,0 +1,30 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#ifndef Y4M_H_
+#define Y4M_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct y4m;
+
+/*
+ * Reader of YUV4MPEG2 streams (8-bit 4:2:0 and 4:4:4). Frames are read
+ * directly from `data`, which must stay valid (typically mmapped file).
+ */
+struct y4m *y4m_open(const uint8_t *data, size_t size);
+void y4m_close(struct y4m *y4m);
+
+int y4m_width(const struct y4m *y4m);
+int y4m_height(const struct y4m *y4m);
+
+/* Microseconds each frame is displayed for */
+int y4m_frame_duration(const struct y4m *y4m);
+
+/* Converts next frame to XRGB8888, looping at the end of the stream */
+bool y4m_next_frame(struct y4m *y4m, uint8_t *dst, int stride);
+
+#endif // Y4M_H_
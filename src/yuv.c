@@ -0,0 +1,200 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#include "yuv.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+ #include <immintrin.h>
+#elif defined(__aarch64__)
+ #include <arm_neon.h>
+#endif
+
+static inline uint32_t clamp_u8(int32_t v)
+{
+    return (v < 0) ? 0 : (v > 255) ? 255 : (uint32_t)v;
+}
+
+/* Reference implementation; SIMD kernels below must match it exactly */
+static void row_scalar(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+                       uint32_t *dst, int width, int chroma_shift,
+                       const struct yuv_converter *c)
+{
+    for (int i = 0; i < width; ++i) {
+        const int32_t yy = (y[i] - c->y_off) * c->cy + 32;
+        const int32_t uu = u[i >> chroma_shift] - 128;
+        const int32_t vv = v[i >> chroma_shift] - 128;
+
+        const uint32_t r = clamp_u8((yy + vv * c->crv) >> 6);
+        const uint32_t g = clamp_u8((yy - uu * c->cgu - vv * c->cgv) >> 6);
+        const uint32_t b = clamp_u8((yy + uu * c->cbu) >> 6);
+
+        dst[i] = 0xff000000u | r << 16 | g << 8 | b;
+    }
+}
+
+/*
+ * Both kernels work on 16-bit lanes. Intermediate sums can only leave the
+ * int16 range when the final value is out of 0..255 anyway, so saturating
+ * arithmetic clamps to the same result as the scalar code.
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("avx2")))
+static void row_avx2(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+                     uint32_t *dst, int width, int chroma_shift,
+                     const struct yuv_converter *c)
+{
+    const __m256i y_off = _mm256_set1_epi16(c->y_off);
+    const __m256i cy = _mm256_set1_epi16(c->cy);
+    const __m256i crv = _mm256_set1_epi16(c->crv);
+    const __m256i cgu = _mm256_set1_epi16(c->cgu);
+    const __m256i cgv = _mm256_set1_epi16(c->cgv);
+    const __m256i cbu = _mm256_set1_epi16(c->cbu);
+    const __m256i round = _mm256_set1_epi16(32);
+    const __m256i bias = _mm256_set1_epi16(128);
+    const __m256i alpha = _mm256_set1_epi16(255);
+
+    int i = 0;
+    for (; i + 16 <= width; i += 16) {
+        __m128i u8, v8;
+        if (chroma_shift) {
+            u8 = _mm_loadl_epi64((const __m128i *)(u + i / 2));
+            v8 = _mm_loadl_epi64((const __m128i *)(v + i / 2));
+            u8 = _mm_unpacklo_epi8(u8, u8);
+            v8 = _mm_unpacklo_epi8(v8, v8);
+        } else {
+            u8 = _mm_loadu_si128((const __m128i *)(u + i));
+            v8 = _mm_loadu_si128((const __m128i *)(v + i));
+        }
+
+        __m256i yy = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(y + i)));
+        const __m256i uu = _mm256_sub_epi16(_mm256_cvtepu8_epi16(u8), bias);
+        const __m256i vv = _mm256_sub_epi16(_mm256_cvtepu8_epi16(v8), bias);
+
+        yy = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_sub_epi16(yy, y_off), cy), round);
+
+        const __m256i r = _mm256_srai_epi16(
+            _mm256_adds_epi16(yy, _mm256_mullo_epi16(vv, crv)), 6);
+        const __m256i g = _mm256_srai_epi16(
+            _mm256_subs_epi16(_mm256_subs_epi16(yy, _mm256_mullo_epi16(uu, cgu)),
+                              _mm256_mullo_epi16(vv, cgv)), 6);
+        const __m256i b = _mm256_srai_epi16(
+            _mm256_adds_epi16(yy, _mm256_mullo_epi16(uu, cbu)), 6);
+
+        /* Interleave into B,G,R,X bytes; packs and unpacks work within
+         * 128-bit lanes, hence the final cross-lane permutes */
+        const __m256i br = _mm256_packus_epi16(b, r);
+        const __m256i ga = _mm256_packus_epi16(g, alpha);
+        const __m256i bg = _mm256_unpacklo_epi8(br, ga);
+        const __m256i ra = _mm256_unpackhi_epi8(br, ga);
+        const __m256i p0 = _mm256_unpacklo_epi16(bg, ra); /* px 0-3, 8-11 */
+        const __m256i p1 = _mm256_unpackhi_epi16(bg, ra); /* px 4-7, 12-15 */
+
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_permute2x128_si256(p0, p1, 0x20));
+        _mm256_storeu_si256((__m256i *)(dst + i + 8), _mm256_permute2x128_si256(p0, p1, 0x31));
+    }
+
+    row_scalar(y + i, u + (i >> chroma_shift), v + (i >> chroma_shift),
+               dst + i, width - i, chroma_shift, c);
+}
+
+#elif defined(__aarch64__)
+
+static void row_neon(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+                     uint32_t *dst, int width, int chroma_shift,
+                     const struct yuv_converter *c)
+{
+    const int16x8_t y_off = vdupq_n_s16(c->y_off);
+    const int16x8_t cy = vdupq_n_s16(c->cy);
+    const int16x8_t crv = vdupq_n_s16(c->crv);
+    const int16x8_t cgu = vdupq_n_s16(c->cgu);
+    const int16x8_t cgv = vdupq_n_s16(c->cgv);
+    const int16x8_t cbu = vdupq_n_s16(c->cbu);
+    const int16x8_t round = vdupq_n_s16(32);
+    const int16x8_t bias = vdupq_n_s16(128);
+
+    int i = 0;
+    for (; i + 8 <= width; i += 8) {
+        uint8x8_t u8, v8;
+        if (chroma_shift) {
+            /* 4 chroma samples, each duplicated */
+            uint8x8_t ut = vreinterpret_u8_u32(vld1_dup_u32((const uint32_t *)(const void *)(u + i / 2)));
+            uint8x8_t vt = vreinterpret_u8_u32(vld1_dup_u32((const uint32_t *)(const void *)(v + i / 2)));
+            u8 = vzip1_u8(ut, ut);
+            v8 = vzip1_u8(vt, vt);
+        } else {
+            u8 = vld1_u8(u + i);
+            v8 = vld1_u8(v + i);
+        }
+
+        int16x8_t yy = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(y + i)));
+        const int16x8_t uu = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(u8)), bias);
+        const int16x8_t vv = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(v8)), bias);
+
+        yy = vaddq_s16(vmulq_s16(vsubq_s16(yy, y_off), cy), round);
+
+        const int16x8_t r = vqaddq_s16(yy, vmulq_s16(vv, crv));
+        const int16x8_t g = vqsubq_s16(vqsubq_s16(yy, vmulq_s16(uu, cgu)), vmulq_s16(vv, cgv));
+        const int16x8_t b = vqaddq_s16(yy, vmulq_s16(uu, cbu));
+
+        /* Shift, clamp to 0..255 and narrow in one go */
+        const uint8x8x4_t px = { .val = {
+            vqshrun_n_s16(b, 6),
+            vqshrun_n_s16(g, 6),
+            vqshrun_n_s16(r, 6),
+            vdup_n_u8(255),
+        } };
+        vst4_u8((uint8_t *)(dst + i), px);
+    }
+
+    row_scalar(y + i, u + (i >> chroma_shift), v + (i >> chroma_shift),
+               dst + i, width - i, chroma_shift, c);
+}
+
+#endif
+
+void yuv_converter_init(struct yuv_converter *c, bool bt709, bool full_range)
+{
+    /* Kr/Kb derived matrices, scaled by 64 */
+    double cy, crv, cgu, cgv, cbu;
+    if (bt709) {
+        crv = 1.5748;
+        cgu = 0.187324;
+        cgv = 0.468124;
+        cbu = 1.8556;
+    } else {
+        crv = 1.402;
+        cgu = 0.344136;
+        cgv = 0.714136;
+        cbu = 1.772;
+    }
+
+    if (full_range) {
+        cy = 1.0;
+        c->y_off = 0;
+    } else {
+        /* Luma in 16..235, chroma in 16..240 */
+        cy = 255.0 / 219.0;
+        crv *= 255.0 / 224.0;
+        cgu *= 255.0 / 224.0;
+        cgv *= 255.0 / 224.0;
+        cbu *= 255.0 / 224.0;
+        c->y_off = 16;
+    }
+
+    c->cy = (int16_t)(cy * 64 + 0.5);
+    c->crv = (int16_t)(crv * 64 + 0.5);
+    c->cgu = (int16_t)(cgu * 64 + 0.5);
+    c->cgv = (int16_t)(cgv * 64 + 0.5);
+    c->cbu = (int16_t)(cbu * 64 + 0.5);
+
+#if defined(__x86_64__) || defined(__i386__)
+    c->row = __builtin_cpu_supports("avx2") ? &row_avx2 : &row_scalar;
+#elif defined(__aarch64__)
+    c->row = &row_neon;
+#else
+    c->row = &row_scalar;
+#endif
+}
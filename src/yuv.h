@@ -0,0 +1,42 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+#ifndef YUV_H_
+#define YUV_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct yuv_converter;
+
+typedef void (*yuv_row_fn)(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+                           uint32_t *dst, int width, int chroma_shift,
+                           const struct yuv_converter *c);
+
+/* Fixed point (Q6) coefficients and the best row kernel for this CPU */
+struct yuv_converter {
+    int16_t y_off;
+    int16_t cy;
+    int16_t crv;
+    int16_t cgu;
+    int16_t cgv;
+    int16_t cbu;
+
+    yuv_row_fn row;
+};
+
+void yuv_converter_init(struct yuv_converter *c, bool bt709, bool full_range);
+
+/*
+ * Converts one row of 8-bit planar YUV to XRGB8888. With `chroma_shift`
+ * set to 1, U and V are horizontally subsampled by 2 (as in I420).
+ */
+static inline void yuv_to_xrgb_row(const struct yuv_converter *c,
+                                   const uint8_t *y, const uint8_t *u, const uint8_t *v,
+                                   uint32_t *dst, int width, int chroma_shift)
+{
+    c->row(y, u, v, dst, width, chroma_shift, c);
+}
+
+#endif // YUV_H_
@@ -0,0 +1,166 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+/*
+ * Generates C header with a perfect hash table of named colors, read from
+ * lines of `NAME #RRGGBB[AA]`. Names are split into buckets by one hash,
+ * then each bucket, biggest first, is given the seed of a second hash that
+ * puts all of its names into free slots. Lookup thus takes two hashes and
+ * a single comparison.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "colorhash.h"
+
+#define BUCKETS 64
+#define SLOTS   256
+#define MAX_NAME 20
+#define MAX_SEED 0xffff
+
+struct color {
+    char name[MAX_NAME + 1];
+    uint32_t argb;
+    int bucket;
+};
+
+static struct color colors[SLOTS];
+static int count;
+
+static int slot_of[SLOTS];        /* index into `colors`, -1 if free */
+static uint16_t seeds[BUCKETS];
+
+static bool place(int bucket, uint32_t seed)
+{
+    int taken[SLOTS];
+    int n = 0;
+
+    for (int i = 0; i < count; ++i) {
+        if (colors[i].bucket != bucket) {
+            continue;
+        }
+
+        /* Names of this bucket placed so far count as taken too */
+        const int slot = colorhash(colors[i].name, strlen(colors[i].name), seed) % SLOTS;
+        if (slot_of[slot] >= 0) {
+            for (int j = 0; j < n; ++j) {
+                slot_of[taken[j]] = -1;
+            }
+            return false;
+        }
+
+        slot_of[slot] = i;
+        taken[n++] = slot;
+    }
+
+    return true;
+}
+
+static int bucket_size(int bucket)
+{
+    int n = 0;
+    for (int i = 0; i < count; ++i) {
+        n += colors[i].bucket == bucket;
+    }
+    return n;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s NAMED-COLORS.txt > named-colors.h\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    FILE *f = fopen(argv[1], "r");
+    if (f == NULL) {
+        perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    char line[256];
+    int lineno = 0;
+    while (fgets(line, sizeof (line), f) != NULL) {
+        lineno++;
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+
+        char name[64];
+        char hex[16];
+        if (sscanf(line, "%63s #%15s", name, hex) != 2 ||
+            strlen(name) > MAX_NAME || (strlen(hex) != 6 && strlen(hex) != 8) ||
+            strspn(hex, "0123456789abcdefABCDEF") != strlen(hex) || count == SLOTS) {
+            fprintf(stderr, "%s:%d: invalid line\n", argv[1], lineno);
+            fclose(f);
+            return EXIT_FAILURE;
+        }
+
+        uint32_t v = (uint32_t)strtoul(hex, NULL, 16);
+        const uint32_t argb = (strlen(hex) == 6) ? 0xff000000u | v : (v & 0xff) << 24 | v >> 8;
+
+        struct color *c = &colors[count++];
+        strcpy(c->name, name);
+        c->argb = argb;
+        c->bucket = colorhash(name, strlen(name), 0) % BUCKETS;
+    }
+    fclose(f);
+
+    for (int i = 0; i < SLOTS; ++i) {
+        slot_of[i] = -1;
+    }
+
+    /* Biggest buckets first, while there is most room */
+    bool done[BUCKETS] = { false };
+    for (int round = 0; round < BUCKETS; ++round) {
+        int bucket = -1;
+        for (int b = 0; b < BUCKETS; ++b) {
+            if (!done[b] && (bucket < 0 || bucket_size(b) > bucket_size(bucket))) {
+                bucket = b;
+            }
+        }
+
+        uint32_t seed = 1;
+        while (seed <= MAX_SEED && !place(bucket, seed)) {
+            seed++;
+        }
+        if (seed > MAX_SEED) {
+            fprintf(stderr, "no seed found for bucket %d\n", bucket);
+            return EXIT_FAILURE;
+        }
+
+        seeds[bucket] = (uint16_t)seed;
+        done[bucket] = true;
+    }
+
+    printf("/* Generated by tools/gen-colors.c from %s; do not edit */\n\n", argv[1]);
+    printf("#define NAMED_COLOR_BUCKETS %d\n", BUCKETS);
+    printf("#define NAMED_COLOR_SLOTS %d\n", SLOTS);
+    printf("#define NAMED_COLOR_MAX %d\n\n", MAX_NAME);
+
+    printf("static const uint16_t named_color_seeds[NAMED_COLOR_BUCKETS] = {");
+    for (int b = 0; b < BUCKETS; ++b) {
+        printf("%s%u,", (b % 12 == 0) ? "\n    " : " ", seeds[b]);
+    }
+    printf("\n};\n\n");
+
+    printf("/* Free slots have an empty name */\n");
+    printf("static const struct named_color {\n");
+    printf("    char name[NAMED_COLOR_MAX + 1];\n");
+    printf("    uint32_t argb;\n");
+    printf("} named_colors[NAMED_COLOR_SLOTS] = {\n");
+    for (int s = 0; s < SLOTS; ++s) {
+        if (slot_of[s] >= 0) {
+            const struct color *c = &colors[slot_of[s]];
+            printf("    [%d] = { \"%s\", 0x%08xu },\n", s, c->name, c->argb);
+        }
+    }
+    printf("};\n");
+
+    return EXIT_SUCCESS;
+}
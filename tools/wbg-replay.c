@@ -0,0 +1,1098 @@
+/* SPDX-License-Identifier:  MIT
+ * Copyright 2024 Jorengarenar
+ */
+
+/*
+ * Stand-in compositor, playing a session trace (see src/trace.h) back to a
+ * client it starts itself: globals, output events and layer surface
+ * configures are sent as they were received, at their original times, or
+ * as fast as possible (-f). Requests are accepted and, but for buffers
+ * being released and frames presented, ignored. Reported are latencies of
+ * the client handling those events:
+ *
+ *   global     global sent, to it being bound (handle_global())
+ *   configure  configure sent, to it being acknowledged
+ *              (layer_surface_configure())
+ *   render     configure sent, to the next commit of a buffer (render())
+ *
+ * Usage: wbg-replay [-f] TRACE -- wbg-color [OPTIONS]...
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <wayland-server.h>
+
+#include <wlr-layer-shell-unstable-v1-server.h>
+#include <wlr-output-power-management-unstable-v1-server.h>
+#include <xdg-output-unstable-v1-server.h>
+#include <viewporter-server.h>
+#include <presentation-time-server.h>
+
+#include "log.h"
+#include "trace.h"
+
+#define MAX_ARGS 10
+
+/* Event waiting longer for what it is sent to is skipped */
+#define STALL_NS (5 * 1000000000ull)
+
+/* After the last event, client is stopped once it is quiet for this long */
+#define QUIET_NS (1 * 1000000000ull)
+
+#define FRAME_MS 16
+
+struct event {
+    uint64_t usec;
+    char *line;
+    int argc;
+    char *argv[MAX_ARGS]; /* [0] is the event name */
+};
+
+struct layer;
+
+/* Global as recorded; those of outputs also hold what refers to them */
+struct global {
+    uint32_t name; /* in the trace */
+    const struct wl_interface *iface;
+    struct wl_global *global;
+    struct wl_resource *resource; /* last bound */
+    uint64_t sent_ns;
+    bool bound;
+
+    struct wl_resource *xdg_output;
+    struct wl_resource *power;
+    struct layer *layer;
+
+    struct wl_list link;
+};
+
+struct surface {
+    struct wl_resource *resource;
+    struct wl_resource *pending;  /* buffer attached */
+    struct wl_resource *current;  /* buffer committed */
+    bool attached;
+    struct wl_list frames;    /* callbacks, until commit */
+    struct wl_list feedbacks; /* presentation feedback, until commit */
+    struct layer *layer;
+    struct wl_list link;
+};
+
+struct layer {
+    struct wl_resource *resource;
+    struct surface *surface;
+    struct global *output;
+
+    uint32_t serial;
+    uint64_t configured_ns;
+    bool ack_pending;
+    bool render_pending;
+};
+
+struct latency {
+    const char *name;
+    unsigned count;
+    double sum_ms;
+    double max_ms;
+};
+
+enum { STAT_GLOBAL, STAT_CONFIGURE, STAT_RENDER, STAT_COUNT };
+
+static struct latency stats[STAT_COUNT] = {
+    [STAT_GLOBAL] = { .name = "global" },
+    [STAT_CONFIGURE] = { .name = "configure" },
+    [STAT_RENDER] = { .name = "render" },
+};
+
+static struct wl_display *display;
+static struct wl_client *peer; /* NULL once gone */
+static struct wl_listener client_destroy;
+
+static struct wl_list globals; /* never freed before resources */
+
+static struct wl_list surfaces;
+static struct wl_list presented_frames;
+static struct wl_list presented_feedbacks;
+static struct wl_event_source *frame_timer;
+static bool frame_armed;
+
+static uint64_t last_request_ns;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void stat_add(int which, uint64_t since_ns)
+{
+    const double ms = (now_ns() - since_ns) / 1e6;
+    struct latency *stat = &stats[which];
+    stat->count++;
+    stat->sum_ms += ms;
+    if (ms > stat->max_ms) {
+        stat->max_ms = ms;
+    }
+}
+
+static struct global *find_global(uint32_t name)
+{
+    struct global *global;
+    wl_list_for_each(global, &globals, link) {
+        if (global->name == name) {
+            return global;
+        }
+    }
+    return NULL;
+}
+
+/* First one of `iface` bound by the client */
+static struct global *find_global_of(const struct wl_interface *iface)
+{
+    struct global *global;
+    wl_list_for_each(global, &globals, link) {
+        if (global->iface == iface && global->resource != NULL) {
+            return global;
+        }
+    }
+    return NULL;
+}
+
+/* Percent-decodes in place; `-` is NULL, sent as empty string */
+static const char *unescape(char *str)
+{
+    if (strcmp(str, "-") == 0) {
+        return "";
+    }
+
+    char *out = str;
+    for (const char *in = str; *in != '\0'; ++in) {
+        unsigned c;
+        if (in[0] == '%' && sscanf(in + 1, "%2x", &c) == 1) {
+            *out++ = c;
+            in += 2;
+        } else {
+            *out++ = *in;
+        }
+    }
+    *out = '\0';
+    return str;
+}
+
+static void resource_destroy(struct wl_client *, struct wl_resource *resource)
+{
+    wl_resource_destroy(resource);
+}
+
+static void unlink_resource(struct wl_resource *resource)
+{
+    wl_list_remove(wl_resource_get_link(resource));
+}
+
+static void arm_frame_timer(void)
+{
+    if (!frame_armed) {
+        wl_event_source_timer_update(frame_timer, FRAME_MS);
+        frame_armed = true;
+    }
+}
+
+/* Frames committed are all presented at the next tick */
+static int frame_tick(void *)
+{
+    frame_armed = false;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    const uint32_t msec = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+    struct wl_resource *resource, *tmp;
+    wl_resource_for_each_safe(resource, tmp, &presented_frames) {
+        wl_callback_send_done(resource, msec);
+        wl_resource_destroy(resource);
+    }
+
+    wl_resource_for_each_safe(resource, tmp, &presented_feedbacks) {
+        wp_presentation_feedback_send_presented(
+            resource, (uint64_t)ts.tv_sec >> 32, ts.tv_sec & 0xffffffff, ts.tv_nsec,
+            FRAME_MS * 1000000, 0, 0, 0);
+        wl_resource_destroy(resource);
+    }
+    return 0;
+}
+
+/* wl_buffer, wl_shm ------------------------------------------------------ */
+
+static void buffer_destroyed(struct wl_resource *resource)
+{
+    struct surface *surface;
+    wl_list_for_each(surface, &surfaces, link) {
+        if (surface->pending == resource) {
+            surface->pending = NULL;
+        }
+        if (surface->current == resource) {
+            surface->current = NULL;
+        }
+    }
+}
+
+static const struct wl_buffer_interface buffer_impl = {
+    .destroy = &resource_destroy,
+};
+
+static void pool_create_buffer(struct wl_client *client, struct wl_resource *resource,
+                               uint32_t id, int32_t offset, int32_t width, int32_t height,
+                               int32_t stride, uint32_t format)
+{
+    struct wl_resource *buffer = wl_resource_create(client, &wl_buffer_interface, 1, id);
+    wl_resource_set_implementation(buffer, &buffer_impl, NULL, &buffer_destroyed);
+}
+
+static void pool_resize(struct wl_client *, struct wl_resource *, int32_t)
+{
+}
+
+static const struct wl_shm_pool_interface pool_impl = {
+    .create_buffer = &pool_create_buffer,
+    .destroy = &resource_destroy,
+    .resize = &pool_resize,
+};
+
+/* Pixels are never looked at; memory is not even mapped */
+static void shm_create_pool(struct wl_client *client, struct wl_resource *resource,
+                            uint32_t id, int32_t fd, int32_t size)
+{
+    close(fd);
+
+    struct wl_resource *pool = wl_resource_create(client, &wl_shm_pool_interface, 1, id);
+    wl_resource_set_implementation(pool, &pool_impl, NULL, NULL);
+}
+
+static const struct wl_shm_interface shm_impl = {
+    .create_pool = &shm_create_pool,
+};
+
+/* wl_surface, wl_region, wl_compositor ----------------------------------- */
+
+static void surface_attach(struct wl_client *, struct wl_resource *resource,
+                           struct wl_resource *buffer, int32_t, int32_t)
+{
+    struct surface *surface = wl_resource_get_user_data(resource);
+    surface->pending = buffer;
+    surface->attached = true;
+}
+
+static void surface_damage(struct wl_client *, struct wl_resource *,
+                           int32_t, int32_t, int32_t, int32_t)
+{
+}
+
+static void surface_frame(struct wl_client *client, struct wl_resource *resource, uint32_t id)
+{
+    struct surface *surface = wl_resource_get_user_data(resource);
+
+    struct wl_resource *cb = wl_resource_create(client, &wl_callback_interface, 1, id);
+    wl_resource_set_implementation(cb, NULL, NULL, &unlink_resource);
+    wl_list_insert(surface->frames.prev, wl_resource_get_link(cb));
+}
+
+static void surface_set_region(struct wl_client *, struct wl_resource *, struct wl_resource *)
+{
+}
+
+static void surface_commit(struct wl_client *, struct wl_resource *resource)
+{
+    struct surface *surface = wl_resource_get_user_data(resource);
+    last_request_ns = now_ns();
+
+    const bool new_buffer = surface->attached && surface->pending != NULL;
+    if (surface->attached) {
+        if (surface->current != NULL && surface->current != surface->pending) {
+            wl_buffer_send_release(surface->current);
+        }
+        surface->current = surface->pending;
+        surface->attached = false;
+    }
+
+    struct layer *layer = surface->layer;
+    if (layer != NULL && layer->render_pending && !layer->ack_pending) {
+        /* Commit without a buffer: configure needed no render */
+        if (new_buffer) {
+            stat_add(STAT_RENDER, layer->configured_ns);
+        }
+        layer->render_pending = false;
+    }
+
+    wl_list_insert_list(&presented_frames, &surface->frames);
+    wl_list_init(&surface->frames);
+    wl_list_insert_list(&presented_feedbacks, &surface->feedbacks);
+    wl_list_init(&surface->feedbacks);
+    arm_frame_timer();
+}
+
+static void surface_set_int(struct wl_client *, struct wl_resource *, int32_t)
+{
+}
+
+static const struct wl_surface_interface surface_impl = {
+    .destroy = &resource_destroy,
+    .attach = &surface_attach,
+    .damage = &surface_damage,
+    .frame = &surface_frame,
+    .set_opaque_region = &surface_set_region,
+    .set_input_region = &surface_set_region,
+    .commit = &surface_commit,
+    .set_buffer_transform = &surface_set_int,
+    .set_buffer_scale = &surface_set_int,
+    .damage_buffer = &surface_damage,
+};
+
+static void surface_destroyed(struct wl_resource *resource)
+{
+    struct surface *surface = wl_resource_get_user_data(resource);
+
+    struct wl_resource *cb, *tmp;
+    wl_resource_for_each_safe(cb, tmp, &surface->frames) {
+        wl_resource_destroy(cb);
+    }
+    wl_resource_for_each_safe(cb, tmp, &surface->feedbacks) {
+        wl_resource_destroy(cb);
+    }
+
+    if (surface->layer != NULL) {
+        surface->layer->surface = NULL;
+    }
+
+    wl_list_remove(&surface->link);
+    free(surface);
+}
+
+static void compositor_create_surface(struct wl_client *client, struct wl_resource *resource,
+                                      uint32_t id)
+{
+    struct surface *surface = calloc(1, sizeof (*surface));
+    surface->resource = wl_resource_create(
+        client, &wl_surface_interface, wl_resource_get_version(resource), id);
+    wl_list_init(&surface->frames);
+    wl_list_init(&surface->feedbacks);
+    wl_list_insert(&surfaces, &surface->link);
+
+    wl_resource_set_implementation(surface->resource, &surface_impl, surface, &surface_destroyed);
+}
+
+static void region_box(struct wl_client *, struct wl_resource *,
+                       int32_t, int32_t, int32_t, int32_t)
+{
+}
+
+static const struct wl_region_interface region_impl = {
+    .destroy = &resource_destroy,
+    .add = &region_box,
+    .subtract = &region_box,
+};
+
+static void compositor_create_region(struct wl_client *client, struct wl_resource *resource,
+                                     uint32_t id)
+{
+    struct wl_resource *region = wl_resource_create(client, &wl_region_interface, 1, id);
+    wl_resource_set_implementation(region, &region_impl, NULL, NULL);
+}
+
+static const struct wl_compositor_interface compositor_impl = {
+    .create_surface = &compositor_create_surface,
+    .create_region = &compositor_create_region,
+};
+
+/* Layer shell -------------------------------------------------------------- */
+
+static void layer_set_size(struct wl_client *, struct wl_resource *, uint32_t, uint32_t)
+{
+}
+
+static void layer_set_uint(struct wl_client *, struct wl_resource *, uint32_t)
+{
+}
+
+static void layer_set_exclusive_zone(struct wl_client *, struct wl_resource *, int32_t)
+{
+}
+
+static void layer_set_margin(struct wl_client *, struct wl_resource *,
+                             int32_t, int32_t, int32_t, int32_t)
+{
+}
+
+static void layer_get_popup(struct wl_client *, struct wl_resource *, struct wl_resource *)
+{
+}
+
+static void layer_ack_configure(struct wl_client *, struct wl_resource *resource, uint32_t serial)
+{
+    struct layer *layer = wl_resource_get_user_data(resource);
+    last_request_ns = now_ns();
+
+    if (layer->ack_pending && serial == layer->serial) {
+        stat_add(STAT_CONFIGURE, layer->configured_ns);
+        layer->ack_pending = false;
+    }
+}
+
+static const struct zwlr_layer_surface_v1_interface layer_impl = {
+    .set_size = &layer_set_size,
+    .set_anchor = &layer_set_uint,
+    .set_exclusive_zone = &layer_set_exclusive_zone,
+    .set_margin = &layer_set_margin,
+    .set_keyboard_interactivity = &layer_set_uint,
+    .get_popup = &layer_get_popup,
+    .ack_configure = &layer_ack_configure,
+    .destroy = &resource_destroy,
+    .set_layer = &layer_set_uint,
+};
+
+static void layer_destroyed(struct wl_resource *resource)
+{
+    struct layer *layer = wl_resource_get_user_data(resource);
+    if (layer->surface != NULL) {
+        layer->surface->layer = NULL;
+    }
+    if (layer->output != NULL && layer->output->layer == layer) {
+        layer->output->layer = NULL;
+    }
+    free(layer);
+}
+
+static struct global *output_of(struct wl_resource *output)
+{
+    if (output != NULL) {
+        return wl_resource_get_user_data(output);
+    }
+
+    /* Compositor's choice; ours is the first one */
+    return find_global_of(&wl_output_interface);
+}
+
+static void layer_shell_get_layer_surface(struct wl_client *client, struct wl_resource *resource,
+                                          uint32_t id, struct wl_resource *surface,
+                                          struct wl_resource *output, uint32_t,
+                                          const char *)
+{
+    struct layer *layer = calloc(1, sizeof (*layer));
+    layer->resource = wl_resource_create(
+        client, &zwlr_layer_surface_v1_interface, wl_resource_get_version(resource), id);
+    layer->surface = wl_resource_get_user_data(surface);
+    layer->surface->layer = layer;
+    layer->output = output_of(output);
+    if (layer->output != NULL) {
+        layer->output->layer = layer;
+    }
+
+    wl_resource_set_implementation(layer->resource, &layer_impl, layer, &layer_destroyed);
+}
+
+static const struct zwlr_layer_shell_v1_interface layer_shell_impl = {
+    .get_layer_surface = &layer_shell_get_layer_surface,
+    .destroy = &resource_destroy,
+};
+
+/* Outputs and their extensions --------------------------------------------- */
+
+static const struct wl_output_interface output_impl = {
+    .release = &resource_destroy,
+};
+
+static const struct zxdg_output_v1_interface xdg_output_impl = {
+    .destroy = &resource_destroy,
+};
+
+static void xdg_output_destroyed(struct wl_resource *resource)
+{
+    struct global *output = wl_resource_get_user_data(resource);
+    if (output != NULL && output->xdg_output == resource) {
+        output->xdg_output = NULL;
+    }
+}
+
+static void xdg_output_manager_get_xdg_output(struct wl_client *client,
+                                              struct wl_resource *resource,
+                                              uint32_t id, struct wl_resource *output)
+{
+    struct global *global = wl_resource_get_user_data(output);
+    struct wl_resource *xdg_output = wl_resource_create(
+        client, &zxdg_output_v1_interface, wl_resource_get_version(resource), id);
+    wl_resource_set_implementation(xdg_output, &xdg_output_impl, global, &xdg_output_destroyed);
+    global->xdg_output = xdg_output;
+}
+
+static const struct zxdg_output_manager_v1_interface xdg_output_manager_impl = {
+    .destroy = &resource_destroy,
+    .get_xdg_output = &xdg_output_manager_get_xdg_output,
+};
+
+static void power_set_mode(struct wl_client *, struct wl_resource *resource, uint32_t mode)
+{
+    zwlr_output_power_v1_send_mode(resource, mode);
+}
+
+static const struct zwlr_output_power_v1_interface power_impl = {
+    .set_mode = &power_set_mode,
+    .destroy = &resource_destroy,
+};
+
+static void power_destroyed(struct wl_resource *resource)
+{
+    struct global *output = wl_resource_get_user_data(resource);
+    if (output != NULL && output->power == resource) {
+        output->power = NULL;
+    }
+}
+
+static void power_manager_get_output_power(struct wl_client *client, struct wl_resource *resource,
+                                           uint32_t id, struct wl_resource *output)
+{
+    struct global *global = wl_resource_get_user_data(output);
+    struct wl_resource *power = wl_resource_create(
+        client, &zwlr_output_power_v1_interface, wl_resource_get_version(resource), id);
+    wl_resource_set_implementation(power, &power_impl, global, &power_destroyed);
+    global->power = power;
+}
+
+static const struct zwlr_output_power_manager_v1_interface power_manager_impl = {
+    .get_output_power = &power_manager_get_output_power,
+    .destroy = &resource_destroy,
+};
+
+/* Viewporter, presentation ------------------------------------------------- */
+
+static void viewport_set_source(struct wl_client *, struct wl_resource *,
+                                wl_fixed_t, wl_fixed_t, wl_fixed_t, wl_fixed_t)
+{
+}
+
+static void viewport_set_destination(struct wl_client *, struct wl_resource *, int32_t, int32_t)
+{
+}
+
+static const struct wp_viewport_interface viewport_impl = {
+    .destroy = &resource_destroy,
+    .set_source = &viewport_set_source,
+    .set_destination = &viewport_set_destination,
+};
+
+static void viewporter_get_viewport(struct wl_client *client, struct wl_resource *resource,
+                                    uint32_t id, struct wl_resource *)
+{
+    struct wl_resource *viewport = wl_resource_create(client, &wp_viewport_interface, 1, id);
+    wl_resource_set_implementation(viewport, &viewport_impl, NULL, NULL);
+}
+
+static const struct wp_viewporter_interface viewporter_impl = {
+    .destroy = &resource_destroy,
+    .get_viewport = &viewporter_get_viewport,
+};
+
+static void presentation_feedback(struct wl_client *client, struct wl_resource *,
+                                  struct wl_resource *surface_resource, uint32_t id)
+{
+    struct surface *surface = wl_resource_get_user_data(surface_resource);
+
+    struct wl_resource *feedback = wl_resource_create(
+        client, &wp_presentation_feedback_interface, 1, id);
+    wl_resource_set_implementation(feedback, NULL, NULL, &unlink_resource);
+    wl_list_insert(surface->feedbacks.prev, wl_resource_get_link(feedback));
+}
+
+static const struct wp_presentation_interface presentation_impl = {
+    .destroy = &resource_destroy,
+    .feedback = &presentation_feedback,
+};
+
+/* Globals ------------------------------------------------------------------ */
+
+static void global_resource_destroyed(struct wl_resource *resource)
+{
+    struct global *global = wl_resource_get_user_data(resource);
+    if (global->resource == resource) {
+        global->resource = NULL;
+    }
+}
+
+static const struct {
+    const struct wl_interface *iface;
+    const void *impl;
+} supported[] = {
+    { &wl_compositor_interface, &compositor_impl },
+    { &wl_shm_interface, &shm_impl },
+    { &wl_output_interface, &output_impl },
+    { &zwlr_layer_shell_v1_interface, &layer_shell_impl },
+    { &zxdg_output_manager_v1_interface, &xdg_output_manager_impl },
+    { &wp_viewporter_interface, &viewporter_impl },
+    { &wp_presentation_interface, &presentation_impl },
+    { &zwlr_output_power_manager_v1_interface, &power_manager_impl },
+};
+
+static void bind_global(struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+    struct global *global = data;
+    last_request_ns = now_ns();
+
+    const void *impl = NULL;
+    for (size_t i = 0; i < sizeof (supported) / sizeof (supported[0]); ++i) {
+        if (supported[i].iface == global->iface) {
+            impl = supported[i].impl;
+        }
+    }
+
+    global->resource = wl_resource_create(client, global->iface, version, id);
+    wl_resource_set_implementation(global->resource, impl, global, &global_resource_destroyed);
+
+    if (!global->bound) {
+        stat_add(STAT_GLOBAL, global->sent_ns);
+        global->bound = true;
+    }
+}
+
+static void add_global(uint32_t name, const char *interface, uint32_t version)
+{
+    const struct wl_interface *iface = NULL;
+    for (size_t i = 0; i < sizeof (supported) / sizeof (supported[0]); ++i) {
+        if (strcmp(supported[i].iface->name, interface) == 0) {
+            iface = supported[i].iface;
+        }
+    }
+
+    if (iface == NULL) {
+        LOG_DEBUG("%s: not implemented; not advertised", interface);
+        return;
+    }
+
+    if (version > (uint32_t)iface->version) {
+        version = iface->version;
+    }
+
+    struct global *global = malloc(sizeof (*global));
+    *global = (struct global){ .name = name, .iface = iface, .sent_ns = now_ns() };
+    wl_list_insert(globals.prev, &global->link);
+
+    global->global = wl_global_create(display, iface, version, global, &bind_global);
+}
+
+/* Events ------------------------------------------------------------------- */
+
+static long arg(const struct event *ev, int i)
+{
+    return (i < ev->argc) ? strtol(ev->argv[i], NULL, 10) : 0;
+}
+
+/* Resource event is sent to, NULL if there is none (yet) */
+static struct wl_resource *event_target(const struct event *ev)
+{
+    const char *name = ev->argv[0];
+
+    if (strcmp(name, "global") == 0 || strcmp(name, "global_remove") == 0) {
+        return NULL;
+    }
+
+    if (strcmp(name, "shm_format") == 0) {
+        const struct global *global = find_global_of(&wl_shm_interface);
+        return (global != NULL) ? global->resource : NULL;
+    }
+    if (strcmp(name, "clock_id") == 0) {
+        const struct global *global = find_global_of(&wp_presentation_interface);
+        return (global != NULL) ? global->resource : NULL;
+    }
+
+    const struct global *output = find_global(arg(ev, 1));
+    if (output == NULL) {
+        return NULL;
+    }
+
+    if (strcmp(name, "logical_position") == 0 || strcmp(name, "logical_size") == 0) {
+        return output->xdg_output;
+    }
+    if (strcmp(name, "configure") == 0 || strcmp(name, "closed") == 0) {
+        return (output->layer != NULL) ? output->layer->resource : NULL;
+    }
+    if (strcmp(name, "power") == 0 || strcmp(name, "power_failed") == 0) {
+        return output->power;
+    }
+    return output->resource;
+}
+
+static bool event_ready(const struct event *ev)
+{
+    const char *name = ev->argv[0];
+    return strcmp(name, "global") == 0 || strcmp(name, "global_remove") == 0 ||
+           event_target(ev) != NULL;
+}
+
+static void send_event(struct event *ev)
+{
+    const char *name = ev->argv[0];
+    struct wl_resource *target = event_target(ev);
+
+    if (strcmp(name, "global") == 0) {
+        add_global(arg(ev, 1), ev->argc > 2 ? ev->argv[2] : "", arg(ev, 3));
+    } else if (strcmp(name, "global_remove") == 0) {
+        struct global *global = find_global(arg(ev, 1));
+        if (global != NULL && global->global != NULL) {
+            wl_global_destroy(global->global);
+            global->global = NULL;
+        }
+    } else if (strcmp(name, "shm_format") == 0) {
+        wl_shm_send_format(target, arg(ev, 1));
+    } else if (strcmp(name, "clock_id") == 0) {
+        wp_presentation_send_clock_id(target, arg(ev, 1));
+    } else if (strcmp(name, "geometry") == 0 && ev->argc > 9) {
+        wl_output_send_geometry(target, arg(ev, 2), arg(ev, 3), arg(ev, 4), arg(ev, 5),
+                                arg(ev, 6), unescape(ev->argv[7]), unescape(ev->argv[8]),
+                                arg(ev, 9));
+    } else if (strcmp(name, "mode") == 0) {
+        wl_output_send_mode(target, arg(ev, 2), arg(ev, 3), arg(ev, 4), arg(ev, 5));
+    } else if (strcmp(name, "scale") == 0) {
+        wl_output_send_scale(target, arg(ev, 2));
+    } else if (strcmp(name, "done") == 0) {
+        wl_output_send_done(target);
+    } else if (strcmp(name, "logical_position") == 0) {
+        zxdg_output_v1_send_logical_position(target, arg(ev, 2), arg(ev, 3));
+    } else if (strcmp(name, "logical_size") == 0) {
+        zxdg_output_v1_send_logical_size(target, arg(ev, 2), arg(ev, 3));
+    } else if (strcmp(name, "configure") == 0) {
+        struct layer *layer = wl_resource_get_user_data(target);
+        layer->serial = arg(ev, 2);
+        layer->configured_ns = now_ns();
+        layer->ack_pending = true;
+        layer->render_pending = true;
+        zwlr_layer_surface_v1_send_configure(target, layer->serial, arg(ev, 3), arg(ev, 4));
+    } else if (strcmp(name, "closed") == 0) {
+        zwlr_layer_surface_v1_send_closed(target);
+    } else if (strcmp(name, "power") == 0) {
+        zwlr_output_power_v1_send_mode(target, arg(ev, 2));
+    } else if (strcmp(name, "power_failed") == 0) {
+        zwlr_output_power_v1_send_failed(target);
+    } else {
+        LOG_WARN("%s: unknown or malformed event; skipped", name);
+    }
+}
+
+static struct event *load_trace(const char *path, size_t *count)
+{
+    FILE *f = fopen(path, "re");
+    if (f == NULL) {
+        LOG_ERRNO("%s: failed to open", path);
+        return NULL;
+    }
+
+    struct event *events = NULL;
+    size_t n = 0;
+
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    bool first = true;
+
+    while ((len = getline(&line, &size, f)) > 0) {
+        if (line[len - 1] == '\n') {
+            line[len - 1] = '\0';
+        }
+
+        if (first) {
+            first = false;
+            if (strcmp(line, TRACE_MAGIC) != 0) {
+                LOG_ERR("%s: not a trace", path);
+                goto err;
+            }
+            continue;
+        }
+
+        struct event ev = { .line = strdup(line) };
+        char *save = NULL;
+        char *usec = strtok_r(ev.line, " ", &save);
+        for (char *tok; ev.argc < MAX_ARGS && (tok = strtok_r(NULL, " ", &save)) != NULL;) {
+            ev.argv[ev.argc++] = tok;
+        }
+
+        if (usec == NULL || ev.argc == 0) {
+            free(ev.line);
+            continue;
+        }
+
+        ev.usec = strtoull(usec, NULL, 10);
+        events = realloc(events, (n + 1) * sizeof (events[0]));
+        events[n++] = ev;
+    }
+
+    free(line);
+    fclose(f);
+    *count = n;
+    return events;
+
+err:
+    free(line);
+    fclose(f);
+    for (size_t i = 0; i < n; ++i) {
+        free(events[i].line);
+    }
+    free(events);
+    return NULL;
+}
+
+/* Client --------------------------------------------------------------------- */
+
+static void client_destroyed(struct wl_listener *, void *)
+{
+    peer = NULL;
+}
+
+static pid_t spawn_client(char *const *argv)
+{
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        LOG_ERRNO("failed to create socket pair");
+        return -1;
+    }
+
+    const pid_t pid = fork();
+    if (pid < 0) {
+        LOG_ERRNO("failed to fork");
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        /* Inherited, and picked up by wl_display_connect() */
+        char fd[16];
+        snprintf(fd, sizeof (fd), "%d", sv[1]);
+        fcntl(sv[1], F_SETFD, 0);
+        setenv("WAYLAND_SOCKET", fd, 1);
+        unsetenv("WAYLAND_DISPLAY");
+
+        execvp(argv[0], argv);
+        LOG_ERRNO("%s: failed to execute", argv[0]);
+        _exit(127);
+    }
+
+    close(sv[1]);
+
+    peer = wl_client_create(display, sv[0]);
+    if (peer == NULL) {
+        LOG_ERR("failed to create client");
+        close(sv[0]);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+
+    client_destroy.notify = &client_destroyed;
+    wl_client_add_destroy_listener(peer, &client_destroy);
+    return pid;
+}
+
+static void dispatch(struct wl_event_loop *loop, int timeout_ms)
+{
+    wl_display_flush_clients(display);
+    wl_event_loop_dispatch(loop, timeout_ms);
+}
+
+static void print_stats(const char *path, bool fast, size_t sent, size_t skipped, double secs)
+{
+    printf("%s: %zu events sent, %zu skipped, in %.3f s (%s); latencies in ms\n\n",
+           path, sent, skipped, secs, fast ? "as fast as possible" : "original timing");
+    printf("%-12s %8s %10s %10s\n", "", "count", "mean", "max");
+
+    for (int i = 0; i < STAT_COUNT; ++i) {
+        const struct latency *stat = &stats[i];
+        printf("%-12s %8u %10.3f %10.3f\n", stat->name, stat->count,
+               stat->count > 0 ? stat->sum_ms / stat->count : 0.0, stat->max_ms);
+    }
+}
+
+static void print_usage(FILE *stream, const char *prog)
+{
+    fprintf(stream,
+            "Usage: %s [-f] TRACE -- COMMAND [ARGS]...\n"
+            "\n"
+            "Plays events recorded by `wbg-color --record=TRACE` back to\n"
+            "COMMAND, and prints how long it took to handle them\n"
+            "\n"
+            "Options:\n"
+            "  -f, --fast  send events as fast as possible, instead of at\n"
+            "              their original times\n"
+            "  -h, --help  show this help and exit\n",
+            prog);
+}
+
+int main(int argc, char *const *argv)
+{
+    static const struct option longopts[] = {
+        { "fast", no_argument, NULL, 'f' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL,   0,           NULL, 0 },
+    };
+
+    bool fast = false;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "+fh", longopts, NULL)) != -1) {
+        switch (opt) {
+            case 'f':
+                fast = true;
+                break;
+            case 'h':
+                print_usage(stdout, argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                print_usage(stderr, argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (optind < argc && strcmp(argv[optind], "--") == 0) {
+        optind++;
+    }
+    if (argc - optind < 2) {
+        print_usage(stderr, argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const char *path = argv[optind];
+    char *const *command = &argv[optind + 1];
+    if (strcmp(command[0], "--") == 0) {
+        command++;
+    }
+
+    size_t count;
+    struct event *events = load_trace(path, &count);
+    if (events == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    int exit_code = EXIT_FAILURE;
+    pid_t pid = -1;
+
+    wl_list_init(&globals);
+    wl_list_init(&surfaces);
+    wl_list_init(&presented_frames);
+    wl_list_init(&presented_feedbacks);
+
+    display = wl_display_create();
+    if (display == NULL) {
+        LOG_ERR("failed to create display");
+        goto out;
+    }
+
+    struct wl_event_loop *loop = wl_display_get_event_loop(display);
+    frame_timer = wl_event_loop_add_timer(loop, &frame_tick, NULL);
+
+    pid = spawn_client(command);
+    if (pid < 0) {
+        goto out;
+    }
+
+    const uint64_t start = now_ns();
+    uint64_t lag = 0; /* waiting on the client, pushing later events back */
+    size_t sent = 0;
+    size_t skipped = 0;
+
+    for (size_t i = 0; i < count && peer != NULL; ++i) {
+        struct event *ev = &events[i];
+        const uint64_t deadline = fast ? 0 : start + ev->usec * 1000 + lag;
+        const uint64_t waiting = now_ns();
+
+        bool ready;
+        uint64_t now;
+        while (true) {
+            now = now_ns();
+            ready = event_ready(ev);
+            if ((ready && now >= deadline) || now - waiting > STALL_NS || peer == NULL) {
+                break;
+            }
+
+            const int timeout = ready ? (int)((deadline - now + 999999) / 1000000) : 1;
+            dispatch(loop, timeout);
+        }
+
+        if (peer == NULL) {
+            break;
+        }
+
+        if (!ready) {
+            LOG_WARN("%s: nothing to send it to; skipped", ev->argv[0]);
+            skipped++;
+            continue;
+        }
+
+        if (!fast && now > deadline) {
+            lag += now - deadline;
+        }
+
+        send_event(ev);
+        sent++;
+
+        if (fast) {
+            dispatch(loop, 0);
+        }
+    }
+
+    /* Let the client finish with the last events */
+    last_request_ns = now_ns();
+    while (peer != NULL && now_ns() - last_request_ns < QUIET_NS) {
+        dispatch(loop, 10);
+    }
+
+    const double secs = (now_ns() - start) / 1e9;
+
+    if (peer != NULL) {
+        kill(pid, SIGINT);
+        const uint64_t stop = now_ns();
+        while (peer != NULL && now_ns() - stop < STALL_NS) {
+            dispatch(loop, 10);
+        }
+    }
+
+    int status;
+    if (peer == NULL && waitpid(pid, &status, 0) == pid &&
+        WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS) {
+        exit_code = EXIT_SUCCESS;
+    } else {
+        LOG_ERR("%s: did not exit cleanly", command[0]);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+    }
+    pid = -1;
+
+    print_stats(path, fast, sent, skipped, secs);
+
+out:
+    if (pid > 0) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+    }
+    if (display != NULL) {
+        wl_display_destroy_clients(display);
+        wl_display_destroy(display);
+    }
+
+    struct global *global, *tmp;
+    wl_list_for_each_safe(global, tmp, &globals, link) {
+        free(global);
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        free(events[i].line);
+    }
+    free(events);
+    return exit_code;
+}